@@ -41,6 +41,11 @@ enum class ErrorCode : int {
   FileReadAndWrite = -9,
   IllegalNetworkConfiguration = -10,
   TmpNotRemounted = -11,
+  InvalidTapOption = -12,
+  TapNotStarted = -13,
+  InvalidFirewallRule = -14,
+  FirewallUpdateFailed = -15,
+  NoSandboxToAttach = -16,
   GeneralOSError = -100,
   // Error codes from -201 are recoverables
   NestedSandbox = -201,
@@ -81,6 +86,16 @@ inline std::string GetErrorMessage(ErrorCode code) {
       return "Cannot allow all domains after specifying one network rule";
     case ErrorCode::TmpNotRemounted:
       return "/tmp cannot be remounted when running in default mode";
+    case ErrorCode::InvalidTapOption:
+      return "Unknown tap option or invalid value";
+    case ErrorCode::TapNotStarted:
+      return "The minitap network stack did not start";
+    case ErrorCode::InvalidFirewallRule:
+      return "Not an IP, subnet or domain name";
+    case ErrorCode::FirewallUpdateFailed:
+      return "Could not update the firewall of the running sandbox";
+    case ErrorCode::NoSandboxToAttach:
+      return "No sandbox of our own to publish the PID of (-p) when nested or in an unprivileged container";
     case ErrorCode::Unknown:
     default:
       return "Unknown error occurred";
@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "src/main/tools/fast-connect.h"
+#include "src/main/tools/logging.h"
+#include "src/main/tools/minitap-interface.h"
+#include "src/main/tools/process-tools.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#if defined(__x86_64__)
+#define FAST_CONNECT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define FAST_CONNECT_ARCH AUDIT_ARCH_AARCH64
+#endif
+
+// Older headers miss what fast-connect needs, it is left out then
+#if defined(FAST_CONNECT_ARCH) && defined(SECCOMP_IOCTL_NOTIF_ADDFD) && \
+    defined(SYS_pidfd_getfd)
+#define HAVE_FAST_CONNECT 1
+#endif
+
+// SECCOMP_IOCTL_NOTIF_ADDFD came last, with Linux 5.9
+#define FAST_CONNECT_KERNEL_MAJOR 5
+#define FAST_CONNECT_KERNEL_MINOR 9
+
+// The end of the channel pid1 hands the seccomp listener over on
+static int sandbox_chan = -1;
+// and the supervisor's
+static int supervisor_chan = -1;
+// The socket on which minitap tells the supervisor which destinations are
+// allowed
+static int verdict_fd = -1;
+static std::mutex verdict_mu;
+
+
+#ifdef HAVE_FAST_CONNECT
+static bool KernelAtLeast(int major, int minor) {
+  struct utsname u;
+  int kmajor = 0, kminor = 0;
+  if (uname(&u) < 0 || sscanf(u.release, "%d.%d", &kmajor, &kminor) != 2)
+    return false;
+  return kmajor > major || (kmajor == major && kminor >= minor);
+}
+#endif
+
+
+int FastConnectPrepare(int* minitap_fd) {
+#ifdef HAVE_FAST_CONNECT
+  if (!KernelAtLeast(FAST_CONNECT_KERNEL_MAJOR, FAST_CONNECT_KERNEL_MINOR)) {
+    errno = ENOSYS;
+    return -1;
+  }
+  int chan[2], verdict[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, chan) < 0)
+    return -1;
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, verdict) < 0) {
+    close(chan[0]);
+    close(chan[1]);
+    return -1;
+  }
+  sandbox_chan = chan[0];
+  supervisor_chan = chan[1];
+  verdict_fd = verdict[0];
+  *minitap_fd = verdict[1];
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+void FastConnectSandboxSide() {
+  if (supervisor_chan >= 0) {
+    close(supervisor_chan);
+    supervisor_chan = -1;
+  }
+  if (verdict_fd >= 0) {
+    close(verdict_fd);
+    verdict_fd = -1;
+  }
+}
+
+
+int FastConnectFd() {
+  return sandbox_chan;
+}
+
+
+int FastConnectInstall() {
+  if (sandbox_chan < 0)
+    return 0;
+  int chan = sandbox_chan;
+  sandbox_chan = -1;
+#ifdef HAVE_FAST_CONNECT
+  // connect() goes to the supervisor, the syscalls of other architectures
+  // (e.g. x32) are left alone and go through minitap
+  struct sock_filter filter[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, FAST_CONNECT_ARCH, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_connect, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+  };
+  struct sock_fprog prog = {sizeof(filter) / sizeof(filter[0]), filter};
+  int listener = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER,
+                         SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog);
+  if (listener < 0) {
+    // The connections go through minitap, as without fast-connect
+    PRINT_DEBUG("fast-connect: seccomp: %s", strerror(errno));
+    close(chan);
+    return 0;
+  }
+  int res = SendWithFds(chan, "listener", &listener, 1);
+  close(listener);
+  close(chan);
+  return res;
+#else
+  close(chan);
+  return 0;
+#endif
+}
+
+
+#ifdef HAVE_FAST_CONNECT
+// The options of the socket of the sandbox that carry over to ours
+struct SocketOption {
+  int level;
+  int name;
+  // 0 for both AF_INET and AF_INET6
+  int family;
+};
+
+static const SocketOption kSocketOptions[] = {
+  {SOL_SOCKET, SO_KEEPALIVE, 0},
+  {SOL_SOCKET, SO_REUSEADDR, 0},
+  {SOL_SOCKET, SO_LINGER, 0},
+  {SOL_SOCKET, SO_RCVTIMEO, 0},
+  {SOL_SOCKET, SO_SNDTIMEO, 0},
+  {IPPROTO_TCP, TCP_NODELAY, 0},
+  {IPPROTO_TCP, TCP_KEEPIDLE, 0},
+  {IPPROTO_TCP, TCP_KEEPINTVL, 0},
+  {IPPROTO_TCP, TCP_KEEPCNT, 0},
+  {IPPROTO_TCP, TCP_USER_TIMEOUT, 0},
+  {IPPROTO_IPV6, IPV6_V6ONLY, AF_INET6},
+};
+
+static void CopySocketOptions(int from, int to, int family) {
+  for (const SocketOption& o : kSocketOptions) {
+    if (o.family != 0 && o.family != family)
+      continue;
+    char value[64];
+    socklen_t len = sizeof(value);
+    if (getsockopt(from, o.level, o.name, value, &len) == 0)
+      setsockopt(to, o.level, o.name, value, len);
+  }
+}
+
+static int GetIntOption(int sock, int level, int name) {
+  int value = -1;
+  socklen_t len = sizeof(value);
+  if (getsockopt(sock, level, name, &value, &len) < 0)
+    return -1;
+  return value;
+}
+
+// Only TCP sockets that are neither bound nor connected yet are ours to
+// replace
+static bool IsFreshTcpSocket(int sock, int family) {
+  if (GetIntOption(sock, SOL_SOCKET, SO_TYPE) != SOCK_STREAM ||
+      GetIntOption(sock, SOL_SOCKET, SO_DOMAIN) != family ||
+      GetIntOption(sock, SOL_SOCKET, SO_PROTOCOL) != IPPROTO_TCP)
+    return false;
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  if (getsockname(sock, reinterpret_cast<struct sockaddr*>(&ss), &len) < 0)
+    return false;
+  in_port_t port = family == AF_INET
+      ? reinterpret_cast<struct sockaddr_in*>(&ss)->sin_port
+      : reinterpret_cast<struct sockaddr_in6*>(&ss)->sin6_port;
+  if (port != 0)
+    return false;
+  len = sizeof(ss);
+  return getpeername(sock, reinterpret_cast<struct sockaddr*>(&ss), &len) < 0 &&
+         errno == ENOTCONN;
+}
+
+static bool IsCloseOnExec(pid_t pid, int fd) {
+  std::ifstream fdinfo("/proc/" + std::to_string(pid) + "/fdinfo/" + std::to_string(fd));
+  std::string line;
+  while (std::getline(fdinfo, line)) {
+    if (line.compare(0, 6, "flags:") == 0)
+      return (strtol(line.c_str() + 6, NULL, 8) & O_CLOEXEC) != 0;
+  }
+  return false;
+}
+
+// Asks minitap whether the firewall lets a connection to ss through. It
+// counts the connection against the budget like any other.
+static bool Allowed(const struct sockaddr_storage& ss) {
+  char host[INET6_ADDRSTRLEN];
+  std::string request;
+  if (ss.ss_family == AF_INET) {
+    const struct sockaddr_in* sin = reinterpret_cast<const struct sockaddr_in*>(&ss);
+    inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+    request = std::string("connect ") + host + ":" + std::to_string(ntohs(sin->sin_port));
+  } else {
+    const struct sockaddr_in6* sin6 = reinterpret_cast<const struct sockaddr_in6*>(&ss);
+    inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+    request = std::string("connect [") + host + "]:" + std::to_string(ntohs(sin6->sin6_port));
+  }
+  std::string err_msg;
+  std::lock_guard<std::mutex> lock(verdict_mu);
+  if (MinitapRequest(verdict_fd, request, err_msg) < 0) {
+    PRINT_DEBUG("fast-connect: %s: %s", request.c_str(), err_msg.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Lets the connect() of the sandbox go on as if nothing happened, through
+// minitap. That the sandbox could change the address in the meantime doesn't
+// matter, minitap's firewall still applies there.
+static void Continue(int listener, uint64_t id) {
+  struct seccomp_notif_resp resp = {};
+  resp.id = id;
+  resp.flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+  ioctl(listener, SECCOMP_IOCTL_NOTIF_SEND, &resp);
+}
+
+static void Answer(int listener, uint64_t id, int error) {
+  struct seccomp_notif_resp resp = {};
+  resp.id = id;
+  resp.error = error;
+  ioctl(listener, SECCOMP_IOCTL_NOTIF_SEND, &resp);
+}
+
+static void HandleConnect(int listener, struct seccomp_notif req) {
+  pid_t pid = req.pid;
+  int target_fd = req.data.args[0];
+  socklen_t addrlen = req.data.args[2];
+  struct sockaddr_storage ss = {};
+  // The address is copied once and checked, the sandbox can't change what
+  // we connect to afterwards
+  struct iovec local = {&ss, addrlen};
+  struct iovec remote = {reinterpret_cast<void*>(req.data.args[1]), addrlen};
+  if (addrlen > sizeof(ss) ||
+      process_vm_readv(pid, &local, 1, &remote, 1, 0) != static_cast<ssize_t>(addrlen) ||
+      !((ss.ss_family == AF_INET && addrlen >= sizeof(struct sockaddr_in)) ||
+        (ss.ss_family == AF_INET6 && addrlen >= sizeof(struct sockaddr_in6)))) {
+    Continue(listener, req.id);
+    return;
+  }
+  // pid still is the process that called connect()
+  if (ioctl(listener, SECCOMP_IOCTL_NOTIF_ID_VALID, &req.id) < 0)
+    return;
+
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  int sock = pidfd < 0 ? -1 : syscall(SYS_pidfd_getfd, pidfd, target_fd, 0);
+  if (pidfd >= 0)
+    close(pidfd);
+  if (sock < 0 || !IsFreshTcpSocket(sock, ss.ss_family) || !Allowed(ss)) {
+    if (sock >= 0)
+      close(sock);
+    Continue(listener, req.id);
+    return;
+  }
+
+  bool nonblocking = (fcntl(sock, F_GETFL) & O_NONBLOCK) != 0;
+  int host = socket(ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0),
+                    IPPROTO_TCP);
+  if (host < 0) {
+    close(sock);
+    Continue(listener, req.id);
+    return;
+  }
+  CopySocketOptions(sock, host, ss.ss_family);
+  close(sock);
+
+  int error = 0;
+  if (connect(host, reinterpret_cast<struct sockaddr*>(&ss), addrlen) < 0) {
+    error = -errno;
+    if (error != -EINPROGRESS) {
+      close(host);
+      Answer(listener, req.id, error);
+      return;
+    }
+  }
+  struct seccomp_notif_addfd addfd = {};
+  addfd.id = req.id;
+  addfd.flags = SECCOMP_ADDFD_FLAG_SETFD;
+  addfd.srcfd = host;
+  addfd.newfd = target_fd;
+  addfd.newfd_flags = IsCloseOnExec(pid, target_fd) ? O_CLOEXEC : 0;
+  if (ioctl(listener, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd) < 0) {
+    close(host);
+    Continue(listener, req.id);
+    return;
+  }
+  close(host);
+  Answer(listener, req.id, error);
+}
+
+static void Supervise(int chan) {
+  int listener = -1;
+  std::string data;
+  int n = RecvWithFds(chan, &data, &listener, 1);
+  close(chan);
+  if (n != 1) {
+    // pid1 couldn't install the filter
+    PRINT_DEBUG("fast-connect: no seccomp listener");
+    return;
+  }
+  for (;;) {
+    struct seccomp_notif req;
+    memset(&req, 0, sizeof(req));
+    if (ioctl(listener, SECCOMP_IOCTL_NOTIF_RECV, &req) < 0) {
+      // ENOENT: the process was gone before we got to it
+      if (errno == EINTR || errno == ENOENT)
+        continue;
+      break;
+    }
+    // Connecting may block, each connect() has a thread of its own
+    std::thread(HandleConnect, listener, req).detach();
+  }
+  close(listener);
+}
+#endif
+
+
+void FastConnectSupervise() {
+  if (supervisor_chan < 0)
+    return;
+  if (sandbox_chan >= 0) {
+    close(sandbox_chan);
+    sandbox_chan = -1;
+  }
+#ifdef HAVE_FAST_CONNECT
+  std::thread(Supervise, supervisor_chan).detach();
+  supervisor_chan = -1;
+#endif
+}
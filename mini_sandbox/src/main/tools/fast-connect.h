@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FAST_CONNECT_H
+#define _FAST_CONNECT_H
+
+// With the fast-connect tap option, the TCP connections that the firewall
+// lets through skip minitap. pid1 installs a seccomp filter that hands every
+// connect() of the sandbox to a supervisor outside of it, in the host network
+// namespace. The supervisor asks minitap for its verdict and, when the
+// destination is allowed, connects a socket of its own and puts it in place of
+// the socket of the sandbox (SECCOMP_IOCTL_NOTIF_ADDFD). The traffic of these
+// connections then goes straight through the kernel. Everything else (UDP,
+// denied destinations, the addresses minitap serves itself, bound sockets...)
+// continues as usual, through the TUN device and minitap's firewall.
+
+// Creates the channels between the sandbox, the supervisor and minitap,
+// before the sandboxed side is forked. minitap_fd is set to minitap's end, on
+// which it answers the supervisor. Returns -1 if fast-connect is unavailable.
+int FastConnectPrepare(int* minitap_fd);
+
+// In the sandboxed side: keeps the channel to the supervisor for pid1
+void FastConnectSandboxSide();
+
+// In the supervisor: starts supervising in a thread of its own
+void FastConnectSupervise();
+
+// In pid1, once the sandbox is set up and before anything runs in it:
+// installs the seccomp filter and hands it over to the supervisor. Does
+// nothing without fast-connect. Returns -1 if the filter was installed but
+// nobody supervises it, in which case connect() would fail in the sandbox.
+int FastConnectInstall();
+
+// The file descriptor that must stay open until FastConnectInstall(), -1 if
+// there is none
+int FastConnectFd();
+
+#endif
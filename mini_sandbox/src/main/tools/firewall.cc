@@ -3,11 +3,13 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <libgen.h>
@@ -23,69 +25,304 @@ int set_max_connections(int max_connections, FirewallRules* fw_rules) {
 }
 
 
+// Parses the IP and subnet rules, IPv4 or IPv6
+static bool ParseIpRule(const std::string& rule, FirewallRule* out) {
+  std::string address = rule.substr(0, rule.find('/'));
+  int max_len;
+  if (inet_pton(AF_INET, address.c_str(), out->address) == 1) {
+    out->type = RuleType::Ipv4;
+    max_len = 32;
+  } else if (inet_pton(AF_INET6, address.c_str(), out->address) == 1) {
+    out->type = RuleType::Ipv6;
+    max_len = 128;
+  } else {
+    return false;
+  }
+  out->prefix_len = max_len;
+  if (address.size() < rule.size()) {
+    std::string plen = rule.substr(address.size() + 1);
+    if (plen.empty() || plen.size() > 3 ||
+        plen.find_first_not_of("0123456789") != std::string::npos ||
+        std::stoi(plen) > max_len)
+      return false;
+    out->prefix_len = std::stoi(plen);
+  }
+  return true;
+}
+
+
+// The domain names minitap takes: labels of letters, digits, '-' and '_',
+// the first of which may be '*' to allow every name under the others
+static bool IsDomainRule(const std::string& rule) {
+  std::string name = rule;
+  if (name.compare(0, 2, "*.") == 0)
+    name.erase(0, 2);
+  if (!name.empty() && name.back() == '.')
+    name.pop_back();
+  if (name.empty() || name.size() > 253 || name.front() == '.' ||
+      name.find("..") != std::string::npos)
+    return false;
+  return name.find_first_not_of("abcdefghijklmnopqrstuvwxyz"
+                                "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                "0123456789-_.") == std::string::npos;
+}
+
+
 int set_firewall_rule(const char *rule, FirewallRules *fw_rules) {
-  if (fw_rules->count > MAX_RULES) 
-    return RULES_OVERFLOW;
-  
   size_t rule_len = strlen(rule);
-  if (rule_len > MAX_RULE_LENGTH)
+  if (rule_len == 0 || rule_len > MAX_RULE_LENGTH)
     return RULES_OVERFLOW;
   
   if (fw_rules->mode == FirewallMode::FirewallDisabled)
     return RULES_CONFIG_ALREADY_SET;
 
+  FirewallRule parsed = {};
+  std::string rule_str(rule, rule_len);
+  if (rule_str.find_first_of("/:") != std::string::npos ||
+      rule_str.find_first_not_of("0123456789.") == std::string::npos) {
+    // Looks like an address, it has to be a valid one
+    if (!ParseIpRule(rule_str, &parsed))
+      return RULES_ERR;
+  } else if (!IsDomainRule(rule_str)) {
+    return RULES_ERR;
+  } else {
+    // Each domain is kept once
+    if (fw_rules->name_offsets.count(rule_str) > 0) {
+      fw_rules->mode = FirewallMode::FirewallEnabled;
+      return 0;
+    }
+    parsed.type = RuleType::Domain;
+    parsed.name_offset = fw_rules->names.size();
+    parsed.name_length = rule_len;
+    fw_rules->name_offsets[rule_str] = parsed.name_offset;
+    fw_rules->names += rule_str;
+  }
 
   fw_rules->mode = FirewallMode::FirewallEnabled;
-  memcpy(fw_rules->rules[fw_rules->count], rule, rule_len);
-  fw_rules->count++;
+  fw_rules->rules.push_back(parsed);
   return 0;
 }
 
+
+
+int queue_rule_update(bool allow, const char* rule, FirewallRules* fw_rules) {
+  size_t rule_len = strlen(rule);
+  if (rule_len == 0 || rule_len > MAX_RULE_LENGTH)
+    return RULES_OVERFLOW;
+
+  FirewallRule parsed = {};
+  std::string rule_str(rule, rule_len);
+  if (rule_str.find_first_of("/:") != std::string::npos ||
+      rule_str.find_first_not_of("0123456789.") == std::string::npos) {
+    if (!ParseIpRule(rule_str, &parsed))
+      return RULES_ERR;
+  } else if (!IsDomainRule(rule_str)) {
+    return RULES_ERR;
+  }
+  fw_rules->updates += (allow ? "allow " : "revoke ") + rule_str + "\n";
+  return 0;
+}
+
+
+int queue_max_connections_update(int max_connections, FirewallRules* fw_rules) {
+  fw_rules->updates += "max-connections " + std::to_string(max_connections) + "\n";
+  return 0;
+}
+
+
 int reset_firewall_rules(FirewallRules *fw_rules) {
 
   if (fw_rules->mode == FirewallMode::FirewallEnabled)
     return RULES_CONFIG_ALREADY_SET;
   fw_rules->mode = FirewallMode::FirewallDisabled;
-  fw_rules->count = 0; 
+  fw_rules->rules.clear();
+  fw_rules->names.clear();
+  fw_rules->name_offsets.clear();
+  return 0;
+}
+
+
+// The options minitap understands: integers within [min, max], one of values
+// when there is a list, or absolute paths
+struct TapOption {
+  const char* key;
+  long min;
+  long max;
+  const char* const* values;
+  bool is_path;
+};
+
+static const char* const kCongestionControls[] = {"reno", "cubic", NULL};
+
+static const TapOption kTapOptions[] = {
+  // TUN queues, each with its own packet dispatcher (the kernel allows 256)
+  {"queues", 1, 256, NULL},
+  // TCP handshakes the forwarder keeps pending before dropping SYNs
+  {"max-in-flight", 1, 65535, NULL},
+  // how long minitap waits for the world to accept a connection, in ms
+  {"connect-timeout", 100, 600000, NULL},
+  // how long an idle UDP flow keeps its socket to the world, in ms
+  {"udp-timeout", 1000, 3600000, NULL},
+  // MTU of the TUN device, up to a 64 KiB packet (IPv6 needs 1280)
+  {"mtu", 1280, 65520, NULL},
+  // TCP options of the stack, the buffer sizes are in bytes
+  {"tcp-sack", 0, 1, NULL},
+  {"tcp-moderate-rcvbuf", 0, 1, NULL},
+  {"tcp-delay", 0, 1, NULL},
+  {"tcp-rcvbuf-max", 4096, 1L << 30, NULL},
+  {"tcp-sndbuf-max", 4096, 1L << 30, NULL},
+  {"tcp-congestion", 0, 0, kCongestionControls},
+  // where minitap dumps its traffic metrics as JSON
+  {"metrics", 0, 0, NULL, true},
+  // where minitap writes the last packets of the sandbox as pcapng, the size
+  // of its ring in bytes, the age of the packets kept in ms and the bytes
+  // kept of each packet
+  {"pcap", 0, 0, NULL, true},
+  {"pcap-size", 65536, 1L << 30, NULL},
+  {"pcap-window", 1000, 86400000, NULL},
+  {"pcap-snaplen", 64, 262144, NULL},
+  // how long mini-tapbox waits for minitap to start, in ms
+  {"start-timeout", 100, 600000, NULL},
+  // connect() of allowed TCP destinations from the host, see fast-connect.h
+  {"fast-connect", 0, 1, NULL},
+  // the socket of a shared minitap, see minitap-shared.h
+  {"shared", 0, 0, NULL, true},
+  // HTTP(S) to unknown addresses decided by the TLS SNI or Host header
+  {"sni", 0, 1, NULL},
+};
+
+static bool ValidTapOptionValue(const TapOption* option, const char* value) {
+  if (option->is_path)
+    return value[0] == '/' && strchr(value, '\n') == NULL;
+  if (option->values != NULL) {
+    for (const char* const* v = option->values; *v != NULL; v++) {
+      if (strcmp(*v, value) == 0)
+        return true;
+    }
+    return false;
+  }
+  char* end = NULL;
+  errno = 0;
+  long n = strtol(value, &end, 10);
+  return errno == 0 && *end == '\0' && n >= option->min && n <= option->max;
+}
+
+int set_tap_option(const char* key, const char* value, FirewallRules* fw_rules) {
+  const TapOption* option = NULL;
+  for (const TapOption& o : kTapOptions) {
+    if (strcmp(o.key, key) == 0)
+      option = &o;
+  }
+  if (option == NULL || *value == '\0' || !ValidTapOptionValue(option, value))
+    return RULES_ERR;
+
+  // Not one of minitap's, it doesn't get to see it
+  if (strcmp(key, "start-timeout") == 0) {
+    fw_rules->start_timeout_ms = atoi(value);
+    return 0;
+  }
+  if (strcmp(key, "fast-connect") == 0) {
+    fw_rules->fast_connect = atoi(value) != 0;
+    return 0;
+  }
+  if (strcmp(key, "shared") == 0) {
+    fw_rules->shared_socket = value;
+    return 0;
+  }
+  if (strcmp(key, "mtu") == 0)
+    fw_rules->mtu = atoi(value);
+
+  std::string prefix = std::string(key) + "=";
+  for (std::string& o : fw_rules->options) {
+    if (o.compare(0, prefix.size(), prefix) == 0) {
+      o = prefix + value;
+      return 0;
+    }
+  }
+  fw_rules->options.push_back(prefix + value);
   return 0;
 }
 
 
-// This method dumps the policy that the minitap backend binary
+static void AppendU32(std::string& out, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    out += static_cast<char>((value >> (8 * i)) & 0xff);
+}
+
+
+// This method dumps the policy that the minitap backend
 // will use to setup the firewall rules and, if specified, 
-// the max number of connections
+// the max number of connections, in a memfd (see firewall.h)
 // The two policies are exclusive, i.e., either you set up
 // a maximum number of connections OR you set up the firewall 
 // rules, at least for now.
-void DumpRules(FirewallRules* fw_rules, std::string& filepath) { 
+int DumpRules(FirewallRules* fw_rules) { 
 
-  if (fw_rules == NULL || filepath.empty()) {
-    return;
+  if (fw_rules == NULL) {
+    return -1;
   }
 
-  FILE* file = fopen(filepath.c_str(), "w");
-  if (file == NULL) {
-    perror("Failed to open file");
-    return;
+  // The options go after the names of the domains
+  std::string strings = fw_rules->names;
+  std::string options;
+  for (const std::string& option : fw_rules->options) {
+    AppendU32(options, strings.size());
+    AppendU32(options, option.size());
+    strings += option;
   }
 
-  // The first line stores the number of connections allowed in the sandbox. 
-  // A negative number means the value will be ignored
-  fprintf(file, "%d\n", fw_rules->max_connections);
-
   // if max_connections >= 0 we only enforce the `max_connections` policy. 
   // if max_connections < 0 (which is the default value) we look at the firewall
   // rules and dump them
+  std::string rules;
+  uint32_t rule_count = 0;
   if (fw_rules->max_connections < 0) {
-
-  // Then we dump all the IP addresses/ domain names / subnets we wanna 
-  // allow in the new network
-    for (size_t i = 0; i < fw_rules->count; ++i) {
-      if (fw_rules->rules[i] != NULL) {
-        fprintf(file, "%s\n", fw_rules->rules[i]);
+    rule_count = fw_rules->rules.size();
+    rules.reserve(rule_count * RULES_RECORD_SIZE);
+    for (const FirewallRule& rule : fw_rules->rules) {
+      rules += static_cast<char>(rule.type);
+      rules += static_cast<char>(rule.prefix_len);
+      rules.append(2, '\0');
+      if (rule.type == RuleType::Domain) {
+        AppendU32(rules, rule.name_offset);
+        AppendU32(rules, rule.name_length);
+        rules.append(8, '\0');
+      } else {
+        rules.append(reinterpret_cast<const char*>(rule.address), sizeof(rule.address));
       }
     }
   }
 
-  fclose(file);  
+  std::string out = RULES_MAGIC;
+  AppendU32(out, RULES_VERSION);
+  AppendU32(out, static_cast<uint32_t>(fw_rules->max_connections));
+  AppendU32(out, fw_rules->options.size());
+  AppendU32(out, rule_count);
+  AppendU32(out, strings.size());
+  out += options;
+  out += rules;
+  out += strings;
+
+  int fd = memfd_create("minitap-rules", MFD_CLOEXEC);
+  if (fd < 0) {
+    perror("memfd_create");
+    return -1;
+  }
+  const char* data = out.data();
+  size_t left = out.size();
+  while (left > 0) {
+    ssize_t n = write(fd, data, left);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("write");
+      close(fd);
+      return -1;
+    }
+    data += n;
+    left -= n;
+  }
+  // minitap reads it from the start
+  lseek(fd, 0, SEEK_SET);
+  return fd;
 }
@@ -7,7 +7,6 @@
 #define _FIREWALL_H
 
 #define MAX_RULE_LENGTH 1024
-#define MAX_RULES 100
 #define RULES_ERR -1
 #define RULES_OVERFLOW -2
 #define RULES_CONFIG_ALREADY_SET -3
@@ -15,9 +14,14 @@
 
 #define MAX_ARGS 64
 
+// How long mini-tapbox waits for minitap to start by default
+#define MINITAP_START_TIMEOUT_MS 10000
+
 #include <string>
 #include <iostream>
 #include <cstdint>
+#include <unordered_map>
+#include <vector>
 
 
 enum class FirewallMode : int {
@@ -28,17 +32,71 @@ enum class FirewallMode : int {
 };
 
 
+// DumpRules hands the rules to minitap in a memfd, in this format (the
+// integers are little endian, u32 unless noted):
+//
+//   header   "MTFW", RULES_VERSION, max_connections (signed), number of
+//            options, number of rules, size of the strings
+//   options  offset and length of each "key=value" in the strings
+//   rules    RULES_RECORD_SIZE bytes each: type (u8), prefix length (u8), two
+//            zero bytes, then the address in network order (16 bytes, IPv4
+//            in the first 4), or the offset and length of the domain name in
+//            the strings followed by 8 zero bytes
+//   strings  the domain names and the options, not NUL terminated
+//
+// minitap/rules.go reads it.
+#define RULES_MAGIC "MTFW"
+#define RULES_VERSION 1
+#define RULES_RECORD_SIZE 20
+
+enum class RuleType : uint8_t {
+  Domain = 0,
+  Ipv4   = 1,
+  Ipv6   = 2
+};
+
+struct FirewallRule {
+  RuleType type;
+  // of the IP rules, the address length for a single address
+  uint8_t prefix_len;
+  uint8_t address[16];
+  // where the domain rules have their name in FirewallRules::names
+  uint32_t name_offset;
+  uint32_t name_length;
+};
+
 struct FirewallRules {
-    char rules[MAX_RULES][MAX_RULE_LENGTH];
-    size_t count = 0;
+    std::vector<FirewallRule> rules;
+    // the names of the domain rules, each once
+    std::string names;
+    std::unordered_map<std::string, uint32_t> name_offsets;
     int max_connections = -1;
     FirewallMode mode = FirewallMode::FirewallUninitialized;
+    // options of the minitap backend, as "key=value"
+    std::vector<std::string> options;
+    int start_timeout_ms = MINITAP_START_TIMEOUT_MS;
+    // the allowed TCP connections skip minitap, see fast-connect.h
+    bool fast_connect = false;
+    // the socket of a shared minitap to register with rather than starting
+    // one, see minitap-shared.h
+    std::string shared_socket;
+    // the mtu option, which mini-tapbox applies itself with a shared minitap
+    int mtu = 0;
+    // changes to the rules of the running minitap, one per line, until they
+    // are sent together (see MinitapControl)
+    std::string updates;
 };
 
 int set_firewall_rule(const char* rule, FirewallRules* fw_rules);
 int set_max_connections(int max_connections, FirewallRules* fw_rules);
 int reset_firewall_rules(FirewallRules* fw_rules);
-void DumpRules(FirewallRules* fw_rules, std::string& filepath);
+int set_tap_option(const char* key, const char* value, FirewallRules* fw_rules);
+// Returns a memfd with the rules, or -1
+int DumpRules(FirewallRules* fw_rules);
+// Queue changes to fw_rules->updates, allowing or revoking an IP, subnet or
+// domain, or starting a new budget of connections
+int queue_rule_update(bool allow, const char* rule, FirewallRules* fw_rules);
+int queue_max_connections_update(int max_connections, FirewallRules* fw_rules);
 
 
 #endif
@@ -84,10 +84,34 @@ int mini_sandbox_mount_parents_write() {
   return MiniSbxMountParentsWrite();
 }
 
+int mini_sandbox_set_pid_file(const char* path) {
+  return MiniSbxSetPidFile(path);
+}
+
+int mini_sandbox_set_mount_template(const char* socket_path) {
+  return MiniSbxSetMountTemplate(socket_path);
+}
+
+int mini_sandbox_clone_working_dir(const char* base_dir) {
+  return MiniSbxCloneWorkingDir(base_dir);
+}
+
+int mini_sandbox_exec(int pid, char* const argv[]) {
+  std::vector<char *> args;
+  for (; argv != nullptr && *argv != nullptr; argv++) {
+    args.push_back(*argv);
+  }
+  return MiniSbxExec(pid, args);
+}
+
 #ifndef MINITAP
 int mini_sandbox_share_network() {
   return MiniSbxShareNetNamespace();
 }
+
+int mini_sandbox_set_netns_pool(const char* socket_path) {
+  return MiniSbxSetNetnsPool(socket_path);
+}
 #endif
 
 #ifdef MINITAP
@@ -118,6 +142,36 @@ int mini_sandbox_allow_all_domains() {
 int mini_sandbox_allow_ipv4_subnet(const char* subnet) {
   return MiniSbxAllowIpv4Subnet(subnet);
 }
+
+
+int mini_sandbox_allow_ipv6(const char* rule) {
+  return MiniSbxAllowIpv6(rule);
+}
+
+
+int mini_sandbox_set_tap_option(const char* key, const char* value) {
+  return MiniSbxSetTapOption(key, value);
+}
+
+
+int mini_sandbox_firewall_allow(const char* rule) {
+  return MiniSbxFirewallAllow(rule);
+}
+
+
+int mini_sandbox_firewall_revoke(const char* rule) {
+  return MiniSbxFirewallRevoke(rule);
+}
+
+
+int mini_sandbox_firewall_reset_max_connections(int max_connections) {
+  return MiniSbxFirewallResetMaxConnections(max_connections);
+}
+
+
+int mini_sandbox_firewall_commit() {
+  return MiniSbxFirewallCommit();
+}
 #endif
 
 #endif
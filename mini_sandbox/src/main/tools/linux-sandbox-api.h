@@ -44,8 +44,33 @@ const char* mini_sandbox_get_last_error_msg();
 
 int mini_sandbox_is_running();
 
+// Writes the PID of the sandbox init process to path once the sandbox is up.
+// This PID can be handed to mini_sandbox_exec() (or `mini-sandbox -A`) from
+// another process to run more commands in the same sandbox.
+int mini_sandbox_set_pid_file(const char* path);
+
+// Clones the read-only root folders from the mount template served on
+// socket_path by `mini-sandbox -B`, instead of mounting them one by one. Only
+// used by the default setup; falls back to the usual mounts if unavailable.
+int mini_sandbox_set_mount_template(const char* socket_path);
+
+// Clones the working directory in a new folder under base_dir and mounts the
+// clone in its place, so that the sandbox never writes to the original. Files
+// are cloned with reflinks when base_dir is on the same filesystem and the
+// filesystem supports them, and copied otherwise.
+int mini_sandbox_clone_working_dir(const char* base_dir);
+
+// Runs argv (NULL terminated) inside the running sandbox whose init process has
+// PID pid, without setting up the sandbox again. Blocks until the command exits
+// and returns its exit code, or a negative value if it could not be started.
+int mini_sandbox_exec(int pid, char* const argv[]);
+
 #ifndef MINITAP
 int mini_sandbox_share_network();
+// Takes the network namespace from the pool served on socket_path by
+// `mini-sandbox -Q`, instead of creating a new one. Falls back to a new one if
+// the pool is unavailable.
+int mini_sandbox_set_netns_pool(const char* socket_path);
 #else // ifdef MINITAP
 int mini_sandbox_allow_connections(const char* path);
 int mini_sandbox_allow_max_connections(int max_connections);
@@ -53,6 +78,22 @@ int mini_sandbox_allow_ipv4(const char* ip);
 int mini_sandbox_allow_domain(const char* domain);
 int mini_sandbox_allow_all_domains();
 int mini_sandbox_allow_ipv4_subnet(const char* subnet);
+// Takes an IPv6 address or subnet, e.g. "2001:db8::/32"
+int mini_sandbox_allow_ipv6(const char* rule);
+// Sets an option of the network stack of the tap mode, e.g. key "queues" and
+// value "4". See docs/flags.md for the options.
+int mini_sandbox_set_tap_option(const char* key, const char* value);
+
+// These change the firewall after mini_sandbox_start(), i.e. of the running
+// sandbox. allow and revoke take an IP, a subnet or a domain, and
+// reset_max_connections starts a new budget of max_connections connections
+// (none if negative). The changes are queued until mini_sandbox_firewall_commit()
+// applies them all at once, or none of them if minitap rejects one; the queue
+// is emptied either way.
+int mini_sandbox_firewall_allow(const char* rule);
+int mini_sandbox_firewall_revoke(const char* rule);
+int mini_sandbox_firewall_reset_max_connections(int max_connections);
+int mini_sandbox_firewall_commit();
 #endif
 
 #if defined(__cplusplus)
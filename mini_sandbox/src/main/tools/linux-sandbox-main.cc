@@ -6,12 +6,21 @@
 #include "src/main/tools/docker-support.h"
 #include "src/main/tools/linux-sandbox-options.h"
 #include "src/main/tools/linux-sandbox.h"
+#include "src/main/tools/mount-template.h"
+#include "src/main/tools/netns-pool.h"
 
 int main(int argc, char *argv[]) {
   int exit_code = 0;
   docker_mode = CheckDockerMode();
   ParseOptions(argc, argv);
-  exit_code = MiniSbxStart();
+  if (!opt.mount_template_server.empty())
+    exit_code = MiniSbxServeMountTemplate(opt.mount_template_server);
+  else if (!opt.netns_pool_server.empty())
+    exit_code = MiniSbxServeNetnsPool(opt.netns_pool_server);
+  else if (opt.attach_pid > 0)
+    exit_code = MiniSbxExec(opt.attach_pid, opt.args);
+  else
+    exit_code = MiniSbxStart();
   return exit_code;
 
 }
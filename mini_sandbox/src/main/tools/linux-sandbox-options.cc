@@ -15,6 +15,7 @@
 #include "src/main/tools/docker-support.h"
 #include "error-handling.h"
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fstream>
 #include <iostream>
@@ -43,6 +44,9 @@ namespace fs = std::experimental::filesystem;
 #endif
 #include "src/main/tools/logging.h"
 #include "src/main/tools/process-tools.h"
+#ifdef MINITAP
+#include "src/main/tools/minitap-interface.h"
+#endif
 #include <algorithm>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -98,6 +102,9 @@ static void Usage(char *program_name, const char *fmt, ...) {
       "  -P  if set, make the gid be tty and make /dev/pts writable\n"
       "  -F <firewall-rules-file> if set, reads the firewall rules to enable "
       "(only in tap mode)\n"
+      "  -O <key=value>  set an option of the tap mode network stack, e.g. "
+      "queues=4, max-in-flight=1000, mtu=65520 or metrics=/tmp/net.json "
+      "(only in tap mode)\n"
       "  -D <debug-file> if set, debug info will be printed to this file\n"
       "  -d <overlayfs-directory> indicate the base folder to use for overlay"
       ", it's meant to be used together with -o\n"
@@ -108,6 +115,25 @@ static void Usage(char *program_name, const char *fmt, ...) {
       "network, chroot) \n"
       " -k directory ot mount as overlayfs inside the sanbdox. Only available "
       "with -o\n"
+      "  -p <pid-file>  if set, write the PID of the sandbox init process to "
+      "this file. It can be used with -A to run more commands in the sandbox\n"
+      "  -A <pid>  run the command inside the already running sandbox whose "
+      "init process has this PID instead of creating a new sandbox\n"
+      "  -j <json|proto>  run the command as a persistent worker speaking this "
+      "worker protocol on stdin/stdout. The overlays are reset every time the "
+      "worker has no request in flight, only with -x or -o\n"
+      "  -B <socket>  serve a template of the read-only root folders on this "
+      "unix socket instead of running a command\n"
+      "  -b <socket>  clone the read-only root folders from the template "
+      "served on this socket, only with -x\n"
+      "  -Q <socket>  serve a pool of loopback-only network namespaces on "
+      "this unix socket instead of running a command (not in tap mode)\n"
+      "  -q <socket>  take the network namespace from the pool served on "
+      "this socket (not in tap mode)\n"
+      "  -C <dir>  clone the working directory in a new folder under dir and "
+      "mount the clone in its place, so that the sandbox can't change the "
+      "original. dir should be on the same filesystem as the working "
+      "directory to clone with reflinks instead of copying\n"
       "  -h <sandbox-dir>  if set, chroot to sandbox-dir and only "
       " mount whats been specified with -M/-m for improved hermeticity. "
       " The working-dir should be a folder inside the sandbox-dir\n"
@@ -303,7 +329,7 @@ static void ParseCommandLine(unique_ptr<vector<char *>> args) {
   int c;
 
   while ((c = getopt(args->size(), args->data(),
-                     ":S:G:W:T:t:il:L:w:e:M:m:h:HnNRUPF:D:o:d:k:x")) != -1) {
+                     ":S:G:W:T:t:il:L:w:e:M:m:h:HnNRUPF:O:D:o:d:k:xp:A:j:B:b:Q:q:C:")) != -1) {
 
     switch (c) {
     case 'W':
@@ -366,6 +392,15 @@ static void ParseCommandLine(unique_ptr<vector<char *>> args) {
       }
       MiniSbxShareNetNamespace();
       break;
+    case 'Q':
+      ValidateIsAbsolutePath(optarg, args->front(), static_cast<char>(c));
+      opt.netns_pool_server.assign(optarg);
+      break;
+    case 'q':
+      if (MiniSbxSetNetnsPool(std::string(optarg)) < 0) {
+        Usage(args->front(), MiniSbxGetErrorMsg());
+      }
+      break;
 #else
     case 'F':
       if (opt.firewall_rules_path.empty()) {
@@ -376,6 +411,15 @@ static void ParseCommandLine(unique_ptr<vector<char *>> args) {
               "Cannot write firewall rule in more than one file.");
       }
       break;
+    case 'O': {
+      std::string option(optarg);
+      size_t eq = option.find('=');
+      if (eq == std::string::npos ||
+          MiniSbxSetTapOption(option.substr(0, eq), option.substr(eq + 1)) < 0) {
+        Usage(args->front(), "Invalid tap option %s.", optarg);
+      }
+      break;
+    }
 #endif
     case 'R':
       if (opt.fake_username) {
@@ -421,6 +465,39 @@ static void ParseCommandLine(unique_ptr<vector<char *>> args) {
           Usage(args->front(), MiniSbxGetErrorMsg());
       }
       break;
+    case 'p':
+      if (MiniSbxSetPidFile(std::string(optarg)) < 0) {
+        Usage(args->front(), MiniSbxGetErrorMsg());
+      }
+      break;
+    case 'j':
+      if (strcmp(optarg, "json") == 0) {
+        opt.worker_protocol = WORKER_JSON;
+      } else if (strcmp(optarg, "proto") == 0) {
+        opt.worker_protocol = WORKER_PROTO;
+      } else {
+        Usage(args->front(), "Invalid worker protocol (-j) value: %s", optarg);
+      }
+      break;
+    case 'B':
+      ValidateIsAbsolutePath(optarg, args->front(), static_cast<char>(c));
+      opt.mount_template_server.assign(optarg);
+      break;
+    case 'b':
+      if (MiniSbxSetMountTemplate(std::string(optarg)) < 0) {
+        Usage(args->front(), MiniSbxGetErrorMsg());
+      }
+      break;
+    case 'C':
+      if (MiniSbxCloneWorkingDir(std::string(optarg)) < 0) {
+        Usage(args->front(), MiniSbxGetErrorMsg());
+      }
+      break;
+    case 'A':
+      if (sscanf(optarg, "%d", &opt.attach_pid) != 1 || opt.attach_pid <= 0) {
+        Usage(args->front(), "Invalid sandbox PID (-A) value: %s", optarg);
+      }
+      break;
     case '?':
       Usage(args->front(), "Unrecognized argument: -%c (%d)", optopt, optind);
       break;
@@ -443,6 +520,19 @@ static void ParseCommandLine(unique_ptr<vector<char *>> args) {
       Usage(args->front(),
             "Illegal configuration: overlayfs folder inside sandbox root.");
   }
+
+  // Resetting the sandbox between requests is resetting its overlays
+  if (opt.worker_protocol != NO_WORKER && !opt.use_overlayfs) {
+    Usage(args->front(), "The -j option requires one of the overlay modes (-x or -o).");
+  }
+
+  // When attaching, the filesystem and namespaces are the ones of the running
+  // sandbox, so there's nothing to set up here
+  if (opt.attach_pid > 0 &&
+      (opt.use_default || opt.use_overlayfs || opt.hermetic)) {
+    Usage(args->front(),
+          "The -A option cannot be used together with -x, -o or -h.");
+  }
 }
 
 // Expands a single argument, expanding options @filename to read in the content
@@ -503,7 +593,8 @@ void ParseOptions(int argc, char *argv[]) {
       Usage(args.front(), "Could not obtain CWD.");
   }
 
-  if (opt.args.empty()) {
+  if (opt.args.empty() && opt.mount_template_server.empty() &&
+      opt.netns_pool_server.empty()) {
     Usage(args.front(), "No command specified.");
   }
 }
@@ -512,9 +603,23 @@ void ParseOptions(int argc, char *argv[]) {
 #ifdef MINITAP
 
 std::regex ipv4_regex(R"(^(\d{1,3}\.){3}\d{1,3}$)");
-std::regex domain_regex(R"(^([a-zA-Z0-9-]+\.)*[a-zA-Z0-9-]+$)");
+std::regex domain_regex(R"(^(\*\.)?([a-zA-Z0-9-]+\.)*[a-zA-Z0-9-]+$)");
 std::regex subnet_regex(R"(^(\d{1,3}\.){3}\d{1,3}/\d{1,2}$)");
 
+// IPv6 addresses, optionally with a prefix length, are left to inet_pton
+static bool IsIpv6Rule(const std::string& rule) {
+  std::string address = rule.substr(0, rule.find('/'));
+  if (address.size() < rule.size()) {
+    std::string plen = rule.substr(address.size() + 1);
+    if (plen.empty() || plen.size() > 3 ||
+        plen.find_first_not_of("0123456789") != std::string::npos ||
+        std::stoi(plen) > 128)
+      return false;
+  }
+  struct in6_addr addr;
+  return inet_pton(AF_INET6, address.c_str(), &addr) == 1;
+}
+
 static int ValidateFilePath(const std::string &path) {
   std::error_code ec;
   fs::path fs_path(path);
@@ -548,6 +653,8 @@ static int ReadAllowedConnections(std::ifstream& file) {
           MiniSbxAllowDomain(line.c_str());
       } else if (std::regex_match(line, subnet_regex)) {
           MiniSbxAllowIpv4Subnet(line.c_str());
+      } else if (IsIpv6Rule(line)) {
+          MiniSbxAllowIpv6(line.c_str());
       } else {
           std::cerr << "Warning: Unrecognized rule format: " << line << "\n";
           res = -1;
@@ -632,6 +739,66 @@ int MiniSbxAllowIpv4Subnet(const std::string& subnet) {
   }
   return MiniSbxAllowIpv4(subnet);
 }
+
+int MiniSbxSetTapOption(const std::string& key, const std::string& value) {
+  if (opt.is_running != NOT_RUNNING){
+    MiniSbxReportError(ErrorCode::SandboxAlreadyStarted);
+    return -1;
+  }
+  PRINT_DEBUG("tap option %s=%s", key.c_str(), value.c_str());
+  if(set_tap_option(key.c_str(), value.c_str(), &(opt.fw_rules))<0){
+    return MiniSbxReportErrorAndMessage(key + "=" + value, ErrorCode::InvalidTapOption);
+  }
+  return 0;
+}
+
+int MiniSbxAllowIpv6(const std::string& rule) {
+  if (opt.is_running != NOT_RUNNING){
+    MiniSbxReportError(ErrorCode::SandboxAlreadyStarted);
+    return -1;
+  }
+  PRINT_DEBUG("allow ipv6 %s", rule.c_str());
+  if(!IsIpv6Rule(rule) || set_firewall_rule(rule.c_str(), &(opt.fw_rules))<0){
+    return MiniSbxReportError(ErrorCode::IllegalNetworkConfiguration);
+  }
+  return 0;
+}
+
+// The updates of the firewall of the running sandbox are queued, then sent
+// to minitap together by MiniSbxFirewallCommit
+int MiniSbxFirewallAllow(const std::string& rule) {
+  PRINT_DEBUG("firewall update: allow %s", rule.c_str());
+  if(queue_rule_update(true, rule.c_str(), &(opt.fw_rules))<0){
+    return MiniSbxReportErrorAndMessage(rule, ErrorCode::InvalidFirewallRule);
+  }
+  return 0;
+}
+
+int MiniSbxFirewallRevoke(const std::string& rule) {
+  PRINT_DEBUG("firewall update: revoke %s", rule.c_str());
+  if(queue_rule_update(false, rule.c_str(), &(opt.fw_rules))<0){
+    return MiniSbxReportErrorAndMessage(rule, ErrorCode::InvalidFirewallRule);
+  }
+  return 0;
+}
+
+int MiniSbxFirewallResetMaxConnections(int max_connections) {
+  PRINT_DEBUG("firewall update: max connections %d", max_connections);
+  return queue_max_connections_update(max_connections, &(opt.fw_rules));
+}
+
+int MiniSbxFirewallCommit() {
+  std::string request;
+  // Dropped whatever the outcome, minitap applied either all or none of it
+  request.swap(opt.fw_rules.updates);
+  if (request.empty())
+    return 0;
+  std::string err_msg;
+  if (MinitapControl(request, err_msg) < 0) {
+    return MiniSbxReportErrorAndMessage(err_msg, ErrorCode::FirewallUpdateFailed);
+  }
+  return 0;
+}
 #endif
 
 #ifndef MINITAP
@@ -639,6 +806,17 @@ int MiniSbxShareNetNamespace() {
     opt.create_netns = NO_NETNS;
     return 0;
 }
+
+int MiniSbxSetNetnsPool(const std::string& socket_path) {
+  if (opt.is_running != NOT_RUNNING){
+    MiniSbxReportError(ErrorCode::SandboxAlreadyStarted);
+    return -1;
+  }
+  if (socket_path[0] != '/')
+    return MiniSbxReportErrorAndMessage(socket_path, ErrorCode::NotAnAbsolutePath);
+  opt.netns_pool.assign(socket_path);
+  return 0;
+}
 #endif
 
 
@@ -1002,6 +1180,47 @@ int MiniSbxMountParentsWrite() {
   return 0;
 }
 
+int MiniSbxSetPidFile(const std::string& path) {
+  if (opt.is_running != NOT_RUNNING){
+    MiniSbxReportError(ErrorCode::SandboxAlreadyStarted);
+    return -1;
+  }
+  int res = 0;
+  if (path[0] != '/')
+    return MiniSbxReportErrorAndMessage(path, ErrorCode::NotAnAbsolutePath);
+  fs::path fs_path(path);
+  if ((res = ValidateDirPath(fs_path.parent_path().string())) < 0)
+    return res;
+  opt.pid_file.assign(path);
+  return 0;
+}
+
+int MiniSbxSetMountTemplate(const std::string& socket_path) {
+  if (opt.is_running != NOT_RUNNING){
+    MiniSbxReportError(ErrorCode::SandboxAlreadyStarted);
+    return -1;
+  }
+  if (socket_path[0] != '/')
+    return MiniSbxReportErrorAndMessage(socket_path, ErrorCode::NotAnAbsolutePath);
+  opt.mount_template.assign(socket_path);
+  return 0;
+}
+
+int MiniSbxCloneWorkingDir(const std::string& base_dir) {
+  if (opt.is_running != NOT_RUNNING){
+    MiniSbxReportError(ErrorCode::SandboxAlreadyStarted);
+    return -1;
+  }
+  if (!opt.clone_base_dir.empty())
+    return MiniSbxReportErrorAndMessage(base_dir, ErrorCode::IllegalConfiguration);
+  std::string path = CanonicPath(base_dir, true);
+  int res = 0;
+  if ((res = ValidateDirPath(path)) < 0)
+    return res;
+  opt.clone_base_dir.assign(path);
+  return 0;
+}
+
 int MiniSbxSetWorkingDir(const std::string& input_path) {
   if (opt.is_running != NOT_RUNNING){
     MiniSbxReportError(ErrorCode::SandboxAlreadyStarted);
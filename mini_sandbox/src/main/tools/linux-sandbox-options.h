@@ -17,6 +17,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 #include <string>
 #include <vector>
@@ -32,6 +33,7 @@
 enum NetNamespaceOption {NETNS_WITH_LOOPBACK,  NO_NETNS, NETNS};
 enum DockerMode {NO_CONTAINER, UNPRIVILEGED_CONTAINER, PRIVILEGED_CONTAINER};
 enum MiniSbxStatus {NOT_RUNNING, RUNNING, FAILED};
+enum WorkerProtocol {NO_WORKER, WORKER_JSON, WORKER_PROTO};
 extern DockerMode docker_mode;
 
 // Options parsing result.
@@ -88,6 +90,29 @@ struct Options {
   bool parents_writable = false;
   // tells if the sandbox is running or not
   MiniSbxStatus is_running = NOT_RUNNING;
+  // File where to write the host PID of the sandbox pid1 (-p)
+  std::string pid_file;
+  // Host PID of the pid1 of an already running sandbox in which the command
+  // is executed instead of starting a new sandbox (-A)
+  pid_t attach_pid = 0;
+  // Run the command as a Bazel persistent worker speaking this protocol on
+  // stdin/stdout, resetting the overlays between requests (-j)
+  WorkerProtocol worker_protocol = NO_WORKER;
+  // Socket of a mount template server to clone the read-only root folders
+  // from (-b)
+  std::string mount_template;
+  // Serve a mount template on this socket instead of running a command (-B)
+  std::string mount_template_server;
+  // Socket of a netns pool server to take the network namespace from (-q)
+  std::string netns_pool;
+  // Serve a pool of network namespaces on this socket instead of running a
+  // command (-Q)
+  std::string netns_pool_server;
+  // Directory under which the working directory is cloned (with reflinks
+  // where possible) and mounted in its place, instead of being writable (-C)
+  std::string clone_base_dir;
+  // Folder of the clone, created in clone_base_dir when the sandbox starts
+  std::string clone_dir;
   // path to firewall rules if tap mode is enabled
 #ifdef MINITAP
   std::string firewall_rules_path;
@@ -117,12 +142,16 @@ int MiniSbxMountTmpfs(const std::string& path);
 int MiniSbxMountOverlay(const std::string& path);
 int MiniSbxMountEmptyOutputFile(const std::string& path);
 int MiniSbxMountParentsWrite();
+int MiniSbxSetPidFile(const std::string& path);
+int MiniSbxSetMountTemplate(const std::string& socket_path);
+int MiniSbxCloneWorkingDir(const std::string& base_dir);
 
 int MiniSbxCreateInit();
 int MiniSbxReadInit();
 
 #ifndef MINITAP
 int MiniSbxShareNetNamespace() ;
+int MiniSbxSetNetnsPool(const std::string& socket_path);
 #endif
 
 #ifdef MINITAP
@@ -132,6 +161,14 @@ int MiniSbxAllowIpv4(const std::string& ip);
 int MiniSbxAllowDomain(const std::string& domain);
 int MiniSbxAllowAllDomains();
 int MiniSbxAllowIpv4Subnet(const std::string& subnet);
+// Takes an IPv6 address or subnet
+int MiniSbxAllowIpv6(const std::string& rule);
+int MiniSbxSetTapOption(const std::string& key, const std::string& value);
+// Update the firewall of the running sandbox
+int MiniSbxFirewallAllow(const std::string& rule);
+int MiniSbxFirewallRevoke(const std::string& rule);
+int MiniSbxFirewallResetMaxConnections(int max_connections);
+int MiniSbxFirewallCommit();
 #endif
 
 
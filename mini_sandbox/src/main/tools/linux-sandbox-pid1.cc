@@ -42,6 +42,7 @@
 #include <unistd.h>
 #include <linux/magic.h>
 #include <algorithm>
+#include <fstream>
 #include <string>
 #include <unordered_set>
 #include <set>
@@ -74,11 +75,60 @@ namespace fs = std::experimental::filesystem;
 #include "src/main/tools/process-tools.h"
 #include "src/main/tools/linux-sandbox-pid1.h"
 #include "src/main/tools/docker-support.h"
+#include "src/main/tools/worker-protocol.h"
+#include "src/main/tools/mount-template.h"
+#include "src/main/tools/reflink-copy.h"
+#ifdef MINITAP
+#include "src/main/tools/fast-connect.h"
+#endif
 
 #ifndef XFS_SUPER_MAGIC
 #define XFS_SUPER_MAGIC 0x58465342
 #endif
 
+// The new mount API might be missing from older headers
+#ifndef SYS_fsopen
+#define SYS_fsopen 430
+#endif
+#ifndef SYS_fsconfig
+#define SYS_fsconfig 431
+#endif
+#ifndef SYS_fsmount
+#define SYS_fsmount 432
+#endif
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#endif
+#ifndef FSCONFIG_SET_STRING
+#define FSCONFIG_SET_STRING 1
+#endif
+#ifndef FSCONFIG_CMD_CREATE
+#define FSCONFIG_CMD_CREATE 6
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOUNT_ATTR_NOSUID 0x00000002
+#define MOUNT_ATTR_NODEV 0x00000004
+#define MOUNT_ATTR_NOEXEC 0x00000008
+#endif
+#ifndef SYS_move_mount
+#define SYS_move_mount 429
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef MOVE_MOUNT_T_EMPTY_PATH
+#define MOVE_MOUNT_T_EMPTY_PATH 0x00000040
+#endif
+
+// In worker mode (-j), where the layers of each overlay are kept, under its
+// mount point
+#define OVERLAY_LAYERS_DIR ".mini-sandbox-layers"
+
+
 #define ROOT "/"
 #define MINISBX_TMP_INIT "/tmp/mini-sandbox-init"
 
@@ -142,6 +192,33 @@ static int global_child_pid __attribute__((unused));
 extern DockerMode docker_mode;
 std::string home_dir;
 std::set<std::string> ReadOnlyPaths;
+// sysfs of the network namespace from the pool (-q), -1 if we created our own
+static int pool_sysfs_fd = -1;
+// Root folders already mounted from the mount template (-b)
+static std::set<std::string> TemplatePaths;
+
+// Overlays mounted by MountOverlayFs. In worker mode (-j) every request gets a
+// fresh overlay, which is mounted from the layers kept here.
+struct OverlayMount {
+  // The root of the overlay
+  int merged_fd = -1;
+  int lower_fd = -1;
+  // Where the upper and work directories are
+  int staging_fd = -1;
+  // Where the next overlay is mounted until it takes the place of this one
+  int next_fd = -1;
+  std::string upperdir;
+  std::string workdir;
+  int generation = 0;
+};
+static std::vector<OverlayMount> overlay_mounts;
+
+#if (!(LIBMINISANDBOX))
+// Pipes the worker (-j) uses as stdin/stdout
+static int worker_stdin = -1;
+static int worker_stdout = -1;
+static void ResetOverlays();
+#endif
 
 
 void MountAllOverlayFs(std::vector<std::string> list_of_dirs, int depth);
@@ -352,6 +429,18 @@ static void SetupUtsNamespace() {
   }
 }
 
+// Returns what to mount on the working directory: the directory itself or,
+// with -C, a clone of it.
+static std::string WorkingDirSource() {
+  if (opt.clone_dir.empty()) {
+    return opt.working_dir;
+  }
+  if (CloneTree(opt.working_dir, opt.clone_dir) < 0) {
+    DIE("CloneTree(%s, %s)", opt.working_dir.c_str(), opt.clone_dir.c_str());
+  }
+  return opt.clone_dir;
+}
+
 static void MountFilesystems() {
   // An attempt to mount the sandbox in tmpfs will always fail, so this block is
   // slightly redundant with the next mount() check, but dumping the mount()
@@ -407,7 +496,8 @@ static void MountFilesystems() {
   // this is by bind-mounting it upon itself.
   PRINT_DEBUG("working dir: %s", opt.working_dir.c_str());
 
-  if (mount(opt.working_dir.c_str(), opt.working_dir.c_str(), nullptr,
+  const std::string working_dir_source = WorkingDirSource();
+  if (mount(working_dir_source.c_str(), opt.working_dir.c_str(), nullptr,
             MS_BIND, nullptr) < 0) {
       // If working_dir is also a mount point we need to remount it via MS_REMOUNT
       // and can't just bind mount . This is likely the cause of the error. If 
@@ -435,6 +525,47 @@ std::vector<std::string> list_directories(const std::string string_path) {
   return directories;
 }
 
+static std::string FdPath(int fd) {
+  return "/proc/self/fd/" + std::to_string(fd);
+}
+
+// Once in the sandbox root, the paths of the layers of the overlays are gone.
+// For the worker mode to mount fresh overlays (see ResetOverlays), the layers
+// of the overlay just mounted on destinationdir are bind mounted in a
+// directory of under_fd, the directory it hides, and kept open.
+static void KeepOverlayLayers(int under_fd, const std::string &lowerdir,
+                              const std::string &overlayfs,
+                              const std::string &destinationdir) {
+  const std::string layers = FdPath(under_fd) + "/" OVERLAY_LAYERS_DIR;
+  const std::string lower = layers + "/lower";
+  const std::string staging = layers + "/staging";
+  const std::string next = layers + "/next";
+  for (const std::string &dir : {layers, lower, staging, next}) {
+    if (mkdir(dir.c_str(), 0700) < 0) {
+      DIE("mkdir(%s)", dir.c_str());
+    }
+  }
+  if (mount(lowerdir.c_str(), lower.c_str(), nullptr, MS_BIND | MS_REC, nullptr) < 0) {
+    DIE("mount(%s, %s, nullptr, MS_BIND | MS_REC, nullptr)", lowerdir.c_str(), lower.c_str());
+  }
+  if (mount(overlayfs.c_str(), staging.c_str(), nullptr, MS_BIND | MS_REC, nullptr) < 0) {
+    DIE("mount(%s, %s, nullptr, MS_BIND | MS_REC, nullptr)", overlayfs.c_str(), staging.c_str());
+  }
+
+  OverlayMount overlay;
+  overlay.merged_fd = open(destinationdir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  overlay.lower_fd = open(lower.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  overlay.staging_fd = open(staging.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  overlay.next_fd = open(next.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (overlay.merged_fd < 0 || overlay.lower_fd < 0 || overlay.staging_fd < 0 ||
+      overlay.next_fd < 0) {
+    DIE("open(%s)", layers.c_str());
+  }
+  overlay.upperdir = "upperdir";
+  overlay.workdir = "workingdir";
+  overlay_mounts.push_back(overlay);
+}
+
 void MountOverlayFs(std::string lowerdir, int depth) {
 
   std::string overlayfs = opt.tmp_overlayfs + lowerdir;
@@ -450,6 +581,14 @@ void MountOverlayFs(std::string lowerdir, int depth) {
 
   std::string data = "lowerdir=" + lowerdir + ",upperdir=" + upperdir +
                      ",workdir=" + workingdir ;
+  // The directory the overlay is about to hide, to keep its layers there
+  int under_fd = -1;
+  if (opt.worker_protocol != NO_WORKER) {
+    under_fd = open(destinationdir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (under_fd < 0) {
+      DIE("open(%s)", destinationdir.c_str());
+    }
+  }
   PRINT_DEBUG("mount(\"overlay\", %s, overlay, MS_MGC_VAL, %s",
               destinationdir.c_str(), data.c_str());
   int error = mount("overlay", destinationdir.c_str(), "overlay", MS_MGC_VAL,
@@ -473,6 +612,11 @@ void MountOverlayFs(std::string lowerdir, int depth) {
     PRINT_DEBUG("%s", strerror(errno));
     DIE("mount(\"overlay\", %s, overlay, MS_MGC_VAL, %s",
         destinationdir.c_str(), data.c_str());
+  } else if (opt.worker_protocol != NO_WORKER) {
+    KeepOverlayLayers(under_fd, lowerdir, overlayfs, destinationdir);
+  }
+  if (under_fd >= 0) {
+    close(under_fd);
   }
 }
 
@@ -697,7 +841,7 @@ AddLeftoverFoldersToReadOnlyPaths() {
           // to mount this folder. We'll add it to our internal ReadOnlyPaths structure
           // and will mount later as read-only. Otherwise we already have in place the
           // rules to mount it and the following methods will mount accordingly
-          if (!deferred_mount) {
+          if (!deferred_mount && TemplatePaths.count(path) == 0) {
               PRINT_DEBUG("ADDING %s in the internal ReadOnlyPaths", path.c_str());
               ReadOnlyPaths.insert(path);
           }
@@ -713,6 +857,34 @@ AddLeftoverFoldersToReadOnlyPaths() {
 }
 
 
+// Mounts the read-only root folders cloned from the mount template server
+// instead of binding and remounting each of them. The folders that have a
+// policy of their own are skipped as in AddLeftoverFoldersToReadOnlyPaths,
+// which takes care of whatever the template could not provide.
+static void MountTemplate() {
+  std::vector<TemplateMount> mounts;
+  if (ReceiveMountTemplate(opt.mount_template, &mounts) < 0) {
+    PRINT_DEBUG("mount template %s unavailable, mounting the root folders",
+                opt.mount_template.c_str());
+    return;
+  }
+  for (const TemplateMount &mount : mounts) {
+    const std::string path = std::string(ROOT) + mount.name;
+    if (!ToBeMounted(path.c_str())) {
+      const std::string full_sandbox_path(opt.sandbox_root + path);
+      if (CreateTarget(full_sandbox_path.c_str(), true) == 0 &&
+          MoveMount(mount.fd, full_sandbox_path) == 0) {
+        PRINT_DEBUG("%s mounted from the template", path.c_str());
+        TemplatePaths.insert(path);
+      } else {
+        PRINT_DEBUG("move_mount(%s) failure (%m) ignored", path.c_str());
+      }
+    }
+    close(mount.fd);
+  }
+}
+
+
 // The function MakeFilesystemPartiallyReadonly can be invoked to remount the mount points in /proc/self/mounts in
 // read-only. For it to succeed to mount a certain mount point, e.g., /a/b , we need /a/b to be already mounted
 // in the new root. Since this function can be invoked in two different modes, one chroot-ed and the other that 
@@ -859,6 +1031,15 @@ static void MountProcAndSys() {
     return;
   }
 
+  // We have no say on a network namespace from the pool, so the pool mounted
+  // its sysfs for us
+  if (pool_sysfs_fd >= 0) {
+    if (MoveMount(pool_sysfs_fd, "/sys") < 0) {
+      DIE("move_mount /sys");
+    }
+    return;
+  }
+
   // Same for sys, but only if a separate network namespace was requested.
   if (mount("none", "/sys", "sysfs",
             MS_NOEXEC | MS_NOSUID | MS_NODEV | MS_RDONLY, nullptr) < 0) {
@@ -875,7 +1056,8 @@ static void SetupNetworking() {
 
   // When running in a separate network namespace, enable the loopback interface
   // because some application may want to use it.
-  if (opt.create_netns == NETNS_WITH_LOOPBACK) {
+  // The pool brought up the loopback of its namespaces already
+  if (opt.create_netns == NETNS_WITH_LOOPBACK && pool_sysfs_fd < 0) {
     // By default we disable network except for loopback interface
     int fd;
     fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -1001,6 +1183,48 @@ static int WaitForChild() {
 }
 #endif
 
+#if (!(LIBMINISANDBOX))
+// Reaps the orphans in our PID namespace while we are busy relaying, leaving
+// the worker to WaitForChild
+static void ReapZombies() {
+  while (true) {
+    siginfo_t info = {};
+    if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0 ||
+        info.si_pid == 0 || info.si_pid == global_child_pid) {
+      return;
+    }
+    waitpid(info.si_pid, nullptr, 0);
+  }
+}
+
+// Runs the command as a persistent worker. We stand between it and our
+// stdin/stdout to know when it's done with all its WorkRequests, and reset the
+// overlays at that point so that every request starts from the same state.
+static int RunWorker() {
+  int to_worker[2], from_worker[2];
+  if (pipe2(to_worker, O_CLOEXEC) < 0 || pipe2(from_worker, O_CLOEXEC) < 0) {
+    DIE("pipe2");
+  }
+  worker_stdin = to_worker[0];
+  worker_stdout = from_worker[1];
+  SpawnChild(false);
+  close(to_worker[0]);
+  close(from_worker[1]);
+  fcntl(to_worker[1], F_SETFL, O_NONBLOCK);
+
+  InstallSignalHandler(SIGTERM, ForwardSignal);
+  IgnoreSignal(SIGPIPE);
+  if (RelayWorkerProtocol(opt.worker_protocol, STDIN_FILENO, STDOUT_FILENO,
+                          to_worker[1], from_worker[0], ResetOverlays,
+                          ReapZombies) < 0) {
+    PRINT_DEBUG("worker: relay failed: %s", strerror(errno));
+  }
+  close(to_worker[1]);
+  close(from_worker[0]);
+  return WaitForChild();
+}
+#endif
+
 void SpawnChild(bool nested) {
   PRINT_DEBUG("calling fork...");
   global_child_pid = fork();
@@ -1035,6 +1259,14 @@ void SpawnChild(bool nested) {
       umask(022);
     }
 
+#if (!(LIBMINISANDBOX))
+    if (worker_stdin >= 0) {
+      if (dup2(worker_stdin, STDIN_FILENO) < 0 || dup2(worker_stdout, STDOUT_FILENO) < 0) {
+        DIE("dup2");
+      }
+    }
+#endif
+
     // argv[] passed to execve() must be a null-terminated array.
     opt.args.push_back(nullptr);
     if (execvp(opt.args[0], opt.args.data()) < 0) {
@@ -1271,14 +1503,15 @@ static void MountAllMounts() {
   // of the file system, which is read-only by default). The easiest way to do
   // this is by bind-mounting it upon itself.
   const std::string full_working_dir_path(opt.sandbox_root + opt.working_dir);
+  const std::string working_dir_source = WorkingDirSource();
 
   CreateTarget(full_working_dir_path.c_str(), true);
-  if (mount(opt.working_dir.c_str(), full_working_dir_path.c_str(), nullptr,
+  if (mount(working_dir_source.c_str(), full_working_dir_path.c_str(), nullptr,
             MS_REC | MS_BIND, nullptr) < 0) {
-    DIE("mount(%s, %s, nullptr, MS_BIND, nullptr)", opt.working_dir.c_str(),
+    DIE("mount(%s, %s, nullptr, MS_BIND, nullptr)", working_dir_source.c_str(),
         full_working_dir_path.c_str());
   } else {
-    PRINT_DEBUG("Mounted CWD -> %s ->  %s\n", opt.working_dir.c_str(),
+    PRINT_DEBUG("Mounted CWD -> %s ->  %s\n", working_dir_source.c_str(),
                 full_working_dir_path.c_str());
   }
 }
@@ -1306,6 +1539,217 @@ static void ChangeRoot() {
 }
 
 
+#if (!(LIBMINISANDBOX))
+// rm -rf of dir_fd/name that does not cross mount points
+static void RemoveTree(int dir_fd, const char *name, dev_t dev) {
+  struct stat sb;
+  if (fstatat(dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+    return;
+  }
+  if (!S_ISDIR(sb.st_mode)) {
+    unlinkat(dir_fd, name, 0);
+    return;
+  }
+  if (sb.st_dev != dev) {
+    return;
+  }
+  int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  DIR *dir = fdopendir(fd);
+  if (dir == nullptr) {
+    close(fd);
+    return;
+  }
+  std::vector<std::string> entries;
+  while (struct dirent *dent = readdir(dir)) {
+    if (strcmp(dent->d_name, ".") != 0 && strcmp(dent->d_name, "..") != 0) {
+      entries.emplace_back(dent->d_name);
+    }
+  }
+  for (const auto &entry : entries) {
+    RemoveTree(fd, entry.c_str(), dev);
+  }
+  closedir(dir);
+  unlinkat(dir_fd, name, AT_REMOVEDIR);
+}
+
+struct MountInfo {
+  int id;
+  int parent;
+  std::string mountpoint;
+};
+
+// The mounts of /proc/self/mountinfo, mount points unescaped
+static std::vector<MountInfo> ReadMountInfo() {
+  std::vector<MountInfo> mounts;
+  std::ifstream f("/proc/self/mountinfo");
+  std::string line;
+  while (std::getline(f, line)) {
+    MountInfo m;
+    char mountpoint[PATH_MAX];
+    if (sscanf(line.c_str(), "%d %d %*s %*s %4095s", &m.id, &m.parent, mountpoint) != 3) {
+      continue;
+    }
+    for (const char *c = mountpoint; *c; c++) {
+      if (c[0] == '\\' && c[1] >= '0' && c[1] <= '3' && c[2] && c[3]) {
+        m.mountpoint += static_cast<char>((c[1] - '0') << 6 | (c[2] - '0') << 3 | (c[3] - '0'));
+        c += 3;
+      } else {
+        m.mountpoint += *c;
+      }
+    }
+    mounts.push_back(m);
+  }
+  return mounts;
+}
+
+// The id of the mount fd is on, as in /proc/self/mountinfo
+static int MountId(int fd) {
+  std::ifstream f("/proc/self/fdinfo/" + std::to_string(fd));
+  std::string line;
+  while (std::getline(f, line)) {
+    if (line.compare(0, 7, "mnt_id:") == 0) {
+      return atoi(line.c_str() + 7);
+    }
+  }
+  return -1;
+}
+
+// Returns a detached overlay of the layers of overlay, with upperdir and
+// workdir in its staging directory, and the mount attributes of the current one
+static int CreateOverlay(const OverlayMount &overlay, const std::string &upperdir,
+                         const std::string &workdir) {
+  struct statvfs vfs;
+  if (fstatvfs(overlay.merged_fd, &vfs) < 0) {
+    return -1;
+  }
+  unsigned int attrs = 0;
+  if (vfs.f_flag & ST_RDONLY) attrs |= MOUNT_ATTR_RDONLY;
+  if (vfs.f_flag & ST_NOSUID) attrs |= MOUNT_ATTR_NOSUID;
+  if (vfs.f_flag & ST_NODEV) attrs |= MOUNT_ATTR_NODEV;
+  if (vfs.f_flag & ST_NOEXEC) attrs |= MOUNT_ATTR_NOEXEC;
+
+  int fs_fd = syscall(SYS_fsopen, "overlay", FSOPEN_CLOEXEC);
+  if (fs_fd < 0) {
+    return -1;
+  }
+  const std::string lower = FdPath(overlay.lower_fd);
+  const std::string upper = FdPath(overlay.staging_fd) + "/" + upperdir;
+  const std::string work = FdPath(overlay.staging_fd) + "/" + workdir;
+  int mnt_fd = -1;
+  if (syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_STRING, "lowerdir", lower.c_str(), 0) == 0 &&
+      syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_STRING, "upperdir", upper.c_str(), 0) == 0 &&
+      syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_STRING, "workdir", work.c_str(), 0) == 0 &&
+      syscall(SYS_fsconfig, fs_fd, FSCONFIG_CMD_CREATE, nullptr, nullptr, 0) == 0) {
+    mnt_fd = syscall(SYS_fsmount, fs_fd, FSMOUNT_CLOEXEC, attrs);
+  }
+  close(fs_fd);
+  return mnt_fd;
+}
+
+// Moves the mount fd to path, relative to dir_fd, or to dir_fd itself if path
+// is empty. move_mount() doesn't take /proc/self/fd/N links as targets.
+static int MoveMountAt(int fd, int dir_fd, const std::string &path) {
+  return syscall(SYS_move_mount, fd, "", dir_fd, path.c_str(),
+                 MOVE_MOUNT_F_EMPTY_PATH | (path.empty() ? MOVE_MOUNT_T_EMPTY_PATH : 0));
+}
+
+// Replaces the overlay by a fresh one with empty upper and work directories.
+// Changing the upper directory of a mounted overlay is undefined behaviour, so
+// the new overlay is mounted on the side, the mounts inside the old one (the
+// working directory, -w, ...) are moved over to it, and it takes the place of
+// the old one. The old upper directory is removed once the old overlay is
+// unmounted; the files the worker still has open keep their content.
+static void ResetOverlay(OverlayMount *overlay) {
+  int id = MountId(overlay->merged_fd);
+  std::vector<MountInfo> mounts = ReadMountInfo();
+  auto self = std::find_if(mounts.begin(), mounts.end(),
+                           [id](const MountInfo &m) { return m.id == id; });
+  if (self == mounts.end()) {
+    DIE("worker: overlay mount %d not found", id);
+  }
+  const std::string mountpoint = self->mountpoint;
+  std::vector<std::string> submounts;
+  for (const MountInfo &m : mounts) {
+    if (m.parent != id) {
+      continue;
+    }
+    if (m.mountpoint == mountpoint) {
+      PRINT_DEBUG("worker: overlay %s is under another mount, not reset", mountpoint.c_str());
+      return;
+    }
+    submounts.push_back(m.mountpoint);
+  }
+  // A submount under another one is hidden by it: only the latter can be moved
+  submounts.erase(std::remove_if(submounts.begin(), submounts.end(),
+                                 [&submounts](const std::string &path) {
+                                   for (const std::string &other : submounts) {
+                                     if (path.size() > other.size() &&
+                                         path.compare(0, other.size() + 1, other + "/") == 0) {
+                                       return true;
+                                     }
+                                   }
+                                   return false;
+                                 }),
+                  submounts.end());
+
+  struct stat staging_sb, upper_sb;
+  if (fstat(overlay->staging_fd, &staging_sb) < 0 ||
+      fstatat(overlay->staging_fd, overlay->upperdir.c_str(), &upper_sb, 0) < 0) {
+    DIE("worker: stat(%s)", overlay->upperdir.c_str());
+  }
+  overlay->generation++;
+  const std::string upperdir = "upperdir." + std::to_string(overlay->generation);
+  const std::string workdir = "workingdir." + std::to_string(overlay->generation);
+  if (mkdirat(overlay->staging_fd, upperdir.c_str(), 0700) < 0 ||
+      fchmodat(overlay->staging_fd, upperdir.c_str(), upper_sb.st_mode & 07777, 0) < 0 ||
+      mkdirat(overlay->staging_fd, workdir.c_str(), 0700) < 0) {
+    DIE("worker: mkdir(%s)", upperdir.c_str());
+  }
+  int mnt_fd = CreateOverlay(*overlay, upperdir, workdir);
+  if (mnt_fd < 0 || MoveMountAt(mnt_fd, overlay->next_fd, "") < 0) {
+    DIE("worker: mounting a fresh overlay for %s", mountpoint.c_str());
+  }
+
+  for (const std::string &submount : submounts) {
+    int fd = open(submount.c_str(), O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+      DIE("worker: open(%s)", submount.c_str());
+    }
+    // Relative to the root of the fresh overlay
+    const std::string target = submount.substr(mountpoint.size() + 1);
+    CreateTarget((FdPath(mnt_fd) + "/" + target).c_str(), S_ISDIR(sb.st_mode));
+    if (MoveMountAt(fd, mnt_fd, target) < 0) {
+      DIE("worker: moving %s to the fresh overlay", submount.c_str());
+    }
+    close(fd);
+  }
+  if (umount2(mountpoint.c_str(), MNT_DETACH) < 0) {
+    DIE("worker: umount2(%s)", mountpoint.c_str());
+  }
+  if (MoveMountAt(mnt_fd, AT_FDCWD, mountpoint) < 0) {
+    DIE("worker: moving the fresh overlay to %s", mountpoint.c_str());
+  }
+  close(overlay->merged_fd);
+  overlay->merged_fd = mnt_fd;
+
+  RemoveTree(overlay->staging_fd, overlay->upperdir.c_str(), staging_sb.st_dev);
+  RemoveTree(overlay->staging_fd, overlay->workdir.c_str(), staging_sb.st_dev);
+  overlay->upperdir = upperdir;
+  overlay->workdir = workdir;
+}
+
+static void ResetOverlays() {
+  PRINT_DEBUG("worker: resetting %zu overlays", overlay_mounts.size());
+  for (OverlayMount &overlay : overlay_mounts) {
+    ResetOverlay(&overlay);
+  }
+}
+#endif
+
 void MountAllOverlayFs(std::vector<std::string> list_of_dirs, int depth) {
   if (depth > OVELAY_MAX_DEPTH) {
     // Most likely there is a critical error. Fail
@@ -1578,10 +2022,11 @@ int Pid1Main(void *args) {
   std::vector<std::string> overlay_dirs;
   int mounts = 0;
 
-  Pid1Args pid1Args = {nullptr, nullptr};
+  Pid1Args pid1Args = {nullptr, nullptr, nullptr, -1};
   if (args != NULL) {
     pid1Args = *(static_cast<Pid1Args *>(args));
   }
+  pool_sysfs_fd = pid1Args.pool_sysfs_fd;
 
   if (getpid() != 1) {
     DIE("Using PID namespaces, but we are not PID 1");
@@ -1599,6 +2044,9 @@ int Pid1Main(void *args) {
   ClearSignalMask();
 
   SetupSelfDestruction(pid1Args.pipe_to_parent);
+#else
+  // Let the parent proceed, otherwise it would wait on the pipe until we exit
+  SignalPipe(pid1Args.pipe_to_parent, true);
 #endif
   SetupMountNamespace();
   SetupUserNamespace();
@@ -1640,6 +2088,8 @@ int Pid1Main(void *args) {
       const std::string mount_point = GetMountPointOf(opt.working_dir);
       mounts = CountMounts();
       MountWorkingDirMountPoint(mount_point);
+      if (!opt.mount_template.empty())
+        MountTemplate();
       AddLeftoverFoldersToReadOnlyPaths();
       MountAllMounts();
       MakeFilesystemPartiallyReadOnly(true, mounts);
@@ -1678,13 +2128,27 @@ int Pid1Main(void *args) {
 
   EnterWorkingDirectory();
 
+#ifdef MINITAP
+  // Before anything runs in the sandbox, and while we still have
+  // CAP_SYS_ADMIN to install a seccomp filter
+  if (FastConnectInstall() < 0) {
+    DIE("fast-connect: handing the seccomp listener over");
+  }
+#endif
+
   // Set up init status useful mostly in library mode
   InitDone();
+  if (pid1Args.pipe_ready != nullptr) {
+    SignalPipe(pid1Args.pipe_ready, true);
+  }
 #if (!(LIBMINISANDBOX))
   // Ignore terminal signals; we hand off the terminal to the child in
   // SpawnChild below.
   IgnoreSignal(SIGTTIN);
   IgnoreSignal(SIGTTOU);
+  if (opt.worker_protocol != NO_WORKER) {
+    return RunWorker();
+  }
   // Fork the child process.
   SpawnChild(false);
   InstallSignalHandler(SIGTERM, ForwardSignal);
@@ -18,6 +18,10 @@
 struct Pid1Args {
   int *pipe_to_parent;
   int *pipe_from_parent;
+  // Signalled once the sandbox is fully set up, nullptr if nobody waits on it
+  int *pipe_ready;
+  // sysfs of the network namespace taken from the pool (-q), -1 otherwise
+  int pool_sysfs_fd;
 };
 
 #if defined(__cplusplus)
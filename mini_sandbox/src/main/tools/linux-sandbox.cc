@@ -43,9 +43,11 @@
 #include "src/main/tools/linux-sandbox-pid1.h"
 #include "src/main/tools/logging.h"
 #include "src/main/tools/minitap-interface.h"
+#include "src/main/tools/fast-connect.h"
 #include "src/main/tools/process-tools.h"
 #include "src/main/tools/error-handling.h"
 #include "src/main/tools/firewall.h"
+#include "src/main/tools/netns-pool.h"
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
@@ -57,9 +59,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/prctl.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -88,6 +92,10 @@ namespace fs = std::experimental::filesystem;
 #include <stdexcept>
 #include <thread>
 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
 //#ifdef VERSION
 __attribute__((used, section(".version")))
 const char build_version[] = VERSION;
@@ -107,6 +115,13 @@ pid_t initial_ppid;
 // want it to exit)? Holds only zero or one.
 static std::atomic<int> global_need_polite_sigterm{false};
 
+#ifdef LIBMINISANDBOX
+// The child spawning pid1 leaves our mount namespace, and with it the path of
+// the pid file (-p): it hands the PID of pid1 back on this pipe instead, for
+// us to publish.
+static int pid_pipe[2] = {-1, -1};
+#endif
+
 #if __cplusplus >= 201703L
 static_assert(global_child_pid.is_always_lock_free);
 static_assert(global_need_polite_sigterm.is_always_lock_free);
@@ -142,6 +157,12 @@ static void CloseFds() {
       // (3) Do not accidentally close our directory handle.
       if (errno == 0 && fd > STDERR_FILENO &&
           (global_debug == NULL || fd != fileno(global_debug)) &&
+#ifdef MINITAP
+          // pid1 needs it to hand its seccomp filter over
+          fd != FastConnectFd() &&
+          // the shared minitap serves the sandbox until it's closed
+          fd != MinitapControlFd() &&
+#endif
           fd != dirfd(fds)) {
         if (close(fd) < 0) {
           MiniSbxReportGenericError("close");
@@ -196,13 +217,30 @@ static pid_t SpawnPid1() {
   if (pipe(pipe_to_child) < 0) {
     return MiniSbxReportGenericError("pipe");
   }
+  // Only needed to know when to publish the PID of pid1 (-p)
+  int pipe_ready[2];
+  if (!opt.pid_file.empty() && pipe(pipe_ready) < 0) {
+    return MiniSbxReportGenericError("pipe");
+  }
 
   int clone_flags = CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWIPC | CLONE_NEWPID;
 #ifndef LIBMINISANDBOX
   clone_flags |= SIGCHLD;
 #endif
 
-  if (opt.create_netns != NO_NETNS) {
+  int pool_sysfs_fd = -1;
+#ifndef MINITAP
+  // Loopback-only namespaces can come from the pool (-q) instead. The
+  // connection to the pool stays open until we (and pid1) exit, which gives
+  // the namespace back. With a fake root pid1 needs to configure the
+  // namespace, which it can't do with one of the pool.
+  if (!opt.netns_pool.empty() && opt.create_netns == NETNS_WITH_LOOPBACK &&
+      !opt.fake_root && JoinPooledNetns(opt.netns_pool, &pool_sysfs_fd) < 0) {
+    PRINT_DEBUG("network namespace pool %s unavailable", opt.netns_pool.c_str());
+  }
+#endif
+
+  if (opt.create_netns != NO_NETNS && pool_sysfs_fd < 0) {
     clone_flags |= CLONE_NEWNET;
   }
 
@@ -218,6 +256,8 @@ static pid_t SpawnPid1() {
   Pid1Args pid1Args;
   pid1Args.pipe_to_parent = pipe_from_child;
   pid1Args.pipe_from_parent = pipe_to_child;
+  pid1Args.pipe_ready = opt.pid_file.empty() ? nullptr : pipe_ready;
+  pid1Args.pool_sysfs_fd = pool_sysfs_fd;
 
 #ifdef LIBMINISANDBOX
   int unshare_res = unshare(clone_flags);
@@ -237,6 +277,9 @@ static pid_t SpawnPid1() {
 
 #ifdef LIBMINISANDBOX
   if (child_pid == 0) {
+    if (pid_pipe[1] >= 0) {
+      close(pid_pipe[1]);
+    }
     int sandbox_res = Pid1Main(&pid1Args);
     if (sandbox_res < 0) {
       MiniSbxReportGenericError("Failed in Pid1Main\n");
@@ -269,6 +312,25 @@ static pid_t SpawnPid1() {
 
     PRINT_DEBUG("done manipulating pipes");
 
+    // Once pid1 is done setting up the sandbox, publish its PID so that other
+    // commands can be executed in it with -A / mini_sandbox_exec()
+    if (pid1Args.pipe_ready != nullptr) {
+      res = WaitPipe(pipe_ready, false);
+      if (res < 0) {
+        KillAndWait(child_pid);
+        return res;
+      }
+#ifdef LIBMINISANDBOX
+      if (write(pid_pipe[1], &child_pid, sizeof(child_pid)) != sizeof(child_pid)) {
+        KillAndWait(child_pid);
+        return MiniSbxReportGenericError("write");
+      }
+      close(pid_pipe[1]);
+#else
+      WriteFile(opt.pid_file, "%d\n", child_pid);
+#endif
+    }
+
     return child_pid;
 #ifdef LIBMINISANDBOX
   }
@@ -319,6 +381,12 @@ static int WaitForPid1(const pid_t child_pid) {
 }
 #endif
 
+static void RemovePidFile() {
+  if (!opt.pid_file.empty()) {
+    unlink(opt.pid_file.c_str());
+  }
+}
+
 static int ValidateOptions() {
   if (opt.use_overlayfs) {
     if (ValidateOverlayOutOfFolder(opt.tmp_overlayfs, opt.working_dir) < 0)
@@ -329,6 +397,11 @@ static int ValidateOptions() {
      if (ValidateOverlayOutOfFolder(opt.sandbox_root, opt.working_dir) < 0)
       return MiniSbxReportError(ErrorCode::IllegalConfiguration);
   }
+
+  // The clone would end up cloning itself
+  if (!opt.clone_base_dir.empty() &&
+      ValidateOverlayOutOfFolder(opt.clone_base_dir, opt.working_dir) < 0)
+    return MiniSbxReportError(ErrorCode::IllegalConfiguration);
  
   if (ValidateReadWritePaths(opt.bind_mount_sources, opt.writable_files) < 0)
       return MiniSbxReportError(ErrorCode::FileReadAndWrite);
@@ -402,6 +475,12 @@ int MiniSbxStart() {
 
 
 
+  // -p publishes the PID of the pid1 of our sandbox, and there is none when
+  // running nested or in an unprivileged container
+  if (!opt.pid_file.empty() &&
+      (MiniSbxGetInternalEnv() == 0 || docker_mode == UNPRIVILEGED_CONTAINER))
+    return MiniSbxReportError(ErrorCode::NoSandboxToAttach);
+
   if (MiniSbxGetInternalEnv() == 0) {
     PRINT_DEBUG("Already running inside mini-sandbox. Not nesting another sandbox\n");
 #if (!(LIBMINISANDBOX))
@@ -432,6 +511,10 @@ int MiniSbxStart() {
   if (res < 0)
     return res;
 
+  // Each sandbox clones in a folder of its own, removed by Cleanup()
+  if (!opt.clone_base_dir.empty())
+    opt.clone_dir = CreateTempDirectory(opt.clone_base_dir);
+
   res = MiniSbxCreateInit();
   if (res < 0)
     return res;
@@ -455,14 +538,23 @@ int MiniSbxStart() {
   global_outer_gid = getgid();
 
 #ifdef MINITAP
-  std::string rules = CreateRandomFilename(std::string("/tmp"));
-  DumpRules(&(opt.fw_rules), rules);
-  res = RunTCPIP(global_outer_uid, global_outer_gid, rules);
+  int rules_fd = DumpRules(&(opt.fw_rules));
+  if (rules_fd < 0)
+    return MiniSbxReportGenericError("could not hand the firewall rules to minitap");
+  res = RunTCPIP(global_outer_uid, global_outer_gid, rules_fd, opt.fw_rules.start_timeout_ms,
+                 opt.fw_rules.fast_connect, opt.fw_rules.shared_socket, opt.fw_rules.mtu);
+  close(rules_fd);
   if (res < 0)
     return res;
   // In this case the Network namespace has been taken care of by RunTCPIP so
   // we don't need to create a new one
   opt.create_netns = NO_NETNS;
+  // Anyone reaching the socket of a shared minitap can register a TUN device
+  // with the rules they like, so the sandbox doesn't see its directory
+  if (!opt.fw_rules.shared_socket.empty()) {
+    const std::string &socket = opt.fw_rules.shared_socket;
+    opt.tmpfs_dirs.emplace_back(socket.substr(0, std::max<size_t>(socket.rfind('/'), 1)));
+  }
 
 #endif
   // Ensure we don't pass on any FDs from our parent to our child other than
@@ -476,11 +568,17 @@ int MiniSbxStart() {
   // namespaces etc.
 
 #ifdef LIBMINISANDBOX
+  if (!opt.pid_file.empty() && pipe2(pid_pipe, O_CLOEXEC) < 0)
+    return MiniSbxReportGenericError("pipe");
+
   pid_t pid = fork();
   if (pid < 0) {
     perror("fork1 - error");
     exit(-1);
   } else if (pid == 0) {
+    if (pid_pipe[0] >= 0) {
+      close(pid_pipe[0]);
+    }
 #endif
     const pid_t child_pid = SpawnPid1();
     if (child_pid < 0) {
@@ -543,17 +641,43 @@ int MiniSbxStart() {
   }
 #else
     int exit_res = WaitForPid1(child_pid);
+    RemovePidFile();
 #endif
 
 
 #ifdef LIBMINISANDBOX
   else {
+    if (pid_pipe[0] >= 0) {
+      close(pid_pipe[1]);
+      // Nothing comes if the sandbox failed to start
+      pid_t pid1;
+      ssize_t n;
+      do {
+        n = read(pid_pipe[0], &pid1, sizeof(pid1));
+      } while (n < 0 && errno == EINTR);
+      close(pid_pipe[0]);
+      if (n == sizeof(pid1)) {
+        FILE *stream = fopen(opt.pid_file.c_str(), "w");
+        bool written = stream != nullptr && fprintf(stream, "%d\n", pid1) > 0;
+        if (stream != nullptr && fclose(stream) != 0) {
+          written = false;
+        }
+        // As the command line does, give up on a sandbox no one can attach to
+        if (!written) {
+          PRINT_DEBUG("could not write the pid file %s", opt.pid_file.c_str());
+          kill(pid, SIGKILL);
+        }
+      }
+    }
+
     int status;
     if (waitpid(pid, &status, 0) == -1) {
           perror("waitpid failed");
+          RemovePidFile();
           Cleanup();
           exit(EXIT_FAILURE);
     }
+    RemovePidFile();
          
    if (WIFEXITED(status)) {
           // Child exited normally, get its exit status
@@ -603,3 +727,197 @@ bool MiniSbxIsNestedSandbox(){
 bool MiniSbxIsRunning(){
   return (opt.is_running != NOT_RUNNING) || MiniSbxIsNestedSandbox();
 }
+
+#ifndef NS_GET_USERNS
+#define NS_GET_USERNS _IO(0xb7, 0x1)
+#endif
+
+// Returns true if the namespace `ns` of process `pid` differs from ours.
+static bool IsOtherNamespace(const std::string& proc, const char* ns) {
+  struct stat self_sb, target_sb;
+  std::string self_path = std::string("/proc/self/ns/") + ns;
+  std::string target_path = proc + "/ns/" + ns;
+  if (stat(self_path.c_str(), &self_sb) < 0 ||
+      stat(target_path.c_str(), &target_sb) < 0) {
+    return false;
+  }
+  return self_sb.st_dev != target_sb.st_dev || self_sb.st_ino != target_sb.st_ino;
+}
+
+// Moves the calling process into the namespaces of the sandbox whose pid1 has
+// (host) PID `pid`, then into its root and working directory. The caller must
+// be single threaded as setns(CLONE_NEWUSER) refuses multithreaded processes.
+// Errors are returned as a message instead of being reported since this runs
+// in a forked child.
+static int JoinSandbox(pid_t pid, std::string& err_msg) {
+  // The user namespace must be joined first, as it grants us the capabilities
+  // needed to join the others. We only join namespaces that the sandbox did
+  // not share with the host, e.g., -N or no -H, since we don't have the
+  // capabilities to (re-)enter the host ones from within the sandbox userns.
+  static const struct {
+    const char* name;
+    int flag;
+  } kNamespaces[] = {
+      {"user", CLONE_NEWUSER}, {"mnt", CLONE_NEWNS}, {"pid", CLONE_NEWPID},
+      {"net", CLONE_NEWNET},   {"ipc", CLONE_NEWIPC}, {"uts", CLONE_NEWUTS},
+  };
+  std::string proc = "/proc/" + std::to_string(pid);
+
+  int flags = 0;
+  for (const auto& ns : kNamespaces) {
+    if (IsOtherNamespace(proc, ns.name)) {
+      flags |= ns.flag;
+    }
+  }
+  if (!(flags & CLONE_NEWUSER) || !(flags & CLONE_NEWNS)) {
+    err_msg = "process " + std::to_string(pid) + " is not a sandbox pid1";
+    return -1;
+  }
+
+  // The root of pid1 is not necessarily the root of its mount namespace, e.g.,
+  // when pivot_root'ed, so let's grab it (and its cwd) while we still can
+  int root_fd = open((proc + "/root").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int cwd_fd = open((proc + "/cwd").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0 || cwd_fd < 0) {
+    err_msg = "open(" + proc + "/root): " + strerror(errno);
+    return -1;
+  }
+
+  // A network namespace from the pool (-q) belongs to the user namespace of the
+  // pool, the parent of the sandbox one, so it must be joined from there
+  if (flags & CLONE_NEWNET) {
+    int net_fd = open((proc + "/ns/net").c_str(), O_RDONLY | O_CLOEXEC);
+    int owner_fd = (net_fd < 0) ? -1 : ioctl(net_fd, NS_GET_USERNS);
+    struct stat owner_sb, user_sb, self_sb;
+    if (owner_fd >= 0 && fstat(owner_fd, &owner_sb) == 0 &&
+        stat((proc + "/ns/user").c_str(), &user_sb) == 0 &&
+        stat("/proc/self/ns/user", &self_sb) == 0 &&
+        owner_sb.st_ino != user_sb.st_ino) {
+      if ((owner_sb.st_ino != self_sb.st_ino &&
+           setns(owner_fd, CLONE_NEWUSER) < 0) ||
+          setns(net_fd, CLONE_NEWNET) < 0) {
+        err_msg = std::string("setns(net): ") + strerror(errno);
+        return -1;
+      }
+      flags &= ~CLONE_NEWNET;
+    }
+    if (owner_fd >= 0) close(owner_fd);
+    if (net_fd >= 0) close(net_fd);
+  }
+
+  // setns() on a pidfd joins all the namespaces atomically (Linux >= 5.8).
+  // Older kernels get the per-namespace files under /proc/<pid>/ns instead.
+  int res = -1;
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd >= 0) {
+    res = setns(pidfd, flags);
+    close(pidfd);
+  }
+  if (res < 0) {
+    std::vector<int> ns_fds;
+    for (const auto& ns : kNamespaces) {
+      if (!(flags & ns.flag)) continue;
+      int fd = open((proc + "/ns/" + ns.name).c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        err_msg = "open(" + proc + "/ns/" + ns.name + "): " + strerror(errno);
+        return -1;
+      }
+      ns_fds.push_back(fd);
+    }
+    for (int fd : ns_fds) {
+      if (setns(fd, 0) < 0) {
+        err_msg = std::string("setns: ") + strerror(errno);
+        return -1;
+      }
+      close(fd);
+    }
+  }
+
+  if (fchdir(root_fd) < 0 || chroot(".") < 0 || fchdir(cwd_fd) < 0) {
+    err_msg = std::string("chroot into the sandbox: ") + strerror(errno);
+    return -1;
+  }
+  close(root_fd);
+  close(cwd_fd);
+  return 0;
+}
+
+int MiniSbxExec(pid_t pid, const std::vector<char *>& args) {
+  if (args.empty() || args[0] == nullptr) {
+    return MiniSbxReportGenericError("no command to execute");
+  }
+
+  // Errors of the children are sent back on this pipe, on success it's just
+  // closed by exec
+  int err_pipe[2];
+  if (pipe2(err_pipe, O_CLOEXEC) < 0) {
+    return MiniSbxReportGenericError("pipe");
+  }
+
+  // We never touch the namespaces of the calling process, which is possibly
+  // multithreaded in library mode. The first child joins the sandbox and, as
+  // a PID namespace only applies to the children of who joined it, forks
+  // again the process that runs the command.
+  pid_t child_pid = fork();
+  if (child_pid < 0) {
+    return MiniSbxReportGenericError("fork");
+  }
+  if (child_pid == 0) {
+    std::string err_msg;
+    close(err_pipe[0]);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (JoinSandbox(pid, err_msg) < 0) {
+      (void)!write(err_pipe[1], err_msg.c_str(), err_msg.length());
+      _exit(EXIT_FAILURE);
+    }
+
+    pid_t cmd_pid = fork();
+    if (cmd_pid < 0) {
+      err_msg = std::string("fork: ") + strerror(errno);
+      (void)!write(err_pipe[1], err_msg.c_str(), err_msg.length());
+      _exit(EXIT_FAILURE);
+    } else if (cmd_pid == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      MiniSbxSetInternalEnv();
+      std::vector<char *> argv(args.begin(), args.end());
+      if (argv.back() != nullptr) {
+        argv.push_back(nullptr);
+      }
+      execvp(argv[0], argv.data());
+      err_msg = std::string("execvp(") + argv[0] + "): " + strerror(errno);
+      (void)!write(err_pipe[1], err_msg.c_str(), err_msg.length());
+      _exit(EXIT_FAILURE);
+    }
+    close(err_pipe[1]);
+
+    int status;
+    while (waitpid(cmd_pid, &status, 0) < 0) {
+      if (errno != EINTR) _exit(EXIT_FAILURE);
+    }
+    if (WIFSIGNALED(status)) {
+      _exit(128 + WTERMSIG(status));
+    }
+    _exit(WEXITSTATUS(status));
+  }
+
+  close(err_pipe[1]);
+  char buf[MAX_ERR_LEN] = {0};
+  ssize_t n;
+  while ((n = read(err_pipe[0], buf, sizeof(buf) - 1)) < 0 && errno == EINTR) {
+  }
+  close(err_pipe[0]);
+
+  int status;
+  while (waitpid(child_pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return MiniSbxReportGenericError("waitpid");
+    }
+  }
+  if (n > 0) {
+    return MiniSbxReportGenericError(std::string(buf));
+  }
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
@@ -15,6 +15,7 @@
 #ifndef SRC_MAIN_TOOLS_LINUX_SANDBOX_H_
 #define SRC_MAIN_TOOLS_LINUX_SANDBOX_H_
 #include <sys/types.h>
+#include <vector>
 
 extern uid_t global_outer_uid;
 extern gid_t global_outer_gid;
@@ -22,4 +23,7 @@ extern gid_t global_outer_gid;
 int MiniSbxStart();
 bool MiniSbxIsNestedSandbox();
 bool MiniSbxIsRunning();
+// Runs args inside the already running sandbox whose pid1 has host PID pid and
+// returns the exit code of the command.
+int MiniSbxExec(pid_t pid, const std::vector<char *>& args);
 #endif
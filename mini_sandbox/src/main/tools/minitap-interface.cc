@@ -6,8 +6,15 @@
 #include "src/main/tools/error-handling.h"
 #include "src/main/tools/process-tools.h"
 #include "src/main/tools/linux-sandbox-options.h"
+#include "src/main/tools/fast-connect.h"
+#include "src/main/tools/logging.h"
+#include "src/main/tools/minitap-interface.h"
+#include "src/main/tools/minitap-shared.h"
 
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -16,8 +23,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <chrono>
 #include <iostream>
 #include <limits.h>
+#include <mutex>
+#include <string.h>
 #if __has_include(<filesystem>)
 #include <filesystem>
 namespace fs = std::filesystem;
@@ -29,13 +41,18 @@ namespace fs = std::experimental::filesystem;
 
 #define MINITAPBIN "minitap"
 
-char MinitapBin[PATH_MAX] = {0};
-
-volatile sig_atomic_t signal_received = 0;
+// minitap gets the write end of a pipe in this variable, on which it reports
+// either MINITAP_READY once its stack is up or "error: <reason>", each on one
+// line
+#define MINITAP_READY_FD_ENV "MINITAP_READY_FD"
+// and the memfd of the firewall rules in this one
+#define MINITAP_RULES_FD_ENV "MINITAP_RULES_FD"
+// and its end of the control channel in this one, see MinitapControl
+#define MINITAP_CONTROL_FD_ENV "MINITAP_CONTROL_FD"
+// and with fast-connect the socket it answers the supervisor on
+#define MINITAP_VERDICT_FD_ENV "MINITAP_VERDICT_FD"
 
-void handler(int sig) {
-    signal_received = 1;
-}
+char MinitapBin[PATH_MAX] = {0};
 
 
 
@@ -120,29 +137,268 @@ int GetMinitapBinDir() {
 }
 
 
-static int RunMinitap(std::string& rules) {
-    signal(SIGUSR1, handler);
-    if (GetMinitapBinDir() < 0) 
+#ifdef MINITAP_EMBED
+// The minitap binary, built by `make -C minitap bin`, is part of this one. It
+// is executed from a memfd as there is no file to look up.
+__asm__(
+    ".section .rodata\n"
+    ".balign 16\n"
+    ".hidden minitap_exe_start\n"
+    "minitap_exe_start:\n"
+    ".incbin \"" MINITAP_EXE "\"\n"
+    ".hidden minitap_exe_end\n"
+    "minitap_exe_end:\n"
+    ".previous\n");
+extern "C" const char minitap_exe_start[];
+extern "C" const char minitap_exe_end[];
+
+// Returns a sealed memfd holding the embedded minitap, or -1 with the reason in
+// err_msg
+static int CreateEmbeddedMinitapFd(std::string& err_msg) {
+    int fd = memfd_create(MINITAPBIN, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        err_msg = std::string("memfd_create: ") + strerror(errno);
+        return -1;
+    }
+    const char* data = minitap_exe_start;
+    while (data < minitap_exe_end) {
+        ssize_t n = write(fd, data, minitap_exe_end - data);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            err_msg = std::string("write: ") + strerror(errno);
+            close(fd);
+            return -1;
+        }
+        data += n;
+    }
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        err_msg = std::string("sealing the minitap memfd: ") + strerror(errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Copying the image takes a few ms for a multi-MB minitap, so the memfd is
+// only created by the first start of the process and then kept open for the
+// next ones. fexecve() from it is as fast as executing a binary from the page
+// cache.
+static int EmbeddedMinitapFd(std::string& err_msg) {
+    static std::string create_err;
+    static const int fd = CreateEmbeddedMinitapFd(create_err);
+    if (fd < 0)
+        err_msg = create_err;
+    return fd;
+}
+#endif
+
+// Marks every descriptor from 3 on close-on-exec, so that minitap only
+// inherits the ones it is given. Async-signal-safe. Kernels before 5.11 don't
+// have CLOSE_RANGE_CLOEXEC, and minitap inherits what the caller didn't mark
+// there.
+static void CloseOnExecFrom3() {
+#ifdef SYS_close_range
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+    syscall(SYS_close_range, 3U, ~0U, CLOSE_RANGE_CLOEXEC);
+#endif
+}
+
+// Writes "<prefix><n>\n" to fd, async-signal-safe
+static void WriteErrno(int fd, const std::string& prefix, int n) {
+    char digits[16];
+    int i = sizeof(digits);
+    digits[--i] = '\n';
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0 && i > 0);
+    (void)!write(fd, prefix.data(), prefix.size());
+    (void)!write(fd, digits + i, sizeof(digits) - i);
+}
+
+
+// Waits up to timeout_ms for minitap (pid p) to report on fd whether it
+// started
+static int WaitMinitapReady(int fd, pid_t p, int timeout_ms, std::string& err_msg) {
+    std::string msg;
+    char buf[256];
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (msg.find('\n') == std::string::npos) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0) {
+            err_msg = "no answer from minitap after " + std::to_string(timeout_ms) + " ms";
+            return -1;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int res = poll(&pfd, 1, left);
+        if (res < 0 && errno != EINTR) {
+            err_msg = std::string("poll: ") + strerror(errno);
+            return -1;
+        }
+        if (res <= 0)
+            continue;
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            err_msg = std::string("read: ") + strerror(errno);
+            return -1;
+        }
+        if (n == 0) {
+            // Nobody is left to write, i.e. minitap died without a word
+            int status = 0;
+            if (msg.empty() && waitpid(p, &status, 0) == p) {
+                if (WIFSIGNALED(status))
+                    err_msg = "minitap was killed by signal " + std::to_string(WTERMSIG(status));
+                else
+                    err_msg = "minitap exited with status " + std::to_string(WEXITSTATUS(status));
+                return -1;
+            }
+            break;
+        }
+        msg.append(buf, n);
+    }
+    msg = msg.substr(0, msg.find('\n'));
+    if (msg == MINITAP_READY)
+        return 0;
+    if (msg.compare(0, strlen(MINITAP_ERROR_PREFIX), MINITAP_ERROR_PREFIX) == 0)
+        msg = msg.substr(strlen(MINITAP_ERROR_PREFIX));
+    err_msg = msg;
+    return -1;
+}
+
+
+// Starts minitap and waits for it to be ready. Returns its pid, or -1 with
+// the reason in err_msg. control_fd is set to our end of the control channel.
+// verdict_fd is minitap's end of the fast-connect verdicts, -1 without.
+static pid_t RunMinitap(int rules_fd, int verdict_fd, int timeout_ms, int* control_fd,
+                        std::string& err_msg) {
+#ifdef MINITAP_EMBED
+    // MINI_SANDBOX_TAP_BINARY still takes precedence over the linked in minitap
+    bool embedded = std::getenv("MINI_SANDBOX_TAP_BINARY") == NULL;
+#else
+    bool embedded = false;
+#endif
+    if (!embedded && GetMinitapBinDir() < 0) 
         // If all our heuristics for finding the minitap binary go wrong
         // we try to see if it's in PATH
         strncpy(MinitapBin, MINITAPBIN, sizeof(MINITAPBIN));
 
-    char* const  m_args[] = {MinitapBin, (char*)rules.c_str(), NULL};
+    char* const  m_args[] = {MinitapBin, NULL};
+
+    int exe_fd = -1;
+#ifdef MINITAP_EMBED
+    if (embedded && (exe_fd = EmbeddedMinitapFd(err_msg)) < 0)
+        return -1;
+#endif
+
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        err_msg = std::string("pipe: ") + strerror(errno);
+        return -1;
+    }
+    int control[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, control) < 0) {
+        err_msg = std::string("socketpair: ") + strerror(errno);
+        close(ready[0]);
+        close(ready[1]);
+        return -1;
+    }
+
+    // Everything the child needs is prepared here: the caller of
+    // libmini-tapbox may have threads, whose locks (e.g. malloc's) the child
+    // would inherit held, so the child only makes async-signal-safe calls.
+    // These are the only file descriptors minitap inherits.
+    std::vector<std::pair<const char*, int>> inherited = {
+        {MINITAP_READY_FD_ENV, ready[1]},
+        {MINITAP_RULES_FD_ENV, rules_fd},
+        {MINITAP_CONTROL_FD_ENV, control[1]},
+    };
+    if (verdict_fd >= 0)
+        inherited.push_back({MINITAP_VERDICT_FD_ENV, verdict_fd});
+    std::vector<std::string> env;
+    for (char** e = environ; *e != NULL; e++) {
+        bool ours = false;
+        for (const auto& fd : inherited)
+            ours = ours || (strncmp(*e, fd.first, strlen(fd.first)) == 0 && (*e)[strlen(fd.first)] == '=');
+        if (!ours)
+            env.push_back(*e);
+    }
+    for (const auto& fd : inherited)
+        env.push_back(std::string(fd.first) + "=" + std::to_string(fd.second));
+    std::vector<char*> envp;
+    for (std::string& e : env)
+        envp.push_back(&e[0]);
+    envp.push_back(NULL);
+    std::string exec_err = std::string(MINITAP_ERROR_PREFIX) + "executing " +
+                           (exe_fd >= 0 ? "the embedded minitap" : m_args[0]) + " failed, errno ";
 
     pid_t p = fork();
+    if (p < 0) {
+        err_msg = std::string("fork: ") + strerror(errno);
+        close(ready[0]);
+        close(ready[1]);
+        close(control[0]);
+        close(control[1]);
+        return -1;
+    }
     if (p == 0) {
-        execvp(m_args[0], m_args);
-        std::cerr << "Failed to execute minitap binary. No TUN device and firewall available\n";
-        kill(getppid(), SIGUSR1);
-        exit(-1);
+        CloseOnExecFrom3();
+        for (const auto& fd : inherited)
+            fcntl(fd.second, F_SETFD, 0);
+        if (exe_fd >= 0)
+            fexecve(exe_fd, m_args, envp.data());
+        else
+            execvpe(m_args[0], m_args, envp.data());
+        WriteErrno(ready[1], exec_err, errno);
+        _exit(EXIT_FAILURE);
     }
-    else {
-        while (signal_received == 0) 
-            pause();
-        return p;
+
+    close(ready[1]);
+    close(control[1]);
+    int res = WaitMinitapReady(ready[0], p, timeout_ms, err_msg);
+    close(ready[0]);
+    if (res < 0) {
+        close(control[0]);
+        kill(p, SIGKILL);
+        waitpid(p, NULL, 0);
+        return -1;
     }
-    // Should never go here
-    return -1;
+    *control_fd = control[0];
+    return p;
+}
+
+
+// minitap is a child of the process that started it, which stops it when
+// exiting so that minitap can write out what it has to (e.g. the metrics)
+// rather than being killed by its parent death signal
+#define MINITAP_STOP_TIMEOUT_MS 1000
+
+static pid_t minitap_pid = -1;
+static pid_t minitap_parent = -1;
+// Our end of the control channel, inherited by the sandboxed side (the
+// library caller) but not by what it executes
+static int minitap_control = -1;
+static std::mutex minitap_control_mu;
+// minitap_control is the registration of the sandbox with a shared minitap
+static bool minitap_shared = false;
+
+static void StopMinitap() {
+  // The children forked afterwards run the atexit handlers too
+  if (minitap_pid <= 0 || getpid() != minitap_parent)
+    return;
+  kill(minitap_pid, SIGTERM);
+  for (int waited = 0; waited < MINITAP_STOP_TIMEOUT_MS; waited += 10) {
+    if (waitpid(minitap_pid, NULL, WNOHANG) != 0)
+      return;
+    usleep(10 * 1000);
+  }
+  kill(minitap_pid, SIGKILL);
+  waitpid(minitap_pid, NULL, 0);
 }
 
 
@@ -166,10 +422,89 @@ static int JoinNetNs(pid_t p) {
 }
 
 
-int RunTCPIP(uid_t outer_uid, gid_t outer_gid, std::string& rules) {
+static int WriteAll(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+static int ReadAll(int fd, char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (n == 0)
+        errno = ECONNRESET;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+int MinitapRequest(int fd, const std::string& request, std::string& err_msg) {
+  // Lengths are u32, little endian like the hosts minitap runs on
+  uint32_t len = request.length();
+  std::string answer;
+  if (WriteAll(fd, reinterpret_cast<const char*>(&len), sizeof(len)) < 0 ||
+      WriteAll(fd, request.c_str(), request.length()) < 0 ||
+      ReadAll(fd, reinterpret_cast<char*>(&len), sizeof(len)) < 0) {
+    err_msg = std::string("control channel: ") + strerror(errno);
+    return -1;
+  }
+  answer.resize(len);
+  if (ReadAll(fd, &answer[0], len) < 0) {
+    err_msg = std::string("control channel: ") + strerror(errno);
+    return -1;
+  }
+  if (answer == MINITAP_READY)
+    return 0;
+  if (answer.compare(0, strlen(MINITAP_ERROR_PREFIX), MINITAP_ERROR_PREFIX) == 0)
+    answer = answer.substr(strlen(MINITAP_ERROR_PREFIX));
+  err_msg = answer;
+  return -1;
+}
+
+
+int MinitapControl(const std::string& request, std::string& err_msg) {
+  std::lock_guard<std::mutex> lock(minitap_control_mu);
+  if (minitap_control < 0) {
+    err_msg = "no control channel to minitap";
+    return -1;
+  }
+  return MinitapRequest(minitap_control, request, err_msg);
+}
+
+
+int MinitapControlFd() {
+  return minitap_shared ? minitap_control : -1;
+}
+
+
+int RunTCPIP(uid_t outer_uid, gid_t outer_gid, int rules_fd, int start_timeout_ms,
+             bool fast_connect, const std::string& shared_socket, int mtu) {
+  // Why minitap didn't start goes back to the caller on this pipe, which the
+  // sandboxed side closes once it runs on the minitap network
+  int err_pipe[2];
+  if (pipe2(err_pipe, O_CLOEXEC) < 0)
+    return MiniSbxReportGenericError("pipe");
+
   pid_t extern_pid = fork();
  
   if(extern_pid == 0) {
+    close(err_pipe[0]);
     int r = unshare(CLONE_NEWUSER);
     if (r != 0) {
       exit(0);
@@ -177,15 +512,51 @@ int RunTCPIP(uid_t outer_uid, gid_t outer_gid, std::string& rules) {
     WriteFile("/proc/self/uid_map", "0 %u 1\n", outer_uid);
     WriteFile("/proc/self/setgroups", "deny");
     WriteFile("/proc/self/gid_map", "0 %u 1\n", outer_gid);
-    pid_t minitap_pid = fork();
-    if (minitap_pid == 0) {
-      pid_t tcp_p = RunMinitap(rules);
-      if ( JoinNetNs(tcp_p) < 0)
+    // We stay in the host network namespace, to supervise the connections of
+    // the sandbox with fast-connect
+    int verdict_fd = -1;
+    if (fast_connect && FastConnectPrepare(&verdict_fd) < 0)
+      PRINT_DEBUG("fast-connect unavailable: %s", strerror(errno));
+    pid_t sandbox_pid = fork();
+    if (sandbox_pid == 0) {
+      FastConnectSandboxSide();
+      std::string err_msg;
+      if (!shared_socket.empty()) {
+        int res = JoinSharedMinitap(shared_socket, rules_fd, verdict_fd, mtu, start_timeout_ms,
+                                    &minitap_control, err_msg);
+        if (verdict_fd >= 0)
+          close(verdict_fd);
+        if (res < 0) {
+          (void)!write(err_pipe[1], err_msg.c_str(), err_msg.length());
+          exit(0);
+        }
+        close(err_pipe[1]);
+        minitap_shared = true;
+        return 0;
+      }
+      pid_t tcp_p = RunMinitap(rules_fd, verdict_fd, start_timeout_ms, &minitap_control, err_msg);
+      if (verdict_fd >= 0)
+        close(verdict_fd);
+      if (tcp_p < 0 || JoinNetNs(tcp_p) < 0) {
+        if (tcp_p >= 0) {
+          err_msg = std::string("joining the minitap network: ") + strerror(errno);
+          kill(tcp_p, SIGKILL);
+        }
+        (void)!write(err_pipe[1], err_msg.c_str(), err_msg.length());
         exit(0);
+      }
+      close(err_pipe[1]);
+      minitap_pid = tcp_p;
+      minitap_parent = getpid();
+      atexit(StopMinitap);
       return 0;
     } else {
+      close(err_pipe[1]);
+      if (verdict_fd >= 0)
+        close(verdict_fd);
+      FastConnectSupervise();
       int status = 0;
-      if (waitpid(minitap_pid, &status, 0) == -1) {
+      if (waitpid(sandbox_pid, &status, 0) == -1) {
         perror("waitpid failed");
         exit(EXIT_FAILURE);
       }
@@ -198,6 +569,7 @@ int RunTCPIP(uid_t outer_uid, gid_t outer_gid, std::string& rules) {
     }
   }
   else {
+    close(err_pipe[1]);
     int status = 0;
     if (waitpid(extern_pid, &status, 0) == -1) {
       perror("waitpid failed");
@@ -207,8 +579,14 @@ int RunTCPIP(uid_t outer_uid, gid_t outer_gid, std::string& rules) {
     if (WIFEXITED(status)) {
       int child_exit_code = WEXITSTATUS(status);
       int init_status = MiniSbxReadInit();
-      if (init_status == 0)
+      if (init_status == 0) {
+        char err_msg[MAX_ERR_LEN] = {0};
+        ssize_t n = read(err_pipe[0], err_msg, sizeof(err_msg) - 1);
+        close(err_pipe[0]);
+        if (n > 0)
+          return MiniSbxReportErrorAndMessage(err_msg, ErrorCode::TapNotStarted);
         return -1;
+      }
       exit(child_exit_code);
     }
     else {
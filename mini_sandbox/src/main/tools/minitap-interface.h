@@ -5,11 +5,37 @@
 #ifndef MINITAP_INTERFACE_H
 #define MINITAP_INTERFACE_H
 
+#include <string>
+#include <sys/types.h>
+
+// What minitap answers on the ready pipe, the control channel and the
+// registration of a shared minitap
+#define MINITAP_READY "ok"
+#define MINITAP_ERROR_PREFIX "error: "
+
 // This calls execve() on the binary that sets up the TCP/IP
-// stack. Need uid and gid cause we'll need to run in a user 
-// namespace as 'fake root'. The third parameter can be empty
-// if we do not want to set any specific network restriction
-// via firewall
-int RunTCPIP(uid_t uid, gid_t gid, std::string& rules);
+// stack, or on the copy linked in from a memfd
+// (MINITAP_EMBED). Need uid and gid cause we'll need to run in a user 
+// namespace as 'fake root'. rules_fd is the memfd of the
+// firewall rules written by DumpRules. minitap has
+// start_timeout_ms to report that its stack is up. With fast_connect the
+// allowed TCP connections skip minitap, see fast-connect.h. With a
+// shared_socket the sandbox registers with the minitap serving it instead, on
+// a TUN device of the given mtu (0 for the default), see minitap-shared.h.
+int RunTCPIP(uid_t uid, gid_t gid, int rules_fd, int start_timeout_ms,
+             bool fast_connect, const std::string& shared_socket, int mtu);
+
+// Sends a batch of firewall changes to the running minitap, one per line
+// ("allow <rule>", "revoke <rule>" or "max-connections <n>"), which applies
+// all of them at once or none. Returns 0, or -1 with the reason in err_msg.
+int MinitapControl(const std::string& request, std::string& err_msg);
+
+// Sends request on fd, a socket minitap answers on like the control channel
+int MinitapRequest(int fd, const std::string& request, std::string& err_msg);
+
+// Our end of the control channel when it must stay open for as long as the
+// sandbox runs (a shared minitap serves the sandbox until it's closed), -1
+// otherwise
+int MinitapControlFd();
 
 #endif
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "src/main/tools/minitap-shared.h"
+#include "src/main/tools/logging.h"
+#include "src/main/tools/minitap-interface.h"
+#include "src/main/tools/process-tools.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <net/route.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/if_tun.h>
+#include <linux/ipv6.h>
+
+// As minitap sets its own TUN device up, see DefaultInit in minitap
+#define SHARED_TUN_NAME "mini-tun0"
+#define SHARED_TUN_ADDRESS "10.1.1.100"
+#define SHARED_TUN_NETMASK "255.255.255.0"
+#define SHARED_TUN_ADDRESS6 "fd00:1:1::100"
+#define SHARED_TUN_PREFIX6 64
+
+static int Fail(std::string& err_msg, const std::string& what) {
+  err_msg = what + ": " + strerror(errno);
+  return -1;
+}
+
+static void SetIpv4(struct sockaddr* sa, const char* address) {
+  struct sockaddr_in* in = reinterpret_cast<struct sockaddr_in*>(sa);
+  in->sin_family = AF_INET;
+  inet_pton(AF_INET, address, &in->sin_addr);
+}
+
+static int SetUp(int sock, const char* name) {
+  struct ifreq ifr = {};
+  strncpy(ifr.ifr_name, name, IF_NAMESIZE - 1);
+  if (ioctl(sock, SIOCGIFFLAGS, &ifr) < 0)
+    return -1;
+  ifr.ifr_flags |= IFF_UP;
+  return ioctl(sock, SIOCSIFFLAGS, &ifr);
+}
+
+// Gives the TUN device an IPv6 address and routes the globally routable IPv6
+// traffic through it. Fails on hosts without IPv6.
+static int SetUpIpv6(std::string& err_msg) {
+  int sock6 = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sock6 < 0)
+    return Fail(err_msg, "socket(AF_INET6)");
+  int res = -1;
+  struct in6_ifreq ifr6 = {};
+  struct in6_rtmsg rt6 = {};
+  inet_pton(AF_INET6, SHARED_TUN_ADDRESS6, &ifr6.ifr6_addr);
+  ifr6.ifr6_prefixlen = SHARED_TUN_PREFIX6;
+  ifr6.ifr6_ifindex = if_nametoindex(SHARED_TUN_NAME);
+  if (ioctl(sock6, SIOCSIFADDR, &ifr6) < 0) {
+    Fail(err_msg, "assigning " SHARED_TUN_ADDRESS6);
+    goto out;
+  }
+  inet_pton(AF_INET6, "2000::", &rt6.rtmsg_dst);
+  rt6.rtmsg_dst_len = 3;
+  rt6.rtmsg_metric = 1;
+  rt6.rtmsg_flags = RTF_UP;
+  rt6.rtmsg_ifindex = ifr6.ifr6_ifindex;
+  if (ioctl(sock6, SIOCADDRT, &rt6) < 0) {
+    Fail(err_msg, "creating the default IPv6 route");
+    goto out;
+  }
+  res = 0;
+
+out:
+  close(sock6);
+  return res;
+}
+
+// Creates the TUN device in the current network namespace and routes the
+// traffic to the world through it. mtu is updated to the one of the device,
+// and ipv6 tells whether IPv6 is routed as well.
+static int CreateTun(int* mtu, bool* ipv6, std::string& err_msg) {
+  int tun = open("/dev/net/tun", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+  if (tun < 0)
+    return Fail(err_msg, "open(/dev/net/tun)");
+  struct ifreq ifr = {};
+  strncpy(ifr.ifr_name, SHARED_TUN_NAME, IF_NAMESIZE - 1);
+  ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+  if (ioctl(tun, TUNSETIFF, &ifr) < 0) {
+    Fail(err_msg, "ioctl(TUNSETIFF)");
+    close(tun);
+    return -1;
+  }
+
+  int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    Fail(err_msg, "socket");
+    close(tun);
+    return -1;
+  }
+  int res = -1;
+  struct rtentry rt = {};
+  if (SetUp(sock, "lo") < 0) {
+    Fail(err_msg, "bringing up lo");
+    goto out;
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, SHARED_TUN_NAME, IF_NAMESIZE - 1);
+  ifr.ifr_mtu = *mtu;
+  if (*mtu > 0 && ioctl(sock, SIOCSIFMTU, &ifr) < 0) {
+    Fail(err_msg, "setting MTU " + std::to_string(*mtu));
+    goto out;
+  }
+  if (ioctl(sock, SIOCGIFMTU, &ifr) < 0) {
+    Fail(err_msg, "ioctl(SIOCGIFMTU)");
+    goto out;
+  }
+  *mtu = ifr.ifr_mtu;
+  SetIpv4(&ifr.ifr_addr, SHARED_TUN_ADDRESS);
+  if (ioctl(sock, SIOCSIFADDR, &ifr) < 0) {
+    Fail(err_msg, "assigning " SHARED_TUN_ADDRESS);
+    goto out;
+  }
+  SetIpv4(&ifr.ifr_netmask, SHARED_TUN_NETMASK);
+  if (ioctl(sock, SIOCSIFNETMASK, &ifr) < 0) {
+    Fail(err_msg, "ioctl(SIOCSIFNETMASK)");
+    goto out;
+  }
+  if (SetUp(sock, SHARED_TUN_NAME) < 0) {
+    Fail(err_msg, "bringing up " SHARED_TUN_NAME);
+    goto out;
+  }
+
+  // All the IPv4 traffic goes to the TUN device
+  SetIpv4(&rt.rt_dst, "0.0.0.0");
+  SetIpv4(&rt.rt_genmask, "0.0.0.0");
+  rt.rt_flags = RTF_UP;
+  rt.rt_dev = const_cast<char*>(SHARED_TUN_NAME);
+  if (ioctl(sock, SIOCADDRT, &rt) < 0) {
+    Fail(err_msg, "creating the default IPv4 route");
+    goto out;
+  }
+  res = 0;
+
+out:
+  close(sock);
+  if (res < 0) {
+    close(tun);
+    return -1;
+  }
+
+  // And so does the IPv6 traffic, when the host has IPv6. Otherwise minitap
+  // doesn't answer AAAA queries.
+  std::string ipv6_err;
+  *ipv6 = SetUpIpv6(ipv6_err) == 0;
+  if (!*ipv6)
+    PRINT_DEBUG("%s, the sandbox only has IPv4", ipv6_err.c_str());
+
+  // ICMP sockets for everyone in the sandbox, as minitap does
+  int range = open("/proc/sys/net/ipv4/ping_group_range", O_WRONLY | O_CLOEXEC);
+  if (range >= 0) {
+    (void)!write(range, "0 0\n", 4);
+    close(range);
+  }
+  return tun;
+}
+
+// Waits up to timeout_ms for minitap to answer the registration on conn
+static int WaitRegistered(int conn, int timeout_ms, std::string& err_msg) {
+  struct pollfd pfd = {conn, POLLIN, 0};
+  int res;
+  do {
+    res = poll(&pfd, 1, timeout_ms);
+  } while (res < 0 && errno == EINTR);
+  if (res < 0)
+    return Fail(err_msg, "poll");
+  if (res == 0) {
+    err_msg = "no answer from the shared minitap after " + std::to_string(timeout_ms) + " ms";
+    return -1;
+  }
+  char answer[256];
+  ssize_t n = recv(conn, answer, sizeof(answer) - 1, 0);
+  if (n < 0)
+    return Fail(err_msg, "recv");
+  answer[n] = '\0';
+  std::string msg(answer);
+  if (msg == MINITAP_READY)
+    return 0;
+  if (msg.empty())
+    msg = "the shared minitap closed the connection";
+  else if (msg.compare(0, strlen(MINITAP_ERROR_PREFIX), MINITAP_ERROR_PREFIX) == 0)
+    msg = msg.substr(strlen(MINITAP_ERROR_PREFIX));
+  err_msg = msg;
+  return -1;
+}
+
+int JoinSharedMinitap(const std::string& socket_path, int rules_fd, int verdict_fd, int mtu,
+                      int timeout_ms, int* control_fd, std::string& err_msg) {
+  int conn = ConnectToUnixSocket(socket_path, (timeout_ms + 999) / 1000);
+  if (conn < 0)
+    return Fail(err_msg, "connecting to the shared minitap on " + socket_path);
+  if (unshare(CLONE_NEWNET) < 0) {
+    Fail(err_msg, "unshare(CLONE_NEWNET)");
+    close(conn);
+    return -1;
+  }
+  bool ipv6 = false;
+  int tun = CreateTun(&mtu, &ipv6, err_msg);
+  if (tun < 0) {
+    close(conn);
+    return -1;
+  }
+  int control[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, control) < 0) {
+    Fail(err_msg, "socketpair");
+    close(tun);
+    close(conn);
+    return -1;
+  }
+
+  int fds[4] = {tun, rules_fd, control[1], verdict_fd};
+  std::string msg = "register " + std::to_string(mtu) + (ipv6 ? " ipv6" : "");
+  int res = SendWithFds(conn, msg, fds, verdict_fd >= 0 ? 4 : 3);
+  if (res < 0)
+    Fail(err_msg, "registering with the shared minitap");
+  else
+    res = WaitRegistered(conn, timeout_ms, err_msg);
+  // minitap has its own copies now
+  close(tun);
+  close(control[1]);
+  close(conn);
+  if (res < 0) {
+    close(control[0]);
+    return -1;
+  }
+  *control_fd = control[0];
+  return 0;
+}
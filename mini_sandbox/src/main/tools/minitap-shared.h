@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _MINITAP_SHARED_H
+#define _MINITAP_SHARED_H
+
+#include <string>
+
+// With the shared tap option, the sandbox doesn't start a minitap of its own:
+// it registers with a minitap already running as `minitap --shared <socket>`,
+// which serves every sandbox that registers, each with its own gVisor stack,
+// firewall and metrics. The sandboxed side creates its network namespace and
+// TUN device itself, then hands the TUN device, the rules memfd and its end of
+// the control channel over on socket, in a single "register <mtu> [ipv6]"
+// message answered "ok" or "error: <reason>". ipv6 is there when the TUN device
+// could be given an IPv6 address and route, minitap only answers AAAA queries
+// then. minitap serves the sandbox until the control channel is closed, that
+// is until the sandbox is gone.
+
+// Moves the calling process to a new network namespace routed through a TUN
+// device, and registers it with the shared minitap on socket_path. rules_fd is
+// the memfd of DumpRules, verdict_fd minitap's end of the fast-connect
+// verdicts (-1 without) and mtu the MTU of the TUN device (0 for the kernel's
+// default). Returns 0 with control_fd set to our end of the control channel,
+// or -1 with the reason in err_msg.
+int JoinSharedMinitap(const std::string& socket_path, int rules_fd, int verdict_fd, int mtu,
+                      int timeout_ms, int* control_fd, std::string& err_msg);
+
+#endif
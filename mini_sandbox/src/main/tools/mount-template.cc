@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "src/main/tools/mount-template.h"
+#include "src/main/tools/linux-sandbox-options.h"
+#include "src/main/tools/logging.h"
+#include "src/main/tools/process-tools.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The new mount API might be missing from older headers
+#ifndef SYS_open_tree
+#define SYS_open_tree 428
+#endif
+#ifndef SYS_move_mount
+#define SYS_move_mount 429
+#endif
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+
+#define TEMPLATE_DIR "/tmp/mini-sandbox-template-XXXXXX"
+// Wait for the mount table to settle before rebuilding the template
+#define TEMPLATE_REBUILD_DELAY_MS 100
+#define TEMPLATE_RECV_TIMEOUT_SECS 5
+
+// Root folders that pid1 always sets up by itself
+static const char *kSkippedFolders[] = {"proc", "sys", "dev", "tmp", nullptr};
+
+static volatile sig_atomic_t template_stop = 0;
+
+static void StopServer(int signum) { template_stop = 1; }
+
+static bool IsSkippedFolder(const char *name) {
+  for (int i = 0; kSkippedFolders[i] != nullptr; i++) {
+    if (strcmp(name, kSkippedFolders[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void EnterTemplateNamespace() {
+  uid_t uid = getuid();
+  gid_t gid = getgid();
+  if (unshare(CLONE_NEWUSER | CLONE_NEWNS) < 0) {
+    DIE("unshare");
+  }
+  struct stat sb;
+  if (stat("/proc/self/setgroups", &sb) == 0) {
+    WriteFile("/proc/self/setgroups", "deny");
+  }
+  WriteFile("/proc/self/uid_map", "%u %u 1\n", uid, uid);
+  WriteFile("/proc/self/gid_map", "%u %u 1\n", gid, gid);
+  // Host mounts keep propagating to us, so that we can notice the changes
+  if (mount(nullptr, "/", nullptr, MS_REC | MS_SLAVE, nullptr) < 0) {
+    DIE("mount");
+  }
+}
+
+// Same flags as in MakeFilesystemPartiallyReadOnly(), a remount in a user
+// namespace fails if it tries to clear any of them.
+static void RemountTemplateReadOnly(const std::string &dir) {
+  FILE *mounts = setmntent("/proc/self/mounts", "r");
+  if (mounts == nullptr) {
+    DIE("setmntent");
+  }
+  const std::string prefix = dir + "/";
+  struct mntent *ent;
+  while ((ent = getmntent(mounts)) != nullptr) {
+    if (strncmp(ent->mnt_dir, prefix.c_str(), prefix.size()) != 0) {
+      continue;
+    }
+    int mountFlags = MS_BIND | MS_REMOUNT | MS_RDONLY;
+    if (hasmntopt(ent, "nodev") != nullptr) {
+      mountFlags |= MS_NODEV;
+    }
+    if (hasmntopt(ent, "noexec") != nullptr) {
+      mountFlags |= MS_NOEXEC;
+    }
+    if (hasmntopt(ent, "nosuid") != nullptr) {
+      mountFlags |= MS_NOSUID;
+    }
+    if (hasmntopt(ent, "noatime") != nullptr) {
+      mountFlags |= MS_NOATIME;
+    }
+    if (hasmntopt(ent, "nodiratime") != nullptr) {
+      mountFlags |= MS_NODIRATIME;
+    }
+    if (hasmntopt(ent, "relatime") != nullptr) {
+      mountFlags |= MS_RELATIME;
+    }
+    if (mount(nullptr, ent->mnt_dir, nullptr, mountFlags, nullptr) < 0) {
+      PRINT_DEBUG("remount(%s) failure (%m) ignored", ent->mnt_dir);
+    }
+  }
+  endmntent(mounts);
+}
+
+// Mounts a tmpfs on dir with a read-only recursive bind mount of every root
+// folder in it, and returns the names of the folders in names.
+static void BuildTemplate(const std::string &dir,
+                          std::vector<std::string> *names) {
+  names->clear();
+  if (mount("tmpfs", dir.c_str(), "tmpfs", MS_NOSUID | MS_NODEV,
+            "mode=0755") < 0) {
+    DIE("mount(tmpfs, %s)", dir.c_str());
+  }
+  DIR *root = opendir("/");
+  if (root == nullptr) {
+    DIE("opendir(/)");
+  }
+  struct dirent *ent;
+  while ((ent = readdir(root)) != nullptr) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 ||
+        IsSkippedFolder(ent->d_name)) {
+      continue;
+    }
+    const std::string source = std::string("/") + ent->d_name;
+    const std::string target = dir + source;
+    struct stat sb;
+    if (stat(source.c_str(), &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+      continue;
+    }
+    if (mkdir(target.c_str(), 0755) < 0) {
+      continue;
+    }
+    if (mount(source.c_str(), target.c_str(), nullptr, MS_BIND | MS_REC,
+              nullptr) < 0) {
+      PRINT_DEBUG("mount(%s, %s) failure (%m) ignored", source.c_str(),
+                  target.c_str());
+      continue;
+    }
+    names->push_back(ent->d_name);
+  }
+  closedir(root);
+  RemountTemplateReadOnly(dir);
+  PRINT_DEBUG("mount template ready with %zu folders", names->size());
+}
+
+static void RebuildTemplate(const std::string &dir,
+                            std::vector<std::string> *names, int mounts_fd) {
+  if (umount2(dir.c_str(), MNT_DETACH) < 0) {
+    DIE("umount2(%s)", dir.c_str());
+  }
+  BuildTemplate(dir, names);
+  // Swallow the events of our own mounts
+  struct pollfd pfd = {mounts_fd, POLLPRI, 0};
+  poll(&pfd, 1, 0);
+}
+
+static void SendTemplate(int conn, const std::string &dir,
+                         const std::vector<std::string> &names) {
+  for (const std::string &name : names) {
+    const std::string path = dir + "/" + name;
+    int fd = syscall(SYS_open_tree, AT_FDCWD, path.c_str(),
+                     OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+    if (fd < 0) {
+      PRINT_DEBUG("open_tree(%s) failure (%m) ignored", path.c_str());
+      continue;
+    }
+    int res = SendWithFds(conn, name, &fd, 1);
+    close(fd);
+    if (res < 0) {
+      PRINT_DEBUG("sendmsg: %m");
+      return;
+    }
+  }
+  // The end of the template
+  SendWithFds(conn, "", nullptr, 0);
+}
+
+int MiniSbxServeMountTemplate(const std::string &socket_path) {
+  if (!opt.debug_path.empty()) {
+    global_debug = fopen(opt.debug_path.c_str(), "w");
+  }
+  EnterTemplateNamespace();
+
+  char dir[] = TEMPLATE_DIR;
+  if (mkdtemp(dir) == nullptr) {
+    DIE("mkdtemp");
+  }
+  int listen_fd = ListenOnUnixSocket(socket_path);
+  if (listen_fd < 0) {
+    DIE("listen(%s)", socket_path.c_str());
+  }
+  int mounts_fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+  if (mounts_fd < 0) {
+    DIE("open(/proc/self/mounts)");
+  }
+
+  std::vector<std::string> names;
+  BuildTemplate(dir, &names);
+  struct pollfd drain = {mounts_fd, POLLPRI, 0};
+  poll(&drain, 1, 0);
+
+  InstallSignalHandler(SIGTERM, StopServer);
+  InstallSignalHandler(SIGINT, StopServer);
+  IgnoreSignal(SIGPIPE);
+
+  bool stale = false;
+  while (!template_stop) {
+    struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {mounts_fd, POLLPRI, 0}};
+    int res = poll(fds, 2, stale ? TEMPLATE_REBUILD_DELAY_MS : -1);
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      DIE("poll");
+    }
+    if (fds[1].revents & POLLPRI) {
+      PRINT_DEBUG("mount table changed");
+      stale = true;
+      continue;
+    }
+    if (stale) {
+      // Either it has settled or somebody needs the template right now
+      RebuildTemplate(dir, &names, mounts_fd);
+      stale = false;
+    }
+    if (fds[0].revents & POLLIN) {
+      int conn = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (conn < 0) {
+        continue;
+      }
+      SendTemplate(conn, dir, names);
+      close(conn);
+    }
+  }
+
+  close(listen_fd);
+  unlink(socket_path.c_str());
+  umount2(dir, MNT_DETACH);
+  rmdir(dir);
+  return 0;
+}
+
+int ReceiveMountTemplate(const std::string &socket_path,
+                         std::vector<TemplateMount> *mounts) {
+  // Don't let a stuck server hang the sandbox start
+  int fd = ConnectToUnixSocket(socket_path, TEMPLATE_RECV_TIMEOUT_SECS);
+  if (fd < 0) {
+    PRINT_DEBUG("connect(%s): %m", socket_path.c_str());
+    return -1;
+  }
+
+  int res = -1;
+  while (true) {
+    TemplateMount mount;
+    int nfds = RecvWithFds(fd, &mount.name, &mount.fd, 1);
+    if (nfds < 0) {
+      PRINT_DEBUG("recvmsg(%s): %m", socket_path.c_str());
+      break;
+    }
+    if (nfds == 0) {
+      res = mount.name.empty() ? 0 : -1;
+      break;
+    }
+    mounts->push_back(mount);
+  }
+  close(fd);
+
+  if (res < 0) {
+    for (const TemplateMount &mount : *mounts) {
+      close(mount.fd);
+    }
+    mounts->clear();
+  }
+  return res;
+}
+
+int MoveMount(int fd, const std::string &target) {
+  return syscall(SYS_move_mount, fd, "", AT_FDCWD, target.c_str(),
+                 MOVE_MOUNT_F_EMPTY_PATH);
+}
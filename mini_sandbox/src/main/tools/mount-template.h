@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _MOUNT_TEMPLATE_H
+#define _MOUNT_TEMPLATE_H
+
+#include <string>
+#include <vector>
+
+// In default mode every sandbox bind mounts each root folder (/usr, /etc, ...)
+// and remounts it and all of its submounts read-only. A mount template server
+// (mini-sandbox -B <socket>) does that once in a namespace of its own and hands
+// each sandbox a clone of the resulting read-only trees, so that the sandbox
+// only needs one move_mount() per root folder.
+
+// A read-only clone of the root folder /name , as a detached mount tree.
+struct TemplateMount {
+  std::string name;
+  int fd;
+};
+
+// Builds the template and serves it on the unix socket socket_path until
+// SIGTERM/SIGINT. The template is rebuilt when the host mount table changes.
+int MiniSbxServeMountTemplate(const std::string& socket_path);
+
+// Asks the server listening on socket_path for a fresh clone of the template.
+// On success the caller owns the fds in mounts.
+int ReceiveMountTemplate(const std::string& socket_path,
+                         std::vector<TemplateMount>* mounts);
+
+// Attaches a tree received with ReceiveMountTemplate() on target.
+int MoveMount(int fd, const std::string& target);
+
+#endif
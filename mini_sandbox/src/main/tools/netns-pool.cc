@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "src/main/tools/netns-pool.h"
+#include "src/main/tools/linux-sandbox-options.h"
+#include "src/main/tools/logging.h"
+#include "src/main/tools/process-tools.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/nsfs.h>
+
+#include <map>
+#include <vector>
+
+// The new mount API might be missing from older headers
+#ifndef SYS_fsopen
+#define SYS_fsopen 430
+#endif
+#ifndef SYS_fsconfig
+#define SYS_fsconfig 431
+#endif
+#ifndef SYS_fsmount
+#define SYS_fsmount 432
+#endif
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#endif
+#ifndef FSCONFIG_CMD_CREATE
+#define FSCONFIG_CMD_CREATE 6
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOUNT_ATTR_NOSUID 0x00000002
+#define MOUNT_ATTR_NODEV 0x00000004
+#define MOUNT_ATTR_NOEXEC 0x00000008
+#endif
+
+// How many namespaces to keep ready. Those given back are kept up to twice as
+// many, so that bursts don't end up destroying namespaces.
+#define NETNS_POOL_SIZE 8
+#define NETNS_POOL_MAX_SIZE (2 * NETNS_POOL_SIZE)
+#define NETNS_POOL_RECV_TIMEOUT_SECS 5
+
+// A namespace that still has any of these sockets can't be reused
+static const char *kSocketTables[] = {
+    "tcp", "tcp6", "udp",  "udp6",   "udplite", "udplite6",
+    "raw", "raw6", "icmp", "icmp6",  "unix",    "packet",   nullptr};
+
+struct PooledNetns {
+  int netns_fd;
+  int sysfs_fd;
+};
+
+static volatile sig_atomic_t pool_stop = 0;
+
+static void StopServer(int signum) { pool_stop = 1; }
+
+static void EnterPoolNamespace() {
+  uid_t uid = getuid();
+  gid_t gid = getgid();
+  // A mount namespace of our own is needed to create the sysfs mounts
+  if (unshare(CLONE_NEWUSER | CLONE_NEWNS) < 0) {
+    DIE("unshare");
+  }
+  struct stat sb;
+  if (stat("/proc/self/setgroups", &sb) == 0) {
+    WriteFile("/proc/self/setgroups", "deny");
+  }
+  WriteFile("/proc/self/uid_map", "%u %u 1\n", uid, uid);
+  WriteFile("/proc/self/gid_map", "%u %u 1\n", gid, gid);
+}
+
+// Returns a detached read-only sysfs mount for the current network namespace
+static int CreateSysfs() {
+  int fs_fd = syscall(SYS_fsopen, "sysfs", FSOPEN_CLOEXEC);
+  if (fs_fd < 0) {
+    return -1;
+  }
+  int mnt_fd = -1;
+  if (syscall(SYS_fsconfig, fs_fd, FSCONFIG_CMD_CREATE, nullptr, nullptr, 0) ==
+      0) {
+    mnt_fd = syscall(SYS_fsmount, fs_fd, FSMOUNT_CLOEXEC,
+                     MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV |
+                         MOUNT_ATTR_NOEXEC);
+  }
+  close(fs_fd);
+  return mnt_fd;
+}
+
+static void BringUpLoopback() {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    DIE("socket");
+  }
+  struct ifreq ifr = {};
+  strncpy(ifr.ifr_name, "lo", IF_NAMESIZE);
+  ifr.ifr_flags |= IFF_UP;
+  if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0) {
+    DIE("ioctl");
+  }
+  close(fd);
+}
+
+static PooledNetns CreatePooledNetns() {
+  if (unshare(CLONE_NEWNET) < 0) {
+    DIE("unshare(CLONE_NEWNET)");
+  }
+  BringUpLoopback();
+  PooledNetns netns;
+  netns.netns_fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+  if (netns.netns_fd < 0) {
+    DIE("open(/proc/self/ns/net)");
+  }
+  netns.sysfs_fd = CreateSysfs();
+  if (netns.sysfs_fd < 0) {
+    DIE("fsmount(sysfs)");
+  }
+  return netns;
+}
+
+// /proc/self/net shows the sockets of the network namespace we are in
+static bool HasSockets(int netns_fd) {
+  if (setns(netns_fd, CLONE_NEWNET) < 0) {
+    return true;
+  }
+  for (int i = 0; kSocketTables[i] != nullptr; i++) {
+    const std::string path = std::string("/proc/self/net/") + kSocketTables[i];
+    FILE *table = fopen(path.c_str(), "re");
+    if (table == nullptr) {
+      continue;
+    }
+    // Every table starts with a header line
+    int lines = 0;
+    char line[512];
+    while (lines < 2 && fgets(line, sizeof(line), table) != nullptr) {
+      if (strchr(line, '\n') != nullptr) {
+        lines++;
+      }
+    }
+    fclose(table);
+    if (lines > 1) {
+      PRINT_DEBUG("%s sockets left, dropping the namespace", kSocketTables[i]);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Takes a namespace back from a sandbox that is gone
+static void ReturnNetns(std::vector<PooledNetns> *pool, int netns_fd) {
+  if (pool->size() >= NETNS_POOL_MAX_SIZE || HasSockets(netns_fd)) {
+    close(netns_fd);
+    return;
+  }
+  // The sysfs mount went away with the sandbox, the next one needs another
+  PooledNetns netns = {netns_fd, CreateSysfs()};
+  if (netns.sysfs_fd < 0) {
+    close(netns_fd);
+    return;
+  }
+  pool->push_back(netns);
+  PRINT_DEBUG("network namespace given back, %zu ready", pool->size());
+}
+
+int MiniSbxServeNetnsPool(const std::string &socket_path) {
+  if (!opt.debug_path.empty()) {
+    global_debug = fopen(opt.debug_path.c_str(), "w");
+  }
+  EnterPoolNamespace();
+  int userns_fd = open("/proc/self/ns/user", O_RDONLY | O_CLOEXEC);
+  if (userns_fd < 0) {
+    DIE("open(/proc/self/ns/user)");
+  }
+  int listen_fd = ListenOnUnixSocket(socket_path);
+  if (listen_fd < 0) {
+    DIE("listen(%s)", socket_path.c_str());
+  }
+
+  InstallSignalHandler(SIGTERM, StopServer);
+  InstallSignalHandler(SIGINT, StopServer);
+  IgnoreSignal(SIGPIPE);
+
+  std::vector<PooledNetns> pool;
+  // Connection of each sandbox -> its namespace
+  std::map<int, int> in_use;
+
+  while (!pool_stop) {
+    std::vector<struct pollfd> fds;
+    fds.push_back({listen_fd, POLLIN, 0});
+    for (const auto &conn : in_use) {
+      fds.push_back({conn.first, POLLIN, 0});
+    }
+    // Refill the pool one namespace at a time while there's nothing else to do
+    int timeout = pool.size() < NETNS_POOL_SIZE ? 0 : -1;
+    int res = poll(fds.data(), fds.size(), timeout);
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      DIE("poll");
+    }
+    if (res == 0) {
+      pool.push_back(CreatePooledNetns());
+      PRINT_DEBUG("network namespace created, %zu ready", pool.size());
+      continue;
+    }
+
+    for (size_t i = 1; i < fds.size(); i++) {
+      if (fds[i].revents) {
+        // The sandbox never writes, so this is the end of it
+        close(fds[i].fd);
+        ReturnNetns(&pool, in_use[fds[i].fd]);
+        in_use.erase(fds[i].fd);
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int conn = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (conn < 0) {
+        continue;
+      }
+      if (pool.empty()) {
+        PRINT_DEBUG("network namespace pool is empty");
+        pool.push_back(CreatePooledNetns());
+      }
+      PooledNetns netns = pool.back();
+      pool.pop_back();
+      int ns_fds[3] = {userns_fd, netns.netns_fd, netns.sysfs_fd};
+      res = SendWithFds(conn, "", ns_fds, 3);
+      close(netns.sysfs_fd);
+      if (res < 0) {
+        close(conn);
+        close(netns.netns_fd);
+        continue;
+      }
+      in_use[conn] = netns.netns_fd;
+    }
+  }
+
+  close(listen_fd);
+  unlink(socket_path.c_str());
+  return 0;
+}
+
+// Whether userns_fd is a user namespace and netns_fd a network namespace it
+// owns
+static bool IsPooledNetns(int userns_fd, int netns_fd) {
+  if (ioctl(userns_fd, NS_GET_NSTYPE) != CLONE_NEWUSER ||
+      ioctl(netns_fd, NS_GET_NSTYPE) != CLONE_NEWNET) {
+    return false;
+  }
+  int owner_fd = ioctl(netns_fd, NS_GET_USERNS);
+  if (owner_fd < 0) {
+    return false;
+  }
+  struct stat owner, userns;
+  bool owned = fstat(owner_fd, &owner) == 0 && fstat(userns_fd, &userns) == 0 &&
+               owner.st_dev == userns.st_dev && owner.st_ino == userns.st_ino;
+  close(owner_fd);
+  return owned;
+}
+
+int JoinPooledNetns(const std::string &socket_path, int *sysfs_fd) {
+  int conn = ConnectToUnixSocket(socket_path, NETNS_POOL_RECV_TIMEOUT_SECS);
+  if (conn < 0) {
+    PRINT_DEBUG("connect(%s): %m", socket_path.c_str());
+    return -1;
+  }
+  std::string data;
+  int fds[3];
+  int nfds = RecvWithFds(conn, &data, fds, 3);
+  if (nfds != 3) {
+    PRINT_DEBUG("recvmsg(%s): %m", socket_path.c_str());
+    for (int i = 0; i < nfds; i++) {
+      close(fds[i]);
+    }
+    close(conn);
+    return -1;
+  }
+
+  // We own the user namespace of the pool, which gives us the capabilities to
+  // join the network namespace from there. There's no way back once we are in
+  // that user namespace, so the namespaces are checked first: until then we
+  // can still create a new network namespace as usual.
+  if (!IsPooledNetns(fds[0], fds[1])) {
+    PRINT_DEBUG("%s did not send a network namespace of its user namespace",
+                socket_path.c_str());
+    for (int i = 0; i < 3; i++) {
+      close(fds[i]);
+    }
+    close(conn);
+    return -1;
+  }
+  if (setns(fds[0], CLONE_NEWUSER) < 0) {
+    PRINT_DEBUG("setns(CLONE_NEWUSER): %m");
+    for (int i = 0; i < 3; i++) {
+      close(fds[i]);
+    }
+    close(conn);
+    return -1;
+  }
+  if (setns(fds[1], CLONE_NEWNET) < 0) {
+    DIE("setns(CLONE_NEWNET) in the user namespace of the pool");
+  }
+  close(fds[0]);
+  close(fds[1]);
+  *sysfs_fd = fds[2];
+  return conn;
+}
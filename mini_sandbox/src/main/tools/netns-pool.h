@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _NETNS_POOL_H
+#define _NETNS_POOL_H
+
+#include <string>
+
+// Creating and, even more, destroying network namespaces is slow and the
+// kernel tears them down one at a time. A netns pool server
+// (mini-sandbox -Q <socket>) keeps a few loopback-only network namespaces
+// ready and takes them back once the sandbox using them is gone.
+//
+// The namespaces belong to the user namespace of the server, so the sandbox
+// joins that user namespace first and creates its own inside it. The sandbox
+// can then use the namespace but not reconfigure it, which is what makes it
+// safe to hand it to the next sandbox once no socket is left in it.
+
+// Serves the pool on the unix socket socket_path until SIGTERM/SIGINT.
+int MiniSbxServeNetnsPool(const std::string& socket_path);
+
+// Makes the calling (single threaded) process join a network namespace from
+// the pool served on socket_path. Returns a detached sysfs mount of the
+// namespace in sysfs_fd, since the sandbox can't mount one itself. The
+// namespace goes back to the pool when the returned connection is closed,
+// i.e., when the processes that inherited it exit. Returns -1 on error, when
+// the sandbox can still create its own namespace, and exits if the namespace
+// can't be joined once in the user namespace of the pool.
+int JoinPooledNetns(const std::string& socket_path, int* sysfs_fd);
+
+#endif
@@ -27,12 +27,15 @@
 #include <iostream>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/syscall.h>
 #include <sched.h>
 #include <signal.h>
@@ -149,7 +152,8 @@ static int DieOrReport(const char* msg, bool die_on_error) {
   return MiniSbxReportGenericError(msg);
 }
 
-// Waits for a signal to proceed from the pipe.
+// Waits for a signal to proceed from the pipe. The other process exiting
+// without signalling (end of file) is an error.
 int WaitPipe(int *pipe, bool die_on_error) {
   char buf = 0;
 
@@ -158,9 +162,18 @@ int WaitPipe(int *pipe, bool die_on_error) {
   if (close(pipe[1]) < 0) {
     return DieOrReport("close", die_on_error);
   }
-  if (read(pipe[0], &buf, 1) < 0) {
+  ssize_t n;
+  do {
+    n = read(pipe[0], &buf, 1);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
     return DieOrReport("read", die_on_error);
   }
+  if (n == 0) {
+    close(pipe[0]);
+    errno = EPIPE;
+    return DieOrReport("the other process exited before signalling", die_on_error);
+  }
   if (close(pipe[0]) < 0) {
     return DieOrReport("close", die_on_error);
   }
@@ -186,6 +199,139 @@ int SignalPipe(int *pipe, bool die_on_error) {
   return 0;
 }
 
+static int UnixSocketAddress(const std::string& path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strncpy(addr->sun_path, path.c_str(), sizeof(addr->sun_path) - 1);
+  return 0;
+}
+
+int ListenOnUnixSocket(const std::string& path) {
+  struct sockaddr_un addr;
+  if (UnixSocketAddress(path, &addr) < 0) {
+    return -1;
+  }
+  // Only a socket left behind by a previous server is replaced, not whatever
+  // else the path names
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      errno = EEXIST;
+      return -1;
+    }
+    int in_use = ConnectToUnixSocket(path, 1);
+    if (in_use >= 0) {
+      close(in_use);
+      errno = EADDRINUSE;
+      return -1;
+    }
+    unlink(path.c_str());
+  }
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  mode_t old_umask = umask(0077);
+  int res = bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+  umask(old_umask);
+  if (res < 0 || listen(fd, SOMAXCONN) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int ConnectToUnixSocket(const std::string& path, int timeout_secs) {
+  struct sockaddr_un addr;
+  if (UnixSocketAddress(path, &addr) < 0) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct timeval tv = {timeout_secs, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+#define MAX_FDS_PER_MESSAGE 8
+
+int SendWithFds(int sock, const std::string& data, const int *fds, int nfds) {
+  if (nfds > MAX_FDS_PER_MESSAGE) {
+    errno = EINVAL;
+    return -1;
+  }
+  // The NUL terminator makes sure that messages are never empty
+  struct iovec iov = {const_cast<char *>(data.c_str()), data.size() + 1};
+  char control[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)] = {};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (nfds > 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+  }
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+int RecvWithFds(int sock, std::string *data, int *fds, int max_fds) {
+  char buf[PATH_MAX];
+  char control[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)];
+  struct iovec iov = {buf, sizeof(buf)};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n;
+  while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+  }
+  if (n <= 0) {
+    return -1;
+  }
+
+  int nfds = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < count; i++) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (nfds < max_fds) {
+        fds[nfds++] = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+  if (buf[n - 1] != '\0' || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    for (int i = 0; i < nfds; i++) {
+      close(fds[i]);
+    }
+    errno = EPROTO;
+    return -1;
+  }
+  data->assign(buf);
+  return nfds;
+}
+
 
 void KillAndWait(pid_t pid) {
   kill(pid, SIGKILL);
@@ -426,7 +572,8 @@ static inline void makeWritable(const fs::path &dir, unsigned depth, unsigned ma
 
   for (const auto &entry : fs::directory_iterator(
            dir, fs::directory_options::skip_permission_denied)) {
-    if (fs::is_directory(entry.status())) {
+    // Don't follow symlinks out of the tree
+    if (fs::is_directory(entry.symlink_status())) {
       makeWritable(entry.path(), depth + 1, max_depth);
     }
   }
@@ -459,6 +606,17 @@ void Cleanup() {
       PRINT_DEBUG("Warning: Could not remove the trash files");
     }
   }
+
+  if (!opt.clone_dir.empty()) {
+    PRINT_DEBUG("delete %s\n", opt.clone_dir.c_str());
+    try {
+      fs::path clone_dir = opt.clone_dir.c_str();
+      makeWritable(clone_dir, 0, MAX_DEPTH_CLONE_DIR);
+      fs::remove_all(clone_dir);
+    } catch (const std::exception &e) {
+      PRINT_DEBUG("Warning: Could not remove the working directory clone");
+    }
+  }
 }
 
 
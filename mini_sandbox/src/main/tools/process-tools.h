@@ -31,6 +31,7 @@ namespace fs = std::experimental::filesystem;
 
 #define MAX_DEPTH_SANDBOX_ROOT 5
 #define MAX_DEPTH_OVERLAYFS_ROOT 12
+#define MAX_DEPTH_CLONE_DIR 64
 
 // Set up a signal handler for a signal.
 void InstallSignalHandler(int signum, void (*handler)(int));
@@ -83,6 +84,23 @@ int WaitPipe(int *pipe, bool die_on_err);
 // that it can proceed by writing a byte to the pipe.
 int SignalPipe(int *pipe, bool die_on_err);
 
+// Creates a SOCK_SEQPACKET unix socket listening on path that only our user
+// can connect to. A socket no one listens on anymore is replaced. Returns -1
+// on error, with errno EEXIST if path is something else than a socket and
+// EADDRINUSE if a server is listening on it.
+int ListenOnUnixSocket(const std::string& path);
+
+// Connects a SOCK_SEQPACKET unix socket to path. Receiving on it times out
+// after timeout_secs. Returns -1 on error.
+int ConnectToUnixSocket(const std::string& path, int timeout_secs);
+
+// Sends a message made of the string data and nfds file descriptors.
+int SendWithFds(int sock, const std::string& data, const int *fds, int nfds);
+
+// Receives a message sent with SendWithFds(). Returns the number of file
+// descriptors stored in fds (at most max_fds), or -1 on error.
+int RecvWithFds(int sock, std::string *data, int *fds, int max_fds);
+
 std::string CreateTempDirectory(const std::string& base_path);
 std::string CreateRandomFilename(const std::string& base_path);
 int CreateDirectory(const std::string& base_path, const std::string& dir_name, std::string& out);
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "src/main/tools/reflink-copy.h"
+#include "src/main/tools/logging.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define CLONE_MAX_THREADS 8
+#define CLONE_READ_SIZE 65536
+
+struct CloneEntry {
+  std::string source;
+  std::string target;
+  struct stat sb;
+};
+
+enum CloneResult { CLONE_FAILED, CLONE_REFLINKED, CLONE_COPIED };
+
+static void CopyTimes(int dir_fd, const std::string &path,
+                      const struct stat &sb, int flags) {
+  struct timespec times[2] = {sb.st_atim, sb.st_mtim};
+  utimensat(dir_fd, path.c_str(), times, flags);
+}
+
+static bool CopyData(int in, int out) {
+  // Same filesystem: copy_file_range() may still share the blocks (NFS, CIFS)
+  // or at least keep the data in the kernel
+  while (true) {
+    ssize_t n = copy_file_range(in, nullptr, out, nullptr, SSIZE_MAX, 0);
+    if (n == 0) return true;
+    if (n > 0) continue;
+    if (errno == EINTR) continue;
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+        errno != EOPNOTSUPP) {
+      return false;
+    }
+    break;
+  }
+  // Both offsets moved with whatever copy_file_range() managed to copy
+  std::vector<char> buf(CLONE_READ_SIZE);
+  while (true) {
+    ssize_t n = read(in, buf.data(), buf.size());
+    if (n == 0) return true;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    for (ssize_t done = 0; done < n;) {
+      ssize_t w = write(out, buf.data() + done, n - done);
+      if (w < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      done += w;
+    }
+  }
+}
+
+static CloneResult CloneFile(const CloneEntry &file) {
+  int in = open(file.source.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (in < 0) {
+    PRINT_DEBUG("open(%s): %m", file.source.c_str());
+    return CLONE_FAILED;
+  }
+  // Read-only files get their mode once they are written
+  int out = open(file.target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                 S_IRUSR | S_IWUSR);
+  if (out < 0) {
+    PRINT_DEBUG("open(%s): %m", file.target.c_str());
+    close(in);
+    return CLONE_FAILED;
+  }
+
+  CloneResult res = CLONE_REFLINKED;
+  if (ioctl(out, FICLONE, in) < 0) {
+    res = CopyData(in, out) ? CLONE_COPIED : CLONE_FAILED;
+    if (res == CLONE_FAILED) {
+      PRINT_DEBUG("copy(%s): %m", file.source.c_str());
+    }
+  }
+  fchmod(out, file.sb.st_mode & 07777);
+  struct timespec times[2] = {file.sb.st_atim, file.sb.st_mtim};
+  futimens(out, times);
+  close(out);
+  close(in);
+  return res;
+}
+
+// Creates the directories and symlinks of the tree right away and returns the
+// regular files, which are the expensive part, in files. Like cp -x, the
+// filesystems mounted in the tree are not cloned, only their mount points.
+static bool CollectTree(const std::string &source, const std::string &target,
+                        std::vector<CloneEntry> *dirs,
+                        std::vector<CloneEntry> *files) {
+  struct stat root;
+  if (stat(source.c_str(), &root) < 0) {
+    PRINT_DEBUG("stat(%s): %m", source.c_str());
+    return false;
+  }
+  bool ok = true;
+  std::vector<std::pair<std::string, std::string>> pending = {{source, target}};
+  while (!pending.empty()) {
+    const std::string src = pending.back().first;
+    const std::string dst = pending.back().second;
+    pending.pop_back();
+
+    DIR *dir = opendir(src.c_str());
+    if (dir == nullptr) {
+      PRINT_DEBUG("opendir(%s): %m", src.c_str());
+      ok = false;
+      continue;
+    }
+    while (struct dirent *dent = readdir(dir)) {
+      if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+        continue;
+      }
+      CloneEntry entry;
+      entry.source = src + "/" + dent->d_name;
+      entry.target = dst + "/" + dent->d_name;
+      if (lstat(entry.source.c_str(), &entry.sb) < 0) {
+        ok = false;
+        continue;
+      }
+      if (S_ISDIR(entry.sb.st_mode)) {
+        // Writable until everything in it is created
+        if (mkdir(entry.target.c_str(), S_IRWXU) < 0) {
+          PRINT_DEBUG("mkdir(%s): %m", entry.target.c_str());
+          ok = false;
+          continue;
+        }
+        if (entry.sb.st_dev == root.st_dev) {
+          pending.emplace_back(entry.source, entry.target);
+        } else {
+          PRINT_DEBUG("%s is a mount point, not cloned", entry.source.c_str());
+        }
+        dirs->push_back(entry);
+      } else if (entry.sb.st_dev != root.st_dev) {
+        // A file bind mounted in the tree
+        PRINT_DEBUG("%s is a mount point, not cloned", entry.source.c_str());
+      } else if (S_ISREG(entry.sb.st_mode)) {
+        files->push_back(entry);
+      } else if (S_ISLNK(entry.sb.st_mode)) {
+        char link[PATH_MAX];
+        ssize_t len = readlink(entry.source.c_str(), link, sizeof(link) - 1);
+        if (len < 0) {
+          ok = false;
+          continue;
+        }
+        link[len] = '\0';
+        if (symlink(link, entry.target.c_str()) < 0) {
+          ok = false;
+          continue;
+        }
+        CopyTimes(AT_FDCWD, entry.target, entry.sb, AT_SYMLINK_NOFOLLOW);
+      } else {
+        PRINT_DEBUG("%s is a special file, not cloned", entry.source.c_str());
+      }
+    }
+    closedir(dir);
+  }
+  return ok;
+}
+
+int CloneTree(const std::string &source, const std::string &target) {
+  std::vector<CloneEntry> dirs, files;
+  bool ok = CollectTree(source, target, &dirs, &files);
+
+  std::atomic<size_t> next(0);
+  std::atomic<size_t> reflinked(0), copied(0), failed(0);
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next.fetch_add(1)) < files.size()) {
+      switch (CloneFile(files[i])) {
+        case CLONE_REFLINKED: reflinked++; break;
+        case CLONE_COPIED: copied++; break;
+        default: failed++; break;
+      }
+    }
+  };
+  size_t nthreads = std::thread::hardware_concurrency();
+  if (nthreads > CLONE_MAX_THREADS) nthreads = CLONE_MAX_THREADS;
+  if (nthreads > files.size()) nthreads = files.size();
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < nthreads; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  // Children come after their parents, so going backwards we fix up each
+  // directory once nothing else needs to be created in it
+  for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+    chmod(it->target.c_str(), it->sb.st_mode & 07777);
+    CopyTimes(AT_FDCWD, it->target, it->sb, 0);
+  }
+  struct stat sb;
+  if (stat(source.c_str(), &sb) == 0) {
+    chmod(target.c_str(), sb.st_mode & 07777);
+    CopyTimes(AT_FDCWD, target, sb, 0);
+  }
+
+  PRINT_DEBUG("cloned %s to %s: %zu files reflinked, %zu copied, %zu failed",
+              source.c_str(), target.c_str(), reflinked.load(), copied.load(),
+              failed.load());
+  return (ok && failed == 0) ? 0 : -1;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _REFLINK_COPY_H
+#define _REFLINK_COPY_H
+
+#include <string>
+
+// Where overlayfs can't be used (e.g., XFS in a user namespace) the working
+// directory would be bind mounted writable, and the sandbox would write to the
+// host tree. Instead, the working directory can be cloned (-C <dir>) and the
+// clone mounted in its place. On filesystems with reflinks (XFS with
+// reflink=1, btrfs) the files of the clone share their data blocks with the
+// originals until either of them is written, so cloning only costs metadata.
+// Elsewhere the data is copied.
+
+// Recreates the tree under source in the existing, empty directory target.
+// Regular files are cloned with FICLONE, falling back to copy_file_range() and
+// then to read()/write(), from several threads. Directories, symlinks, modes
+// and timestamps are preserved; other special files and hard links are not.
+// Returns -1 if anything could not be cloned.
+int CloneTree(const std::string& source, const std::string& target);
+
+#endif
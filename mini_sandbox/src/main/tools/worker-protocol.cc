@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "src/main/tools/worker-protocol.h"
+#include "src/main/tools/logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// WorkRequest.request_id and WorkRequest.cancel field numbers (the same number
+// is WorkResponse.request_id in the response)
+#define PROTO_REQUEST_ID 3
+#define PROTO_CANCEL 4
+
+#define WORKER_READ_SIZE 65536
+// Stop reading from one side when the other is this much behind
+#define WORKER_MAX_PENDING (1 << 20)
+
+
+static void ParseJsonMessage(const std::string& json, WorkerMessage* msg) {
+  // Walk the top-level object looking for "requestId": <int> and
+  // "cancel": true. Nested objects/arrays (arguments, inputs) are skipped.
+  int depth = 0;
+  size_t i = 0;
+  while (i < json.size()) {
+    char c = json[i];
+    if (c == '"') {
+      size_t end = i + 1;
+      while (end < json.size() && json[end] != '"') {
+        end += (json[end] == '\\') ? 2 : 1;
+      }
+      if (end >= json.size()) return;
+      std::string key = json.substr(i + 1, end - i - 1);
+      i = end + 1;
+      if (depth != 1) continue;
+
+      size_t colon = json.find_first_not_of(" \t\r\n", i);
+      if (colon == std::string::npos || json[colon] != ':') continue;
+      size_t value = json.find_first_not_of(" \t\r\n", colon + 1);
+      if (value == std::string::npos) return;
+      if (key == "requestId") {
+        msg->request_id = static_cast<int>(strtol(json.c_str() + value, nullptr, 10));
+      } else if (key == "cancel") {
+        msg->cancel = json.compare(value, 4, "true") == 0;
+      }
+      i = value;
+      continue;
+    }
+    if (c == '{' || c == '[') depth++;
+    if (c == '}' || c == ']') depth--;
+    i++;
+  }
+}
+
+int WorkerMessageSplitter::FeedJson(const char* data, size_t len,
+                                    std::vector<WorkerMessage>* messages) {
+  for (size_t i = 0; i < len; i++) {
+    char c = data[i];
+    if (depth_ == 0) {
+      // Anything between two messages should be whitespace
+      if (c != '{') continue;
+      buffer_.clear();
+    }
+    buffer_.push_back(c);
+
+    if (in_string_) {
+      if (escape_) {
+        escape_ = false;
+      } else if (c == '\\') {
+        escape_ = true;
+      } else if (c == '"') {
+        in_string_ = false;
+      }
+      continue;
+    }
+    if (c == '"') {
+      in_string_ = true;
+    } else if (c == '{' || c == '[') {
+      depth_++;
+    } else if (c == '}' || c == ']') {
+      if (--depth_ < 0) return -1;
+      if (depth_ == 0) {
+        WorkerMessage msg;
+        ParseJsonMessage(buffer_, &msg);
+        messages->push_back(msg);
+        buffer_.clear();
+      }
+    }
+  }
+  return 0;
+}
+
+static bool ReadVarint(const std::string& buf, size_t* pos, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *pos < buf.size(); shift += 7) {
+    uint8_t b = static_cast<uint8_t>(buf[(*pos)++]);
+    *value |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+static int ParseProtoMessage(const std::string& buf, size_t pos, size_t end,
+                             WorkerMessage* msg) {
+  while (pos < end) {
+    uint64_t key, value;
+    if (!ReadVarint(buf, &pos, &key)) return -1;
+    switch (key & 0x7) {
+      case 0:  // varint
+        if (!ReadVarint(buf, &pos, &value)) return -1;
+        if ((key >> 3) == PROTO_REQUEST_ID) msg->request_id = static_cast<int>(value);
+        if ((key >> 3) == PROTO_CANCEL) msg->cancel = value != 0;
+        break;
+      case 1:  // 64-bit
+        pos += 8;
+        break;
+      case 2:  // length-delimited
+        if (!ReadVarint(buf, &pos, &value)) return -1;
+        pos += value;
+        break;
+      case 5:  // 32-bit
+        pos += 4;
+        break;
+      default:
+        return -1;
+    }
+  }
+  return pos == end ? 0 : -1;
+}
+
+int WorkerMessageSplitter::FeedProto(const char* data, size_t len,
+                                     std::vector<WorkerMessage>* messages) {
+  buffer_.append(data, len);
+  size_t consumed = 0;
+  while (consumed < buffer_.size()) {
+    size_t pos = consumed;
+    uint64_t size;
+    if (!ReadVarint(buffer_, &pos, &size)) {
+      // Either incomplete or more than 10 bytes of varint
+      if (buffer_.size() - consumed >= 10) return -1;
+      break;
+    }
+    if (buffer_.size() - pos < size) break;
+
+    WorkerMessage msg;
+    if (ParseProtoMessage(buffer_, pos, pos + size, &msg) < 0) return -1;
+    messages->push_back(msg);
+    consumed = pos + size;
+  }
+  buffer_.erase(0, consumed);
+  return 0;
+}
+
+int WorkerMessageSplitter::Feed(const char* data, size_t len,
+                                std::vector<WorkerMessage>* messages) {
+  if (protocol_ == WORKER_PROTO) {
+    return FeedProto(data, len, messages);
+  }
+  return FeedJson(data, len, messages);
+}
+
+
+// Writes as much of pending as possible without blocking. out_fd may be shared
+// with other processes (e.g., our stdout) so we can't make it non-blocking, but
+// writes of at most PIPE_BUF bytes don't block after poll() reported POLLOUT.
+static int FlushPending(int fd, std::string* pending) {
+  size_t len = pending->size() < PIPE_BUF ? pending->size() : PIPE_BUF;
+  ssize_t n = write(fd, pending->data(), len);
+  if (n < 0) {
+    return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+  }
+  pending->erase(0, n);
+  return 0;
+}
+
+int RelayWorkerProtocol(WorkerProtocol protocol, int in_fd, int out_fd,
+                        int worker_in, int worker_out, void (*on_idle)(),
+                        void (*on_tick)()) {
+  WorkerMessageSplitter requests(protocol);
+  WorkerMessageSplitter responses(protocol);
+  std::string to_worker, to_out;
+  std::vector<WorkerMessage> messages;
+  std::vector<char> buf(WORKER_READ_SIZE);
+  int in_flight = 0;
+  bool in_open = true;
+
+  while (true) {
+    // Nothing more to send to the worker: let it know
+    if (!in_open && to_worker.empty() && worker_in >= 0) {
+      close(worker_in);
+      worker_in = -1;
+    }
+
+    struct pollfd fds[4];
+    int nfds = 0;
+    int in_idx = -1, worker_out_idx = -1, worker_in_idx = -1, out_idx = -1;
+    if (in_open && to_worker.size() < WORKER_MAX_PENDING) {
+      in_idx = nfds;
+      fds[nfds++] = {in_fd, POLLIN, 0};
+    }
+    if (to_out.size() < WORKER_MAX_PENDING) {
+      worker_out_idx = nfds;
+      fds[nfds++] = {worker_out, POLLIN, 0};
+    }
+    if (!to_worker.empty() && worker_in >= 0) {
+      worker_in_idx = nfds;
+      fds[nfds++] = {worker_in, POLLOUT, 0};
+    }
+    if (!to_out.empty()) {
+      out_idx = nfds;
+      fds[nfds++] = {out_fd, POLLOUT, 0};
+    }
+
+    int res = poll(fds, nfds, 1000);
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (on_tick) on_tick();
+
+    // Handle responses first so that we reset before the next request goes in
+    if (worker_out_idx >= 0 && fds[worker_out_idx].revents) {
+      ssize_t n = read(worker_out, buf.data(), buf.size());
+      if (n < 0 && errno != EINTR) return -1;
+      if (n == 0) {
+        // The worker is gone, forward what's left and let the caller reap it
+        while (!to_out.empty() && FlushPending(out_fd, &to_out) == 0) {
+        }
+        return 0;
+      }
+      if (n > 0) {
+        messages.clear();
+        if (responses.Feed(buf.data(), n, &messages) < 0) {
+          PRINT_DEBUG("worker: cannot parse the WorkResponses, no more resets");
+          in_flight = -1;
+        }
+        for (const WorkerMessage& msg : messages) {
+          PRINT_DEBUG("worker: response for request %d", msg.request_id);
+          if (in_flight > 0 && --in_flight == 0 && on_idle) {
+            on_idle();
+          }
+        }
+        to_out.append(buf.data(), n);
+      }
+    }
+
+    if (in_idx >= 0 && fds[in_idx].revents) {
+      ssize_t n = read(in_fd, buf.data(), buf.size());
+      if (n < 0 && errno != EINTR) return -1;
+      if (n == 0) {
+        in_open = false;
+      }
+      if (n > 0) {
+        messages.clear();
+        if (requests.Feed(buf.data(), n, &messages) < 0) {
+          PRINT_DEBUG("worker: cannot parse the WorkRequests, no more resets");
+          in_flight = -1;
+        }
+        for (const WorkerMessage& msg : messages) {
+          PRINT_DEBUG("worker: request %d (cancel = %d)", msg.request_id, msg.cancel);
+          // A cancel request does not get a response of its own
+          if (in_flight >= 0 && !msg.cancel) in_flight++;
+        }
+        to_worker.append(buf.data(), n);
+      }
+    }
+
+    if (worker_in_idx >= 0 && fds[worker_in_idx].revents) {
+      if (fds[worker_in_idx].revents & (POLLERR | POLLHUP)) {
+        // The worker closed its stdin, drop whatever it won't read
+        to_worker.clear();
+      } else if (FlushPending(worker_in, &to_worker) < 0) {
+        return -1;
+      }
+    }
+    if (out_idx >= 0 && fds[out_idx].revents) {
+      if (FlushPending(out_fd, &to_out) < 0) return -1;
+    }
+  }
+}
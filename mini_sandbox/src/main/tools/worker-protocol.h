@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _WORKER_PROTOCOL_H
+#define _WORKER_PROTOCOL_H
+
+#include "src/main/tools/linux-sandbox-options.h"
+
+#include <string>
+#include <vector>
+
+// Bazel persistent worker protocol, see
+// https://bazel.build/remote/persistent and worker_protocol.proto .
+// We don't need to understand the whole WorkRequest/WorkResponse, only where
+// each message ends and which request it refers to.
+struct WorkerMessage {
+  int request_id = 0;
+  bool cancel = false;
+};
+
+// Splits a stream of WorkRequests or WorkResponses into messages. The JSON
+// flavour is a sequence of JSON objects, the proto one a sequence of
+// varint-length-delimited messages.
+class WorkerMessageSplitter {
+ public:
+  explicit WorkerMessageSplitter(WorkerProtocol protocol) : protocol_(protocol) {}
+  // Consumes len bytes and appends the messages completed by them. Returns -1
+  // if the stream cannot be parsed.
+  int Feed(const char* data, size_t len, std::vector<WorkerMessage>* messages);
+
+ private:
+  int FeedJson(const char* data, size_t len, std::vector<WorkerMessage>* messages);
+  int FeedProto(const char* data, size_t len, std::vector<WorkerMessage>* messages);
+
+  WorkerProtocol protocol_;
+  std::string buffer_;
+  // JSON scanner state
+  int depth_ = 0;
+  bool in_string_ = false;
+  bool escape_ = false;
+};
+
+// Relays WorkRequests from in_fd to the worker (worker_in) and WorkResponses
+// from the worker (worker_out) to out_fd, until the worker closes its output.
+// on_idle is invoked every time the last request in flight got its response,
+// before any further request reaches the worker. on_tick is invoked at least
+// every second.
+int RelayWorkerProtocol(WorkerProtocol protocol, int in_fd, int out_fd,
+                        int worker_in, int worker_out, void (*on_idle)(),
+                        void (*on_tick)());
+
+#endif
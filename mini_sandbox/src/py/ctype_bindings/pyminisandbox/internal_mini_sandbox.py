@@ -187,6 +187,43 @@ def mini_sandbox_set_working_dir(path):
             return MiniSandboxErrors.NOERROR
     return _lib.mini_sandbox_set_working_dir(path.encode())
 
+def mini_sandbox_set_pid_file(path):
+    if _lib is None:
+        if is_platform_supported():
+            return MiniSandboxErrors.LIB_NOT_LOADED
+        else:
+            return MiniSandboxErrors.NOERROR
+    return _lib.mini_sandbox_set_pid_file(path.encode())
+
+def mini_sandbox_set_mount_template(socket_path):
+    if _lib is None:
+        if is_platform_supported():
+            return MiniSandboxErrors.LIB_NOT_LOADED
+        else:
+            return MiniSandboxErrors.NOERROR
+    return _lib.mini_sandbox_set_mount_template(socket_path.encode())
+
+def mini_sandbox_clone_working_dir(base_dir):
+    if _lib is None:
+        if is_platform_supported():
+            return MiniSandboxErrors.LIB_NOT_LOADED
+        else:
+            return MiniSandboxErrors.NOERROR
+    return _lib.mini_sandbox_clone_working_dir(base_dir.encode())
+
+def mini_sandbox_exec(pid, args):
+    if _lib is None:
+        if is_platform_supported():
+            return MiniSandboxErrors.LIB_NOT_LOADED
+        else:
+            return MiniSandboxErrors.NOERROR
+    if len(args) == 0:
+        return MiniSandboxErrors.INVALID_ARG
+    argv = (ctypes.c_char_p * (len(args) + 1))()
+    argv[:-1] = [arg.encode() for arg in args]
+    argv[-1] = None
+    return _lib.mini_sandbox_exec(pid, argv)
+
 def mini_sandbox_share_network():
     if _lib is None:
         if is_platform_supported():
@@ -195,6 +232,14 @@ def mini_sandbox_share_network():
             return MiniSandboxErrors.NOERROR
     return _lib.mini_sandbox_share_network()
 
+def mini_sandbox_set_netns_pool(socket_path):
+    if _lib is None:
+        if is_platform_supported():
+            return MiniSandboxErrors.LIB_NOT_LOADED
+        else:
+            return MiniSandboxErrors.NOERROR
+    return _lib.mini_sandbox_set_netns_pool(socket_path.encode())
+
 
 def mini_sandbox_allow_max_connections(max_connections):
     if _lib is None:
@@ -258,6 +303,27 @@ def mini_sandbox_allow_ipv4_subnet(subnet):
         return _lib.mini_sandbox_allow_ipv4_subnet(subnet.encode())
     return MiniSandboxErrors.FEATURE_NOT_AVAILABLE
 
+def mini_sandbox_allow_ipv6(rule):
+    if _lib is None:
+        if is_platform_supported():
+            return MiniSandboxErrors.LIB_NOT_LOADED
+        else:
+            return MiniSandboxErrors.NOERROR
+    if _tap and hasattr(_lib, "mini_sandbox_allow_ipv6"):
+        return _lib.mini_sandbox_allow_ipv6(rule.encode())
+    return MiniSandboxErrors.FEATURE_NOT_AVAILABLE
+
+def mini_sandbox_set_tap_option(key, value):
+    if _lib is None:
+        if is_platform_supported():
+            return MiniSandboxErrors.LIB_NOT_LOADED
+        else:
+            return MiniSandboxErrors.NOERROR
+
+    if _tap and hasattr(_lib, "mini_sandbox_set_tap_option"):
+        return _lib.mini_sandbox_set_tap_option(key.encode(), str(value).encode())
+    return MiniSandboxErrors.FEATURE_NOT_AVAILABLE
+
 def mini_sandbox_is_running():
     if _lib is None:
         if is_platform_supported():
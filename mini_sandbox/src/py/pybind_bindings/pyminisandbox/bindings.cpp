@@ -3,6 +3,7 @@
  * SPDX-License-Identifier: MIT
  */
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
 #include "linux-sandbox-api.h"
 
 
@@ -17,11 +18,22 @@ PYBIND11_MODULE(pyminisandbox, m) {
     m.def("mini_sandbox_setup_default", &mini_sandbox_setup_default, "Set default sandbox configuration");
 #ifndef MINITAP
     m.def("mini_sandbox_share_network", &mini_sandbox_share_network, "Share network namespace with host machine");
+    m.def("mini_sandbox_set_netns_pool", &mini_sandbox_set_netns_pool, py::arg("socket_path"), "Take the network namespace from a netns pool server");
 #endif
     m.def("mini_sandbox_mount_bind", &mini_sandbox_mount_bind, py::arg("path"), "Bind mount a path");
     m.def("mini_sandbox_mount_write", &mini_sandbox_mount_write, py::arg("path"), "Make a path writable");
     m.def("mini_sandbox_mount_empty_output_file", &mini_sandbox_mount_empty_output_file, py::arg("path"), "Make a path writable");
     m.def("mini_sandbox_enable_log", &mini_sandbox_enable_log, py::arg("path"), "Set a path where to store the log");
+    m.def("mini_sandbox_set_pid_file", &mini_sandbox_set_pid_file, py::arg("path"), "Write the PID of the sandbox init process to a file");
+    m.def("mini_sandbox_set_mount_template", &mini_sandbox_set_mount_template, py::arg("socket_path"), "Clone the read-only root folders from a mount template server");
+    m.def("mini_sandbox_clone_working_dir", &mini_sandbox_clone_working_dir, py::arg("base_dir"), "Mount a clone of the working directory in its place");
+    m.def("mini_sandbox_exec", [](int pid, const std::vector<std::string>& args) -> int {
+        std::vector<char*> argv;
+        for (const auto& arg : args)
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(nullptr);
+        return mini_sandbox_exec(pid, argv.data());
+    }, py::arg("pid"), py::arg("args"), "Run a command inside an already running sandbox");
 
     m.def("mini_sandbox_get_last_error_msg", []() -> std::string { return std::string(mini_sandbox_get_last_error_msg()); });
 
@@ -31,6 +43,8 @@ PYBIND11_MODULE(pyminisandbox, m) {
     m.def("mini_sandbox_allow_domain", &mini_sandbox_allow_domain, py::arg("domain"), "Add the domain  allow-list. Should be called before mini_sandbox_start");
     m.def("mini_sandbox_allow_all_domains", &mini_sandbox_allow_all_domains, "Allow all domains. Should be called before mini_sandbox_start");
     m.def("mini_sandbox_allow_ipv4_subnet", &mini_sandbox_allow_ipv4_subnet, py::arg("subnet"), "Allow all domains. Should be called before mini_sandbox_start");
+    m.def("mini_sandbox_allow_ipv6", &mini_sandbox_allow_ipv6, py::arg("rule"), "Add the IPv6 address or subnet in allow-list. Should be called before mini_sandbox_start");
+    m.def("mini_sandbox_set_tap_option", &mini_sandbox_set_tap_option, py::arg("key"), py::arg("value"), "Set an option of the tap mode network stack. Should be called before mini_sandbox_start");
 
 #endif
 }
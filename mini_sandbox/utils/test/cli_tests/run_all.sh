@@ -50,3 +50,8 @@ check_exit $SCRIPT_DIR/test_readonly.sh
 check_exit $SCRIPT_DIR/test_custom_base.sh
 check_exit $SCRIPT_DIR/test_default_overlay_over_readonly.sh
 check_exit $SCRIPT_DIR/test_mount_single_file.sh
+check_exit $SCRIPT_DIR/test_attach.sh
+check_exit $SCRIPT_DIR/test_mount_template.sh
+check_exit $SCRIPT_DIR/test_netns_pool.sh
+check_exit $SCRIPT_DIR/test_clone_workdir.sh
+check_exit $SCRIPT_DIR/test_worker.sh
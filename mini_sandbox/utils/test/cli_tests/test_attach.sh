@@ -0,0 +1,45 @@
+#!/bin/bash
+##
+## Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+## SPDX-License-Identifier: MIT
+##
+
+PID_FILE=$(mktemp -u /tmp/mini-sandbox-attach.XXXXXX)
+
+mini-sandbox -x -p $PID_FILE -- /bin/bash -c 'echo "sandbox-test" > /tmp/attach.txt; sleep 5' &
+SANDBOX=$!
+
+for i in $(seq 50); do
+    [ -s $PID_FILE ] && break
+    # e.g. -p refused in an unprivileged container
+    kill -0 $SANDBOX 2>/dev/null || break
+    sleep 0.1
+done
+
+if [ ! -s $PID_FILE ]; then
+    wait $SANDBOX
+    echo "Error: pid file was not written, mini-sandbox exited with $?"
+    exit 1
+fi
+
+echo -e "\nTest that the attached command sees the sandbox /tmp"
+mini-sandbox -A $(cat $PID_FILE) -- /bin/bash -c 'grep -q sandbox-test /tmp/attach.txt'
+if [ $? -ne 0 ]; then
+    echo "Error: attached command does not run in the sandbox"
+    exit 1
+fi
+
+echo -e "\nTest that the exit code of the attached command is returned"
+mini-sandbox -A $(cat $PID_FILE) -- /bin/bash -c 'exit 3'
+if [ $? -ne 3 ]; then
+    echo "Error: unexpected exit code"
+    exit 1
+fi
+
+wait $SANDBOX
+
+if [ -e $PID_FILE ]; then
+    echo "Error: pid file was not removed"
+    exit 1
+fi
+echo "Success"
@@ -0,0 +1,58 @@
+#!/bin/bash
+##
+## Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+## SPDX-License-Identifier: MIT
+##
+
+WORKDIR=$(mktemp -d $PWD/mini-sandbox-clone-src.XXXXXX)
+CLONES=$(mktemp -d /tmp/mini-sandbox-clones.XXXXXX)
+
+mkdir -p $WORKDIR/dir
+echo "original" > $WORKDIR/dir/existing.txt
+ln -s dir/existing.txt $WORKDIR/link
+
+cd $WORKDIR
+mini-sandbox -x -C $CLONES -- /bin/bash << 'EOF'
+
+check_last_command() {
+    if [ $? -ne 0 ]; then
+        echo "Error: Last command failed."
+        exit 1
+    else
+        echo "Success: Last command succeeded."
+    fi
+}
+
+echo -e "\nTest that the working directory is cloned"
+grep -q original ./link
+check_last_command
+
+echo -e "\nTest writing in the cloned working dir"
+echo "sandbox-test" > ./new.txt
+check_last_command
+echo "sandbox-test" > ./dir/existing.txt
+check_last_command
+rm ./link
+check_last_command
+EOF
+RES=$?
+cd - > /dev/null
+
+echo -e "\nTest that the writes of the sandbox did not reach the working directory"
+if [ $RES -ne 0 ] || [ -e $WORKDIR/new.txt ] || [ ! -L $WORKDIR/link ] || \
+   [ "$(cat $WORKDIR/dir/existing.txt)" != "original" ]; then
+    echo "Error: the sandbox wrote in the original working directory"
+    RES=1
+fi
+
+echo -e "\nTest that the clone was removed"
+if [ -n "$(ls -A $CLONES)" ]; then
+    echo "Error: the clone was left in $CLONES"
+    RES=1
+fi
+
+rm -rf $WORKDIR $CLONES
+if [ $RES -ne 0 ]; then
+    exit 1
+fi
+echo "Success"
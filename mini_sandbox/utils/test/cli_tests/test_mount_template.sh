@@ -0,0 +1,61 @@
+#!/bin/bash
+##
+## Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+## SPDX-License-Identifier: MIT
+##
+
+SOCKET_DIR=$(mktemp -d /tmp/mini-sandbox-template.XXXXXX)
+SOCKET=$SOCKET_DIR/template.sock
+
+echo -e "\nTest that the server does not replace a file that is not a socket"
+touch $SOCKET
+mini-sandbox -B $SOCKET
+if [ $? -eq 0 ] || [ ! -f $SOCKET ]; then
+    echo "Error: the server replaced a regular file"
+    exit 1
+fi
+rm -f $SOCKET
+
+mini-sandbox -B $SOCKET &
+SERVER=$!
+for i in $(seq 50); do
+    [ -S $SOCKET ] && break
+    kill -0 $SERVER 2>/dev/null || break
+    sleep 0.1
+done
+if [ ! -S $SOCKET ]; then
+    wait $SERVER
+    echo "Error: the mount template server did not start, it exited with $?"
+    exit 1
+fi
+
+echo -e "\nTest that a second server does not take over the socket"
+mini-sandbox -B $SOCKET
+if [ $? -eq 0 ]; then
+    echo "Error: a second server started on the same socket"
+    kill $SERVER
+    exit 1
+fi
+
+echo -e "\nTest that the root folders of the template are read-only"
+mini-sandbox -x -b $SOCKET -- /bin/bash -c 'ls /usr/bin > /dev/null && ! touch /usr/sandbox-test 2> /dev/null && ! touch /etc/sandbox-test 2> /dev/null'
+RES=$?
+
+echo -e "\nTest writing in working dir"
+mini-sandbox -x -b $SOCKET -- /bin/bash -c 'echo "sandbox-test" > ./template-test.txt'
+RES_WRITE=$?
+rm -f ./template-test.txt
+
+kill $SERVER
+wait $SERVER
+if [ -e $SOCKET ]; then
+    echo "Error: the socket was not removed"
+    exit 1
+fi
+rmdir $SOCKET_DIR
+
+if [ $RES -ne 0 ] || [ $RES_WRITE -ne 0 ]; then
+    echo "Error: the sandbox did not run as expected on the template"
+    exit 1
+fi
+echo "Success"
@@ -0,0 +1,65 @@
+#!/bin/bash
+##
+## Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+## SPDX-License-Identifier: MIT
+##
+
+SOCKET_DIR=$(mktemp -d /tmp/mini-sandbox-netns.XXXXXX)
+SOCKET=$SOCKET_DIR/netns.sock
+LOG=$SOCKET_DIR/pool.log
+
+echo -e "\nTest that a sandbox creates its own namespace without the server"
+mini-sandbox -x -q $SOCKET -- /bin/bash -c 'grep -q " lo:" /proc/net/dev'
+if [ $? -ne 0 ]; then
+    echo "Error: the sandbox did not start without the pool server"
+    exit 1
+fi
+
+mini-sandbox -D $LOG -Q $SOCKET &
+SERVER=$!
+for i in $(seq 50); do
+    [ -S $SOCKET ] && break
+    kill -0 $SERVER 2>/dev/null || break
+    sleep 0.1
+done
+if [ ! -S $SOCKET ]; then
+    wait $SERVER
+    echo "Error: the netns pool server did not start, it exited with $?"
+    exit 1
+fi
+
+echo -e "\nTest that sandboxes get a loopback-only namespace from the pool"
+HOST_NETNS=$(readlink /proc/self/ns/net)
+RES=0
+for i in 1 2; do
+    OUT=($(mini-sandbox -x -q $SOCKET -- /bin/bash -c 'ls /sys/class/net; readlink /proc/self/ns/net'))
+    if [ $? -ne 0 ] || [ "${OUT[0]}" != "lo" ] || [ "${OUT[1]}" == "$HOST_NETNS" ]; then
+        echo "Got ${OUT[*]}"
+        RES=1
+    fi
+done
+
+# The namespaces come back to the pool once the sandboxes are gone
+for i in $(seq 50); do
+    [ $(grep -c "given back" $LOG) -ge 2 ] && break
+    sleep 0.1
+done
+GIVEN_BACK=$(grep -c "given back" $LOG)
+
+kill $SERVER
+wait $SERVER
+if [ -e $SOCKET ]; then
+    echo "Error: the socket was not removed"
+    exit 1
+fi
+rm -rf $SOCKET_DIR
+
+if [ $RES -ne 0 ]; then
+    echo "Error: the sandbox did not run in a loopback-only namespace"
+    exit 1
+fi
+if [ $GIVEN_BACK -ne 2 ]; then
+    echo "Error: $GIVEN_BACK namespaces of the pool were used, expected 2"
+    exit 1
+fi
+echo "Success"
@@ -0,0 +1,189 @@
+#!/bin/bash
+##
+## Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+## SPDX-License-Identifier: MIT
+##
+
+# Runs a persistent worker (-j) in both protocols. The requests are split
+# across writes, batched in a single write and hold braces and quotes in their
+# strings, and the worker leaves a file in an overlay (the parent of the
+# working directory) at every request. A request must see the file of the
+# other requests in flight, but not the ones of the requests answered before.
+
+TOP_LVL=$(mktemp -d $PWD/mini-sandbox-worker.XXXXXX)
+WD="$TOP_LVL/working-dir"
+mkdir -p $WD
+
+cat > $TOP_LVL/protocol.py << 'EOF'
+import json
+import os
+
+
+def varint(n):
+    out = b""
+    while n > 0x7f:
+        out += bytes([n & 0x7f | 0x80])
+        n >>= 7
+    return out + bytes([n])
+
+
+def read_varint(data, i):
+    n = shift = 0
+    while True:
+        n |= (data[i] & 0x7f) << shift
+        shift += 7
+        i += 1
+        if not data[i - 1] & 0x80:
+            return n, i
+
+
+def encode(proto, fields):
+    # fields: (number, int or str)
+    if not proto:
+        names = {1: "arguments", 2: "output", 3: "requestId", 5: "exitCode"}
+        msg = {}
+        for number, value in fields:
+            if number == 1:
+                msg.setdefault("arguments", []).append(value)
+            else:
+                msg[names[number]] = value
+        return (json.dumps(msg) + "\n").encode()
+    body = b""
+    for number, value in fields:
+        if isinstance(value, str):
+            value = value.encode()
+            body += varint(number << 3 | 2) + varint(len(value)) + value
+        else:
+            body += varint(number << 3) + varint(value)
+    return varint(len(body)) + body
+
+
+def decode(proto, fd):
+    """Yields the messages read on fd as lists of (number, value)"""
+    buf = b""
+    while True:
+        if proto:
+            try:
+                size, start = read_varint(buf, 0)
+            except IndexError:
+                size, start = None, 0
+            if size is not None and len(buf) >= start + size:
+                body, buf = buf[start:start + size], buf[start + size:]
+                fields, i = [], 0
+                while i < len(body):
+                    tag, i = read_varint(body, i)
+                    if tag & 7 == 2:
+                        n, i = read_varint(body, i)
+                        fields.append((tag >> 3, body[i:i + n].decode()))
+                        i += n
+                    else:
+                        n, i = read_varint(body, i)
+                        fields.append((tag >> 3, n))
+                yield fields
+                continue
+        else:
+            text = buf.decode().lstrip()
+            try:
+                msg, end = json.JSONDecoder().raw_decode(text)
+            except ValueError:
+                pass
+            else:
+                buf = text[end:].encode()
+                names = {"arguments": 1, "output": 2, "requestId": 3, "exitCode": 5}
+                fields = []
+                for key, value in msg.items():
+                    for v in (value if isinstance(value, list) else [value]):
+                        fields.append((names[key], v))
+                yield fields
+                continue
+        data = os.read(fd, 65536)
+        if not data:
+            return
+        buf += data
+EOF
+
+cat > $TOP_LVL/worker.py << 'EOF'
+import os
+import sys
+from protocol import decode, encode
+
+proto = sys.argv[1] == "proto"
+for fields in decode(proto, 0):
+    request_id = dict(fields).get(3, 0)
+    args = [v for n, v in fields if n == 1]
+    marker = "../left-by-%d" % request_id
+    left = sorted(f for f in os.listdir("..") if f.startswith("left-by-"))
+    open(marker, "w").close()
+    output = "%d args, %s" % (len(args), ",".join(left))
+    os.write(1, encode(proto, [(5, 0), (2, output), (3, request_id)]))
+EOF
+
+cat > $TOP_LVL/driver.py << 'EOF'
+import subprocess
+import sys
+import time
+from protocol import decode, encode
+
+proto = sys.argv[1] == "proto"
+worker = subprocess.Popen(sys.argv[2:], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+responses = decode(proto, worker.stdout.fileno())
+tricky = ["a}", "{b", 'c"}{', "\\", "x" * 300]
+failed = False
+
+
+def check(request_id, want):
+    global failed
+    got = dict(next(responses))
+    if got.get(3, 0) != request_id or got.get(2) != want:
+        print("Error: request %d got %s, want %s" % (request_id, got, want))
+        failed = True
+
+
+# One request, one byte at a time
+for b in encode(proto, [(1, a) for a in tricky] + [(3, 1)]):
+    worker.stdin.write(bytes([b]))
+    worker.stdin.flush()
+    time.sleep(0.001)
+check(1, "5 args, ")
+
+# Two requests in flight: the second one sees the file of the first one
+worker.stdin.write(encode(proto, [(1, "x"), (3, 2)]) + encode(proto, [(3, 3)]))
+worker.stdin.flush()
+check(2, "1 args, ")
+check(3, "0 args, left-by-2")
+
+# Both were answered, the next request starts from scratch
+worker.stdin.write(encode(proto, [(1, "{"), (3, 4)]))
+worker.stdin.flush()
+check(4, "1 args, ")
+
+worker.stdin.close()
+if worker.wait() != 0:
+    print("Error: the worker exited with %d" % worker.returncode)
+    failed = True
+sys.exit(1 if failed else 0)
+EOF
+
+pushd $WD > /dev/null
+RES=0
+for PROTOCOL in json proto; do
+    echo -e "\nTest the $PROTOCOL worker protocol"
+    PYTHONPATH=$TOP_LVL python3 $TOP_LVL/driver.py $PROTOCOL \
+        mini-sandbox -x -j $PROTOCOL -- env PYTHONPATH=$TOP_LVL python3 $TOP_LVL/worker.py $PROTOCOL
+    if [ $? -ne 0 ]; then
+        RES=1
+    fi
+done
+popd > /dev/null
+
+echo -e "\nTest that the files of the requests did not reach the host"
+if ls $TOP_LVL | grep -q left-by; then
+    echo "Error: the worker wrote outside of the overlay"
+    RES=1
+fi
+
+rm -rf $TOP_LVL
+if [ $RES -ne 0 ]; then
+    exit 1
+fi
+echo "Success"
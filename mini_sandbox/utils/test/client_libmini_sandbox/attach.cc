@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2025 Qualcomm Technologies, Inc. and/or its subsidiaries.
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "linux-sandbox-api.h"
+
+// attach.bin PID_FILE starts a sandbox publishing its PID in PID_FILE, which
+// leaves /tmp/attach.txt in its /tmp and waits a few seconds.
+// attach.bin PID_FILE exec runs a command in that sandbox, which only
+// succeeds if it sees the file.
+int main(int argc, char* argv[]) {
+    assert(argc >= 2);
+    int res;
+
+    if (argc == 3 && strcmp(argv[2], "exec") == 0) {
+        FILE* f = fopen(argv[1], "r");
+        assert(f != nullptr);
+        int pid;
+        assert(fscanf(f, "%d", &pid) == 1);
+        fclose(f);
+        char* args[] = {"/bin/grep", "-q", "sandbox-test", "/tmp/attach.txt", NULL};
+        res = mini_sandbox_exec(pid, args);
+        printf("attached command exited with %d\n", res);
+        return res;
+    }
+
+    res = mini_sandbox_setup_default();
+    assert (res == 0);
+    res = mini_sandbox_set_pid_file(argv[1]);
+    assert (res == 0);
+    res = mini_sandbox_start();
+    assert (res == 0);
+
+    FILE* f = fopen("/tmp/attach.txt", "w");
+    assert(f != nullptr);
+    fprintf(f, "sandbox-test\n");
+    fclose(f);
+    sleep(5);
+    return 0;
+}
@@ -95,4 +95,21 @@ ls "$PARENT_FOLDER/libminisandbox.test"
 check_last_command
 rm -f $PARENT_FOLDER/libminisandbox.test
 rm -f $HOME/libminisandbox.test
+
+# The pid file of mini_sandbox_set_pid_file() is written on the host
+PID_FILE=$(mktemp -u /tmp/libmini-sandbox-attach.XXXXXX)
+$SCRIPT_DIR/client_cxx_attach.bin $PID_FILE &
+SANDBOX=$!
+for i in $(seq 50); do
+    [ -s $PID_FILE ] && break
+    kill -0 $SANDBOX 2>/dev/null || break
+    sleep 0.1
+done
+check_exit $SCRIPT_DIR/client_cxx_attach.bin $PID_FILE exec
+check_exit wait $SANDBOX
+ls $PID_FILE
+check_last_command_failed
+ls /tmp/attach.txt
+check_last_command_failed
+
 cd $ORIGINAL_DIR
@@ -0,0 +1,292 @@
+package main
+
+import (
+	"encoding/binary"
+	"fmt"
+	"os"
+	"strconv"
+	"sync"
+	"time"
+
+	"gvisor.dev/gvisor/pkg/tcpip"
+	"gvisor.dev/gvisor/pkg/tcpip/link/nested"
+	"gvisor.dev/gvisor/pkg/tcpip/stack"
+)
+
+// With the pcap option, minitap keeps the last packets between the sandbox and
+// its stack in a ring buffer, bounded in size (pcap-size) and optionally in
+// age (pcap-window), and writes them as pcapng when the sandbox exits or on
+// SIGUSR2. The packets are the ones of the TUN device, as the sandbox sees
+// them, so the retransmits and the handshakes of the sandbox can be looked at
+// with the usual tools. Their direction is the one of minitap's side: inbound
+// packets were sent by the sandbox. Without the option the link endpoint of
+// the stack is the fdbased one as is, there is no cost at all.
+//
+// The ring holds the packets as the Enhanced Packet Blocks they are written
+// as, so that writing it out is a copy.
+
+const (
+	defaultCaptureSize    = 16 << 20
+	defaultCaptureSnaplen = 262144
+
+	// pcapng block types (draft-ietf-opsawg-pcapng)
+	pcapngSectionHeader   = 0x0a0d0d0a
+	pcapngInterface       = 0x00000001
+	pcapngEnhancedPacket  = 0x00000006
+	pcapngByteOrderMagic  = 0x1a2b3c4d
+	pcapngOptionEnd       = 0
+	pcapngOptionEPBFlags  = 2
+	pcapngDirectionIn     = 1
+	pcapngDirectionOut    = 2
+	pcapngEPBHeaderSize   = 28
+	pcapngEPBTrailerSize  = 16
+	pcapngLinkTypeRaw     = 101
+	pcapngSectionHeadSize = 28
+	pcapngInterfaceSize   = 20
+)
+
+// captureConfig is what the pcap-* options set
+type captureConfig struct {
+	// Path is where the capture is written, nothing is captured if empty
+	Path string
+	// Size bounds the ring, in bytes of blocks
+	Size int
+	// Window is how old the packets kept may be, no limit if 0
+	Window time.Duration
+	// Snaplen is how much of each packet is kept
+	Snaplen int
+}
+
+// setCaptureOption sets one of the pcap options on c, it returns false if key
+// is not one of them
+func setCaptureOption(c *captureConfig, key string, value string) (bool, error) {
+	switch key {
+	case "pcap":
+		c.Path = value
+		return true, nil
+	case "pcap-size", "pcap-window", "pcap-snaplen":
+		n, err := strconv.Atoi(value)
+		if err != nil || n <= 0 {
+			return true, fmt.Errorf("invalid value %q", value)
+		}
+		switch key {
+		case "pcap-size":
+			c.Size = n
+		case "pcap-window":
+			c.Window = time.Duration(n) * time.Millisecond
+		case "pcap-snaplen":
+			c.Snaplen = n
+		}
+		return true, nil
+	}
+	return false, nil
+}
+
+// packetCapture is the capture of the packets of a tenant
+type packetCapture struct {
+	path string
+	ring *captureRing
+}
+
+// newPacketCapture returns the capture c asks for, nil if none
+func newPacketCapture(c captureConfig) *packetCapture {
+	if c.Path == "" {
+		return nil
+	}
+	if c.Size <= 0 {
+		c.Size = defaultCaptureSize
+	}
+	if c.Snaplen <= 0 {
+		c.Snaplen = defaultCaptureSnaplen
+	}
+	return &packetCapture{path: c.Path, ring: newCaptureRing(c.Size, c.Window, c.Snaplen)}
+}
+
+// flush writes the capture to its path, replacing the previous one at once
+func (c *packetCapture) flush() error {
+	tmp := c.path + ".tmp"
+	if err := os.WriteFile(tmp, c.ring.pcapng(time.Now()), 0644); err != nil {
+		return err
+	}
+	return os.Rename(tmp, c.path)
+}
+
+// flushCaptures writes the capture of every tenant that has one
+func flushCaptures() {
+	eachTenant(func(t *tenant) {
+		t.flushCapture()
+	})
+}
+
+func (t *tenant) flushCapture() {
+	if t.capture == nil {
+		return
+	}
+	if err := t.capture.flush(); err != nil {
+		fmt.Printf("Error writing the packet capture to %s: %v\n", t.capture.path, err)
+	}
+}
+
+// captureRing keeps the last blocks in buf, which they go around. The blocks
+// are at the positions [tail, head) of the stream of the blocks written.
+type captureRing struct {
+	mu      sync.Mutex
+	buf     []byte
+	window  time.Duration
+	snaplen int
+
+	head, tail uint64
+	// the blocks in the ring, from the oldest at first
+	blocks []captureBlock
+	first  int
+}
+
+type captureBlock struct {
+	size uint64
+	// unix nanoseconds
+	at int64
+}
+
+func newCaptureRing(size int, window time.Duration, snaplen int) *captureRing {
+	return &captureRing{buf: make([]byte, size), window: window, snaplen: snaplen}
+}
+
+func pad4(n int) int {
+	return (n + 3) &^ 3
+}
+
+// evict drops the oldest blocks until size bytes are free, and the ones older
+// than the window
+func (r *captureRing) evict(size uint64, now int64) {
+	for r.first < len(r.blocks) {
+		oldest := r.blocks[r.first]
+		if r.head-r.tail+size <= uint64(len(r.buf)) &&
+			(r.window == 0 || oldest.at >= now-int64(r.window)) {
+			break
+		}
+		r.tail += oldest.size
+		r.first++
+	}
+	// the blocks slice is reused once it's half dead
+	if r.first > 0 && r.first >= len(r.blocks)/2 {
+		n := copy(r.blocks, r.blocks[r.first:])
+		r.blocks = r.blocks[:n]
+		r.first = 0
+	}
+}
+
+// put copies b at the head of the ring
+func (r *captureRing) put(b []byte) {
+	for len(b) > 0 {
+		n := copy(r.buf[r.head%uint64(len(r.buf)):], b)
+		r.head += uint64(n)
+		b = b[n:]
+	}
+}
+
+// add records a packet made of slices, of size bytes in total, that went in
+// (to the stack) or out (to the sandbox) at now
+func (r *captureRing) add(in bool, slices [][]byte, size int, now time.Time) {
+	captured := min(size, r.snaplen)
+	blockSize := pcapngEPBHeaderSize + pad4(captured) + pcapngEPBTrailerSize
+	if blockSize > len(r.buf) {
+		return
+	}
+	le := binary.LittleEndian
+	micros := uint64(now.UnixMicro())
+	var header [pcapngEPBHeaderSize]byte
+	le.PutUint32(header[0:], pcapngEnhancedPacket)
+	le.PutUint32(header[4:], uint32(blockSize))
+	// interface 0
+	le.PutUint32(header[12:], uint32(micros>>32))
+	le.PutUint32(header[16:], uint32(micros))
+	le.PutUint32(header[20:], uint32(captured))
+	le.PutUint32(header[24:], uint32(size))
+	var trailer [pcapngEPBTrailerSize + 3]byte
+	direction := uint32(pcapngDirectionOut)
+	if in {
+		direction = pcapngDirectionIn
+	}
+	padding := pad4(captured) - captured
+	le.PutUint16(trailer[padding:], pcapngOptionEPBFlags)
+	le.PutUint16(trailer[padding+2:], 4)
+	le.PutUint32(trailer[padding+4:], direction)
+	le.PutUint32(trailer[padding+8:], pcapngOptionEnd)
+	le.PutUint32(trailer[padding+12:], uint32(blockSize))
+
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	r.evict(uint64(blockSize), now.UnixNano())
+	r.put(header[:])
+	left := captured
+	for _, s := range slices {
+		if left == 0 {
+			break
+		}
+		s = s[:min(len(s), left)]
+		r.put(s)
+		left -= len(s)
+	}
+	r.put(trailer[:padding+pcapngEPBTrailerSize])
+	r.blocks = append(r.blocks, captureBlock{size: uint64(blockSize), at: now.UnixNano()})
+}
+
+// pcapng returns the packets in the ring at now as a pcapng file
+func (r *captureRing) pcapng(now time.Time) []byte {
+	le := binary.LittleEndian
+	out := make([]byte, 0, pcapngSectionHeadSize+pcapngInterfaceSize)
+	out = le.AppendUint32(out, pcapngSectionHeader)
+	out = le.AppendUint32(out, pcapngSectionHeadSize)
+	out = le.AppendUint32(out, pcapngByteOrderMagic)
+	// version 1.0, and a section of unknown length
+	out = le.AppendUint16(out, 1)
+	out = le.AppendUint16(out, 0)
+	out = le.AppendUint64(out, ^uint64(0))
+	out = le.AppendUint32(out, pcapngSectionHeadSize)
+
+	out = le.AppendUint32(out, pcapngInterface)
+	out = le.AppendUint32(out, pcapngInterfaceSize)
+	out = le.AppendUint16(out, pcapngLinkTypeRaw)
+	out = le.AppendUint16(out, 0)
+	out = le.AppendUint32(out, uint32(r.snaplen))
+	out = le.AppendUint32(out, pcapngInterfaceSize)
+
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	r.evict(0, now.UnixNano())
+	start := int(r.tail % uint64(len(r.buf)))
+	size := int(r.head - r.tail)
+	if start+size <= len(r.buf) {
+		return append(out, r.buf[start:start+size]...)
+	}
+	out = append(out, r.buf[start:]...)
+	return append(out, r.buf[:size-(len(r.buf)-start)]...)
+}
+
+// captureEndpoint records the packets of the link endpoint it wraps in ring
+type captureEndpoint struct {
+	nested.Endpoint
+	ring *captureRing
+}
+
+// wrap returns lower, with its packets captured
+func (c *packetCapture) wrap(lower stack.LinkEndpoint) stack.LinkEndpoint {
+	e := &captureEndpoint{ring: c.ring}
+	e.Endpoint.Init(lower, e)
+	return e
+}
+
+// DeliverNetworkPacket captures the packets of the sandbox
+func (e *captureEndpoint) DeliverNetworkPacket(protocol tcpip.NetworkProtocolNumber, pkt *stack.PacketBuffer) {
+	e.ring.add(true, pkt.AsSlices(), pkt.Size(), time.Now())
+	e.Endpoint.DeliverNetworkPacket(protocol, pkt)
+}
+
+// WritePackets captures the packets to the sandbox
+func (e *captureEndpoint) WritePackets(pkts stack.PacketBufferList) (int, tcpip.Error) {
+	now := time.Now()
+	for _, pkt := range pkts.AsSlice() {
+		e.ring.add(false, pkt.AsSlices(), pkt.Size(), now)
+	}
+	return e.Endpoint.WritePackets(pkts)
+}
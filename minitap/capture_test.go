@@ -0,0 +1,142 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"os"
+	"testing"
+	"time"
+)
+
+type capturedPacket struct {
+	data    []byte
+	size    int
+	inbound bool
+	micros  uint64
+}
+
+// readPcapng returns the packets of a pcapng file as captureRing writes them
+func readPcapng(t *testing.T, data []byte) []capturedPacket {
+	t.Helper()
+	le := binary.LittleEndian
+	var packets []capturedPacket
+	for len(data) > 0 {
+		if len(data) < 12 {
+			t.Fatalf("truncated block: %d bytes", len(data))
+		}
+		kind, size := le.Uint32(data), int(le.Uint32(data[4:]))
+		if size%4 != 0 || size > len(data) || le.Uint32(data[size-4:]) != uint32(size) {
+			t.Fatalf("block %#x of %d bytes, %d left", kind, size, len(data))
+		}
+		block := data[:size]
+		data = data[size:]
+		switch kind {
+		case pcapngSectionHeader:
+			if le.Uint32(block[8:]) != pcapngByteOrderMagic {
+				t.Fatal("byte order magic")
+			}
+		case pcapngInterface:
+			if le.Uint16(block[8:]) != pcapngLinkTypeRaw {
+				t.Fatalf("link type %d", le.Uint16(block[8:]))
+			}
+		case pcapngEnhancedPacket:
+			captured := int(le.Uint32(block[20:]))
+			p := capturedPacket{
+				data:   block[28 : 28+captured],
+				size:   int(le.Uint32(block[24:])),
+				micros: uint64(le.Uint32(block[12:]))<<32 | uint64(le.Uint32(block[16:])),
+			}
+			options := block[28+pad4(captured) : size-4]
+			if le.Uint16(options) != pcapngOptionEPBFlags || le.Uint16(options[2:]) != 4 {
+				t.Fatalf("options % x", options)
+			}
+			p.inbound = le.Uint32(options[4:]) == pcapngDirectionIn
+			packets = append(packets, p)
+		default:
+			t.Fatalf("block type %#x", kind)
+		}
+	}
+	return packets
+}
+
+func TestCaptureRing(t *testing.T) {
+	ring := newCaptureRing(1024, 0, 64)
+	now := time.Unix(1700000000, 123456000)
+	ring.add(true, [][]byte{[]byte("hello "), []byte("world")}, 11, now)
+	ring.add(false, [][]byte{bytes.Repeat([]byte{'x'}, 100)}, 100, now)
+
+	packets := readPcapng(t, ring.pcapng(now))
+	if len(packets) != 2 {
+		t.Fatalf("%d packets", len(packets))
+	}
+	if p := packets[0]; string(p.data) != "hello world" || p.size != 11 || !p.inbound ||
+		p.micros != uint64(now.UnixMicro()) {
+		t.Errorf("first packet %+v", p)
+	}
+	// cut at the snaplen
+	if p := packets[1]; len(p.data) != 64 || p.size != 100 || p.inbound {
+		t.Errorf("second packet: %d bytes of %d, inbound %v", len(p.data), p.size, p.inbound)
+	}
+
+	// the oldest packets make room for the new ones, around the ring
+	for i := 0; i < 100; i++ {
+		ring.add(true, [][]byte{{byte(i)}}, 1, now)
+	}
+	packets = readPcapng(t, ring.pcapng(now))
+	if len(packets) != 1024/48 {
+		t.Fatalf("%d packets in the full ring", len(packets))
+	}
+	for i, p := range packets {
+		if want := byte(100 - len(packets) + i); p.data[0] != want {
+			t.Fatalf("packet %d is %d, want %d", i, p.data[0], want)
+		}
+	}
+}
+
+func TestCaptureRingWindow(t *testing.T) {
+	ring := newCaptureRing(1<<16, time.Second, 1500)
+	start := time.Now()
+	ring.add(true, [][]byte{[]byte("old")}, 3, start)
+	ring.add(true, [][]byte{[]byte("new")}, 3, start.Add(900*time.Millisecond))
+	packets := readPcapng(t, ring.pcapng(start.Add(1500*time.Millisecond)))
+	if len(packets) != 1 || string(packets[0].data) != "new" {
+		t.Errorf("packets %+v", packets)
+	}
+	// a packet larger than the ring is dropped rather than emptying it
+	ring = newCaptureRing(128, 0, 1500)
+	ring.add(true, [][]byte{make([]byte, 200)}, 200, start)
+	if packets := readPcapng(t, ring.pcapng(start)); len(packets) != 0 {
+		t.Errorf("%d packets", len(packets))
+	}
+}
+
+func TestPacketCaptureFlush(t *testing.T) {
+	c := captureConfig{}
+	if newPacketCapture(c) != nil {
+		t.Fatal("capture without a path")
+	}
+	for key, value := range map[string]string{"pcap": t.TempDir() + "/sandbox.pcapng", "pcap-snaplen": "96"} {
+		if ok, err := setCaptureOption(&c, key, value); !ok || err != nil {
+			t.Fatalf("%s=%s: %v, %v", key, value, ok, err)
+		}
+	}
+	if ok, err := setCaptureOption(&c, "pcap-size", "-1"); !ok || err == nil {
+		t.Errorf("negative size: %v, %v", ok, err)
+	}
+	if ok, _ := setCaptureOption(&c, "metrics", "/tmp/x"); ok {
+		t.Error("metrics is a capture option")
+	}
+
+	capture := newPacketCapture(c)
+	capture.ring.add(true, [][]byte{make([]byte, 1500)}, 1500, time.Now())
+	if err := capture.flush(); err != nil {
+		t.Fatal(err)
+	}
+	data, err := os.ReadFile(c.Path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if packets := readPcapng(t, data); len(packets) != 1 || len(packets[0].data) != 96 {
+		t.Errorf("packets %+v", packets)
+	}
+}
@@ -0,0 +1,286 @@
+package main
+
+import (
+	"context"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"net"
+	"net/netip"
+	"os"
+	"strconv"
+	"strings"
+
+	"github.com/miekg/dns"
+)
+
+// The control channel lets mini-tapbox change the firewall of a running
+// sandbox, see MinitapControl in mini_sandbox/src/main/tools/minitap-interface.cc.
+// Each request is a batch of lines, applied all at once or not at all:
+//
+//	allow <IP, subnet, domain or *.domain>
+//	revoke <IP, subnet, domain or *.domain>
+//	max-connections <n>
+//
+// where max-connections starts a new budget of n connections, or lifts it if n
+// is negative. Requests and answers are preceded by their length (u32, little
+// endian), the answer is "ok" or "error: <reason>".
+
+// maxControlMessage bounds the requests, a batch of rules is far smaller
+const maxControlMessage = 1 << 20
+
+// controlFD is the socket of the control channel of defaultTenant, -1 if
+// there is none. A shared minitap gets one with each sandbox.
+var controlFD = -1
+
+// verdictFD is the socket on which the fast-connect supervisor of mini-tapbox
+// asks whether the sandbox may connect to a destination, see
+// mini_sandbox/src/main/tools/fast-connect.h. It uses the framing of the
+// control channel, with requests of a single line "connect <address>:<port>",
+// answered "ok" when the supervisor may connect on behalf of the sandbox.
+// -1 if there is none.
+var verdictFD = -1
+
+// serveControl answers the requests on fd with handle until mini-tapbox closes
+// it
+func serveControl(fd int, handle func(string) error) {
+	conn := os.NewFile(uintptr(fd), "control")
+	defer conn.Close()
+	le := binary.LittleEndian
+	var size [4]byte
+	for {
+		if _, err := io.ReadFull(conn, size[:]); err != nil {
+			if err != io.EOF {
+				verbosef("control channel: %v", err)
+			}
+			return
+		}
+		n := le.Uint32(size[:])
+		if n > maxControlMessage {
+			verbosef("control channel: %d bytes request", n)
+			return
+		}
+		request := make([]byte, n)
+		if _, err := io.ReadFull(conn, request); err != nil {
+			verbosef("control channel: %v", err)
+			return
+		}
+		answer := "ok"
+		if err := handle(string(request)); err != nil {
+			answer = "error: " + strings.ReplaceAll(err.Error(), "\n", " ")
+		}
+		out := le.AppendUint32(nil, uint32(len(answer)))
+		if _, err := conn.Write(append(out, answer...)); err != nil {
+			verbosef("control channel: %v", err)
+			return
+		}
+	}
+}
+
+// controlChange is one allow or revoke line of a request
+type controlChange struct {
+	allow  bool
+	prefix netip.Prefix
+	// set for the domain rules
+	domain string
+	// set for the wildcard rules, to the domain the names are under
+	wildcard string
+}
+
+// applyControl checks every line of request, then applies them in a single
+// update of the policy: connections see either none or all of the changes
+func (t *tenant) applyControl(request string) error {
+	var changes []controlChange
+	maxConnections, setBudget := 0, false
+	for _, line := range strings.Split(request, "\n") {
+		line = strings.TrimSpace(line)
+		if line == "" {
+			continue
+		}
+		command, arg, _ := strings.Cut(line, " ")
+		arg = strings.TrimSpace(arg)
+		switch command {
+		case "allow", "revoke":
+			change := controlChange{allow: command == "allow"}
+			if prefix, ok := parsePrefixRule(arg); ok {
+				change.prefix = prefix.Masked()
+			} else if suffix, ok := parseWildcardRule(arg); ok {
+				change.wildcard = suffix
+			} else if isDomainRule(arg) {
+				change.domain = dns.Fqdn(arg)
+			} else {
+				return fmt.Errorf("invalid rule %q", arg)
+			}
+			changes = append(changes, change)
+		case "max-connections":
+			n, err := strconv.Atoi(arg)
+			if err != nil {
+				return fmt.Errorf("invalid maximum number of connections %q", arg)
+			}
+			maxConnections, setBudget = n, true
+		default:
+			return fmt.Errorf("unknown command %q", command)
+		}
+	}
+	if len(changes) == 0 && !setBudget {
+		return errors.New("empty request")
+	}
+
+	var added []string
+	t.updatePolicy(func(next *firewallPolicy) {
+		if setBudget {
+			next.budget = newConnectionBudget(maxConnections)
+		}
+		prefixesChanged, wildcardsChanged := false, false
+		for _, change := range changes {
+			if change.wildcard != "" {
+				next.wildcardRules = applyWildcardChange(next.wildcardRules, change)
+				wildcardsChanged = true
+			} else if change.domain == "" {
+				next.prefixRules = applyPrefixChange(next.prefixRules, change)
+				prefixesChanged = true
+			} else if change.allow {
+				if _, ok := next.domains[change.domain]; !ok {
+					next.domains[change.domain] = []netip.Addr{}
+					added = append(added, change.domain)
+				}
+			} else if addrs, ok := next.domains[change.domain]; ok {
+				for _, ip := range addrs {
+					if next.ips[ip]--; next.ips[ip] <= 0 {
+						delete(next.ips, ip)
+					}
+				}
+				delete(next.domains, change.domain)
+			}
+			// Revoking every rule denies everything rather than letting
+			// everything through again
+			if change.allow {
+				next.restricted = true
+			}
+		}
+		if prefixesChanged {
+			next.prefixes = buildPrefixTree(next.prefixRules)
+		}
+		if wildcardsChanged {
+			next.wildcards = buildDomainTrie(next.wildcardRules)
+			// the names allowed by revoked wildcards are denied again
+			for name, addrs := range next.matched {
+				if next.wildcards.Match(name) {
+					continue
+				}
+				for _, ip := range addrs {
+					if next.ips[ip]--; next.ips[ip] <= 0 {
+						delete(next.ips, ip)
+					}
+				}
+				delete(next.matched, name)
+			}
+		}
+	})
+	verbosef("control: %d changes, budget %v", len(changes), setBudget)
+
+	if len(added) > 0 {
+		// the new domains are resolved before the sandbox asks for them, and
+		// the answers cached while they were denied count right away
+		for _, domain := range added {
+			if entry := resolverCache.peek(domain); entry != nil && entry.err == nil {
+				t.updateFirewall(domain, entry.ips)
+			}
+		}
+		ctx, cancel := context.WithTimeout(context.Background(), dnsLookupTimeout)
+		defer cancel()
+		resolveDomainNames(ctx, added)
+		startDomainRefresh()
+	}
+	return nil
+}
+
+// isDomainRule checks that rule is a domain name, made of letters, digits,
+// '-' and '_'
+func isDomainRule(rule string) bool {
+	rule = strings.TrimSuffix(rule, ".")
+	if rule == "" || len(rule) > 253 {
+		return false
+	}
+	for _, label := range strings.Split(rule, ".") {
+		if label == "" || len(label) > 63 {
+			return false
+		}
+		for _, c := range label {
+			if !('a' <= c && c <= 'z' || 'A' <= c && c <= 'Z' || '0' <= c && c <= '9' || c == '-' || c == '_') {
+				return false
+			}
+		}
+	}
+	return true
+}
+
+// applyPrefixChange returns a copy of prefixes with change applied, the
+// policies that share prefixes keep seeing it unchanged
+func applyPrefixChange(prefixes []netip.Prefix, change controlChange) []netip.Prefix {
+	out := make([]netip.Prefix, 0, len(prefixes)+1)
+	for _, prefix := range prefixes {
+		if prefix.Masked() != change.prefix {
+			out = append(out, prefix)
+		}
+	}
+	if change.allow {
+		out = append(out, change.prefix)
+	}
+	return out
+}
+
+// checkConnect gives the verdict of the firewall on a connection of the
+// sandbox that would not go through minitap. The allowed ones count in the
+// connection budget as any other.
+func (t *tenant) checkConnect(request string) error {
+	command, arg, _ := strings.Cut(strings.TrimSpace(request), " ")
+	if command != "connect" {
+		return fmt.Errorf("unknown command %q", command)
+	}
+	destination, err := netip.ParseAddrPort(arg)
+	if err != nil {
+		return fmt.Errorf("invalid destination %q", arg)
+	}
+	ip := destination.Addr().Unmap()
+	if servedByMinitap(ip) {
+		return errors.New("served by minitap")
+	}
+	addr := net.TCPAddrFromAddrPort(netip.AddrPortFrom(ip, destination.Port()))
+	if t.inspectByName(addr) {
+		return errors.New("decided by name in minitap")
+	}
+	if !t.firewallConnection(addr) {
+		return errors.New("denied")
+	}
+	return nil
+}
+
+// servedByMinitap tells whether connecting to ip must go through minitap
+// rather than straight to the world: the addresses of the sandbox network, on
+// which minitap answers DNS, and those that only make sense in it
+func servedByMinitap(ip netip.Addr) bool {
+	if ip.IsLoopback() || ip.IsUnspecified() || ip.IsMulticast() ||
+		ip.IsLinkLocalUnicast() || ip.IsInterfaceLocalMulticast() {
+		return true
+	}
+	if subnet, err := netip.ParsePrefix(config.Subnet); err == nil && subnet.Masked().Contains(ip) {
+		return true
+	}
+	return false
+}
+
+// applyWildcardChange returns a copy of suffixes with change applied
+func applyWildcardChange(suffixes []string, change controlChange) []string {
+	out := make([]string, 0, len(suffixes)+1)
+	for _, suffix := range suffixes {
+		if suffix != change.wildcard {
+			out = append(out, suffix)
+		}
+	}
+	if change.allow {
+		out = append(out, change.wildcard)
+	}
+	return out
+}
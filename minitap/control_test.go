@@ -0,0 +1,150 @@
+package main
+
+import (
+	"encoding/binary"
+	"io"
+	"net"
+	"net/netip"
+	"os"
+	"sync"
+	"syscall"
+	"testing"
+)
+
+// control sends request on conn as mini-tapbox does and returns the answer
+func control(t *testing.T, conn *os.File, request string) string {
+	t.Helper()
+	le := binary.LittleEndian
+	if _, err := conn.Write(append(le.AppendUint32(nil, uint32(len(request))), request...)); err != nil {
+		t.Fatal(err)
+	}
+	var size [4]byte
+	if _, err := io.ReadFull(conn, size[:]); err != nil {
+		t.Fatal(err)
+	}
+	answer := make([]byte, le.Uint32(size[:]))
+	if _, err := io.ReadFull(conn, answer); err != nil {
+		t.Fatal(err)
+	}
+	return string(answer)
+}
+
+func TestControlRules(t *testing.T) {
+	resetFirewall(t, -1, []string{"10.0.0.0/8"}, []string{"allowed.test."})
+	fds, err := syscall.Socketpair(syscall.AF_UNIX, syscall.SOCK_STREAM, 0)
+	if err != nil {
+		t.Fatal(err)
+	}
+	conn := os.NewFile(uintptr(fds[0]), "control")
+	defer conn.Close()
+	go serveControl(fds[1], defaultTenant.applyControl)
+
+	allowed := func(ip string) bool {
+		return defaultTenant.firewallConnection(&net.TCPAddr{IP: net.ParseIP(ip), Port: 443})
+	}
+	if allowed("192.0.2.1") || !allowed("10.1.2.3") {
+		t.Fatal("wrong verdict before any update")
+	}
+	if answer := control(t, conn, "allow 192.0.2.0/24\nrevoke 10.0.0.0/8\n"); answer != "ok" {
+		t.Fatalf("update answered %q", answer)
+	}
+	if !allowed("192.0.2.1") || allowed("10.1.2.3") {
+		t.Error("update not applied")
+	}
+
+	// a batch with an invalid line changes nothing
+	if answer := control(t, conn, "allow 198.51.100.1\nallow not a rule"); answer == "ok" {
+		t.Error("invalid rule accepted")
+	}
+	if allowed("198.51.100.1") {
+		t.Error("part of a rejected batch applied")
+	}
+
+	defaultTenant.updateFirewall("allowed.test", []net.IP{net.IPv4(203, 0, 113, 1)})
+	if !allowed("203.0.113.1") {
+		t.Fatal("address of allowed.test denied")
+	}
+	if answer := control(t, conn, "revoke allowed.test\nrevoke 192.0.2.0/24"); answer != "ok" {
+		t.Fatalf("revoke answered %q", answer)
+	}
+	if allowed("203.0.113.1") || defaultTenant.firewallDns("allowed.test") || allowed("192.0.2.1") {
+		t.Error("revoked rules still allowed")
+	}
+	if cur := defaultTenant.policy.Load(); len(cur.ips) != 0 || !cur.restricted {
+		t.Errorf("policy after revoking everything: %d addresses, restricted %v", len(cur.ips), cur.restricted)
+	}
+}
+
+func TestControlMaxConnections(t *testing.T) {
+	resetFirewall(t, 1, nil, nil)
+	destination := &net.TCPAddr{IP: net.IPv4(192, 0, 2, 1), Port: 80}
+	if !defaultTenant.firewallConnection(destination) || defaultTenant.firewallConnection(destination) {
+		t.Fatal("wrong number of connections allowed")
+	}
+
+	// a new budget is applied at once, for connections racing with it
+	var wg sync.WaitGroup
+	for i := 0; i < 8; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for j := 0; j < 100; j++ {
+				defaultTenant.firewallConnection(destination)
+			}
+		}()
+	}
+	if err := defaultTenant.applyControl("max-connections 3"); err != nil {
+		t.Fatal(err)
+	}
+	wg.Wait()
+	budget := defaultTenant.policy.Load().budget
+	if budget == nil || budget.max != 3 || budget.used.Load() > 3 {
+		t.Fatalf("budget after the update: %+v", budget)
+	}
+
+	if err := defaultTenant.applyControl("max-connections -1"); err != nil {
+		t.Fatal(err)
+	}
+	if !defaultTenant.firewallConnection(destination) || !defaultTenant.firewallDns("example.com") {
+		t.Error("connection denied without a budget nor rules")
+	}
+	for _, request := range []string{"", "max-connections many", "deny 192.0.2.1"} {
+		if err := defaultTenant.applyControl(request); err == nil {
+			t.Errorf("request %q accepted", request)
+		}
+	}
+	if defaultTenant.policy.Load().prefixes.Contains(netip.MustParseAddr("192.0.2.1")) {
+		t.Error("rejected request applied")
+	}
+}
+
+func TestControlConnect(t *testing.T) {
+	resetFirewall(t, 2, []string{"192.0.2.0/24", "2001:db8::/32"}, nil)
+	subnet := config.Subnet
+	config.Subnet = "10.1.1.100/24"
+	t.Cleanup(func() { config.Subnet = subnet })
+
+	for _, test := range []struct {
+		request string
+		allowed bool
+	}{
+		{"connect 192.0.2.1:443", true},
+		{"connect [2001:db8::1]:80", true},
+		{"connect [::ffff:192.0.2.1]:443", false}, // over the budget
+		{"connect 198.51.100.1:443", false},
+		{"connect 10.1.1.1:53", false},
+		{"connect 127.0.0.1:8080", false},
+		{"connect 192.0.2.1", false},
+		{"allow 192.0.2.1", false},
+	} {
+		if err := defaultTenant.checkConnect(test.request); (err == nil) != test.allowed {
+			t.Errorf("defaultTenant.checkConnect(%q) = %v", test.request, err)
+		}
+	}
+	if err := defaultTenant.applyControl("max-connections -1"); err != nil {
+		t.Fatal(err)
+	}
+	if err := defaultTenant.checkConnect("connect [::ffff:192.0.2.1]:443"); err != nil {
+		t.Errorf("IPv4-mapped destination: %v", err)
+	}
+}
@@ -5,13 +5,12 @@ import (
 	"fmt"
 	"io"
 	"net"
+	"net/netip"
 	"strings"
 
 	"github.com/miekg/dns"
 )
 
-var domainMap = make(map[string][]string)
-
 // dnsCall is a summary of a dns request/response exposed to the application level observers
 type dnsCall struct {
 	queries []dnsQuery
@@ -48,7 +47,7 @@ func (p dnsPairA) Answers() []string {
 }
 
 // handle a DNS query payload here is the application-level UDP payload
-func handleDNS(ctx context.Context, w io.Writer, payload []byte) {
+func (t *tenant) handleDNS(ctx context.Context, w io.Writer, payload []byte) {
 	var req dns.Msg
 	err := req.Unpack(payload)
 	if err != nil {
@@ -63,7 +62,7 @@ func handleDNS(ctx context.Context, w io.Writer, payload []byte) {
 	verbosef("DNS query  sending a response with empty answer %s", req)
 
 	// resolve the query
-	rrs, err := handleDNSQuery(ctx, &req)
+	rrs, err := t.handleDNSQuery(ctx, &req)
 	if err != nil {
 		verbosef("DNS query returned: %v, sending a response with empty answer", err)
 		// do not abort here, continue on and send a reply with no answer
@@ -73,8 +72,8 @@ func handleDNS(ctx context.Context, w io.Writer, payload []byte) {
 	resp.SetReply(&req)
 	resp.Answer = rrs
 
-	// serialize the response
-	buf, err := resp.Pack()
+	// serialize the response, into the buffer of the query when it fits
+	buf, err := resp.PackBuffer(payload[:cap(payload)])
 	if err != nil {
 		errorf("error serializing dns response: %v, abandoning...", err)
 		return
@@ -294,16 +293,25 @@ func setUpstreamDNS() {
 		}
 	}
 	verbosef("Using %s as DNS (search=%v ndots=%d)", upstreamDNS, searchDomains, ndots)
+}
+
+// allowUpstreamDNS lets the sandbox of t reach the upstream DNS server, once
+// setUpstreamDNS found it
+func (t *tenant) allowUpstreamDNS() {
 	if host, _, err := net.SplitHostPort(upstreamDNS); err == nil {
-		allowedIps[host] = 1
+		if addr, err := netip.ParseAddr(host); err == nil {
+			t.updatePolicy(func(next *firewallPolicy) {
+				next.ips[addr.Unmap()]++
+			})
+		}
 	}
 }
 
-// lookupWithSearch resolves name using net.DefaultResolver, applying the
+// lookupWithSearch resolves name using lookupIPs, applying the
 // search list from /etc/resolv.conf per standard ndots semantics. It returns
-// the candidate that actually resolved, its IPs, and any error from the last
-// failed attempt.
-func lookupWithSearch(ctx context.Context, name string) (string, []net.IP, error) {
+// the candidate that actually resolved, its IPs and their TTL, and any error
+// from the last failed attempt.
+func lookupWithSearch(ctx context.Context, name string) (string, []net.IP, uint32, error) {
 	stripped := strings.TrimSuffix(name, ".")
 	dotCount := strings.Count(stripped, ".")
 
@@ -327,22 +335,22 @@ func lookupWithSearch(ctx context.Context, name string) (string, []net.IP, error
 
 	var lastErr error
 	for _, cand := range candidates {
-		ips, err := net.DefaultResolver.LookupIP(ctx, "ip4", cand)
+		ips, ttl, err := lookupIPs(ctx, cand)
 		if err == nil {
-			return cand, ips, nil
+			return cand, ips, ttl, nil
 		}
 		lastErr = err
 	}
-	return name, nil, lastErr
+	return name, nil, 0, lastErr
 }
 
-// handleDNSQuery answers DNS queries according to:
-//
-//	net.DefaultResolver if the DNS request is A or AAAA
-//	cloudflare DNS for other DNS requests
-//
+// handleDNSQuery answers A and AAAA queries from resolverCache, which
+// resolves both with the upstream DNS server the first time and whenever their
+// TTL expires. Other DNS requests get an empty answer (NODATA) right away, so
+// that clients move on instead of waiting for a retry, and so do AAAA queries
+// when the sandbox has no IPv6 route.
 
-func handleDNSQuery(ctx context.Context, req *dns.Msg) ([]dns.RR, error) {
+func (t *tenant) handleDNSQuery(ctx context.Context, req *dns.Msg) ([]dns.RR, error) {
 
 	if len(req.Question) == 0 {
 		return nil, nil // this means no answer, no error, which is fine
@@ -357,37 +365,42 @@ func handleDNSQuery(ctx context.Context, req *dns.Msg) ([]dns.RR, error) {
 
 	// handle the request ourselves
 	switch question.Qtype {
-	case dns.TypeA:
-		if !firewallDns(question.Name) {
+	case dns.TypeA, dns.TypeAAAA:
+		if !t.firewallDns(question.Name) {
+			t.metrics.dnsDenied.Add(1)
 			return nil, fmt.Errorf("Request denied by custom firewall")
 		}
-		resolvedName, ips, err := lookupWithSearch(ctx, question.Name)
-		if err != nil {
-			return nil, fmt.Errorf("for an A record the default resolver said: %w", err)
+		if question.Qtype == dns.TypeAAAA && !t.ipv6 {
+			// the sandbox would try the IPv6 addresses first, and fail
+			verbosef("no ipv6 in the sandbox, answering with no data")
+			return nil, nil
 		}
+		entry := resolverCache.lookup(ctx, question.Name)
+		if entry.err != nil {
+			t.metrics.dnsFailed.Add(1)
+			return nil, fmt.Errorf("for an %v record the resolver said: %w", questionType, entry.err)
+		}
+		if t.policy.Load().restricted {
+			// a cached answer was not handed to this firewall if it was looked
+			// up for another sandbox or before a rule allowed the name
+			t.updateFirewall(question.Name, entry.ips)
+		}
+		t.metrics.dnsAnswered.Add(1)
+		t.metrics.resolved(question.Name, entry.ips)
 		call.queries = append(call.queries, dnsPairA{
-			typ:     dns.TypeA,
+			typ:     question.Qtype,
 			query:   question.Name,
-			answers: ips,
+			answers: entry.ips,
 		})
 
-		if resolvedName != question.Name {
-			verbosef("resolved %v (as %v) to %v with default resolver", question.Name, resolvedName, ips)
+		if entry.resolvedName != question.Name {
+			verbosef("resolved %v (as %v) to %v", question.Name, entry.resolvedName, entry.ips)
 		} else {
-			verbosef("resolved %v to %v with default resolver", question.Name, ips)
-		}
-
-		var rrs []dns.RR
-		for _, ip := range ips {
-			rr, err := dns.NewRR(fmt.Sprintf("%s A %s", question.Name, ip))
-			if err != nil {
-				return nil, fmt.Errorf("error constructing rr: %w", err)
-			}
-			rrs = append(rrs, rr)
+			verbosef("resolved %v to %v", question.Name, entry.ips)
 		}
-		updateFirewall(question.Name, ips)
 
-		return rrs, nil
+		return answerIPs(question.Name, question.Qtype, entry), nil
 	}
-	return nil, fmt.Errorf("Not an A request")
+	verbosef("not an A or AAAA request, answering with no data")
+	return nil, nil
 }
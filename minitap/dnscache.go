@@ -0,0 +1,311 @@
+package main
+
+import (
+	"context"
+	"net"
+	"sync"
+	"time"
+
+	"github.com/miekg/dns"
+)
+
+const (
+	// TTL given to answers that don't come with one, i.e., from net.DefaultResolver
+	dnsDefaultTTL = 60
+	// Failed lookups are not retried before this many seconds
+	dnsNegativeTTL = 5
+	// Answers are kept at least this long, even with a TTL of 0
+	dnsMinTTL = 1
+	// Allowed domains are resolved again when less than 1/dnsRefreshFraction of
+	// their TTL is left
+	dnsRefreshFraction = 10
+	dnsRefreshPeriod   = time.Second
+	dnsLookupTimeout   = 5 * time.Second
+)
+
+// dnsCacheEntry is the outcome of the A and AAAA lookups of a name
+type dnsCacheEntry struct {
+	// the name that actually resolved, after applying the search list
+	resolvedName string
+	// IPv4 and IPv6 addresses, an A or AAAA query answers with its own
+	ips     []net.IP
+	ttl     uint32
+	expires time.Time
+	err     error
+}
+
+// remainingTTL is the TTL to hand out for the entry at time now
+func (e *dnsCacheEntry) remainingTTL(now time.Time) uint32 {
+	left := e.expires.Sub(now) / time.Second
+	if left < dnsMinTTL {
+		return dnsMinTTL
+	}
+	return uint32(left)
+}
+
+// dnsLookup is a lookup in flight, shared by everyone asking for the same name
+type dnsLookup struct {
+	done  chan struct{}
+	entry *dnsCacheEntry
+}
+
+// dnsCache caches A and AAAA lookups for as long as their TTL and runs at most one
+// lookup per name at a time
+type dnsCache struct {
+	mu       sync.Mutex
+	entries  map[string]*dnsCacheEntry
+	inflight map[string]*dnsLookup
+	// resolve looks a name up, lookupWithSearch but in the tests
+	resolve func(ctx context.Context, name string) (string, []net.IP, uint32, error)
+}
+
+func newDNSCache(resolve func(ctx context.Context, name string) (string, []net.IP, uint32, error)) *dnsCache {
+	return &dnsCache{
+		entries:  make(map[string]*dnsCacheEntry),
+		inflight: make(map[string]*dnsLookup),
+		resolve:  resolve,
+	}
+}
+
+var resolverCache = newDNSCache(lookupWithSearch)
+
+// lookup returns the cached answer for name or resolves it, waiting for a
+// lookup of the same name already in flight rather than starting another one
+func (c *dnsCache) lookup(ctx context.Context, name string) *dnsCacheEntry {
+	c.mu.Lock()
+	if entry, ok := c.entries[name]; ok && time.Now().Before(entry.expires) {
+		c.mu.Unlock()
+		return entry
+	}
+	l := c.start(name)
+	c.mu.Unlock()
+
+	select {
+	case <-l.done:
+		return l.entry
+	case <-ctx.Done():
+		return &dnsCacheEntry{resolvedName: name, err: ctx.Err()}
+	}
+}
+
+// refresh resolves name again in the background, unless it's already being
+// resolved
+func (c *dnsCache) refresh(name string) {
+	c.mu.Lock()
+	if _, ok := c.inflight[name]; !ok {
+		c.start(name)
+	}
+	c.mu.Unlock()
+}
+
+// peek returns the cached entry for name, even if expired, or nil
+func (c *dnsCache) peek(name string) *dnsCacheEntry {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	return c.entries[name]
+}
+
+// start must be called with c.mu held
+func (c *dnsCache) start(name string) *dnsLookup {
+	if l, ok := c.inflight[name]; ok {
+		return l
+	}
+	l := &dnsLookup{done: make(chan struct{})}
+	c.inflight[name] = l
+	// The lookup outlives the caller that triggered it, so it has its own
+	// timeout
+	go func() {
+		ctx, cancel := context.WithTimeout(context.Background(), dnsLookupTimeout)
+		defer cancel()
+		entry := &dnsCacheEntry{}
+		entry.resolvedName, entry.ips, entry.ttl, entry.err = c.resolve(ctx, name)
+		if entry.err != nil {
+			entry.ttl = dnsNegativeTTL
+		} else if entry.ttl < dnsMinTTL {
+			entry.ttl = dnsMinTTL
+		}
+		entry.expires = time.Now().Add(time.Duration(entry.ttl) * time.Second)
+		if entry.err == nil {
+			updateTenants(name, entry.ips)
+		}
+
+		c.mu.Lock()
+		c.entries[name] = entry
+		delete(c.inflight, name)
+		c.mu.Unlock()
+		l.entry = entry
+		close(l.done)
+	}()
+	return l
+}
+
+// lookupIPs resolves the A and AAAA records of name, exactly as given, with
+// the shortest TTL of the answers. Both queries go to the upstream server at
+// once, directly since net.DefaultResolver doesn't tell TTLs, and fall back to
+// net.DefaultResolver (e.g., for names only in /etc/hosts).
+func lookupIPs(ctx context.Context, name string) ([]net.IP, uint32, error) {
+	var answers [2]struct {
+		ips []net.IP
+		ttl uint32
+	}
+	var wg sync.WaitGroup
+	for i, qtype := range []uint16{dns.TypeA, dns.TypeAAAA} {
+		wg.Add(1)
+		go func(i int, qtype uint16) {
+			defer wg.Done()
+			answers[i].ips, answers[i].ttl = lookupUpstream(ctx, name, qtype)
+		}(i, qtype)
+	}
+	wg.Wait()
+
+	var ips []net.IP
+	var ttl uint32
+	for _, answer := range answers {
+		if len(answer.ips) == 0 {
+			continue
+		}
+		if len(ips) == 0 || answer.ttl < ttl {
+			ttl = answer.ttl
+		}
+		ips = append(ips, answer.ips...)
+	}
+	if len(ips) > 0 {
+		return ips, ttl, nil
+	}
+
+	ips, err := net.DefaultResolver.LookupIP(ctx, "ip", name)
+	if err != nil {
+		return nil, 0, err
+	}
+	return ips, dnsDefaultTTL, nil
+}
+
+// lookupUpstream asks the upstream server for the qtype (A or AAAA) records of
+// name, nothing if it fails
+func lookupUpstream(ctx context.Context, name string, qtype uint16) ([]net.IP, uint32) {
+	var req dns.Msg
+	req.SetQuestion(name, qtype)
+	client := dns.Client{Net: "udp"}
+	resp, _, err := client.ExchangeContext(ctx, &req, upstreamDNS)
+	if err == nil && resp.Truncated {
+		client.Net = "tcp"
+		resp, _, err = client.ExchangeContext(ctx, &req, upstreamDNS)
+	}
+	if err != nil || resp.Rcode != dns.RcodeSuccess {
+		return nil, 0
+	}
+	var ips []net.IP
+	var ttl uint32
+	for i, rr := range resp.Answer {
+		// the TTL of a CNAME on the way counts as well
+		if i == 0 || rr.Header().Ttl < ttl {
+			ttl = rr.Header().Ttl
+		}
+		switch rr := rr.(type) {
+		case *dns.A:
+			ips = append(ips, rr.A)
+		case *dns.AAAA:
+			ips = append(ips, rr.AAAA)
+		}
+	}
+	return ips, ttl
+}
+
+// resolveDomainNames makes sure that the IPs of all the domains are in the
+// firewall. Domains resolved and not expired yet cost nothing, the others are
+// resolved concurrently.
+func resolveDomainNames(ctx context.Context, domains []string) {
+	var wg sync.WaitGroup
+	for _, domain := range domains {
+		wg.Add(1)
+		go func(domain string) {
+			defer wg.Done()
+			resolverCache.lookup(ctx, domain)
+		}(domain)
+	}
+	wg.Wait()
+}
+
+// updateTenants hands the addresses name resolved to to the firewall of the
+// tenants that allow it
+func updateTenants(name string, ips []net.IP) {
+	fqdn := dns.Fqdn(name)
+	eachTenant(func(t *tenant) {
+		if t.policy.Load().allowsDomain(fqdn) {
+			t.updateFirewall(name, ips)
+		}
+	})
+}
+
+// allowedDomains returns the domains allowed by any tenant
+func allowedDomains() []string {
+	seen := make(map[string]bool)
+	var domains []string
+	eachTenant(func(t *tenant) {
+		for _, domain := range t.allowedDomains() {
+			if !seen[domain] {
+				seen[domain] = true
+				domains = append(domains, domain)
+			}
+		}
+	})
+	return domains
+}
+
+// refreshDomainNames resolves the allowed domains again shortly before their
+// answers expire, so that neither the connections nor the DNS queries of the
+// sandboxes have to wait for the upstream server. The domains allowed later on
+// (see control.go) are resolved by whoever allows them.
+func refreshDomainNames() {
+	for _, domain := range allowedDomains() {
+		resolverCache.refresh(domain)
+	}
+	for now := range time.Tick(dnsRefreshPeriod) {
+		resolverCache.refreshAhead(now, allowedDomains())
+	}
+}
+
+// refreshAhead resolves again the domains whose answers expire soon, and drops
+// the expired answers for the other names, which are only resolved again if
+// they are asked for
+func (c *dnsCache) refreshAhead(now time.Time, domains []string) {
+	allowed := make(map[string]bool, len(domains))
+	for _, domain := range domains {
+		allowed[domain] = true
+	}
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	for name, entry := range c.entries {
+		if !allowed[name] {
+			if !now.Before(entry.expires) {
+				delete(c.entries, name)
+			}
+			continue
+		}
+		ahead := time.Duration(entry.ttl) * time.Second / dnsRefreshFraction
+		if ahead < dnsRefreshPeriod {
+			ahead = dnsRefreshPeriod
+		}
+		if entry.expires.Sub(now) <= ahead {
+			verbosef("refreshing %s, TTL %d", name, entry.ttl)
+			c.start(name)
+		}
+	}
+}
+
+// answerIPs builds the answer to an A or AAAA query for name from the cache.
+// It's empty when the name has no address of that family (NODATA).
+func answerIPs(name string, qtype uint16, entry *dnsCacheEntry) []dns.RR {
+	header := dns.RR_Header{Name: name, Rrtype: qtype, Class: dns.ClassINET, Ttl: entry.remainingTTL(time.Now())}
+	var rrs []dns.RR
+	for _, ip := range entry.ips {
+		ip4 := ip.To4()
+		switch {
+		case qtype == dns.TypeA && ip4 != nil:
+			rrs = append(rrs, &dns.A{Hdr: header, A: ip4})
+		case qtype == dns.TypeAAAA && ip4 == nil:
+			rrs = append(rrs, &dns.AAAA{Hdr: header, AAAA: ip})
+		}
+	}
+	return rrs
+}
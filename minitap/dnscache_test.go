@@ -0,0 +1,215 @@
+package main
+
+import (
+	"context"
+	"errors"
+	"net"
+	"strings"
+	"sync"
+	"testing"
+	"time"
+
+	"github.com/miekg/dns"
+)
+
+func TestAnswerIPs(t *testing.T) {
+	entry := &dnsCacheEntry{
+		ips:     []net.IP{net.IPv4(192, 0, 2, 1), net.ParseIP("2001:db8::1"), net.IPv4(192, 0, 2, 2).To4()},
+		expires: time.Now().Add(time.Minute),
+	}
+	for qtype, want := range map[uint16][]string{
+		dns.TypeA:    {"192.0.2.1", "192.0.2.2"},
+		dns.TypeAAAA: {"2001:db8::1"},
+	} {
+		rrs := answerIPs("example.com.", qtype, entry)
+		if len(rrs) != len(want) {
+			t.Fatalf("%s answer: %v", dnsTypeCode(qtype), rrs)
+		}
+		for i, rr := range rrs {
+			var ip net.IP
+			switch rr := rr.(type) {
+			case *dns.A:
+				ip = rr.A
+			case *dns.AAAA:
+				ip = rr.AAAA
+			}
+			if rr.Header().Rrtype != qtype || ip.String() != want[i] {
+				t.Errorf("%s answer %d: %v", dnsTypeCode(qtype), i, rr)
+			}
+		}
+	}
+
+	// NODATA for a name with IPv4 addresses only
+	entry.ips = entry.ips[:1]
+	if rrs := answerIPs("example.com.", dns.TypeAAAA, entry); len(rrs) != 0 {
+		t.Errorf("AAAA answer without IPv6 addresses: %v", rrs)
+	}
+}
+
+// fakeUpstream answers name with 192.0.2.<n>, n the number of lookups of name
+// so far, and fails the names under "fail.". Lookups wait for release, if set.
+type fakeUpstream struct {
+	mu      sync.Mutex
+	lookups map[string]int
+	ttl     uint32
+	release chan struct{}
+}
+
+func newFakeUpstream(ttl uint32) *fakeUpstream {
+	return &fakeUpstream{lookups: make(map[string]int), ttl: ttl}
+}
+
+func (f *fakeUpstream) resolve(ctx context.Context, name string) (string, []net.IP, uint32, error) {
+	if f.release != nil {
+		<-f.release
+	}
+	f.mu.Lock()
+	defer f.mu.Unlock()
+	f.lookups[name]++
+	if strings.HasPrefix(name, "fail.") {
+		return name, nil, 0, errors.New("no such host")
+	}
+	return name, []net.IP{net.IPv4(192, 0, 2, byte(f.lookups[name]))}, f.ttl, nil
+}
+
+func (f *fakeUpstream) count(name string) int {
+	f.mu.Lock()
+	defer f.mu.Unlock()
+	return f.lookups[name]
+}
+
+// settle waits for the lookup of name in flight in c, if any
+func settle(c *dnsCache, name string) {
+	c.mu.Lock()
+	l := c.inflight[name]
+	c.mu.Unlock()
+	if l != nil {
+		<-l.done
+	}
+}
+
+// expire makes the entry of name in c expire at when
+func expire(c *dnsCache, name string, when time.Time) {
+	c.mu.Lock()
+	c.entries[name].expires = when
+	c.mu.Unlock()
+}
+
+func TestDNSCacheTTL(t *testing.T) {
+	upstream := newFakeUpstream(0)
+	c := newDNSCache(upstream.resolve)
+	ctx := context.Background()
+
+	first := c.lookup(ctx, "a.example.")
+	if first.err != nil || len(first.ips) != 1 || first.ttl != dnsMinTTL {
+		t.Fatalf("first lookup: %+v", first)
+	}
+	if again := c.lookup(ctx, "a.example."); again != first || upstream.count("a.example.") != 1 {
+		t.Errorf("not served from the cache: %+v, %d lookups", again, upstream.count("a.example."))
+	}
+	expire(c, "a.example.", time.Now().Add(-time.Millisecond))
+	if again := c.lookup(ctx, "a.example."); again == first || !again.ips[0].Equal(net.IPv4(192, 0, 2, 2)) {
+		t.Errorf("expired answer served: %+v", again)
+	}
+
+	// failures are cached as well, for dnsNegativeTTL
+	failed := c.lookup(ctx, "fail.example.")
+	if failed.err == nil || failed.ttl != dnsNegativeTTL {
+		t.Fatalf("failed lookup: %+v", failed)
+	}
+	if again := c.lookup(ctx, "fail.example."); again != failed || upstream.count("fail.example.") != 1 {
+		t.Errorf("failure not cached: %+v, %d lookups", again, upstream.count("fail.example."))
+	}
+}
+
+func TestDNSCacheCoalescing(t *testing.T) {
+	upstream := newFakeUpstream(60)
+	upstream.release = make(chan struct{})
+	c := newDNSCache(upstream.resolve)
+
+	entries := make([]*dnsCacheEntry, 16)
+	var wg sync.WaitGroup
+	for i := range entries {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			entries[i] = c.lookup(context.Background(), "a.example.")
+		}(i)
+	}
+	// a caller that gives up doesn't cancel the lookup of the others
+	ctx, cancel := context.WithTimeout(context.Background(), 10*time.Millisecond)
+	defer cancel()
+	if entry := c.lookup(ctx, "a.example."); !errors.Is(entry.err, context.DeadlineExceeded) {
+		t.Errorf("lookup past its deadline: %+v", entry)
+	}
+	close(upstream.release)
+	wg.Wait()
+	for i, entry := range entries {
+		if entry != entries[0] || entry.err != nil {
+			t.Errorf("lookup %d: %+v", i, entry)
+		}
+	}
+	if n := upstream.count("a.example."); n != 1 {
+		t.Errorf("%d lookups for concurrent queries", n)
+	}
+}
+
+func TestDNSCacheRefreshAhead(t *testing.T) {
+	upstream := newFakeUpstream(60)
+	c := newDNSCache(upstream.resolve)
+	ctx := context.Background()
+	names := []string{"soon.example.", "later.example.", "old.example.", "fresh.example."}
+	for _, name := range names {
+		c.lookup(ctx, name)
+	}
+	now := time.Now()
+	// within the last tenth of its TTL
+	expire(c, "soon.example.", now.Add(5*time.Second))
+	expire(c, "later.example.", now.Add(30*time.Second))
+	expire(c, "old.example.", now.Add(-time.Second))
+
+	c.refreshAhead(now, []string{"soon.example.", "later.example."})
+	settle(c, "soon.example.")
+	for name, want := range map[string]int{"soon.example.": 2, "later.example.": 1} {
+		if n := upstream.count(name); n != want {
+			t.Errorf("%d lookups of %s, want %d", n, name, want)
+		}
+	}
+	if entry := c.peek("soon.example."); !entry.ips[0].Equal(net.IPv4(192, 0, 2, 2)) {
+		t.Errorf("refreshed answer: %+v", entry)
+	}
+
+	// the expired answers of names that aren't allowed are dropped
+	if c.peek("old.example.") != nil {
+		t.Error("expired answer kept")
+	}
+	if c.peek("fresh.example.") == nil {
+		t.Error("fresh answer dropped")
+	}
+	expire(c, "later.example.", now.Add(-time.Second))
+	c.refreshAhead(now, []string{"later.example."})
+	settle(c, "later.example.")
+	if c.peek("later.example.") == nil || upstream.count("later.example.") != 2 {
+		t.Errorf("expired allowed domain not refreshed, %d lookups", upstream.count("later.example."))
+	}
+	c.mu.Lock()
+	n := len(c.entries)
+	c.mu.Unlock()
+	if want := len(names) - 1; n != want {
+		t.Errorf("%d entries, want %d", n, want)
+	}
+}
+
+func TestAAAAWithoutIPv6(t *testing.T) {
+	sandbox := newTenant()
+	defer sandbox.remove()
+	var req dns.Msg
+	req.SetQuestion("ipv6-less.example.", dns.TypeAAAA)
+	rrs, err := sandbox.handleDNSQuery(context.Background(), &req)
+	if err != nil || len(rrs) != 0 {
+		t.Errorf("AAAA answer without IPv6: %v, %v", rrs, err)
+	}
+	if resolverCache.peek("ipv6-less.example.") != nil {
+		t.Error("looked up for an AAAA query without IPv6")
+	}
+}
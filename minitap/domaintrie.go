@@ -0,0 +1,100 @@
+package main
+
+import (
+	"strings"
+
+	"github.com/miekg/dns"
+)
+
+// domainTrie holds the wildcard domain rules (*.example.com) by their labels,
+// from the top level domain down. Matching a name walks one node per label of
+// the name whatever the number of rules, and doesn't allocate for names in
+// lower case.
+type domainTrie struct {
+	root domainNode
+	size int
+}
+
+type domainNode struct {
+	children map[string]*domainNode
+	// there is a rule for the names below this node
+	wildcard bool
+}
+
+// parseWildcardRule returns the domain under which rule allows every name,
+// e.g. "example.com." for "*.example.com"
+func parseWildcardRule(rule string) (string, bool) {
+	suffix, ok := strings.CutPrefix(rule, "*.")
+	if !ok || !isDomainRule(suffix) {
+		return "", false
+	}
+	return dns.Fqdn(strings.ToLower(suffix)), true
+}
+
+// Insert adds the rule allowing the names below suffix
+func (t *domainTrie) Insert(suffix string) {
+	node := &t.root
+	forEachLabel(suffix, func(label string, last bool) bool {
+		child := node.children[label]
+		if child == nil {
+			if node.children == nil {
+				node.children = make(map[string]*domainNode)
+			}
+			child = &domainNode{}
+			node.children[label] = child
+		}
+		node = child
+		return true
+	})
+	if !node.wildcard {
+		node.wildcard = true
+		t.size++
+	}
+}
+
+// Match tells whether a rule allows name, which has to be strictly below the
+// domain of the rule: *.example.com allows www.example.com and
+// a.b.example.com, not example.com.
+func (t *domainTrie) Match(name string) bool {
+	if t == nil || t.size == 0 {
+		return false
+	}
+	node := &t.root
+	matched := false
+	forEachLabel(strings.ToLower(name), func(label string, last bool) bool {
+		if node = node.children[label]; node == nil || last {
+			return false
+		}
+		matched = node.wildcard
+		return !matched
+	})
+	return matched
+}
+
+func (t *domainTrie) Len() int {
+	if t == nil {
+		return 0
+	}
+	return t.size
+}
+
+// forEachLabel calls f with the labels of name from the last one, until it
+// returns false. last is set for the first label of name.
+func forEachLabel(name string, f func(label string, last bool) bool) {
+	end := len(strings.TrimSuffix(name, "."))
+	for end > 0 {
+		start := strings.LastIndexByte(name[:end], '.') + 1
+		if !f(name[start:end], start == 0) || start == 0 {
+			return
+		}
+		end = start - 1
+	}
+}
+
+func buildDomainTrie(suffixes []string) *domainTrie {
+	trie := &domainTrie{}
+	for _, suffix := range suffixes {
+		trie.Insert(suffix)
+	}
+	return trie
+}
@@ -0,0 +1,107 @@
+package main
+
+import (
+	"fmt"
+	"math/rand"
+	"net"
+	"testing"
+)
+
+func TestDomainTrie(t *testing.T) {
+	trie := buildDomainTrie([]string{"example.com.", "svc.internal.test.", "org."})
+	for name, want := range map[string]bool{
+		"www.example.com.":       true,
+		"a.b.example.com":        true,
+		"WWW.Example.COM.":       true,
+		"example.com.":           false,
+		"badexample.com.":        false,
+		"example.com.evil.test.": false,
+		"x.svc.internal.test.":   true,
+		"internal.test.":         false,
+		"other.internal.test.":   false,
+		"wikipedia.org.":         true,
+		"org.":                   false,
+		"":                       false,
+		".":                      false,
+	} {
+		if got := trie.Match(name); got != want {
+			t.Errorf("Match(%q) = %v, want %v", name, got, want)
+		}
+	}
+	if trie.Len() != 3 {
+		t.Errorf("Len() = %d, want 3", trie.Len())
+	}
+	var empty *domainTrie
+	if empty.Match("www.example.com.") || empty.Len() != 0 {
+		t.Error("nil trie matches")
+	}
+
+	for rule, want := range map[string]string{
+		"*.example.com":  "example.com.",
+		"*.Example.com.": "example.com.",
+		"example.com":    "",
+		"*example.com":   "",
+		"*.*.com":        "",
+		"www.*.com":      "",
+		"*.":             "",
+	} {
+		if got, ok := parseWildcardRule(rule); got != want || ok != (want != "") {
+			t.Errorf("parseWildcardRule(%q) = %q, %v", rule, got, ok)
+		}
+	}
+}
+
+func TestFirewallWildcard(t *testing.T) {
+	resetFirewall(t, -1, nil, []string{"*.example.com", "pypi.org"})
+	if !defaultTenant.firewallDns("files.example.com.") || defaultTenant.firewallDns("example.com.") || !defaultTenant.firewallDns("pypi.org.") {
+		t.Fatal("wrong DNS verdict")
+	}
+	defaultTenant.updateFirewall("files.example.com.", []net.IP{net.IPv4(192, 0, 2, 1)})
+	defaultTenant.updateFirewall("evil.test.", []net.IP{net.IPv4(192, 0, 2, 2)})
+	allowed := func(ip string) bool {
+		return defaultTenant.firewallConnection(&net.TCPAddr{IP: net.ParseIP(ip), Port: 443})
+	}
+	if !allowed("192.0.2.1") || allowed("192.0.2.2") {
+		t.Fatal("wrong connection verdict")
+	}
+	// matched names are not resolved again by minitap
+	if domains := allowedDomains(); len(domains) != 1 || domains[0] != "pypi.org." {
+		t.Errorf("allowedDomains() = %v", domains)
+	}
+
+	if err := defaultTenant.applyControl("revoke *.example.com\nallow *.pythonhosted.org"); err != nil {
+		t.Fatal(err)
+	}
+	if allowed("192.0.2.1") || defaultTenant.firewallDns("files.example.com.") || !defaultTenant.firewallDns("files.pythonhosted.org.") {
+		t.Error("wildcard rules not updated")
+	}
+	if cur := defaultTenant.policy.Load(); len(cur.matched) != 0 || len(cur.ips) != 0 {
+		t.Errorf("%d names and %d addresses left after the revocation", len(cur.matched), len(cur.ips))
+	}
+}
+
+// BenchmarkDomainTrieMatch matches names against 50k wildcard rules, as
+// firewallDns does for every query
+func BenchmarkDomainTrieMatch(b *testing.B) {
+	r := rand.New(rand.NewSource(1))
+	tlds := []string{"com", "org", "net", "io", "dev"}
+	var suffixes []string
+	for i := 0; i < 50000; i++ {
+		suffixes = append(suffixes, fmt.Sprintf("svc%d.team%d.%s.", r.Intn(1<<20), r.Intn(100), tlds[r.Intn(len(tlds))]))
+	}
+	trie := buildDomainTrie(suffixes)
+	names := make([]string, 1024)
+	for i := range names {
+		// half of the names are under a rule
+		if i%2 == 0 {
+			names[i] = "api.eu." + suffixes[r.Intn(len(suffixes))]
+		} else {
+			names[i] = fmt.Sprintf("www.svc%d.team%d.com.", r.Intn(1<<20), r.Intn(100))
+		}
+	}
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		trie.Match(names[i%len(names)])
+	}
+}
@@ -13,14 +13,18 @@ import (
 	"strconv"
 	"strings"
 	"net"
+	"net/netip"
 	"os"
 	"sync"
-	"time"
+	"sync/atomic"
 	"github.com/miekg/dns"
 )
 
 type FirewallRules struct {
-	Rules []string
+	// the IP and subnet rules
+	Prefixes []netip.Prefix
+	// the domain rules
+	Domains []string
 	Count int
         MaxConnections int
 }
@@ -30,14 +34,97 @@ var (
 	mu      sync.Mutex
 )
 
-var allowedIps = make(map[string]int)
-var deniedDomainMap []string
-var connections int = 0
+// firewallPolicy is a snapshot of what the firewall lets through. Snapshots
+// are never modified once published: updatePolicy builds a new one and swaps
+// it in, so that connections and DNS queries check the policy without taking
+// any lock.
+type firewallPolicy struct {
+	// the IP and subnet rules
+	prefixes *prefixTree
+	// the addresses the allowed domains resolve to (and the upstream DNS),
+	// with the number of domains resolving to each
+	ips map[netip.Addr]int
+	// the allowed domains and their addresses
+	domains map[string][]netip.Addr
+	// the wildcard rules, and the domains under them with the names they are
+	// built from
+	wildcards     *domainTrie
+	wildcardRules []string
+	// the names the sandbox resolved that a wildcard rule allows, and their
+	// addresses. Unlike domains, they are not kept resolved by minitap.
+	matched map[string][]netip.Addr
+	// the IP and subnet rules prefixes is built from
+	prefixRules []netip.Prefix
+	// whether there are rules at all, everything is let through until then
+	restricted bool
+	// the maximum number of connections, if any: it takes precedence over
+	// the rules
+	budget *connectionBudget
+}
+
+// connectionBudget counts the connections let through so far. Setting a new
+// maximum swaps in a new budget with the policy, which resets the count.
+type connectionBudget struct {
+	max  int64
+	used atomic.Int64
+}
+
+func newConnectionBudget(max int) *connectionBudget {
+	if max < 0 {
+		return nil
+	}
+	return &connectionBudget{max: int64(max)}
+}
+
+// updatePolicy publishes a copy of the current policy as changed by update
+func (t *tenant) updatePolicy(update func(next *firewallPolicy)) {
+	t.policyMu.Lock()
+	defer t.policyMu.Unlock()
+	cur := t.policy.Load()
+	next := &firewallPolicy{
+		prefixes:      cur.prefixes,
+		ips:           make(map[netip.Addr]int, len(cur.ips)),
+		domains:       make(map[string][]netip.Addr, len(cur.domains)),
+		matched:       make(map[string][]netip.Addr, len(cur.matched)),
+		prefixRules:   cur.prefixRules,
+		wildcards:     cur.wildcards,
+		wildcardRules: cur.wildcardRules,
+		restricted:    cur.restricted,
+		budget:        cur.budget,
+	}
+	for ip, n := range cur.ips {
+		next.ips[ip] = n
+	}
+	for domain, addrs := range cur.domains {
+		next.domains[domain] = addrs
+	}
+	for name, addrs := range cur.matched {
+		next.matched[name] = addrs
+	}
+	update(next)
+	t.policy.Store(next)
+}
+
+// parsePrefixRule parses the IP and subnet rules
+func parsePrefixRule(rule string) (netip.Prefix, bool) {
+	if prefix, err := netip.ParsePrefix(rule); err == nil {
+		return prefix, true
+	}
+	if ip, err := netip.ParseAddr(rule); err == nil {
+		return netip.PrefixFrom(ip, ip.BitLen()), true
+	}
+	return netip.Prefix{}, false
+}
 
 func MiniTapSetupFirewallRule(rule string) {
 	mu.Lock()
 	defer mu.Unlock()
-	fwRules.Rules = append(fwRules.Rules, rule)
+	if prefix, ok := parsePrefixRule(rule); ok {
+		fwRules.Prefixes = append(fwRules.Prefixes, prefix)
+	} else {
+		// Not a literal IP or subnet — either invalid or it's a domain name.
+		fwRules.Domains = append(fwRules.Domains, rule)
+	}
 	fwRules.Count++
 }
 
@@ -69,6 +156,9 @@ func ReadFirewallRules(firewall_rules string) {
           		return
 			}
 			MiniTapSetupMaxConnections(int(n))
+        } else if key, value, ok := strings.Cut(line, "="); ok {
+			// Options of the network stack, rules never have a '='
+			MiniTapSetupOption(key, value)
         } else {
 		    MiniTapSetupFirewallRule(line)
 		}
@@ -80,67 +170,144 @@ func ReadFirewallRules(firewall_rules string) {
 }
 
 func InitFirewall() {
-        // TODO make the argument flow to this point
-	if fwRules.Count == 0 {
-		return
-	}
+	mu.Lock()
+	rules := fwRules
+	mu.Unlock()
+	defaultTenant.initFirewall(rules)
+}
+
+func (t *tenant) initFirewall(rules FirewallRules) {
+	domains, wildcards := splitDomainRules(rules.Domains)
+	t.updatePolicy(func(next *firewallPolicy) {
+		next.budget = newConnectionBudget(rules.MaxConnections)
+		if rules.Count == 0 {
+			return
+		}
+		next.restricted = true
+		next.prefixRules = rules.Prefixes
+		next.prefixes = buildPrefixTree(rules.Prefixes)
+		next.wildcardRules = wildcards
+		next.wildcards = buildDomainTrie(wildcards)
+		for _, domain := range domains {
+			if _, ok := next.domains[domain]; !ok {
+				next.domains[domain] = []netip.Addr{}
+			}
+		}
+	})
 
-	for i := fwRules.Count - 1; i >= 0; i-- {
-		rule := fwRules.Rules[i]
+	verbosef("AllowedPrefixes: %d,\n", t.policy.Load().prefixes.Len())
+	verbosef("DomainMap: %s,\n", domains)
+	verbosef("Wildcards: %s,\n", wildcards)
 
-		verbosef("Rule: %s,\n", rule)
+	// the domains another sandbox resolved already are not looked up again,
+	// their cached answers count right away
+	for _, domain := range domains {
+		if entry := resolverCache.peek(domain); entry != nil && entry.err == nil {
+			t.updateFirewall(domain, entry.ips)
+		}
+	}
+	startDomainRefresh()
+}
 
-		if net.ParseIP(rule) == nil {
-			// Not a literal IP — either invalid or it's a domain name.
-			domainMap[dns.Fqdn(rule)] = []string{}
+// splitDomainRules returns the fully qualified domains of the rules, and the
+// domains under which the wildcard rules allow every name
+func splitDomainRules(rules []string) (domains []string, wildcards []string) {
+	for _, rule := range rules {
+		if suffix, ok := parseWildcardRule(rule); ok {
+			wildcards = append(wildcards, suffix)
 		} else {
-			allowedIps[rule]=1
+			domains = append(domains, dns.Fqdn(rule))
 		}
+	}
+	return domains, wildcards
+}
 
+func buildPrefixTree(prefixes []netip.Prefix) *prefixTree {
+	tree := &prefixTree{}
+	for _, prefix := range prefixes {
+		tree.Insert(prefix)
 	}
+	return tree
+}
+
+var refreshOnce sync.Once
 
-	verbosef("AllowedIps: %s,\n", allowedIps)
-	verbosef("DomainMap: %s,\n", domainMap)
+// startDomainRefresh keeps the answers for the allowed domains fresh and
+// drops the expired ones for the other names, see refreshDomainNames
+func startDomainRefresh() {
+	refreshOnce.Do(func() {
+		go refreshDomainNames()
+	})
+}
 
+func (t *tenant) allowedDomains() []string {
+	cur := t.policy.Load()
+	domains := make([]string, 0, len(cur.domains))
+	for domain := range cur.domains {
+		domains = append(domains, domain)
+	}
+	return domains
 }
 
-func updateFirewall(domain_name string, ips []net.IP) {
-	//domainMap is filled by InitFirewall with the allowed domain names. If a domain name is not already in
+func (t *tenant) updateFirewall(domain_name string, ips []net.IP) {
+	//the domains of the policy are filled by InitFirewall with the allowed domain names. If a domain name is not already in
 	var fully_qualified_domain_name = dns.Fqdn(domain_name)
 	verbosef("updating firewall", fully_qualified_domain_name, ips)
-	if _, ok := domainMap[fully_qualified_domain_name]; ok {
-		for _, ip := range domainMap[fully_qualified_domain_name]{
-			//we clean the previous ips for this domain
-			delete(allowedIps,ip)
+	t.updatePolicy(func(next *firewallPolicy) {
+		names := next.domains
+		if _, ok := names[fully_qualified_domain_name]; !ok {
+			if !next.wildcards.Match(fully_qualified_domain_name) {
+				return
+			}
+			names = next.matched
+		}
+		old := names[fully_qualified_domain_name]
+		for _, ip := range old {
+			//we clean the previous ips for this domain, unless another domain resolves to them too
+			if next.ips[ip]--; next.ips[ip] <= 0 {
+				delete(next.ips, ip)
+			}
 		}
-		var ipStrs []string
-  		for _, ip := range ips {
-			if ip == nil { // skip nils
+		var addrs []netip.Addr
+		for _, ip := range ips {
+			addr, ok := netip.AddrFromSlice(ip)
+			if !ok { // skip nils
 				continue
 			}
-			var ipString=ip.To4().String()
-			ipStrs = append(ipStrs,ipString )
-			allowedIps[ipString]=1
-    	}	
-		domainMap[fully_qualified_domain_name] = ipStrs
-	} else {
-		//we keep a list of the domains that the sandboxed payload tried to reach but are firewall'd.
-		deniedDomainMap = append(deniedDomainMap, fully_qualified_domain_name)
-		verbosef("deniedDomainMap %s", deniedDomainMap)
-	}
+			addr = addr.Unmap()
+			addrs = append(addrs, addr)
+			next.ips[addr]++
+		}
+		names[fully_qualified_domain_name] = addrs
+	})
 }
 
-func solveDomainName(domain_name string) {
-
-	ctx, cancel := context.WithTimeout(context.Background(), 5*time.Second)
-	defer cancel()
-	var req dns.Msg
-	req.SetQuestion(dns.Fqdn(domain_name), dns.TypeA)
-	handleDNSQuery(ctx, &req)
+// isAllowedIp is on the path of every connection, it neither allocates nor
+// waits for updates of the policy
+func (t *tenant) isAllowedIp(addr netip.Addr) bool {
+	cur := t.policy.Load()
+	if cur.prefixes.Contains(addr) {
+		return true
+	}
+	_, ok := cur.ips[addr]
+	return ok
 }
 
+// take counts a new connection, unless there are max already
+func (b *connectionBudget) take() bool {
+	for {
+		n := b.used.Load()
+		if n >= b.max {
+			return false
+		}
+		if b.used.CompareAndSwap(n, n+1) {
+			verbosef("connection number: %d, max allowed: %d\n", n+1, b.max)
+			return true
+		}
+	}
+}
 
-func firewallConnection(addr net.Addr) bool {
+func (t *tenant) firewallConnection(addr net.Addr) bool {
 	var destination_ip net.IP
 	switch addr := addr.(type) {
 	case *net.UDPAddr:
@@ -151,47 +318,44 @@ func firewallConnection(addr net.Addr) bool {
 		//We ignore connections that are not either TCP or UDP
 		return false
 	}
-	verbosef("In firewall fwRules.MaxConnections %d fwRules.Count==%d\n", fwRules.MaxConnections, fwRules.Count)
+	cur := t.policy.Load()
+	verbosef("In firewall budget %v restricted %v\n", cur.budget != nil, cur.restricted)
 
-	if fwRules.MaxConnections >= 0 {
+	if cur.budget != nil {
 	    // In this case we didn't specify any fw rule BUT we have a max number 
 	    // of connections allowed. We respect that policy 
-		if connections < fwRules.MaxConnections {
-        	verbosef("connection number: %d, max allowed: %d\n", connections + 1,  fwRules.MaxConnections);
-        	connections ++;
-			return true;
-        }
-
-		// If we end up here we exceeded the number of connections allowed. Block everything else
-		return false
+		// If we can't take one we exceeded the number of connections allowed. Block everything else
+		return cur.budget.take()
 	} else {
 		// In this branch we handle the firewall rules policy and we don't
 		// care about the number of connections
 		
-		if fwRules.Count == 0 {
+		if !cur.restricted {
 			// If we end up in this branch we haven't specified any network policy 
 			// so we'll just let all the connections go through
-			verbosef("fwRules.Count==0")
+			verbosef("no firewall rules")
 			return true;
 		}
 
+		destination, ok := netip.AddrFromSlice(destination_ip)
+		if !ok {
+			return false
+		}
+		destination = destination.Unmap()
+
 		//Fast path,if we hit here, we don't need to query the dns again
-		ip, ok := allowedIps[destination_ip.To4().String()]
-		if ok { 
-			verbosef("Hit ip: %s in allowedIps\n", ip)
+		if t.isAllowedIp(destination) {
+			verbosef("Hit ip: %s in the policy\n", destination_ip)
 			return true
 		}else{
-			//Slow path, we query dns and next time we use the fast path
-			//We update all the domain names
-			for domain := range domainMap {
-				verbosef("Domain: %s\n", domain)
-				solveDomainName(domain)
-			}
-
-			ip, ok := allowedIps[destination_ip.To4().String()]
+			//Slow path, the domains whose answers expired are resolved again
+			//(all at once), the others are already up to date in the policy
+			ctx, cancel := context.WithTimeout(context.Background(), dnsLookupTimeout)
+			defer cancel()
+			resolveDomainNames(ctx, t.allowedDomains())
 
-			if ok { 
-				verbosef("Hit ip: %s in allowedIps after dns query\n", ip)
+			if t.isAllowedIp(destination) {
+				verbosef("Hit ip: %s in the policy after dns query\n", destination_ip)
 				return true
 			}
 		}
@@ -199,17 +363,43 @@ func firewallConnection(addr net.Addr) bool {
 	}
 }
 
-func firewallDns(addr string) bool{
-	if fwRules.Count == 0 {
-		if fwRules.MaxConnections < 0 {
+// firewallDenies tells whether firewallConnection is sure to deny addr,
+// without resolving anything nor counting a connection
+func (t *tenant) firewallDenies(addr *net.UDPAddr) bool {
+	cur := t.policy.Load()
+	if cur.budget != nil {
+		return cur.budget.used.Load() >= cur.budget.max
+	}
+	if !cur.restricted {
+		return false
+	}
+	destination, ok := netip.AddrFromSlice(addr.IP)
+	if !ok {
+		return true
+	}
+	// resolving the allowed domains again could still allow it
+	return !t.isAllowedIp(destination.Unmap()) && len(cur.domains) == 0
+}
+
+func (t *tenant) firewallDns(addr string) bool{
+	cur := t.policy.Load()
+	if !cur.restricted {
+		if cur.budget == nil {
 			return true;
 		}
-		if connections < fwRules.MaxConnections {
-                	verbosef("connection number: %d, max allowed: %d\n", connections + 1,  fwRules.MaxConnections);
+		if n := cur.budget.used.Load(); n < cur.budget.max {
+                	verbosef("connection number: %d, max allowed: %d\n", n + 1,  cur.budget.max);
 			return true;
 		}
         	return false;
 	}
-	_, ok := domainMap[dns.Fqdn(addr)]
-	return ok
+	return cur.allowsDomain(dns.Fqdn(addr))
+}
+
+// allowsDomain tells whether a domain rule allows name, fully qualified
+func (cur *firewallPolicy) allowsDomain(name string) bool {
+	if _, ok := cur.domains[name]; ok {
+		return true
+	}
+	return cur.wildcards.Match(name)
 }
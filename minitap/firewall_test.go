@@ -0,0 +1,130 @@
+package main
+
+import (
+	"net"
+	"net/netip"
+	"sync"
+	"testing"
+)
+
+// resetFirewall sets up the firewall as ReadFirewallRules and InitFirewall
+// would, minus resolving domains: allowed domains are only added to the policy
+func resetFirewall(t *testing.T, maxConnections int, rules []string, domains []string) {
+	t.Helper()
+	fwRules = FirewallRules{Domains: domains, Count: len(rules) + len(domains), MaxConnections: maxConnections}
+	for _, rule := range rules {
+		fwRules.Prefixes = append(fwRules.Prefixes, netip.MustParsePrefix(rule))
+	}
+	domains, wildcards := splitDomainRules(domains)
+	defaultTenant.updatePolicy(func(next *firewallPolicy) {
+		*next = firewallPolicy{
+			prefixes:      buildPrefixTree(fwRules.Prefixes),
+			ips:           make(map[netip.Addr]int),
+			domains:       make(map[string][]netip.Addr),
+			wildcards:     buildDomainTrie(wildcards),
+			wildcardRules: wildcards,
+			matched:       make(map[string][]netip.Addr),
+			prefixRules:   fwRules.Prefixes,
+			restricted:    fwRules.Count > 0,
+			budget:        newConnectionBudget(maxConnections),
+		}
+		for _, domain := range domains {
+			next.domains[domain] = []netip.Addr{}
+		}
+	})
+}
+
+func TestFirewallMaxConnections(t *testing.T) {
+	resetFirewall(t, 10, nil, nil)
+	var wg sync.WaitGroup
+	var mu sync.Mutex
+	allowed := 0
+	for i := 0; i < 100; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			if defaultTenant.firewallConnection(&net.TCPAddr{IP: net.IPv4(192, 0, 2, 1), Port: 80}) {
+				mu.Lock()
+				allowed++
+				mu.Unlock()
+			}
+		}()
+	}
+	wg.Wait()
+	if allowed != 10 {
+		t.Errorf("%d connections allowed, want 10", allowed)
+	}
+	if defaultTenant.firewallDns("example.com") {
+		t.Errorf("DNS query allowed past the maximum number of connections")
+	}
+}
+
+// TestFirewallConcurrentUpdates checks connections and DNS queries while the
+// addresses of a domain keep changing, it's meant to run with -race
+func TestFirewallConcurrentUpdates(t *testing.T) {
+	resetFirewall(t, -1, []string{"10.0.0.0/8"}, []string{"allowed.test."})
+	done := make(chan struct{})
+	var writers, readers sync.WaitGroup
+	for w := 0; w < 4; w++ {
+		writers.Add(1)
+		go func(w int) {
+			defer writers.Done()
+			for i := 0; i < 1000; i++ {
+				defaultTenant.updateFirewall("allowed.test", []net.IP{net.IPv4(192, 0, 2, byte(w)), net.IPv4(198, 51, 100, byte(i))})
+			}
+		}(w)
+	}
+	for r := 0; r < 8; r++ {
+		readers.Add(1)
+		go func(r int) {
+			defer readers.Done()
+			for i := 0; ; i++ {
+				select {
+				case <-done:
+					return
+				default:
+				}
+				if !defaultTenant.firewallConnection(&net.TCPAddr{IP: net.IPv4(10, byte(r), byte(i), 1), Port: 443}) {
+					t.Errorf("connection to 10.%d.%d.1 denied", r, byte(i))
+					return
+				}
+				if !defaultTenant.firewallDns("allowed.test") || defaultTenant.firewallDns("denied.test") {
+					t.Errorf("wrong DNS verdict")
+					return
+				}
+				defaultTenant.isAllowedIp(netip.AddrFrom4([4]byte{198, 51, 100, byte(i)}))
+			}
+		}(r)
+	}
+	writers.Wait()
+	close(done)
+	readers.Wait()
+
+	defaultTenant.updateFirewall("allowed.test", []net.IP{net.IPv4(203, 0, 113, 1)})
+	if !defaultTenant.isAllowedIp(netip.MustParseAddr("203.0.113.1")) {
+		t.Errorf("the last address of allowed.test is not allowed")
+	}
+	if defaultTenant.isAllowedIp(netip.MustParseAddr("192.0.2.0")) {
+		t.Errorf("an old address of allowed.test is still allowed")
+	}
+	if cur := defaultTenant.policy.Load(); len(cur.ips) != 1 {
+		t.Errorf("%d addresses allowed, want 1", len(cur.ips))
+	}
+}
+
+func TestFirewallDenies(t *testing.T) {
+	udp := func(ip string) *net.UDPAddr { return &net.UDPAddr{IP: net.ParseIP(ip), Port: 443} }
+	resetFirewall(t, -1, []string{"192.0.2.0/24"}, nil)
+	if defaultTenant.firewallDenies(udp("192.0.2.1")) || !defaultTenant.firewallDenies(udp("198.51.100.1")) {
+		t.Error("wrong verdict with IP rules")
+	}
+	// resolving the domains again might allow any address
+	resetFirewall(t, -1, []string{"192.0.2.0/24"}, []string{"allowed.test."})
+	if defaultTenant.firewallDenies(udp("198.51.100.1")) {
+		t.Error("denied before resolving the domains")
+	}
+	resetFirewall(t, 1, nil, nil)
+	if defaultTenant.firewallDenies(udp("198.51.100.1")) || !defaultTenant.firewallConnection(udp("198.51.100.1")) || !defaultTenant.firewallDenies(udp("198.51.100.1")) {
+		t.Error("wrong verdict with a budget")
+	}
+}
@@ -25,8 +25,11 @@ import (
 	"os/exec"
 	"runtime"
 	"os/signal"
+	"strconv"
 	"strings"
+	"sync"
 	"syscall"
+	"time"
 )
 
 
@@ -81,16 +84,36 @@ func setEnv(envVars []string) {
 type cfg struct {
 	Tun        string
 	Subnet     string
+	// Subnet6 is the IPv6 address of the tun device, see setUpIPv6
+	Subnet6    string
 	Gateway    string
 	UID        int
 	GID        int
 	HTTPPorts  []int
 	HTTPSPorts []int
+	// Queues is the number of queues of the TUN device
+	Queues int
+	// MaxInFlight is the number of TCP handshakes the forwarder handles at once
+	MaxInFlight int
+	// ConnectTimeout bounds the connections to the world, the sandbox's
+	// handshake is pending until then
+	ConnectTimeout time.Duration
+	// UDPTimeout is how long UDP flows last without any datagram, see udp.go
+	UDPTimeout time.Duration
+	// MTU of the TUN device, the kernel's default if 0
+	MTU int
+	// MetricsPath is where the traffic metrics are dumped, see metrics.go
+	MetricsPath string
+	// SNI decides the HTTP(S) connections by name, see sni.go
+	SNI bool
+	// Capture is the packet capture, see capture.go
+	Capture captureConfig
 }
 
 var config = cfg{
 	Tun:        "",
 	Subnet:     "",
+	Subnet6:    "",
 	Gateway:    "",
 	UID:        -1,
 	GID:        -1,
@@ -98,6 +121,47 @@ var config = cfg{
 	HTTPSPorts: nil,
 }
 
+// maxTunQueues is the number of queues the kernel allows on a TUN device
+const maxTunQueues = 256
+
+// maxTunMTU is the largest MTU that leaves room for the IP and TCP headers in
+// a 64 KiB packet
+const maxTunMTU = 65520
+
+// maxDNSMessageSize is the size of the buffer DNS queries are read into, they
+// never come close to it
+const maxDNSMessageSize = 4096
+
+var dnsBufferPool = sync.Pool{New: func() any { b := make([]byte, maxDNSMessageSize); return &b }}
+
+// setUpIPv6 gives the tun device an IPv6 address and sends all the globally
+// routable ipv6 traffic to it. It fails on hosts without IPv6, in which case
+// AAAA queries get no answer (see handleDNSQuery).
+func setUpIPv6(link netlink.Link) error {
+	linksubnet, err := netlink.ParseIPNet(config.Subnet6)
+	if err != nil {
+		return fmt.Errorf("error parsing subnet: %w", err)
+	}
+	// minitap is the only other end of the device, there is no one to detect
+	// a duplicate address
+	err = netlink.AddrAdd(link, &netlink.Addr{IPNet: linksubnet, Flags: unix.IFA_F_NODAD})
+	if err != nil {
+		return fmt.Errorf("error assigning address to tun device: %w", err)
+	}
+	ip6Routable, err := netlink.ParseIPNet("2000::/3")
+	if err != nil {
+		return fmt.Errorf("error parsing global subnet: %w", err)
+	}
+	err = netlink.RouteAdd(&netlink.Route{
+		Dst:       ip6Routable,
+		LinkIndex: link.Attrs().Index,
+	})
+	if err != nil {
+		return fmt.Errorf("error creating default ipv6 route: %w", err)
+	}
+	return nil
+}
+
 func DefaultInit() {
 	if config.HTTPPorts == nil {
 		config.HTTPPorts = []int{80}
@@ -111,9 +175,130 @@ func DefaultInit() {
 	if config.Subnet == "" {
 		config.Subnet = "10.1.1.100/24"
 	}
+	if config.Subnet6 == "" {
+		config.Subnet6 = "fd00:1:1::100/64"
+	}
 	if config.Gateway == "" {
 		config.Gateway = "10.1.1.1"
 	}
+	if config.Queues == 0 {
+		config.Queues = min(runtime.NumCPU(), maxTunQueues)
+	}
+	if config.MaxInFlight == 0 {
+		config.MaxInFlight = 100
+	}
+	if config.ConnectTimeout == 0 {
+		config.ConnectTimeout = 10 * time.Second
+	}
+	if config.UDPTimeout == 0 {
+		config.UDPTimeout = time.Minute
+	}
+}
+
+// MiniTapSetupOption sets one of the options that mini-tapbox passes as
+// key=value lines in the rules file
+func MiniTapSetupOption(key string, value string) {
+	if key == "metrics" {
+		config.MetricsPath = value
+		verbosef("Option %s=%s\n", key, value)
+		return
+	}
+	if key == "sni" {
+		enabled, err := strconv.ParseBool(value)
+		if err != nil {
+			fmt.Printf("Invalid value for option %s: %q\n", key, value)
+			return
+		}
+		config.SNI = enabled
+		verbosef("Option %s=%v\n", key, enabled)
+		return
+	}
+	if ok, err := setCaptureOption(&config.Capture, key, value); ok {
+		if err != nil {
+			fmt.Printf("Invalid value for option %s: %v\n", key, err)
+			return
+		}
+		verbosef("Option %s=%s\n", key, value)
+		return
+	}
+	if ok, err := setTCPOption(key, value); ok {
+		if err != nil {
+			fmt.Printf("Invalid value for option %s: %v\n", key, err)
+			return
+		}
+		verbosef("Option %s=%s\n", key, value)
+		return
+	}
+	n, err := strconv.Atoi(value)
+	if err != nil || n <= 0 {
+		fmt.Printf("Invalid value for option %s: %q\n", key, value)
+		return
+	}
+	switch key {
+	case "queues":
+		config.Queues = min(n, maxTunQueues)
+	case "max-in-flight":
+		config.MaxInFlight = n
+	case "connect-timeout":
+		config.ConnectTimeout = time.Duration(n) * time.Millisecond
+	case "udp-timeout":
+		config.UDPTimeout = time.Duration(n) * time.Millisecond
+	case "mtu":
+		config.MTU = min(n, maxTunMTU)
+	default:
+		fmt.Printf("Unknown option %s, ignoring\n", key)
+		return
+	}
+	verbosef("Option %s=%d\n", key, n)
+}
+
+// openTunQueues opens the TUN device with the given number of queues and
+// returns a file descriptor per queue. The kernel spreads the flows over the
+// queues, and the gVisor endpoint runs a packet dispatcher for each of them.
+func openTunQueues(name string, queues int) ([]int, error) {
+	if queues <= 1 {
+		fd, err := tun.Open(name)
+		if err != nil {
+			return nil, err
+		}
+		return []int{fd}, nil
+	}
+	fds := make([]int, 0, queues)
+	for i := 0; i < queues; i++ {
+		fd, err := openTunQueue(name)
+		if err != nil {
+			for _, fd := range fds {
+				unix.Close(fd)
+			}
+			return nil, err
+		}
+		fds = append(fds, fd)
+	}
+	return fds, nil
+}
+
+// openTunQueue attaches a new queue to the multi-queue TUN device name,
+// creating the device with the first one
+func openTunQueue(name string) (int, error) {
+	fd, err := unix.Open("/dev/net/tun", unix.O_RDWR|unix.O_CLOEXEC, 0)
+	if err != nil {
+		return -1, err
+	}
+	ifr, err := unix.NewIfreq(name)
+	if err != nil {
+		unix.Close(fd)
+		return -1, err
+	}
+	ifr.SetUint16(unix.IFF_TUN | unix.IFF_NO_PI | unix.IFF_MULTI_QUEUE)
+	if err := unix.IoctlIfreq(fd, unix.TUNSETIFF, ifr); err != nil {
+		unix.Close(fd)
+		return -1, err
+	}
+	if err := unix.SetNonblock(fd, true); err != nil {
+		unix.Close(fd)
+		return -1, err
+	}
+	return fd, nil
 }
 
 func SetPingGroupRange() error {
@@ -144,10 +329,16 @@ func RunNetwork() (int, error) {
 		return -1, fmt.Errorf("error creating network namespace: %w", err)
 	}
 
-	fd, err := tun.Open(config.Tun)
+	fds, err := openTunQueues(config.Tun, config.Queues)
+	if err != nil && config.Queues > 1 {
+		// e.g. a kernel without multi-queue TUN devices
+		verbosef("error creating tun device with %d queues: %v, using one", config.Queues, err)
+		fds, err = openTunQueues(config.Tun, 1)
+	}
 	if err != nil {
 		return -1, fmt.Errorf("error creating tun device: %w", err)
 	}
+	verbosef("tun device has %d queues", len(fds))
 
 	// find the link for the device we just created
 	link, err := netlink.LinkByName(config.Tun)
@@ -155,7 +346,17 @@ func RunNetwork() (int, error) {
 		return -1, fmt.Errorf("error finding link for new tun device %q: %w", config.Tun, err)
 	}
 
-	verbosef("tun device has MTU %d", link.Attrs().MTU)
+	// with a large MTU the sandbox hands bulk transfers to the stack in a few
+	// large packets rather than as many 1500 bytes ones
+	if config.MTU != 0 && config.MTU != link.Attrs().MTU {
+		if err := netlink.LinkSetMTU(link, config.MTU); err != nil {
+			return -1, fmt.Errorf("error setting MTU %d on %q: %w", config.MTU, config.Tun, err)
+		}
+		link.Attrs().MTU = config.MTU
+	}
+	mtu := link.Attrs().MTU
+
+	verbosef("tun device has MTU %d", mtu)
 
 	// bring the link up
 	err = netlink.LinkSetUp(link)
@@ -184,12 +385,6 @@ func RunNetwork() (int, error) {
 		return -1, fmt.Errorf("error parsing global subnet: %w", err)
 	}
 
-	// parse the subnet corresponding to all globally routable ipv6 addresses
-	ip6Routable, err := netlink.ParseIPNet("2000::/3")
-	if err != nil {
-		return -1, fmt.Errorf("error parsing global subnet: %w", err)
-	}
-
 	// add a route that sends all ipv4 traffic going anywhere to the tun device
 	err = netlink.RouteAdd(&netlink.Route{
 		Dst:       ip4Routable,
@@ -199,13 +394,10 @@ func RunNetwork() (int, error) {
 		return -1, fmt.Errorf("error creating default ipv4 route: %w", err)
 	}
 
-	// add a route that sends all ipv6 traffic going anywhere to the tun device
-	err = netlink.RouteAdd(&netlink.Route{
-		Dst:       ip6Routable,
-		LinkIndex: link.Attrs().Index,
-	})
-	if err != nil {
-		verbosef("error creating default ipv6 route: %v, ignoring", err)
+	if err := setUpIPv6(link); err != nil {
+		verbosef("error setting up ipv6: %v, the sandbox only has ipv4", err)
+	} else {
+		defaultTenant.ipv6 = true
 	}
 
 	// find the loopback device
@@ -220,64 +412,117 @@ func RunNetwork() (int, error) {
 		return -1, fmt.Errorf("error bringing up link for loopback device: %w", err)
 	}
 
-	// the application-level thing is the mux, which distributes new connections according to patterns
-	var mux mux
-
 	// set default dns before start dns handling
 	setUpstreamDNS()
+	defaultTenant.allowUpstreamDNS()
+	defaultTenant.metrics.path = config.MetricsPath
+	defaultTenant.capture = newPacketCapture(config.Capture)
+	if _, err := defaultTenant.startStack(fds, mtu); err != nil {
+		return -1, err
+	}
+
+	SetPingGroupRange()
+	InitFirewall()
+	if controlFD >= 0 {
+		go serveControl(controlFD, defaultTenant.applyControl)
+	}
+	if verdictFD >= 0 {
+		go serveControl(verdictFD, defaultTenant.checkConnect)
+	}
+	reportReady(nil)
+        verbosef("Done with the config of tcp/ip")
+
+	// Create a channel to listen for termination signals
+	sigChan := make(chan os.Signal, 1)
+	signal.Notify(sigChan, syscall.SIGINT, syscall.SIGTERM)
+
+	// SIGUSR2 dumps the metrics on demand
+	dumpChan := make(chan os.Signal, 1)
+	signal.Notify(dumpChan, syscall.SIGUSR2)
+	go func() {
+		for range dumpChan {
+			dumpMetrics()
+			flushCaptures()
+		}
+	}()
+
+	// Run a goroutine to handle shutdown
+	go func() {
+		<-sigChan // Wait for a signal
+		dumpMetrics()
+		flushCaptures()
+		os.Exit(0)
+	}()
+
+	select {}
+}
+
+// startStack runs a gVisor stack for the sandbox of t on the TUN queues fds,
+// whose device has the given MTU: its connections go through the firewall of
+// t and are proxied to the world. The stack runs until it's closed.
+func (t *tenant) startStack(fds []int, mtu int) (*stack.Stack, error) {
+	// the application-level thing is the mux, which distributes new connections according to patterns
+	mux := &mux{tenant: t}
+
 	// handle DNS queries by calling net.Resolve
 	mux.HandleUDP(":53", func(conn net.Conn) {
-		defer conn.Close()
+		// the flow is closed once idle, as the proxied ones
+		session := t.udpSessions.add(conn, nil)
+		defer session.close()
 		for {
-			// allocate new buffer on each iteration for now because different handlers for each packet
-			// are started asynchronously
-			payload := make([]byte, link.Attrs().MTU)
+			// each query has a buffer of its own, as they are handled
+			// asynchronously, and the answer is packed in it
+			bufp := dnsBufferPool.Get().(*[]byte)
+			payload := (*bufp)[:min(mtu, maxDNSMessageSize)]
 			n, err := conn.Read(payload)
-			if err == net.ErrClosed {
-				verbose("UDP connection closed, exiting the read loop")
-				break
-			}
 			if err != nil {
+				dnsBufferPool.Put(bufp)
+				if errors.Is(err, net.ErrClosed) || session.closed.Load() {
+					verbose("UDP connection closed, exiting the read loop")
+					break
+				}
 				verbosef("error reading udp packet with conn.ReadFrom: %v, ignoring", err)
 				continue
 			}
+			session.touch()
 
 			verbosef("read a UDP packet with %d bytes", n)
 
 			// handle the DNS query asynchronously
-			go handleDNS(context.Background(), conn, payload)
+			go func() {
+				defer dnsBufferPool.Put(bufp)
+				t.handleDNS(context.Background(), conn, payload[:n])
+			}()
 		}
 	})
-	// listen for other TCP connections and proxy to the world
-	mux.HandleTCP("*", func(conn net.Conn) {
-		dst := conn.LocalAddr().String()
-		proxyConn("tcp", dst, conn)
-	})
+	// listen for other TCP connections and proxy to the world, once
+	// connected to their destination
+	mux.HandleTCPRequest("*", t.forwardTCP)
 
 	// listen for other UDP connections and proxy to the world
-	mux.HandleUDP("*", func(conn net.Conn) {
-		dst := conn.LocalAddr().String()
-		proxyConn("udp", dst, conn)
-	})
+	mux.HandleUDP("*", t.proxyUDP)
 
 	// create the stack with udp and tcp protocols
 	s := stack.New(stack.Options{
 		NetworkProtocols:   []stack.NetworkProtocolFactory{ipv4.NewProtocol, ipv6.NewProtocol},
 		TransportProtocols: []stack.TransportProtocolFactory{tcp.NewProtocol, udp.NewProtocol, icmp.NewProtocol4},
 	})
+	if err := applyTCPOptions(s, tcpOptions); err != nil {
+		return nil, fmt.Errorf("error setting the TCP options: %w", err)
+	}
 
 	// create a link endpoint based on the TUN device
 	endpoint, err := fdbased.New(&fdbased.Options{
-		FDs: []int{fd},
-		MTU: uint32(link.Attrs().MTU),
+		FDs: fds,
+		MTU: uint32(mtu),
 	})
 	if err != nil {
-		return -1, fmt.Errorf("error creating link from tun device file descriptor: %v", err)
+		return nil, fmt.Errorf("error creating link from tun device file descriptor: %v", err)
 	}
 
 	// create the TCP forwarder, which accepts gvisor connections and notifies the mux
-	const maxInFlight = 100 // maximum simultaneous connections
-	tcpForwarder := tcp.NewForwarder(s, 0, maxInFlight, func(r *tcp.ForwarderRequest) {
+	// config.MaxInFlight is the maximum number of simultaneous handshakes
+	tcpForwarder := tcp.NewForwarder(s, 0, config.MaxInFlight, func(r *tcp.ForwarderRequest) {
 		// remote address is the IP address of the subprocess
 		// local address is IP address that the subprocess was trying to reach
 		verbosef("at TCP forwarder: %v:%v => %v:%v",
@@ -285,10 +530,9 @@ func RunNetwork() (int, error) {
 			r.ID().LocalAddress, r.ID().LocalPort)
 
 		// dispatch the request via the mux
-		go mux.notifyTCP(&tcpRequest{r, new(waiter.Queue)})
+		go mux.notifyTCP(&tcpRequest{r, new(waiter.Queue), time.Now()})
 	})
 
-	// TODO: this UDP forwarder sometimes only ever processes one UDP packet, other times it keeps going... :/
 	// create the UDP forwarder, which accepts UDP packets and notifies the mux
 	udpForwarder := udp.NewForwarder(s, func(r *udp.ForwarderRequest) {
 		// remote address is the IP address of the subprocess
@@ -310,25 +554,40 @@ func RunNetwork() (int, error) {
 
 	// register the forwarders with the stack
 	s.SetTransportProtocolHandler(tcp.ProtocolNumber, tcpForwarder.HandlePacket)
-	s.SetTransportProtocolHandler(udp.ProtocolNumber, udpForwarder.HandlePacket)
+	s.SetTransportProtocolHandler(udp.ProtocolNumber, func(id stack.TransportEndpointID, pkt *stack.PacketBuffer) bool {
+		// Unhandled packets get an ICMP port unreachable back from the
+		// stack, so that the sandbox doesn't wait for answers that never
+		// come
+		if t.firewallDenies(&net.UDPAddr{IP: id.LocalAddress.AsSlice(), Port: int(id.LocalPort)}) {
+			t.metrics.connection("udp", false)
+			return false
+		}
+		return udpForwarder.HandlePacket(id, pkt)
+	})
+
+	// the packets of the sandbox go through the capture first, if any
+	var link stack.LinkEndpoint = endpoint
+	if t.capture != nil {
+		link = t.capture.wrap(endpoint)
+	}
 
 	// create the network interface -- tun2socks says this must happen *after* registering the TCP forwarder
 	nic := s.NextNICID()
-	er := s.CreateNIC(nic, endpoint)
+	er := s.CreateNIC(nic, link)
 	if er != nil {
-		return -1, fmt.Errorf("error creating NIC: %v", er)
+		return nil, fmt.Errorf("error creating NIC: %v", er)
 	}
 
 	// set promiscuous mode so that the forwarder receives packets not addressed to us
 	er = s.SetPromiscuousMode(nic, true)
 	if er != nil {
-		return -1, fmt.Errorf("error activating promiscuous mode: %v", er)
+		return nil, fmt.Errorf("error activating promiscuous mode: %v", er)
 	}
 
 	// set spoofing mode so that we can send packets from any address
 	er = s.SetSpoofing(nic, true)
 	if er != nil {
-		return -1, fmt.Errorf("error activating spoofing mode: %v", er)
+		return nil, fmt.Errorf("error activating spoofing mode: %v", er)
 	}
 
 	// set up the route table so that we can send packets to the subprocess
@@ -343,30 +602,44 @@ func RunNetwork() (int, error) {
 		},
 	})
 
-	SetPingGroupRange()
-	InitFirewall()
-	ppid := syscall.Getppid()
-	syscall.Kill(ppid, syscall.SIGUSR1)
-        verbosef("Done with the config of tcp/ip")
-
-	// Create a channel to listen for termination signals
-	sigChan := make(chan os.Signal, 1)
-	signal.Notify(sigChan, syscall.SIGINT, syscall.SIGTERM)
-
-
-	// Run a goroutine to handle shutdown
-	go func() {
-		<-sigChan // Wait for a signal
-		os.Exit(0)
-	}()
+	return s, nil
+}
 
-	select {}
+// readyFD is where minitap reports to mini-tapbox whether it started, see
+// reportReady
+var readyFD = -1
+var readyReported bool
+
+// reportReady tells whoever started minitap that the stack is up, or why it
+// could not start if err is set. mini-tapbox passes a pipe for this (in
+// MINITAP_READY_FD to the binary), other callers get a SIGUSR1 once the stack
+// is up.
+func reportReady(err error) {
+	// only the first report counts
+	if readyReported {
+		return
+	}
+	readyReported = true
+	if readyFD < 0 {
+		if err == nil {
+			syscall.Kill(syscall.Getppid(), syscall.SIGUSR1)
+		}
+		return
+	}
+	msg := "ok\n"
+	if err != nil {
+		msg = "error: " + strings.ReplaceAll(err.Error(), "\n", " ") + "\n"
+	}
+	ready := os.NewFile(uintptr(readyFD), "ready")
+	ready.WriteString(msg)
+	ready.Close()
 }
 
 //export MiniTapUserTCPIP
 func MiniTapUserTCPIP() C.int {
 	res, err := RunNetwork()
 	if err != nil {
+		reportReady(err)
 		fmt.Println("RunNetwork error:", err)
 		return -1
 	}
@@ -394,12 +667,79 @@ func ParseArg(args []string) {
 	ReadFirewallRules(firewall_rules)
 }
 
+// runShared runs a shared minitap on the unix socket path, with the
+// key=value options given after it, see shared.go
+func runShared(path string, options []string) error {
+	for _, option := range options {
+		key, value, ok := strings.Cut(option, "=")
+		if !ok {
+			return fmt.Errorf("invalid option %q, expected key=value", option)
+		}
+		MiniTapSetupOption(key, value)
+	}
+	DefaultInit()
+	setUpstreamDNS()
+
+	sigChan := make(chan os.Signal, 1)
+	signal.Notify(sigChan, syscall.SIGINT, syscall.SIGTERM)
+	dumpChan := make(chan os.Signal, 1)
+	signal.Notify(dumpChan, syscall.SIGUSR2)
+	go func() {
+		for range dumpChan {
+			dumpMetrics()
+			flushCaptures()
+		}
+	}()
+	go func() {
+		<-sigChan
+		dumpMetrics()
+		flushCaptures()
+		os.Remove(path)
+		os.Exit(0)
+	}()
+
+	return serveShared(path)
+}
+
 func main() {
 	log.SetOutput(os.Stdout)
 	log.SetFlags(0)
-	ParseArg(os.Args)
+	if len(os.Args) > 2 && os.Args[1] == "--shared" {
+		if err := runShared(os.Args[2], os.Args[3:]); err != nil {
+			log.Fatal(err)
+		}
+		return
+	}
+	if fd, err := strconv.Atoi(os.Getenv("MINITAP_READY_FD")); err == nil {
+		readyFD = fd
+		// what minitap runs doesn't inherit it
+		os.Unsetenv("MINITAP_READY_FD")
+		syscall.CloseOnExec(fd)
+	}
+	if fd, err := strconv.Atoi(os.Getenv("MINITAP_CONTROL_FD")); err == nil {
+		controlFD = fd
+		os.Unsetenv("MINITAP_CONTROL_FD")
+		syscall.CloseOnExec(fd)
+	}
+	if fd, err := strconv.Atoi(os.Getenv("MINITAP_VERDICT_FD")); err == nil {
+		verdictFD = fd
+		os.Unsetenv("MINITAP_VERDICT_FD")
+		syscall.CloseOnExec(fd)
+	}
+	if fd, err := strconv.Atoi(os.Getenv("MINITAP_RULES_FD")); err == nil {
+		os.Unsetenv("MINITAP_RULES_FD")
+		if err := ReadFirewallRulesFD(fd); err != nil {
+			err = fmt.Errorf("reading the firewall rules: %w", err)
+			reportReady(err)
+			log.Fatal(err)
+		}
+	} else {
+		// started by hand, with the rules in a text file
+		ParseArg(os.Args)
+	}
 	_, err := RunNetwork()
 	if err != nil {
+		reportReady(err)
 		// if we exit due to a subprocess returning with non-zero exit code then do not
 		// print any extraneous output but do exit with the same code
 		var exitError *exec.ExitError
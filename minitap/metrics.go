@@ -0,0 +1,239 @@
+package main
+
+import (
+	"encoding/json"
+	"fmt"
+	"net"
+	"net/netip"
+	"os"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// latencyBuckets are the upper bounds of the handshake latency histogram
+var latencyBuckets = []time.Duration{
+	100 * time.Microsecond,
+	time.Millisecond,
+	5 * time.Millisecond,
+	10 * time.Millisecond,
+	50 * time.Millisecond,
+	100 * time.Millisecond,
+	500 * time.Millisecond,
+	time.Second,
+	5 * time.Second,
+}
+
+type latencyHistogram struct {
+	// one more than latencyBuckets, for the latencies past the last bound
+	counts [10]atomic.Uint64
+	sum    atomic.Int64
+}
+
+func (h *latencyHistogram) observe(d time.Duration) {
+	i := 0
+	for i < len(latencyBuckets) && d > latencyBuckets[i] {
+		i++
+	}
+	h.counts[i].Add(1)
+	h.sum.Add(int64(d))
+}
+
+type protocolCounters struct {
+	allowed atomic.Uint64
+	denied  atomic.Uint64
+}
+
+// destinationCounters count the traffic of one protocol to one destination.
+// Sent is from the sandbox to the world.
+type destinationCounters struct {
+	connections atomic.Uint64
+	sent        atomic.Uint64
+	received    atomic.Uint64
+}
+
+type destinationKey struct {
+	network string
+	host    string
+}
+
+// trafficMetrics counts what the sandbox does on the network. The counters are
+// always kept, the per destination ones only when they are going to be
+// dumped (to path), as they grow with the destinations.
+type trafficMetrics struct {
+	// where they are dumped, config.MetricsPath for defaultTenant
+	path string
+
+	tcp protocolCounters
+	udp protocolCounters
+
+	dnsAnswered atomic.Uint64
+	dnsDenied   atomic.Uint64
+	dnsFailed   atomic.Uint64
+
+	// from the SYN of the sandbox to the connection to the world
+	handshake latencyHistogram
+
+	mu sync.Mutex
+	// the names the sandbox got the addresses from, through our DNS
+	names        map[netip.Addr]string
+	destinations map[destinationKey]*destinationCounters
+}
+
+func (m *trafficMetrics) enabled() bool {
+	return m.path != ""
+}
+
+func (m *trafficMetrics) connection(network string, allowed bool) {
+	counters := &m.tcp
+	if network == "udp" {
+		counters = &m.udp
+	}
+	if allowed {
+		counters.allowed.Add(1)
+	} else {
+		counters.denied.Add(1)
+	}
+}
+
+// resolved records that the sandbox looked name up and got ips
+func (m *trafficMetrics) resolved(name string, ips []net.IP) {
+	if !m.enabled() {
+		return
+	}
+	name = strings.TrimSuffix(name, ".")
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	for _, ip := range ips {
+		if addr, ok := netip.AddrFromSlice(ip); ok {
+			m.names[addr.Unmap()] = name
+		}
+	}
+}
+
+// destination returns the counters of addr (host:port), which is named after
+// the domain it was resolved from if any, or nil if they are not kept
+func (m *trafficMetrics) destination(network string, addr string) *destinationCounters {
+	if !m.enabled() {
+		return nil
+	}
+	host, _, err := net.SplitHostPort(addr)
+	if err != nil {
+		host = addr
+	}
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	if ip, err := netip.ParseAddr(host); err == nil {
+		if name, ok := m.names[ip.Unmap()]; ok {
+			host = name
+		}
+	}
+	key := destinationKey{network, host}
+	counters, ok := m.destinations[key]
+	if !ok {
+		counters = &destinationCounters{}
+		m.destinations[key] = counters
+	}
+	return counters
+}
+
+type protocolJSON struct {
+	Allowed uint64 `json:"allowed"`
+	Denied  uint64 `json:"denied"`
+}
+
+type destinationJSON struct {
+	Connections   uint64 `json:"connections"`
+	BytesSent     uint64 `json:"bytes_sent"`
+	BytesReceived uint64 `json:"bytes_received"`
+}
+
+type bucketJSON struct {
+	// 0 for the last bucket, which has no upper bound
+	LeMicroseconds int64  `json:"le_us"`
+	Count          uint64 `json:"count"`
+}
+
+type metricsJSON struct {
+	Connections map[string]protocolJSON `json:"connections"`
+	DNS         struct {
+		Answered uint64 `json:"answered"`
+		Denied   uint64 `json:"denied"`
+		Failed   uint64 `json:"failed"`
+	} `json:"dns"`
+	Handshake struct {
+		Count           uint64       `json:"count"`
+		SumMicroseconds int64        `json:"sum_us"`
+		Buckets         []bucketJSON `json:"buckets"`
+	} `json:"handshake_latency"`
+	// destination, then protocol
+	Destinations map[string]map[string]destinationJSON `json:"destinations"`
+}
+
+func (m *trafficMetrics) snapshot() *metricsJSON {
+	var out metricsJSON
+	out.Connections = map[string]protocolJSON{
+		"tcp": {m.tcp.allowed.Load(), m.tcp.denied.Load()},
+		"udp": {m.udp.allowed.Load(), m.udp.denied.Load()},
+	}
+	out.DNS.Answered = m.dnsAnswered.Load()
+	out.DNS.Denied = m.dnsDenied.Load()
+	out.DNS.Failed = m.dnsFailed.Load()
+
+	for i := range m.handshake.counts {
+		bucket := bucketJSON{Count: m.handshake.counts[i].Load()}
+		if i < len(latencyBuckets) {
+			bucket.LeMicroseconds = latencyBuckets[i].Microseconds()
+		}
+		out.Handshake.Count += bucket.Count
+		out.Handshake.Buckets = append(out.Handshake.Buckets, bucket)
+	}
+	out.Handshake.SumMicroseconds = time.Duration(m.handshake.sum.Load()).Microseconds()
+
+	out.Destinations = make(map[string]map[string]destinationJSON)
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	for key, counters := range m.destinations {
+		if out.Destinations[key.host] == nil {
+			out.Destinations[key.host] = make(map[string]destinationJSON)
+		}
+		out.Destinations[key.host][key.network] = destinationJSON{
+			Connections:   counters.connections.Load(),
+			BytesSent:     counters.sent.Load(),
+			BytesReceived: counters.received.Load(),
+		}
+	}
+	return &out
+}
+
+// dump writes the metrics as JSON to path, replacing the previous dump at
+// once so that readers never see half of it
+func (m *trafficMetrics) dump(path string) error {
+	data, err := json.MarshalIndent(m.snapshot(), "", "  ")
+	if err != nil {
+		return err
+	}
+	tmp := path + ".tmp"
+	if err := os.WriteFile(tmp, append(data, '\n'), 0644); err != nil {
+		return err
+	}
+	return os.Rename(tmp, path)
+}
+
+// dumpMetrics dumps the metrics of every tenant that has somewhere to dump
+// them
+func dumpMetrics() {
+	eachTenant(func(t *tenant) {
+		t.dumpMetrics()
+	})
+}
+
+func (t *tenant) dumpMetrics() {
+	if !t.metrics.enabled() {
+		return
+	}
+	if err := t.metrics.dump(t.metrics.path); err != nil {
+		fmt.Printf("Error writing the metrics to %s: %v\n", t.metrics.path, err)
+	}
+}
@@ -0,0 +1,65 @@
+package main
+
+import (
+	"encoding/json"
+	"io"
+	"net"
+	"os"
+	"testing"
+	"time"
+)
+
+func TestMetricsDump(t *testing.T) {
+	defaultTenant.metrics.path = t.TempDir() + "/metrics.json"
+	defer func() { defaultTenant.metrics.path = "" }()
+
+	echo := startEchoServer(t)
+	defer echo.Close()
+	front, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer front.Close()
+
+	// the sandbox resolved the name of the echo server through our DNS
+	defaultTenant.metrics.resolved("echo.test.", []net.IP{net.IPv4(127, 0, 0, 1)})
+	client, err := net.Dial("tcp", front.Addr().String())
+	if err != nil {
+		t.Fatal(err)
+	}
+	server, err := front.Accept()
+	if err != nil {
+		t.Fatal(err)
+	}
+	defaultTenant.proxyConn("tcp", echo.Addr().String(), server)
+	client.Write([]byte("hello"))
+	client.(*net.TCPConn).CloseWrite()
+	io.Copy(io.Discard, client)
+	client.Close()
+	defaultTenant.metrics.handshake.observe(3 * time.Millisecond)
+
+	// the proxy counts the bytes it wrote once the write returns, which may be
+	// after the client got them
+	var dumped metricsJSON
+	for i := 0; i < 100; i++ {
+		dumpMetrics()
+		data, err := os.ReadFile(defaultTenant.metrics.path)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if err := json.Unmarshal(data, &dumped); err != nil {
+			t.Fatal(err)
+		}
+		if dumped.Destinations["echo.test"]["tcp"].BytesReceived == 5 {
+			break
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+	want := destinationJSON{Connections: 1, BytesSent: 5, BytesReceived: 5}
+	if got := dumped.Destinations["echo.test"]["tcp"]; got != want {
+		t.Errorf("echo.test tcp = %+v, want %+v", got, want)
+	}
+	if dumped.Handshake.Count == 0 || dumped.Handshake.Buckets[2].Count == 0 {
+		t.Errorf("3ms handshake not in the 5ms bucket: %+v", dumped.Handshake)
+	}
+}
@@ -4,6 +4,7 @@ import (
 	"net"
 	"strings"
 	"sync"
+	"time"
 )
 
 func patternMatches(pattern string, addr net.Addr) bool {
@@ -16,9 +17,14 @@ func patternMatches(pattern string, addr net.Addr) bool {
 	return false
 }
 
-// mux dispatches network connections to listeners according to patterns
+// mux dispatches network connections to listeners according to patterns,
+// through the firewall of tenant
 type mux struct {
-	mu          sync.Mutex
+	tenant *tenant
+
+	// mu is only written when registering handlers, connections are
+	// dispatched (and firewalled) in parallel under the read lock
+	mu          sync.RWMutex
 	tcpHandlers []*tcpMuxEntry
 	udpHandlers []*udpMuxEntry
 }
@@ -59,9 +65,10 @@ func (s *mux) HandleTCP(pattern string, handler tcpHandlerFunc) {
 	s.HandleTCPRequest(pattern, func(r TCPRequest) {
 		conn, err := r.Accept()
 		if err != nil {
-			errorf("error accepting connection: %v", err)
+			logAcceptError(err)
 			return
 		}
+		s.tenant.metrics.handshake.observe(time.Since(r.Received()))
 		handler(conn)
 	})
 }
@@ -102,32 +109,47 @@ func (s *mux) HandleUDP(pattern string, handler udpHandlerFunc) {
 // notifyTCP is called when a new stream is created. It finds the first listener
 // that will accept the given stream. It never blocks.
 func (s *mux) notifyTCP(req TCPRequest) {
-	s.mu.Lock()
-	defer s.mu.Unlock()
+	s.mu.RLock()
+	defer s.mu.RUnlock()
 
 	for _, entry := range s.tcpHandlers {
 		verbosef(" listening for tcp to %v", req.LocalAddr())
-		if patternMatches(entry.pattern, req.LocalAddr()) &&  firewallConnection(req.LocalAddr()) {
+		if patternMatches(entry.pattern, req.LocalAddr()) && s.tenant.inspectByName(req.LocalAddr()) {
+			// counted in the metrics once the name is known
+			go entry.handler(&namedRequest{req, s.tenant})
+			return
+		}
+		if patternMatches(entry.pattern, req.LocalAddr()) &&  s.tenant.firewallConnection(req.LocalAddr()) {
+			s.tenant.metrics.connection("tcp", true)
 			go entry.handler(req)
 			return
 		}
 	}
 
+	s.tenant.metrics.connection("tcp", false)
+
 	verbosef("nobody listening for tcp to %v, dropping", req.LocalAddr())
+	// Until it's completed, the request holds one of the in-flight slots of
+	// the forwarder
+	req.Reject()
 }
 
 // notifyUDP is called when a new packet arrives. It finds the first handler
 // with a pattern that matches the packet and delivers the packet to it
 func (s *mux) notifyUDP(conn net.Conn) {
-	s.mu.Lock()
-	defer s.mu.Unlock()
+	s.mu.RLock()
+	defer s.mu.RUnlock()
 
 	for _, entry := range s.udpHandlers {
-		if patternMatches(entry.pattern, conn.LocalAddr()) &&  firewallConnection(conn.LocalAddr()) {
+		if patternMatches(entry.pattern, conn.LocalAddr()) &&  s.tenant.firewallConnection(conn.LocalAddr()) {
+			s.tenant.metrics.connection("udp", true)
 			go entry.handler(conn)
 			return
 		}
 	}
 
+	s.tenant.metrics.connection("udp", false)
+
 	verbosef("nobody listening for udp to %v, dropping!", conn.LocalAddr())
+	conn.Close()
 }
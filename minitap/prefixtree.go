@@ -0,0 +1,145 @@
+package main
+
+import (
+	"math/bits"
+	"net/netip"
+)
+
+// prefixTree is a binary radix (Patricia) tree of IP prefixes. IPv4 prefixes
+// are kept as IPv4-mapped IPv6 prefixes (::ffff:a.b.c.d/96+n), so that both
+// families share one tree. Lookups walk at most one node per distinct prefix
+// length on the path and don't allocate.
+type prefixTree struct {
+	root *prefixNode
+	size int
+}
+
+type prefixNode struct {
+	// key has its bits past plen cleared
+	key  [16]byte
+	plen int
+	// the prefix is a rule, rather than just a branching point
+	terminal bool
+	child    [2]*prefixNode
+}
+
+// bitAt returns the bit of key at position i, counting from the most
+// significant bit of key[0]
+func bitAt(key *[16]byte, i int) int {
+	return int(key[i>>3]>>(7-uint(i&7))) & 1
+}
+
+// commonPrefixLen returns the number of leading bits a and b share, up to max
+func commonPrefixLen(a, b *[16]byte, max int) int {
+	n := 0
+	for i := 0; i < 16 && n < max; i++ {
+		if x := a[i] ^ b[i]; x != 0 {
+			n += bits.LeadingZeros8(x)
+			break
+		}
+		n += 8
+	}
+	if n > max {
+		return max
+	}
+	return n
+}
+
+func maskKey(key [16]byte, plen int) [16]byte {
+	for i := 0; i < 16; i++ {
+		switch {
+		case plen >= 8:
+			plen -= 8
+		case plen > 0:
+			key[i] &= ^byte(0xff >> uint(plen))
+			plen = 0
+		default:
+			key[i] = 0
+		}
+	}
+	return key
+}
+
+// prefixKey returns the tree key and length of p
+func prefixKey(p netip.Prefix) ([16]byte, int) {
+	p = p.Masked()
+	plen := p.Bits()
+	if p.Addr().Is4() {
+		plen += 96
+	}
+	return p.Addr().As16(), plen
+}
+
+// Insert adds p to the tree
+func (t *prefixTree) Insert(p netip.Prefix) {
+	key, plen := prefixKey(p)
+	link := &t.root
+	for {
+		n := *link
+		if n == nil {
+			*link = &prefixNode{key: key, plen: plen, terminal: true}
+			t.size++
+			return
+		}
+		common := commonPrefixLen(&key, &n.key, min(plen, n.plen))
+		if common == n.plen && common == plen {
+			if !n.terminal {
+				n.terminal = true
+				t.size++
+			}
+			return
+		}
+		if common == n.plen {
+			// p is below n
+			link = &n.child[bitAt(&key, n.plen)]
+			continue
+		}
+		// p and n part ways at bit common: n moves down under a new node,
+		// which is either p itself or a branching point for both
+		parent := &prefixNode{key: maskKey(key, common), plen: common}
+		parent.child[bitAt(&n.key, common)] = n
+		if common == plen {
+			parent.terminal = true
+		} else {
+			parent.child[bitAt(&key, common)] = &prefixNode{key: key, plen: plen, terminal: true}
+		}
+		*link = parent
+		t.size++
+		return
+	}
+}
+
+// Lookup returns the length of the longest prefix in the tree that contains
+// addr (as an IPv6 prefix length for IPv4 too), or false if there is none
+func (t *prefixTree) Lookup(addr netip.Addr) (int, bool) {
+	if !addr.IsValid() {
+		return 0, false
+	}
+	// IPv4 addresses come out IPv4-mapped, like the IPv4 prefixes
+	key := addr.As16()
+	best, found := 0, false
+	for n := t.root; n != nil; {
+		if commonPrefixLen(&key, &n.key, n.plen) < n.plen {
+			break
+		}
+		if n.terminal {
+			best, found = n.plen, true
+		}
+		if n.plen == 128 {
+			break
+		}
+		n = n.child[bitAt(&key, n.plen)]
+	}
+	return best, found
+}
+
+// Contains tells whether addr is in any prefix of the tree
+func (t *prefixTree) Contains(addr netip.Addr) bool {
+	_, ok := t.Lookup(addr)
+	return ok
+}
+
+// Len returns the number of prefixes in the tree
+func (t *prefixTree) Len() int {
+	return t.size
+}
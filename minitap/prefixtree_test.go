@@ -0,0 +1,125 @@
+package main
+
+import (
+	"math/rand"
+	"net/netip"
+	"testing"
+)
+
+func randomPrefix(r *rand.Rand) netip.Prefix {
+	if r.Intn(2) == 0 {
+		var b [4]byte
+		r.Read(b[:])
+		return netip.PrefixFrom(netip.AddrFrom4(b), 8+r.Intn(25)).Masked()
+	}
+	var b [16]byte
+	r.Read(b[:])
+	// keep some IPv6 rules close together so that they share branches
+	b[0], b[1] = 0x20, 0x01
+	return netip.PrefixFrom(netip.AddrFrom16(b), 16+r.Intn(113)).Masked()
+}
+
+func randomAddr(r *rand.Rand, prefixes []netip.Prefix) netip.Addr {
+	// Half of the addresses are taken from a rule, so that some of them match
+	p := prefixes[r.Intn(len(prefixes))]
+	if r.Intn(2) == 0 {
+		if p.Addr().Is4() {
+			var b [4]byte
+			r.Read(b[:])
+			return netip.AddrFrom4(b)
+		}
+		var b [16]byte
+		r.Read(b[:])
+		b[0], b[1] = 0x20, 0x01
+		return netip.AddrFrom16(b)
+	}
+	addr := p.Addr()
+	for i := r.Intn(8); i > 0; i-- {
+		addr = addr.Next()
+	}
+	return addr
+}
+
+func TestPrefixTree(t *testing.T) {
+	var tree prefixTree
+	for _, rule := range []string{"10.0.0.0/8", "10.1.0.0/16", "192.168.1.7/32", "2001:db8::/32", "0.0.0.0/0"} {
+		tree.Insert(netip.MustParsePrefix(rule))
+	}
+	tree.Insert(netip.MustParsePrefix("10.1.2.3/16"))
+	if tree.Len() != 5 {
+		t.Errorf("Len() = %d, want 5", tree.Len())
+	}
+	for _, tc := range []struct {
+		addr string
+		plen int
+		ok   bool
+	}{
+		{"10.2.3.4", 96 + 8, true},
+		{"10.1.3.4", 96 + 16, true},
+		{"192.168.1.7", 128, true},
+		{"192.168.1.8", 96, true},
+		{"2001:db8::1", 32, true},
+		{"2001:db9::1", 0, false},
+		{"::ffff:10.1.0.1", 96 + 16, true},
+	} {
+		plen, ok := tree.Lookup(netip.MustParseAddr(tc.addr))
+		if plen != tc.plen || ok != tc.ok {
+			t.Errorf("Lookup(%s) = %d, %v, want %d, %v", tc.addr, plen, ok, tc.plen, tc.ok)
+		}
+	}
+	if tree.Contains(netip.Addr{}) {
+		t.Errorf("Contains(invalid address) = true")
+	}
+}
+
+// TestPrefixTreeRandom checks the tree against going through all the rules
+func TestPrefixTreeRandom(t *testing.T) {
+	r := rand.New(rand.NewSource(1))
+	var tree prefixTree
+	var prefixes []netip.Prefix
+	for i := 0; i < 2000; i++ {
+		p := randomPrefix(r)
+		prefixes = append(prefixes, p)
+		tree.Insert(p)
+	}
+	for i := 0; i < 20000; i++ {
+		addr := randomAddr(r, prefixes)
+		want, wantOk := 0, false
+		for _, p := range prefixes {
+			if p.Contains(addr) {
+				plen := p.Bits()
+				if p.Addr().Is4() {
+					plen += 96
+				}
+				if !wantOk || plen > want {
+					want, wantOk = plen, true
+				}
+			}
+		}
+		if got, ok := tree.Lookup(addr); got != want || ok != wantOk {
+			t.Fatalf("Lookup(%s) = %d, %v, want %d, %v", addr, got, ok, want, wantOk)
+		}
+	}
+}
+
+// BenchmarkPrefixTreeLookup looks up addresses among 10k rules, as
+// firewallConnection does for every connection
+func BenchmarkPrefixTreeLookup(b *testing.B) {
+	r := rand.New(rand.NewSource(1))
+	var tree prefixTree
+	var prefixes []netip.Prefix
+	for i := 0; i < 10000; i++ {
+		p := randomPrefix(r)
+		prefixes = append(prefixes, p)
+		tree.Insert(p)
+	}
+	addrs := make([]netip.Addr, 1024)
+	for i := range addrs {
+		addrs[i] = randomAddr(r, prefixes)
+	}
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		tree.Contains(addrs[i%len(addrs)])
+	}
+}
@@ -1,21 +1,95 @@
 package main
 
 import (
+	"errors"
 	"io"
 	"net"
+	"sync"
+	"sync/atomic"
+	"time"
 )
 
-// proxyConn proxies data received on one TCP connection to the world, and back the other way.
-func proxyConn(network, addr string, subprocess net.Conn) {
-	// the connections's "LocalAddr" is actually the address that the other side (the subprocess) was trying
+// Buffer sizes for proxyBytes. TCP is a stream so any size works and 32 KiB is
+// what io.Copy uses, while a UDP read has to fit the largest datagram or the
+// rest of it is lost.
+const (
+	tcpProxyBufferSize = 32 << 10
+	udpProxyBufferSize = 64 << 10
+)
+
+var (
+	tcpBufferPool = sync.Pool{New: func() any { b := make([]byte, tcpProxyBufferSize); return &b }}
+	udpBufferPool = sync.Pool{New: func() any { b := make([]byte, udpProxyBufferSize); return &b }}
+)
+
+// closeWriter is implemented by the TCP connections on both sides (net.TCPConn
+// and gonet.TCPConn)
+type closeWriter interface {
+	CloseWrite() error
+}
+
+// dialWorld connects to addr, giving up after config.ConnectTimeout
+func dialWorld(network, addr string) (net.Conn, error) {
+	dialer := net.Dialer{Timeout: config.ConnectTimeout}
+	return dialer.Dial(network, addr)
+}
+
+// forwardTCP connects to the destination of r before accepting it. When the
+// destination refuses the connection or doesn't answer within
+// config.ConnectTimeout, the sandbox gets a RST right away instead of a
+// connection that is closed as soon as it's established.
+func (t *tenant) forwardTCP(r TCPRequest) {
+	// the request's "LocalAddr" is actually the address that the other side (the subprocess) was trying
 	// to reach, so that's the address we dial in order to proxy
-	world, err := net.Dial(network, addr)
+	dst := r.LocalAddr().String()
+	if _, named := r.(*namedRequest); named {
+		// minitap doesn't connect anywhere before it knows the name
+		subprocess, err := r.Accept()
+		if err != nil {
+			logAcceptError(err)
+			return
+		}
+		t.metrics.handshake.observe(time.Since(r.Received()))
+		t.proxyConn("tcp", dst, subprocess)
+		return
+	}
+	world, err := dialWorld("tcp", dst)
+	if err != nil {
+		verbosef("error connecting to %s: %v, resetting the connection", dst, err)
+		r.Reject()
+		return
+	}
+	subprocess, err := r.Accept()
+	if err != nil {
+		world.Close()
+		logAcceptError(err)
+		return
+	}
+	t.metrics.handshake.observe(time.Since(r.Received()))
+	t.proxyConns("tcp", dst, subprocess, world)
+}
+
+func logAcceptError(err error) {
+	if errors.Is(err, errNameDenied) {
+		verbosef("dropping connection: %v", err)
+	} else {
+		errorf("error accepting connection: %v", err)
+	}
+}
+
+// proxyConn proxies data received on one connection to the world, and back the other way.
+func (t *tenant) proxyConn(network, addr string, subprocess net.Conn) {
+	world, err := dialWorld(network, addr)
 	if err != nil {
-		// TODO: report errors not related to destination being unreachable
 		subprocess.Close()
 		return
 	}
+	t.proxyConns(network, addr, subprocess, world)
+}
 
+// proxyConns proxies data between subprocess and world, which is connected to
+// addr
+func (t *tenant) proxyConns(network, addr string, subprocess, world net.Conn) {
 	verbosef(
 		"subprocess type=%T local=%s remote=%s\n",
 		subprocess,
@@ -23,32 +97,79 @@ func proxyConn(network, addr string, subprocess net.Conn) {
 		subprocess.RemoteAddr(),
 	)
 
-	go proxyBytes(subprocess, world)
-	go proxyBytes(world, subprocess)
+	var sent, received *atomic.Uint64
+	if counters := t.metrics.destination(network, addr); counters != nil {
+		counters.connections.Add(1)
+		sent, received = &counters.sent, &counters.received
+	}
+
+	pool := &tcpBufferPool
+	if network == "udp" {
+		pool = &udpBufferPool
+	}
+
+	// Both connections are closed once both directions are done, each
+	// direction passes its EOF on with a half close
+	var wg sync.WaitGroup
+	wg.Add(2)
+	go func() {
+		defer wg.Done()
+		proxyBytes(subprocess, world, pool, received)
+	}()
+	go func() {
+		defer wg.Done()
+		proxyBytes(world, subprocess, pool, sent)
+	}()
+	go func() {
+		wg.Wait()
+		world.Close()
+		subprocess.Close()
+	}()
 }
 
 // proxyBytes copies data between the world and the subprocess
-func proxyBytes(w io.Writer, r io.Reader) {
+//
+// The data goes through a buffer borrowed from pool instead of io.Copy: one
+// end is always a gVisor endpoint, which lives in our memory, so there is no
+// socket pair for io.Copy to splice() between and it would fall back to
+// allocating a buffer of its own per connection.
+//
+// The bytes written are added to counted, unless it's nil.
+func proxyBytes(w net.Conn, r net.Conn, pool *sync.Pool, counted *atomic.Uint64) {
+	bufp := pool.Get().(*[]byte)
+	defer pool.Put(bufp)
+	buf := *bufp
 
-	buf := make([]byte, 1<<20)
 	for {
 		n, err := r.Read(buf)
+		if n > 0 {
+			if _, werr := w.Write(buf[:n]); werr != nil {
+				//Usually we end up in this branch if the process is killed before we complete the write (e.g. wget smth | head -n1)
+				//We don't want to print the error verbosely so we use verbosef
+				verbosef("error writing in proxyBytes: %s, dropping %d bytes", werr, n)
+				// Nobody is reading anymore, let the sender know
+				r.Close()
+				return
+			}
+			if counted != nil {
+				counted.Add(uint64(n))
+			}
+		}
 		if err == io.EOF {
+			// The other direction may still have data to send
+			if cw, ok := w.(closeWriter); ok {
+				cw.CloseWrite()
+			} else {
+				w.Close()
+			}
 			return
 		}
 		if err != nil {
 			//Usually we end up in this branch if the process is killed before we complete the write (e.g. wget smth | head -n1)
 			//We don't want to print the error verbosely so we use verbosef
 			verbosef("error reading in proxyBytes: %v, abandoning", err)
+			w.Close()
 			return
 		}
-
-		// send packet to channel, drop on failure
-		_, err = w.Write(buf[:n])
-		if err != nil {
-			//Usually we end up in this branch if the process is killed before we complete the write (e.g. wget smth | head -n1)
-			//We don't want to print the error verbosely so we use verbosef
-			verbosef("error writing in proxyBytes: %s, dropping %d bytes", err, n)
-		}
 	}
 }
@@ -0,0 +1,166 @@
+package main
+
+import (
+	"fmt"
+	"io"
+	"net"
+	"os"
+	"runtime"
+	"strconv"
+	"strings"
+	"sync"
+	"testing"
+	"time"
+)
+
+const benchTransferSize = 256 << 10
+
+// startEchoServer plays the world: it sends back whatever it gets and half
+// closes once the client does
+func startEchoServer(b testing.TB) net.Listener {
+	ln, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		b.Fatal(err)
+	}
+	go func() {
+		for {
+			conn, err := ln.Accept()
+			if err != nil {
+				return
+			}
+			go func() {
+				io.Copy(conn, conn)
+				conn.(*net.TCPConn).CloseWrite()
+			}()
+		}
+	}()
+	return ln
+}
+
+// proxiedPair returns the subprocess end of a connection proxied to addr.
+// The proxy gets a plain TCP connection where minitap has a gonet one, which
+// behaves the same as far as proxyConn is concerned.
+func proxiedPair(b *testing.B, ln net.Listener, addr string) net.Conn {
+	client, err := net.Dial("tcp", ln.Addr().String())
+	if err != nil {
+		b.Fatal(err)
+	}
+	server, err := ln.Accept()
+	if err != nil {
+		b.Fatal(err)
+	}
+	defaultTenant.proxyConn("tcp", addr, server)
+	return client
+}
+
+func rssBytes() float64 {
+	data, err := os.ReadFile("/proc/self/statm")
+	if err != nil {
+		return 0
+	}
+	fields := strings.Fields(string(data))
+	if len(fields) < 2 {
+		return 0
+	}
+	pages, _ := strconv.ParseFloat(fields[1], 64)
+	return pages * float64(os.Getpagesize())
+}
+
+// BenchmarkProxy pushes benchTransferSize bytes through each of conns
+// proxied connections and back, and reports the memory in use once they are
+// all set up.
+func BenchmarkProxy(b *testing.B) {
+	for _, conns := range []int{1, 100, 1000} {
+		b.Run(fmt.Sprintf("conns=%d", conns), func(b *testing.B) {
+			echo := startEchoServer(b)
+			defer echo.Close()
+			front, err := net.Listen("tcp", "127.0.0.1:0")
+			if err != nil {
+				b.Fatal(err)
+			}
+			defer front.Close()
+
+			payload := make([]byte, benchTransferSize)
+			b.SetBytes(int64(2 * conns * benchTransferSize))
+			b.ResetTimer()
+			var heap, rss float64
+			for i := 0; i < b.N; i++ {
+				clients := make([]net.Conn, conns)
+				for c := range clients {
+					clients[c] = proxiedPair(b, front, echo.Addr().String())
+				}
+				// Every proxyBytes goroutine holds its buffer from here on
+				var stats runtime.MemStats
+				runtime.ReadMemStats(&stats)
+				heap += float64(stats.HeapInuse)
+				rss += rssBytes()
+
+				var wg sync.WaitGroup
+				for _, client := range clients {
+					wg.Add(1)
+					go func(client net.Conn) {
+						defer wg.Done()
+						go func() {
+							client.Write(payload)
+							client.(*net.TCPConn).CloseWrite()
+						}()
+						io.Copy(io.Discard, client)
+					}(client)
+				}
+				wg.Wait()
+				for _, client := range clients {
+					client.Close()
+				}
+			}
+			b.ReportMetric(heap/float64(b.N)/(1<<20), "heap-MiB")
+			b.ReportMetric(rss/float64(b.N)/(1<<20), "rss-MiB")
+		})
+	}
+}
+
+func TestForwardTCP(t *testing.T) {
+	echo := startEchoServer(t)
+	defer echo.Close()
+	client, server := net.Pipe()
+	defer client.Close()
+	r := &pipeRequest{local: echo.Addr().(*net.TCPAddr), server: server}
+	defaultTenant.forwardTCP(r)
+	if !r.accepted || r.rejected {
+		t.Fatalf("accepted %v, rejected %v", r.accepted, r.rejected)
+	}
+	go client.Write([]byte("ping"))
+	got := make([]byte, 4)
+	if _, err := io.ReadFull(client, got); err != nil || string(got) != "ping" {
+		t.Errorf("read %q, %v", got, err)
+	}
+}
+
+func TestForwardTCPRefused(t *testing.T) {
+	ln, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	// nothing listens there anymore
+	ln.Close()
+	r := &pipeRequest{local: ln.Addr().(*net.TCPAddr)}
+	defaultTenant.forwardTCP(r)
+	if r.accepted || !r.rejected {
+		t.Errorf("accepted %v, rejected %v", r.accepted, r.rejected)
+	}
+}
+
+func TestForwardTCPTimeout(t *testing.T) {
+	saved := config.ConnectTimeout
+	config.ConnectTimeout = time.Millisecond
+	defer func() { config.ConnectTimeout = saved }()
+	// a destination that never answers, or isn't reachable at all here
+	r := &pipeRequest{local: &net.TCPAddr{IP: net.IPv4(192, 0, 2, 1), Port: 443}}
+	start := time.Now()
+	defaultTenant.forwardTCP(r)
+	if r.accepted || !r.rejected {
+		t.Errorf("accepted %v, rejected %v", r.accepted, r.rejected)
+	}
+	if elapsed := time.Since(start); elapsed > time.Second {
+		t.Errorf("rejected after %v", elapsed)
+	}
+}
@@ -0,0 +1,139 @@
+package main
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"net/netip"
+	"os"
+	"strings"
+)
+
+// The rules mini-tapbox hands over in a memfd, the layout is described with
+// DumpRules in mini_sandbox/src/main/tools/firewall.h
+const (
+	rulesMagic      = "MTFW"
+	rulesVersion    = 1
+	rulesHeaderSize = 24
+	ruleRecordSize  = 20
+
+	ruleDomain = 0
+	ruleIPv4   = 1
+	ruleIPv6   = 2
+)
+
+// decodedRules is what the memfd holds
+type decodedRules struct {
+	maxConnections int
+	// "key=value"
+	options  []string
+	prefixes []netip.Prefix
+	domains  []string
+}
+
+var errTruncatedRules = errors.New("truncated rules")
+
+// decodeRules parses data, as written by DumpRules
+func decodeRules(data []byte) (*decodedRules, error) {
+	if len(data) < rulesHeaderSize || string(data[:4]) != rulesMagic {
+		return nil, errors.New("not a rules file")
+	}
+	le := binary.LittleEndian
+	if version := le.Uint32(data[4:]); version != rulesVersion {
+		return nil, fmt.Errorf("unknown rules version %d", version)
+	}
+	optionCount := uint64(le.Uint32(data[12:]))
+	ruleCount := uint64(le.Uint32(data[16:]))
+	stringsSize := uint64(le.Uint32(data[20:]))
+	if uint64(len(data)) != rulesHeaderSize+optionCount*8+ruleCount*ruleRecordSize+stringsSize {
+		return nil, errTruncatedRules
+	}
+	options := data[rulesHeaderSize:]
+	records := options[optionCount*8:]
+	strs := records[ruleCount*ruleRecordSize:]
+	str := func(b []byte) (string, error) {
+		offset, length := uint64(le.Uint32(b)), uint64(le.Uint32(b[4:]))
+		if offset+length > uint64(len(strs)) {
+			return "", errTruncatedRules
+		}
+		return string(strs[offset : offset+length]), nil
+	}
+
+	rules := &decodedRules{maxConnections: int(int32(le.Uint32(data[8:])))}
+	for i := uint64(0); i < optionCount; i++ {
+		option, err := str(options[i*8:])
+		if err != nil {
+			return nil, err
+		}
+		rules.options = append(rules.options, option)
+	}
+	for i := uint64(0); i < ruleCount; i++ {
+		record := records[i*ruleRecordSize : (i+1)*ruleRecordSize]
+		ruleType, bits, value := record[0], int(record[1]), record[4:]
+		switch ruleType {
+		case ruleDomain:
+			domain, err := str(value)
+			if err != nil {
+				return nil, err
+			}
+			rules.domains = append(rules.domains, domain)
+		case ruleIPv4, ruleIPv6:
+			addr := netip.AddrFrom16([16]byte(value))
+			if ruleType == ruleIPv4 {
+				addr = netip.AddrFrom4([4]byte(value[:4]))
+			}
+			prefix, err := addr.Prefix(bits)
+			if err != nil {
+				return nil, fmt.Errorf("invalid prefix length %d for %s", bits, addr)
+			}
+			rules.prefixes = append(rules.prefixes, prefix)
+		default:
+			return nil, fmt.Errorf("unknown rule type %d", ruleType)
+		}
+	}
+	return rules, nil
+}
+
+// readRulesFD decodes the rules in fd, which it closes
+func readRulesFD(fd int) (*decodedRules, error) {
+	file := os.NewFile(uintptr(fd), "rules")
+	defer file.Close()
+	// from the start, whatever the offset mini-tapbox left
+	data, err := io.ReadAll(io.NewSectionReader(file, 0, 1<<62))
+	if err != nil {
+		return nil, err
+	}
+	return decodeRules(data)
+}
+
+// firewallRules returns the rules of the firewall, without the options
+func (r *decodedRules) firewallRules() FirewallRules {
+	return FirewallRules{
+		Prefixes:       r.prefixes,
+		Domains:        r.domains,
+		Count:          len(r.prefixes) + len(r.domains),
+		MaxConnections: r.maxConnections,
+	}
+}
+
+// ReadFirewallRulesFD sets up minitap with the rules in fd, which it closes
+func ReadFirewallRulesFD(fd int) error {
+	rules, err := readRulesFD(fd)
+	if err != nil {
+		return err
+	}
+
+	MiniTapSetupMaxConnections(rules.maxConnections)
+	for _, option := range rules.options {
+		if key, value, ok := strings.Cut(option, "="); ok {
+			MiniTapSetupOption(key, value)
+		}
+	}
+	mu.Lock()
+	defer mu.Unlock()
+	fwRules.Prefixes = append(fwRules.Prefixes, rules.prefixes...)
+	fwRules.Domains = append(fwRules.Domains, rules.domains...)
+	fwRules.Count += len(rules.prefixes) + len(rules.domains)
+	return nil
+}
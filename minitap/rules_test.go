@@ -0,0 +1,103 @@
+package main
+
+import (
+	"encoding/binary"
+	"net/netip"
+	"reflect"
+	"testing"
+)
+
+// encodeRules lays out rules as DumpRules does
+func encodeRules(maxConnections int, options []string, prefixes []netip.Prefix, domains []string) []byte {
+	le := binary.LittleEndian
+	var optionRecords, ruleRecords, strs []byte
+	str := func(out []byte, s string) []byte {
+		out = le.AppendUint32(out, uint32(len(strs)))
+		out = le.AppendUint32(out, uint32(len(s)))
+		strs = append(strs, s...)
+		return out
+	}
+	for _, domain := range domains {
+		ruleRecords = append(ruleRecords, ruleDomain, 0, 0, 0)
+		ruleRecords = str(ruleRecords, domain)
+		ruleRecords = append(ruleRecords, make([]byte, 8)...)
+	}
+	for _, option := range options {
+		optionRecords = str(optionRecords, option)
+	}
+	for _, prefix := range prefixes {
+		var address [16]byte
+		ruleType := byte(ruleIPv6)
+		if prefix.Addr().Is4() {
+			ruleType = ruleIPv4
+			a4 := prefix.Addr().As4()
+			copy(address[:], a4[:])
+		} else {
+			address = prefix.Addr().As16()
+		}
+		ruleRecords = append(ruleRecords, ruleType, byte(prefix.Bits()), 0, 0)
+		ruleRecords = append(ruleRecords, address[:]...)
+	}
+
+	data := []byte(rulesMagic)
+	data = le.AppendUint32(data, rulesVersion)
+	data = le.AppendUint32(data, uint32(int32(maxConnections)))
+	data = le.AppendUint32(data, uint32(len(options)))
+	data = le.AppendUint32(data, uint32(len(prefixes)+len(domains)))
+	data = le.AppendUint32(data, uint32(len(strs)))
+	data = append(data, optionRecords...)
+	data = append(data, ruleRecords...)
+	return append(data, strs...)
+}
+
+func TestDecodeRules(t *testing.T) {
+	want := &decodedRules{
+		maxConnections: -1,
+		options:        []string{"queues=4", "metrics=/tmp/net.json"},
+		prefixes: []netip.Prefix{
+			netip.MustParsePrefix("10.0.0.0/8"),
+			netip.MustParsePrefix("192.0.2.1/32"),
+			netip.MustParsePrefix("2001:db8::/32"),
+		},
+		domains: []string{"example.com", "pypi.org"},
+	}
+	data := encodeRules(want.maxConnections, want.options, want.prefixes, want.domains)
+	got, err := decodeRules(data)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if !reflect.DeepEqual(got, want) {
+		t.Errorf("decodeRules = %+v, want %+v", got, want)
+	}
+
+	for n := 0; n < len(data); n++ {
+		if _, err := decodeRules(data[:n]); err == nil {
+			t.Errorf("decodeRules of the first %d bytes out of %d succeeded", n, len(data))
+		}
+	}
+}
+
+func TestDecodeRulesInvalid(t *testing.T) {
+	data := encodeRules(3, nil, []netip.Prefix{netip.MustParsePrefix("192.0.2.0/24")}, nil)
+	got, err := decodeRules(data)
+	if err != nil || got.maxConnections != 3 {
+		t.Fatalf("decodeRules = %+v, %v", got, err)
+	}
+
+	bad := append([]byte{}, data...)
+	// an IPv4 prefix longer than 32 bits
+	bad[rulesHeaderSize+1] = 33
+	if _, err := decodeRules(bad); err == nil {
+		t.Error("decodeRules accepted a /33")
+	}
+	bad = append([]byte{}, data...)
+	bad[rulesHeaderSize] = 7
+	if _, err := decodeRules(bad); err == nil {
+		t.Error("decodeRules accepted an unknown rule type")
+	}
+	bad = append([]byte{}, data...)
+	bad[4] = 2
+	if _, err := decodeRules(bad); err == nil {
+		t.Error("decodeRules accepted an unknown version")
+	}
+}
@@ -0,0 +1,303 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+	"io/fs"
+	"net"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"syscall"
+
+	"gvisor.dev/gvisor/pkg/tcpip/stack"
+)
+
+// A shared minitap (minitap --shared <socket>) serves every sandbox that
+// registers on socket, instead of mini-tapbox starting a minitap per sandbox.
+// Each sandbox gets a tenant (its firewall, metrics and UDP flows) and a gVisor
+// stack of its own, while the process, the DNS cache and the options given on
+// the command line are shared.
+//
+// Whoever registers brings their own TUN device and rules, so the socket must
+// be out of reach of the sandboxes: it's in a directory only the user of
+// minitap can get into, which mini-tapbox hides in the sandbox, and only
+// processes of that user may register. Nothing the sandboxes send names a file
+// either: with the metrics and pcap options, which are directories in shared
+// mode, minitap writes sandbox-<pid>.json and sandbox-<pid>.pcapng there, pid
+// being the one of the mini-tapbox that registered.
+//
+// mini-tapbox creates the network namespace and TUN device of the sandbox
+// itself, then registers with a single message "register <mtu> [ipv6]" carrying
+// the descriptors of the TUN device, of the rules memfd, of the control channel
+// and, with fast-connect, of the verdict channel (see
+// mini_sandbox/src/main/tools/minitap-shared.h). ipv6 tells that the sandbox
+// has an IPv6 route to the TUN device. minitap answers "ok" or "error:
+// <reason>". The sandbox is served until mini-tapbox closes the control
+// channel, that is until the sandbox is gone.
+
+// maxRegistration bounds the registration message, it's a single short line
+const maxRegistration = 256
+
+// registration is what a sandbox hands over to a shared minitap
+type registration struct {
+	mtu  int
+	ipv6 bool
+	// verdict is -1 without fast-connect
+	tun, rules, control, verdict int
+}
+
+func (r *registration) close() {
+	for _, fd := range []int{r.tun, r.rules, r.control, r.verdict} {
+		if fd >= 0 {
+			syscall.Close(fd)
+		}
+	}
+}
+
+// parseRegistration parses msg, received along with fds. The descriptors are
+// closed on error.
+func parseRegistration(msg string, fds []int) (*registration, error) {
+	r := &registration{tun: -1, rules: -1, control: -1, verdict: -1}
+	for i, fd := range fds {
+		switch i {
+		case 0:
+			r.tun = fd
+		case 1:
+			r.rules = fd
+		case 2:
+			r.control = fd
+		case 3:
+			r.verdict = fd
+		default:
+			syscall.Close(fd)
+		}
+	}
+	// mini-tapbox NUL terminates its messages
+	args, ok := strings.CutPrefix(strings.TrimSpace(strings.TrimRight(msg, "\x00")), "register ")
+	mtu, ipv6, _ := strings.Cut(args, " ")
+	n, err := strconv.Atoi(mtu)
+	switch {
+	case !ok:
+		err = fmt.Errorf("unknown request %q", msg)
+	case ipv6 != "" && ipv6 != "ipv6":
+		err = fmt.Errorf("unknown flag %q", ipv6)
+	case err != nil || n <= 0 || n > maxTunMTU:
+		err = fmt.Errorf("invalid MTU %q", mtu)
+	case len(fds) < 3:
+		err = fmt.Errorf("%d descriptors, expected at least 3", len(fds))
+	}
+	if err != nil {
+		r.close()
+		return nil, err
+	}
+	r.mtu = n
+	r.ipv6 = ipv6 != ""
+	return r, nil
+}
+
+// readRegistration reads the registration message of conn
+func readRegistration(conn *net.UnixConn) (*registration, error) {
+	buf := make([]byte, maxRegistration)
+	oob := make([]byte, syscall.CmsgSpace(4*4))
+	n, oobn, _, _, err := conn.ReadMsgUnix(buf, oob)
+	if err != nil {
+		return nil, err
+	}
+	var fds []int
+	messages, err := syscall.ParseSocketControlMessage(oob[:oobn])
+	if err != nil {
+		return nil, err
+	}
+	for _, m := range messages {
+		rights, err := syscall.ParseUnixRights(&m)
+		if err != nil {
+			continue
+		}
+		for _, fd := range rights {
+			syscall.CloseOnExec(fd)
+		}
+		fds = append(fds, rights...)
+	}
+	return parseRegistration(string(buf[:n]), fds)
+}
+
+// newSandboxTenant returns the tenant of the sandbox named name, whose rules
+// are in the memfd rules, which it closes. The options in the rules are
+// ignored, the sandboxes get the ones of the shared minitap.
+func newSandboxTenant(rules int, name string) (*tenant, error) {
+	decoded, err := readRulesFD(rules)
+	if err != nil {
+		return nil, fmt.Errorf("reading the firewall rules: %w", err)
+	}
+	for _, option := range decoded.options {
+		verbosef("Option %s of a sandbox, ignoring", option)
+	}
+	t := newTenant()
+	if config.MetricsPath != "" {
+		t.metrics.path = filepath.Join(config.MetricsPath, name+".json")
+	}
+	capture := config.Capture
+	if capture.Path != "" {
+		capture.Path = filepath.Join(capture.Path, name+".pcapng")
+	}
+	t.capture = newPacketCapture(capture)
+	t.allowUpstreamDNS()
+	t.initFirewall(decoded.firewallRules())
+	return t, nil
+}
+
+// listenShared listens on the unix socket path, in a directory that is
+// created if missing and must only be accessible to us
+func listenShared(path string) (*net.UnixListener, error) {
+	dir := filepath.Dir(path)
+	if err := os.Mkdir(dir, 0700); err != nil && !errors.Is(err, fs.ErrExist) {
+		return nil, err
+	}
+	var st syscall.Stat_t
+	if err := syscall.Lstat(dir, &st); err != nil {
+		return nil, err
+	}
+	if st.Mode&syscall.S_IFMT != syscall.S_IFDIR || int(st.Uid) != os.Getuid() || st.Mode&0077 != 0 {
+		return nil, fmt.Errorf("%s must be a directory of uid %d that no one else can access", dir, os.Getuid())
+	}
+	if err := removeStaleSocket(path); err != nil {
+		return nil, err
+	}
+	// the socket is ours only from the start, minitap doesn't create files
+	// concurrently at this point
+	umask := syscall.Umask(0177)
+	defer syscall.Umask(umask)
+	return net.ListenUnix("unixpacket", &net.UnixAddr{Name: path, Net: "unixpacket"})
+}
+
+// removeStaleSocket removes the socket a previous minitap left at path, as
+// long as it's a socket that no one serves anymore
+func removeStaleSocket(path string) error {
+	fi, err := os.Lstat(path)
+	if errors.Is(err, fs.ErrNotExist) {
+		return nil
+	}
+	if err != nil {
+		return err
+	}
+	if fi.Mode().Type() != fs.ModeSocket {
+		return fmt.Errorf("%s exists and is not a socket", path)
+	}
+	conn, err := net.Dial("unixpacket", path)
+	if err == nil {
+		conn.Close()
+		return fmt.Errorf("a minitap already serves %s", path)
+	}
+	if !errors.Is(err, syscall.ECONNREFUSED) {
+		return err
+	}
+	return os.Remove(path)
+}
+
+// peerCredentials returns the credentials of the process that connected conn
+func peerCredentials(conn *net.UnixConn) (*syscall.Ucred, error) {
+	raw, err := conn.SyscallConn()
+	if err != nil {
+		return nil, err
+	}
+	var cred *syscall.Ucred
+	err = raw.Control(func(fd uintptr) {
+		cred, err = syscall.GetsockoptUcred(int(fd), syscall.SOL_SOCKET, syscall.SO_PEERCRED)
+	})
+	if err != nil {
+		return nil, err
+	}
+	return cred, nil
+}
+
+// serveShared serves the sandboxes that register on the unix socket path
+func serveShared(path string) error {
+	for _, dir := range []string{config.MetricsPath, config.Capture.Path} {
+		if dir == "" {
+			continue
+		}
+		if err := os.MkdirAll(dir, 0700); err != nil {
+			return err
+		}
+	}
+	l, err := listenShared(path)
+	if err != nil {
+		return err
+	}
+	defer l.Close()
+	verbosef("Serving the sandboxes registering on %s", path)
+	for {
+		conn, err := l.AcceptUnix()
+		if err != nil {
+			if errors.Is(err, net.ErrClosed) {
+				return nil
+			}
+			return err
+		}
+		go serveSandbox(conn)
+	}
+}
+
+// serveSandbox registers the sandbox on conn and serves it until it's gone
+func serveSandbox(conn *net.UnixConn) {
+	answer := func(err error) {
+		msg := "ok"
+		if err != nil {
+			verbosef("Registration failed: %v", err)
+			msg = "error: " + strings.ReplaceAll(err.Error(), "\n", " ")
+		}
+		conn.Write([]byte(msg))
+		conn.Close()
+	}
+	cred, err := peerCredentials(conn)
+	if err == nil && int(cred.Uid) != os.Getuid() {
+		err = fmt.Errorf("uid %d may not register with the minitap of uid %d", cred.Uid, os.Getuid())
+	}
+	if err != nil {
+		answer(err)
+		return
+	}
+	r, err := readRegistration(conn)
+	if err != nil {
+		answer(err)
+		return
+	}
+	t, err := newSandboxTenant(r.rules, fmt.Sprintf("sandbox-%d", cred.Pid))
+	r.rules = -1
+	if err != nil {
+		r.close()
+		answer(err)
+		return
+	}
+	t.ipv6 = r.ipv6
+	// the dispatcher of the stack polls it
+	err = syscall.SetNonblock(r.tun, true)
+	var s *stack.Stack
+	if err == nil {
+		s, err = t.startStack([]int{r.tun}, r.mtu)
+	}
+	if err != nil {
+		t.remove()
+		r.close()
+		answer(err)
+		return
+	}
+	answer(nil)
+	verbosef("Sandbox of pid %d registered, MTU %d", cred.Pid, r.mtu)
+
+	if r.verdict >= 0 {
+		go serveControl(r.verdict, t.checkConnect)
+	}
+	serveControl(r.control, t.applyControl)
+
+	// the sandbox is gone
+	t.dumpMetrics()
+	t.flushCapture()
+	s.Close()
+	s.Wait()
+	syscall.Close(r.tun)
+	t.remove()
+	verbose("Sandbox gone")
+}
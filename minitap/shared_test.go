@@ -0,0 +1,221 @@
+package main
+
+import (
+	"context"
+	"net"
+	"net/netip"
+	"os"
+	"syscall"
+	"testing"
+	"time"
+
+	"github.com/miekg/dns"
+)
+
+// rulesFD returns a descriptor of a file holding data, as the rules memfd
+func rulesFD(t *testing.T, data []byte) int {
+	t.Helper()
+	f, err := os.CreateTemp(t.TempDir(), "rules")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer f.Close()
+	if _, err := f.Write(data); err != nil {
+		t.Fatal(err)
+	}
+	fd, err := syscall.Dup(int(f.Fd()))
+	if err != nil {
+		t.Fatal(err)
+	}
+	return fd
+}
+
+func pipeFDs(t *testing.T, n int) []int {
+	t.Helper()
+	var fds []int
+	for len(fds) < n {
+		var p [2]int
+		if err := syscall.Pipe(p[:]); err != nil {
+			t.Fatal(err)
+		}
+		fds = append(fds, p[:]...)
+	}
+	return fds[:n]
+}
+
+func TestParseRegistration(t *testing.T) {
+	r, err := parseRegistration("register 9000\n", pipeFDs(t, 3))
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer r.close()
+	if r.mtu != 9000 || r.tun < 0 || r.rules < 0 || r.control < 0 || r.verdict != -1 || r.ipv6 {
+		t.Errorf("registration %+v", r)
+	}
+	r, err = parseRegistration("register 1500 ipv6\x00", pipeFDs(t, 4))
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer r.close()
+	if r.mtu != 1500 || !r.ipv6 || r.verdict < 0 {
+		t.Errorf("registration %+v", r)
+	}
+
+	for msg, fds := range map[string]int{
+		"register 9000":      2,
+		"register 0":         3,
+		"register abc":       4,
+		"register 1500 ipv4": 3,
+		"hello":              3,
+	} {
+		if _, err := parseRegistration(msg, pipeFDs(t, fds)); err == nil {
+			t.Errorf("%q with %d descriptors registered", msg, fds)
+		}
+	}
+}
+
+func TestSandboxTenants(t *testing.T) {
+	metricsDir := t.TempDir()
+	defer func(path string) { config.MetricsPath = path }(config.MetricsPath)
+	config.MetricsPath = metricsDir
+	first, err := newSandboxTenant(rulesFD(t, encodeRules(-1, []string{"metrics=/tmp/elsewhere.json", "queues=4"},
+		[]netip.Prefix{netip.MustParsePrefix("192.0.2.0/24")}, nil)), "sandbox-1")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer first.remove()
+	second, err := newSandboxTenant(rulesFD(t, encodeRules(-1, nil,
+		[]netip.Prefix{netip.MustParsePrefix("198.51.100.0/24")}, nil)), "sandbox-2")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer second.remove()
+
+	// the sandboxes have a firewall each
+	addr := func(ip string) net.Addr { return &net.TCPAddr{IP: net.ParseIP(ip), Port: 443} }
+	if !first.firewallConnection(addr("192.0.2.1")) || first.firewallConnection(addr("198.51.100.1")) {
+		t.Error("first sandbox has the rules of the second one")
+	}
+	if !second.firewallConnection(addr("198.51.100.1")) || second.firewallConnection(addr("192.0.2.1")) {
+		t.Error("second sandbox has the rules of the first one")
+	}
+	if err := second.applyControl("allow 203.0.113.0/24"); err != nil {
+		t.Fatal(err)
+	}
+	if first.firewallConnection(addr("203.0.113.1")) {
+		t.Error("control of the second sandbox changed the first one")
+	}
+
+	// the files are named by the shared minitap, whatever the sandboxes ask for
+	if first.metrics.path != metricsDir+"/sandbox-1.json" || second.metrics.path != metricsDir+"/sandbox-2.json" {
+		t.Errorf("metrics paths %q and %q", first.metrics.path, second.metrics.path)
+	}
+	if config.Queues == 4 {
+		t.Error("option of a sandbox applied to the shared minitap")
+	}
+
+	if _, err := newSandboxTenant(rulesFD(t, []byte("not rules")), "sandbox-3"); err == nil {
+		t.Error("invalid rules accepted")
+	}
+}
+
+func TestSandboxTenantsShareAnswers(t *testing.T) {
+	// another sandbox already resolved both names
+	expires := time.Now().Add(time.Hour)
+	resolverCache.mu.Lock()
+	resolverCache.entries["shared.test."] = &dnsCacheEntry{resolvedName: "shared.test.",
+		ips: []net.IP{net.ParseIP("192.0.2.10")}, ttl: 3600, expires: expires}
+	resolverCache.entries["a.wild.test."] = &dnsCacheEntry{resolvedName: "a.wild.test.",
+		ips: []net.IP{net.ParseIP("192.0.2.11")}, ttl: 3600, expires: expires}
+	resolverCache.mu.Unlock()
+	defer func() {
+		resolverCache.mu.Lock()
+		delete(resolverCache.entries, "shared.test.")
+		delete(resolverCache.entries, "a.wild.test.")
+		resolverCache.mu.Unlock()
+	}()
+
+	sandbox, err := newSandboxTenant(rulesFD(t, encodeRules(-1, nil, nil,
+		[]string{"shared.test", "*.wild.test"})), "sandbox-1")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer sandbox.remove()
+	addr := func(ip string) net.Addr { return &net.TCPAddr{IP: net.ParseIP(ip), Port: 443} }
+	if !sandbox.firewallConnection(addr("192.0.2.10")) {
+		t.Error("cached answer of an allowed domain denied")
+	}
+
+	// names under a wildcard rule are only known once the sandbox asks
+	if sandbox.firewallConnection(addr("192.0.2.11")) {
+		t.Error("name under a wildcard rule allowed before it was resolved")
+	}
+	var req dns.Msg
+	req.SetQuestion("a.wild.test.", dns.TypeA)
+	if rrs, err := sandbox.handleDNSQuery(context.Background(), &req); err != nil || len(rrs) != 1 {
+		t.Fatalf("answer %v, %v", rrs, err)
+	}
+	if !sandbox.firewallConnection(addr("192.0.2.11")) {
+		t.Error("cached answer of a name under a wildcard rule denied")
+	}
+}
+
+func TestListenShared(t *testing.T) {
+	dir := t.TempDir()
+	// others may get into the directory
+	if err := os.Chmod(dir, 0755); err != nil {
+		t.Fatal(err)
+	}
+	if l, err := listenShared(dir + "/minitap.sock"); err == nil {
+		l.Close()
+		t.Fatal("listening in a directory others can get into")
+	}
+
+	path := dir + "/private/minitap.sock"
+	l, err := listenShared(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if fi, err := os.Stat(path); err != nil || fi.Mode().Perm() != 0600 {
+		t.Errorf("socket %v, %v", fi.Mode(), err)
+	}
+	// the socket is in use
+	if l, err := listenShared(path); err == nil {
+		l.Close()
+		t.Error("listening on a socket already served")
+	}
+
+	// the credentials of the sandboxes connecting are checked
+	conn, err := net.Dial("unixpacket", path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	accepted, err := l.AcceptUnix()
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer accepted.Close()
+	cred, err := peerCredentials(accepted)
+	if err != nil || int(cred.Uid) != os.Getuid() || int(cred.Pid) != os.Getpid() {
+		t.Errorf("credentials %+v, %v", cred, err)
+	}
+
+	// a socket left behind is replaced, anything else is left alone
+	l.SetUnlinkOnClose(false)
+	l.Close()
+	if l, err = listenShared(path); err != nil {
+		t.Fatalf("stale socket: %v", err)
+	}
+	l.Close()
+	if err := os.WriteFile(path, nil, 0600); err != nil {
+		t.Fatal(err)
+	}
+	if l, err := listenShared(path); err == nil {
+		l.Close()
+		t.Error("listening in place of a file")
+	}
+	if _, err := os.Stat(path); err != nil {
+		t.Errorf("file removed: %v", err)
+	}
+}
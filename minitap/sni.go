@@ -0,0 +1,271 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"net"
+	"net/netip"
+	"strings"
+	"time"
+
+	"github.com/miekg/dns"
+)
+
+// With the sni option, the HTTP and HTTPS connections to addresses that no
+// rule allows are decided by the name the sandbox asks for instead: the
+// server name of the TLS ClientHello or the Host header of the request,
+// checked against the allowed domains. Connecting to a CDN that rotates its
+// addresses then needs neither the addresses to be known beforehand nor a DNS
+// round-trip while the sandbox waits.
+//
+// The name is the one the sandbox claims, nothing checks that the address
+// belongs to it: a payload that makes up its own ClientHello can reach any
+// server on these ports by naming an allowed domain.
+
+const (
+	// how long the sandbox has to send its first bytes
+	namePeekTimeout = 5 * time.Second
+	// a ClientHello is at most a few KiB, and so are the headers of a request
+	maxNamePeek = 16 << 10
+)
+
+var (
+	errNameIncomplete = errors.New("incomplete")
+	errNameDenied     = errors.New("name not allowed")
+)
+
+// inspectByName tells whether the TCP connection to addr is decided by
+// name: the sni option is on, it's to an HTTP(S) port and only the domain
+// rules could allow it
+func (t *tenant) inspectByName(addr net.Addr) bool {
+	tcpAddr, ok := addr.(*net.TCPAddr)
+	if !ok || !config.SNI || nameParser(tcpAddr.Port) == nil {
+		return false
+	}
+	cur := t.policy.Load()
+	if cur.budget != nil || !cur.restricted || len(cur.domains)+cur.wildcards.Len() == 0 {
+		return false
+	}
+	destination, ok := netip.AddrFromSlice(tcpAddr.IP)
+	return ok && !t.isAllowedIp(destination.Unmap())
+}
+
+// nameParser returns the parser of the first bytes the sandbox sends to port,
+// nil if it's neither an HTTP nor an HTTPS port
+func nameParser(port int) func([]byte) (string, error) {
+	for _, p := range config.HTTPSPorts {
+		if p == port {
+			return parseServerName
+		}
+	}
+	for _, p := range config.HTTPPorts {
+		if p == port {
+			return parseHostHeader
+		}
+	}
+	return nil
+}
+
+// firewallName is the in-memory lookup of the name the sandbox connects to
+func (t *tenant) firewallName(name string) bool {
+	return t.policy.Load().allowsDomain(dns.Fqdn(strings.ToLower(name)))
+}
+
+// namedRequest is a TCP request that is accepted, and let through, only if the
+// name in the first bytes of the sandbox is allowed
+type namedRequest struct {
+	TCPRequest
+	tenant *tenant
+}
+
+func (r *namedRequest) Accept() (net.Conn, error) {
+	conn, err := r.TCPRequest.Accept()
+	if err != nil {
+		return nil, err
+	}
+	addr := r.LocalAddr().(*net.TCPAddr)
+	name, peeked, err := peekName(conn, nameParser(addr.Port))
+	if err != nil || !r.tenant.firewallName(name) {
+		r.tenant.metrics.connection("tcp", false)
+		conn.Close()
+		return nil, fmt.Errorf("%w: %q to %v (%v)", errNameDenied, name, addr, err)
+	}
+	r.tenant.metrics.connection("tcp", true)
+	r.tenant.metrics.resolved(name, []net.IP{addr.IP})
+	verbosef("Hit name: %s to %v\n", name, addr)
+	return &peekedConn{Conn: conn, peeked: peeked}, nil
+}
+
+// peekName reads from conn until parse finds the name. The bytes read are
+// returned, for the world to get them too.
+func peekName(conn net.Conn, parse func([]byte) (string, error)) (string, []byte, error) {
+	conn.SetReadDeadline(time.Now().Add(namePeekTimeout))
+	defer conn.SetReadDeadline(time.Time{})
+	buf := make([]byte, 0, 2048)
+	for {
+		if len(buf) == cap(buf) {
+			if len(buf) >= maxNamePeek {
+				return "", buf, errors.New("no name in the first bytes")
+			}
+			buf = append(buf, make([]byte, len(buf))...)[:len(buf)]
+		}
+		n, err := conn.Read(buf[len(buf):cap(buf)])
+		buf = buf[:len(buf)+n]
+		name, perr := parse(buf)
+		if perr != errNameIncomplete {
+			return name, buf, perr
+		}
+		if err != nil {
+			return "", buf, err
+		}
+	}
+}
+
+// peekedConn reads the bytes that were peeked before the rest of the
+// connection
+type peekedConn struct {
+	net.Conn
+	peeked []byte
+}
+
+func (c *peekedConn) Read(b []byte) (int, error) {
+	if len(c.peeked) > 0 {
+		n := copy(b, c.peeked)
+		c.peeked = c.peeked[n:]
+		return n, nil
+	}
+	return c.Conn.Read(b)
+}
+
+func (c *peekedConn) CloseWrite() error {
+	if cw, ok := c.Conn.(closeWriter); ok {
+		return cw.CloseWrite()
+	}
+	return c.Conn.Close()
+}
+
+// helloReader reads the fields of a ClientHello (RFC 8446 section 4.1.2)
+type helloReader []byte
+
+func (r *helloReader) skip(n int) bool {
+	if len(*r) < n {
+		return false
+	}
+	*r = (*r)[n:]
+	return true
+}
+
+// vector reads a field preceded by its length on size bytes
+func (r *helloReader) vector(size int) (helloReader, bool) {
+	if len(*r) < size {
+		return nil, false
+	}
+	n := 0
+	for _, b := range (*r)[:size] {
+		n = n<<8 | int(b)
+	}
+	*r = (*r)[size:]
+	if len(*r) < n {
+		return nil, false
+	}
+	v := (*r)[:n]
+	*r = (*r)[n:]
+	return v, true
+}
+
+// parseServerName returns the server name of the ClientHello at the start of
+// data, which may span several TLS records
+func parseServerName(data []byte) (string, error) {
+	var hello []byte
+	for {
+		if len(data) < 5 {
+			return "", errNameIncomplete
+		}
+		// handshake records
+		if data[0] != 22 {
+			return "", errors.New("not a TLS handshake")
+		}
+		n := int(binary.BigEndian.Uint16(data[3:5]))
+		if len(data) < 5+n {
+			return "", errNameIncomplete
+		}
+		hello = append(hello, data[5:5+n]...)
+		data = data[5+n:]
+		if len(hello) < 4 {
+			continue
+		}
+		if hello[0] != 1 {
+			return "", errors.New("not a ClientHello")
+		}
+		size := 4 + (int(hello[1])<<16 | int(hello[2])<<8 | int(hello[3]))
+		if len(hello) >= size {
+			return serverNameExtension(helloReader(hello[4:size]))
+		}
+	}
+}
+
+func serverNameExtension(r helloReader) (string, error) {
+	invalid := errors.New("invalid ClientHello")
+	// version and random
+	if !r.skip(2 + 32) {
+		return "", invalid
+	}
+	for _, size := range []int{1, 2, 1} { // session id, ciphers, compression
+		if _, ok := r.vector(size); !ok {
+			return "", invalid
+		}
+	}
+	extensions, ok := r.vector(2)
+	if !ok {
+		return "", invalid
+	}
+	for len(extensions) > 0 {
+		var kind [2]byte
+		copy(kind[:], extensions)
+		if !extensions.skip(2) {
+			return "", invalid
+		}
+		data, ok := extensions.vector(2)
+		if !ok {
+			return "", invalid
+		}
+		if kind != [2]byte{0, 0} {
+			continue
+		}
+		names, ok := data.vector(2)
+		for ok && len(names) > 0 {
+			nameType := names[0]
+			names.skip(1)
+			var name helloReader
+			if name, ok = names.vector(2); ok && nameType == 0 {
+				return string(name), nil
+			}
+		}
+		return "", invalid
+	}
+	return "", errors.New("no server name")
+}
+
+// parseHostHeader returns the host of the Host header of the HTTP request at
+// the start of data
+func parseHostHeader(data []byte) (string, error) {
+	end := bytes.Index(data, []byte("\r\n\r\n"))
+	if end < 0 {
+		return "", errNameIncomplete
+	}
+	lines := strings.Split(string(data[:end]), "\r\n")
+	for _, line := range lines[1:] {
+		key, value, ok := strings.Cut(line, ":")
+		if !ok || !strings.EqualFold(key, "host") {
+			continue
+		}
+		host := strings.TrimSpace(value)
+		if !strings.HasPrefix(host, "[") {
+			host, _, _ = strings.Cut(host, ":")
+		}
+		return host, nil
+	}
+	return "", errors.New("no Host header")
+}
@@ -0,0 +1,161 @@
+package main
+
+import (
+	"crypto/tls"
+	"errors"
+	"io"
+	"net"
+	"testing"
+	"time"
+)
+
+// pipeRequest is a TCP request whose accepted end is one of a pipe
+type pipeRequest struct {
+	local  *net.TCPAddr
+	server net.Conn
+
+	accepted, rejected bool
+}
+
+func (r *pipeRequest) RemoteAddr() net.Addr {
+	return &net.TCPAddr{IP: net.IPv4(10, 1, 1, 100), Port: 4000}
+}
+func (r *pipeRequest) LocalAddr() net.Addr { return r.local }
+func (r *pipeRequest) Accept() (net.Conn, error) {
+	r.accepted = true
+	return r.server, nil
+}
+func (r *pipeRequest) Reject()             { r.rejected = true }
+func (r *pipeRequest) Received() time.Time { return time.Now() }
+
+// clientHello returns the ClientHello of a TLS client to serverName
+func clientHello(t *testing.T, serverName string) []byte {
+	t.Helper()
+	client, server := net.Pipe()
+	defer server.Close()
+	go tls.Client(client, &tls.Config{ServerName: serverName}).Handshake()
+	var hello []byte
+	buf := make([]byte, 4096)
+	for {
+		n, err := server.Read(buf)
+		if err != nil {
+			t.Fatal(err)
+		}
+		hello = append(hello, buf[:n]...)
+		if _, err := parseServerName(hello); err != errNameIncomplete {
+			client.Close()
+			return hello
+		}
+	}
+}
+
+func setupSNI(t *testing.T) {
+	t.Helper()
+	resetFirewall(t, -1, []string{"192.0.2.0/24"}, []string{"allowed.test."})
+	saved := config
+	config.SNI, config.HTTPPorts, config.HTTPSPorts = true, []int{80}, []int{443}
+	t.Cleanup(func() { config = saved })
+}
+
+func TestParseServerName(t *testing.T) {
+	hello := clientHello(t, "allowed.test")
+	if name, err := parseServerName(hello); name != "allowed.test" || err != nil {
+		t.Fatalf("parseServerName = %q, %v", name, err)
+	}
+	for n := 0; n < len(hello); n++ {
+		if _, err := parseServerName(hello[:n]); err != errNameIncomplete {
+			t.Fatalf("parseServerName of the first %d bytes out of %d: %v", n, len(hello), err)
+		}
+	}
+
+	// the same handshake split in two records
+	body := hello[5:]
+	var split []byte
+	for _, part := range [][]byte{body[:10], body[10:]} {
+		split = append(split, 22, 3, 1, byte(len(part)>>8), byte(len(part)))
+		split = append(split, part...)
+	}
+	if name, err := parseServerName(split); name != "allowed.test" || err != nil {
+		t.Errorf("parseServerName of two records = %q, %v", name, err)
+	}
+
+	if _, err := parseServerName([]byte("GET / HTTP/1.1\r\n")); err == nil || err == errNameIncomplete {
+		t.Errorf("parseServerName of HTTP: %v", err)
+	}
+}
+
+func TestParseHostHeader(t *testing.T) {
+	for request, want := range map[string]string{
+		"GET / HTTP/1.1\r\nHost: example.com\r\n\r\n":                      "example.com",
+		"GET / HTTP/1.1\r\nUser-Agent: x\r\nhost:example.com:8080\r\n\r\n": "example.com",
+		"GET / HTTP/1.1\r\nHost: [2001:db8::1]:80\r\n\r\n":                 "[2001:db8::1]:80",
+	} {
+		if host, err := parseHostHeader([]byte(request)); host != want || err != nil {
+			t.Errorf("parseHostHeader(%q) = %q, %v", request, host, err)
+		}
+	}
+	if _, err := parseHostHeader([]byte("GET / HTTP/1.1\r\nHost: example.com\r\n")); err != errNameIncomplete {
+		t.Errorf("incomplete headers: %v", err)
+	}
+	if _, err := parseHostHeader([]byte("GET / HTTP/1.0\r\n\r\n")); err == nil || err == errNameIncomplete {
+		t.Errorf("no Host header: %v", err)
+	}
+}
+
+func TestInspectByName(t *testing.T) {
+	setupSNI(t)
+	for _, test := range []struct {
+		addr    string
+		inspect bool
+	}{
+		{"198.51.100.1:443", true},
+		{"198.51.100.1:80", true},
+		{"198.51.100.1:22", false},
+		// allowed by its address already
+		{"192.0.2.1:443", false},
+	} {
+		addr, _ := net.ResolveTCPAddr("tcp", test.addr)
+		if defaultTenant.inspectByName(addr) != test.inspect {
+			t.Errorf("defaultTenant.inspectByName(%s) = %v", test.addr, !test.inspect)
+		}
+	}
+	if defaultTenant.inspectByName(&net.UDPAddr{IP: net.IPv4(198, 51, 100, 1), Port: 443}) {
+		t.Error("UDP inspected")
+	}
+	config.SNI = false
+	if defaultTenant.inspectByName(&net.TCPAddr{IP: net.IPv4(198, 51, 100, 1), Port: 443}) {
+		t.Error("inspected without the sni option")
+	}
+}
+
+func TestNamedRequest(t *testing.T) {
+	setupSNI(t)
+	accept := func(port int, first []byte) (net.Conn, error) {
+		client, server := net.Pipe()
+		t.Cleanup(func() { client.Close() })
+		go client.Write(first)
+		r := &namedRequest{&pipeRequest{local: &net.TCPAddr{IP: net.IPv4(198, 51, 100, 1), Port: port}, server: server}, defaultTenant}
+		return r.Accept()
+	}
+
+	request := []byte("GET / HTTP/1.1\r\nHost: ALLOWED.test\r\n\r\n")
+	conn, err := accept(80, request)
+	if err != nil {
+		t.Fatal(err)
+	}
+	// what the world gets starts with what was peeked
+	got := make([]byte, len(request))
+	if _, err := io.ReadFull(conn, got); err != nil || string(got) != string(request) {
+		t.Errorf("read %q, %v", got, err)
+	}
+
+	if _, err := accept(443, clientHello(t, "allowed.test")); err != nil {
+		t.Error(err)
+	}
+	if _, err := accept(443, clientHello(t, "denied.test")); !errors.Is(err, errNameDenied) {
+		t.Errorf("denied name: %v", err)
+	}
+	if _, err := accept(443, request); !errors.Is(err, errNameDenied) {
+		t.Errorf("HTTP on the HTTPS port: %v", err)
+	}
+}
@@ -0,0 +1,191 @@
+package main
+
+import (
+	"fmt"
+	"io"
+	"runtime"
+	"testing"
+	"time"
+
+	"golang.org/x/sys/unix"
+	"gvisor.dev/gvisor/pkg/tcpip"
+	"gvisor.dev/gvisor/pkg/tcpip/adapters/gonet"
+	"gvisor.dev/gvisor/pkg/tcpip/header"
+	"gvisor.dev/gvisor/pkg/tcpip/link/fdbased"
+	"gvisor.dev/gvisor/pkg/tcpip/network/ipv4"
+	"gvisor.dev/gvisor/pkg/tcpip/stack"
+	"gvisor.dev/gvisor/pkg/tcpip/transport/tcp"
+	"gvisor.dev/gvisor/pkg/waiter"
+)
+
+const (
+	benchMaxInFlight = 1024
+	benchMTU         = 1500
+	// what a bulk transfer sends on each connection
+	benchBulkSize = 64 << 20
+)
+
+var benchServerAddr = tcpip.FullAddress{NIC: 1, Addr: tcpip.AddrFrom4([4]byte{192, 0, 2, 1}), Port: 80}
+
+// newBenchStack returns a stack with an IPv4 NIC on fds, with the TCP options
+// o or the gVisor defaults if nil
+func newBenchStack(b *testing.B, fds []int, mtu int, o *tcpConfig) *stack.Stack {
+	s := stack.New(stack.Options{
+		NetworkProtocols:   []stack.NetworkProtocolFactory{ipv4.NewProtocol},
+		TransportProtocols: []stack.TransportProtocolFactory{tcp.NewProtocol},
+	})
+	if o != nil {
+		if err := applyTCPOptions(s, *o); err != nil {
+			b.Fatal(err)
+		}
+	}
+	endpoint, err := fdbased.New(&fdbased.Options{FDs: fds, MTU: uint32(mtu)})
+	if err != nil {
+		b.Fatal(err)
+	}
+	if err := s.CreateNIC(1, endpoint); err != nil {
+		b.Fatal(err)
+	}
+	s.SetRouteTable([]tcpip.Route{{Destination: header.IPv4EmptySubnet, NIC: 1}})
+	return s
+}
+
+// newLinkedStacks plays minitap and the sandbox with two stacks linked by one
+// socket pair per queue, which stand for the queues of the TUN device. The
+// minitap side accepts every connection with a forwarder, as RunNetwork does,
+// and echoes echoSize bytes before closing it, so that TIME_WAIT stays on its
+// side.
+func newLinkedStacks(b *testing.B, queues int, mtu int, o *tcpConfig, echoSize int64) *stack.Stack {
+	var sandboxFDs, minitapFDs []int
+	for i := 0; i < queues; i++ {
+		pair, err := unix.Socketpair(unix.AF_UNIX, unix.SOCK_SEQPACKET, 0)
+		if err != nil {
+			b.Fatal(err)
+		}
+		sandboxFDs = append(sandboxFDs, pair[0])
+		minitapFDs = append(minitapFDs, pair[1])
+	}
+
+	minitap := newBenchStack(b, minitapFDs, mtu, o)
+	minitap.SetPromiscuousMode(1, true)
+	minitap.SetSpoofing(1, true)
+	forwarder := tcp.NewForwarder(minitap, 0, benchMaxInFlight, func(r *tcp.ForwarderRequest) {
+		conn, err := (&tcpRequest{r, new(waiter.Queue), time.Now()}).Accept()
+		if err != nil {
+			return
+		}
+		io.CopyN(conn, conn, echoSize)
+		conn.Close()
+	})
+	minitap.SetTransportProtocolHandler(tcp.ProtocolNumber, forwarder.HandlePacket)
+
+	sandbox := newBenchStack(b, sandboxFDs, mtu, o)
+	sandbox.AddProtocolAddress(1, tcpip.ProtocolAddress{
+		Protocol:          ipv4.ProtocolNumber,
+		AddressWithPrefix: tcpip.AddrFrom4([4]byte{10, 1, 1, 100}).WithPrefix(),
+	}, stack.AddressProperties{})
+	return sandbox
+}
+
+// echo opens a connection through the stacks, sends payload and waits for it
+// to come back
+func echo(b *testing.B, sandbox *stack.Stack, payload []byte) {
+	conn, err := gonet.DialTCP(sandbox, benchServerAddr, ipv4.ProtocolNumber)
+	if err != nil {
+		b.Error(err)
+		return
+	}
+	defer conn.Close()
+	go conn.Write(payload)
+	if n, err := io.Copy(io.Discard, conn); err != nil || n != int64(len(payload)) {
+		b.Errorf("echoed %d bytes out of %d: %v", n, len(payload), err)
+	}
+}
+
+func benchQueues() []int {
+	if runtime.NumCPU() == 1 {
+		return []int{1}
+	}
+	return []int{1, runtime.NumCPU()}
+}
+
+// BenchmarkConnectionRate opens short connections from many goroutines at
+// once, like a parallel test suite does, through one or one per CPU queues
+func BenchmarkConnectionRate(b *testing.B) {
+	for _, queues := range benchQueues() {
+		sandbox := newLinkedStacks(b, queues, benchMTU, &tcpOptions, 1)
+		b.Run(fmt.Sprintf("queues=%d", queues), func(b *testing.B) {
+			b.SetParallelism(16)
+			b.RunParallel(func(pb *testing.PB) {
+				payload := []byte{0}
+				for pb.Next() {
+					echo(b, sandbox, payload)
+				}
+			})
+		})
+	}
+}
+
+// BenchmarkStackThroughput echoes benchTransferSize bytes on connections
+// from many goroutines at once
+func BenchmarkStackThroughput(b *testing.B) {
+	for _, queues := range benchQueues() {
+		sandbox := newLinkedStacks(b, queues, benchMTU, &tcpOptions, benchTransferSize)
+		b.Run(fmt.Sprintf("queues=%d", queues), func(b *testing.B) {
+			b.SetBytes(2 * benchTransferSize)
+			b.RunParallel(func(pb *testing.PB) {
+				payload := make([]byte, benchTransferSize)
+				for pb.Next() {
+					echo(b, sandbox, payload)
+				}
+			})
+		})
+	}
+}
+
+func cpuTime() time.Duration {
+	var usage unix.Rusage
+	if err := unix.Getrusage(unix.RUSAGE_SELF, &usage); err != nil {
+		return 0
+	}
+	return time.Duration(usage.Utime.Nano() + usage.Stime.Nano())
+}
+
+// benchBulk echoes benchBulkSize bytes on one connection at a time, like a
+// download, and reports the CPU time (of both stacks) it takes per GB
+func benchBulk(b *testing.B, sandbox *stack.Stack) {
+	payload := make([]byte, benchBulkSize)
+	b.SetBytes(2 * benchBulkSize)
+	start := cpuTime()
+	for i := 0; i < b.N; i++ {
+		echo(b, sandbox, payload)
+	}
+	gb := float64(b.N) * 2 * benchBulkSize / (1 << 30)
+	b.ReportMetric((cpuTime()-start).Seconds()/gb, "cpu-s/GB")
+}
+
+// BenchmarkBulkTransfer compares the default MTU and the largest one
+func BenchmarkBulkTransfer(b *testing.B) {
+	for _, mtu := range []int{benchMTU, maxTunMTU} {
+		sandbox := newLinkedStacks(b, 1, mtu, &tcpOptions, benchBulkSize)
+		b.Run(fmt.Sprintf("mtu=%d", mtu), func(b *testing.B) {
+			benchBulk(b, sandbox)
+		})
+	}
+}
+
+// BenchmarkTCPOptions compares the gVisor TCP defaults with the minitap ones
+func BenchmarkTCPOptions(b *testing.B) {
+	for _, bench := range []struct {
+		name string
+		o    *tcpConfig
+	}{
+		{"gvisor-defaults", nil},
+		{"minitap-defaults", &tcpOptions},
+	} {
+		sandbox := newLinkedStacks(b, 1, benchMTU, bench.o, benchBulkSize)
+		b.Run(bench.name, func(b *testing.B) {
+			benchBulk(b, sandbox)
+		})
+	}
+}
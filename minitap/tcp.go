@@ -3,6 +3,7 @@ package main
 import (
 	"fmt"
 	"net"
+	"time"
 	"gvisor.dev/gvisor/pkg/tcpip/adapters/gonet"
 	"gvisor.dev/gvisor/pkg/tcpip/transport/tcp"
 	"gvisor.dev/gvisor/pkg/waiter"
@@ -24,11 +25,15 @@ type TCPRequest interface {
 
 	// Reject replies with a RST and the connection is done
 	Reject()
+
+	// Received is when the SYN of the subprocess arrived
+	Received() time.Time
 }
 
 type tcpRequest struct {
-	fr *tcp.ForwarderRequest
-	wq *waiter.Queue
+	fr       *tcp.ForwarderRequest
+	wq       *waiter.Queue
+	received time.Time
 }
 
 func (r *tcpRequest) RemoteAddr() net.Addr {
@@ -60,3 +65,7 @@ func (r *tcpRequest) Accept() (net.Conn, error) {
 func (r *tcpRequest) Reject() {
 	r.fr.Complete(true)
 }
+
+func (r *tcpRequest) Received() time.Time {
+	return r.received
+}
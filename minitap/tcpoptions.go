@@ -0,0 +1,124 @@
+package main
+
+import (
+	"fmt"
+	"strconv"
+
+	"gvisor.dev/gvisor/pkg/tcpip"
+	"gvisor.dev/gvisor/pkg/tcpip/stack"
+	"gvisor.dev/gvisor/pkg/tcpip/transport/tcp"
+)
+
+// tcpConfig holds the TCP options of the stack. Each connection of the
+// sandbox is a gVisor connection on one side and a host one on the other, and
+// the gVisor side is the one held back by the stack defaults.
+type tcpConfig struct {
+	SACK                  bool
+	ModerateReceiveBuffer bool
+	// Delay is Nagle's algorithm
+	Delay             bool
+	CongestionControl string
+	// largest buffers a connection grows to, in bytes
+	ReceiveBufferMax int
+	SendBufferMax    int
+}
+
+// The defaults favour throughput: the buffers are allowed to grow well past
+// the bandwidth-delay product of a fast link, but only do so on the
+// connections that need it thanks to the receive buffer moderation
+var tcpOptions = tcpConfig{
+	SACK:                  true,
+	ModerateReceiveBuffer: true,
+	Delay:                 false,
+	CongestionControl:     "cubic",
+	ReceiveBufferMax:      16 << 20,
+	SendBufferMax:         16 << 20,
+}
+
+// setTCPOption sets one of the tcp-* options passed by mini-tapbox, it returns
+// false if key is not one of them
+func setTCPOption(key string, value string) (bool, error) {
+	switch key {
+	case "tcp-congestion":
+		if value != "reno" && value != "cubic" {
+			return true, fmt.Errorf("unknown congestion control %q", value)
+		}
+		tcpOptions.CongestionControl = value
+		return true, nil
+	case "tcp-sack", "tcp-moderate-rcvbuf", "tcp-delay":
+		enabled, err := strconv.ParseBool(value)
+		if err != nil {
+			return true, err
+		}
+		switch key {
+		case "tcp-sack":
+			tcpOptions.SACK = enabled
+		case "tcp-moderate-rcvbuf":
+			tcpOptions.ModerateReceiveBuffer = enabled
+		case "tcp-delay":
+			tcpOptions.Delay = enabled
+		}
+		return true, nil
+	case "tcp-rcvbuf-max", "tcp-sndbuf-max":
+		n, err := strconv.Atoi(value)
+		if err != nil || n <= 0 {
+			return true, fmt.Errorf("invalid size %q", value)
+		}
+		if key == "tcp-rcvbuf-max" {
+			tcpOptions.ReceiveBufferMax = n
+		} else {
+			tcpOptions.SendBufferMax = n
+		}
+		return true, nil
+	}
+	return false, nil
+}
+
+// applyTCPOptions sets o on the TCP protocol of s
+func applyTCPOptions(s *stack.Stack, o tcpConfig) error {
+	sack := tcpip.TCPSACKEnabled(o.SACK)
+	if err := s.SetTransportProtocolOption(tcp.ProtocolNumber, &sack); err != nil {
+		return fmt.Errorf("SACK: %v", err)
+	}
+	moderate := tcpip.TCPModerateReceiveBufferOption(o.ModerateReceiveBuffer)
+	if err := s.SetTransportProtocolOption(tcp.ProtocolNumber, &moderate); err != nil {
+		return fmt.Errorf("receive buffer moderation: %v", err)
+	}
+	delay := tcpip.TCPDelayEnabled(o.Delay)
+	if err := s.SetTransportProtocolOption(tcp.ProtocolNumber, &delay); err != nil {
+		return fmt.Errorf("delay: %v", err)
+	}
+	cc := tcpip.CongestionControlOption(o.CongestionControl)
+	if err := s.SetTransportProtocolOption(tcp.ProtocolNumber, &cc); err != nil {
+		return fmt.Errorf("congestion control %s: %v", o.CongestionControl, err)
+	}
+
+	// Only the maximum sizes change, connections start with the default ones
+	var rcv tcpip.TCPReceiveBufferSizeRangeOption
+	if err := s.TransportProtocolOption(tcp.ProtocolNumber, &rcv); err != nil {
+		return fmt.Errorf("receive buffer sizes: %v", err)
+	}
+	rcv.Max = max(o.ReceiveBufferMax, rcv.Default)
+	if err := s.SetTransportProtocolOption(tcp.ProtocolNumber, &rcv); err != nil {
+		return fmt.Errorf("receive buffer sizes: %v", err)
+	}
+	var snd tcpip.TCPSendBufferSizeRangeOption
+	if err := s.TransportProtocolOption(tcp.ProtocolNumber, &snd); err != nil {
+		return fmt.Errorf("send buffer sizes: %v", err)
+	}
+	snd.Max = max(o.SendBufferMax, snd.Default)
+	if err := s.SetTransportProtocolOption(tcp.ProtocolNumber, &snd); err != nil {
+		return fmt.Errorf("send buffer sizes: %v", err)
+	}
+
+	// The stack wide limits cap the TCP ones
+	rcvLimit := tcpip.ReceiveBufferSizeOption{Min: rcv.Min, Default: rcv.Default, Max: rcv.Max}
+	if err := s.SetOption(rcvLimit); err != nil {
+		return fmt.Errorf("stack receive buffer sizes: %v", err)
+	}
+	sndLimit := tcpip.SendBufferSizeOption{Min: snd.Min, Default: snd.Default, Max: snd.Max}
+	if err := s.SetOption(sndLimit); err != nil {
+		return fmt.Errorf("stack send buffer sizes: %v", err)
+	}
+	return nil
+}
@@ -0,0 +1,78 @@
+package main
+
+import (
+	"net/netip"
+	"sync"
+	"sync/atomic"
+)
+
+// tenant is what minitap keeps for each sandbox it serves: the firewall
+// policy, the traffic counters, the UDP flows and the packet capture. minitap started by
+// mini-tapbox serves one sandbox, defaultTenant, while a shared minitap (see
+// shared.go) has a tenant per sandbox registered. Everything else (the DNS
+// cache, the options) is the process's.
+type tenant struct {
+	policy atomic.Pointer[firewallPolicy]
+	// policyMu serializes updatePolicy
+	policyMu sync.Mutex
+
+	metrics     trafficMetrics
+	udpSessions udpSessionTable
+	// nil without the pcap option, see capture.go
+	capture *packetCapture
+	// ipv6 is set when the sandbox has an IPv6 route to minitap, AAAA
+	// queries get no answer otherwise
+	ipv6 bool
+}
+
+var defaultTenant = newTenant()
+
+var (
+	tenantsMu sync.Mutex
+	// the tenants being served, the answers of the DNS cache go to all of
+	// them
+	tenants = make(map[*tenant]struct{})
+)
+
+func newTenant() *tenant {
+	t := &tenant{
+		metrics: trafficMetrics{
+			names:        make(map[netip.Addr]string),
+			destinations: make(map[destinationKey]*destinationCounters),
+		},
+		udpSessions: udpSessionTable{sessions: make(map[udpFlow]*udpSession)},
+	}
+	t.policy.Store(&firewallPolicy{
+		prefixes:  &prefixTree{},
+		ips:       make(map[netip.Addr]int),
+		domains:   make(map[string][]netip.Addr),
+		wildcards: &domainTrie{},
+		matched:   make(map[string][]netip.Addr),
+	})
+	tenantsMu.Lock()
+	tenants[t] = struct{}{}
+	tenantsMu.Unlock()
+	return t
+}
+
+// eachTenant calls f with every tenant, outside of tenantsMu
+func eachTenant(f func(t *tenant)) {
+	tenantsMu.Lock()
+	all := make([]*tenant, 0, len(tenants))
+	for t := range tenants {
+		all = append(all, t)
+	}
+	tenantsMu.Unlock()
+	for _, t := range all {
+		f(t)
+	}
+}
+
+// remove stops serving t: the DNS cache forgets about it and its UDP flows
+// are closed
+func (t *tenant) remove() {
+	tenantsMu.Lock()
+	delete(tenants, t)
+	tenantsMu.Unlock()
+	t.udpSessions.close()
+}
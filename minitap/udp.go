@@ -0,0 +1,266 @@
+package main
+
+import (
+	"net"
+	"net/netip"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+// UDP has no end of flow: minitap keeps the flows of each sandbox in the
+// udpSessions of its tenant, and closes the ones that stay idle for
+// config.UDPTimeout along with the socket they go through to the world. Each
+// flow (the 5-tuple of the gVisor endpoint the forwarder created for it) keeps
+// its socket for as long as it lives.
+
+// udpBatchSize is the number of datagrams read from the world at once
+const udpBatchSize = 8
+
+type udpFlow struct {
+	sandbox, destination netip.AddrPort
+}
+
+type udpSession struct {
+	table      *udpSessionTable
+	flow       udpFlow
+	subprocess net.Conn
+	// nil for the flows minitap answers itself (DNS)
+	world *net.UDPConn
+	// when the last datagram went through, in unix nanoseconds
+	lastActive atomic.Int64
+	closed     atomic.Bool
+}
+
+type udpSessionTable struct {
+	mu       sync.Mutex
+	sessions map[udpFlow]*udpSession
+	reaper   sync.Once
+	// once the tenant is gone
+	closed atomic.Bool
+}
+
+// udpBatch holds what a recvmmsg needs, they are pooled as the buffers
+type udpBatch struct {
+	bufs [udpBatchSize][]byte
+	iovs [udpBatchSize]syscall.Iovec
+	msgs [udpBatchSize]mmsghdr
+}
+
+// mmsghdr is struct mmsghdr, Go pads it as C does
+type mmsghdr struct {
+	hdr syscall.Msghdr
+	len uint32
+}
+
+var udpBatchPool = sync.Pool{New: func() any {
+	b := &udpBatch{}
+	for i := range b.bufs {
+		b.bufs[i] = make([]byte, udpProxyBufferSize)
+		b.iovs[i].Base = &b.bufs[i][0]
+		b.iovs[i].SetLen(udpProxyBufferSize)
+		b.msgs[i].hdr.Iov = &b.iovs[i]
+		b.msgs[i].hdr.Iovlen = 1
+	}
+	return b
+}}
+
+func flowOf(conn net.Conn) udpFlow {
+	var flow udpFlow
+	if addr, ok := conn.RemoteAddr().(*net.UDPAddr); ok {
+		flow.sandbox = unmapAddrPort(addr.AddrPort())
+	}
+	if addr, ok := conn.LocalAddr().(*net.UDPAddr); ok {
+		flow.destination = unmapAddrPort(addr.AddrPort())
+	}
+	return flow
+}
+
+func unmapAddrPort(addr netip.AddrPort) netip.AddrPort {
+	return netip.AddrPortFrom(addr.Addr().Unmap(), addr.Port())
+}
+
+// add starts tracking the flow of subprocess. A session still open for the
+// same flow is closed, the sandbox side of it is gone.
+func (t *udpSessionTable) add(subprocess net.Conn, world *net.UDPConn) *udpSession {
+	s := &udpSession{table: t, flow: flowOf(subprocess), subprocess: subprocess, world: world}
+	s.touch()
+	t.mu.Lock()
+	old := t.sessions[s.flow]
+	t.sessions[s.flow] = s
+	t.mu.Unlock()
+	if old != nil {
+		old.close()
+	}
+	t.reaper.Do(func() { go t.reap(config.UDPTimeout) })
+	return s
+}
+
+func (t *udpSessionTable) remove(s *udpSession) {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	if t.sessions[s.flow] == s {
+		delete(t.sessions, s.flow)
+	}
+}
+
+func (t *udpSessionTable) Len() int {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	return len(t.sessions)
+}
+
+// expire closes the sessions idle since before deadline
+func (t *udpSessionTable) expire(deadline time.Time) {
+	var idle []*udpSession
+	t.mu.Lock()
+	for _, s := range t.sessions {
+		if s.lastActive.Load() < deadline.UnixNano() {
+			idle = append(idle, s)
+		}
+	}
+	t.mu.Unlock()
+	for _, s := range idle {
+		verbosef("UDP flow %v => %v idle, closing", s.flow.sandbox, s.flow.destination)
+		s.close()
+	}
+}
+
+func (t *udpSessionTable) reap(timeout time.Duration) {
+	ticker := time.NewTicker(max(timeout/4, time.Second))
+	defer ticker.Stop()
+	for range ticker.C {
+		if t.closed.Load() {
+			return
+		}
+		t.expire(time.Now().Add(-timeout))
+	}
+}
+
+// close closes every session, for good
+func (t *udpSessionTable) close() {
+	t.closed.Store(true)
+	t.expire(time.Now().Add(time.Hour))
+}
+
+func (s *udpSession) touch() {
+	s.lastActive.Store(time.Now().UnixNano())
+}
+
+func (s *udpSession) close() {
+	if s.closed.Swap(true) {
+		return
+	}
+	s.table.remove(s)
+	s.subprocess.Close()
+	if s.world != nil {
+		s.world.Close()
+	}
+}
+
+// proxyUDP proxies the datagrams of a UDP flow of the sandbox to the world,
+// and back the other way, until the flow is idle for config.UDPTimeout
+func (t *tenant) proxyUDP(subprocess net.Conn) {
+	dst := subprocess.LocalAddr().String()
+	conn, err := dialWorld("udp", dst)
+	if err != nil {
+		subprocess.Close()
+		return
+	}
+	s := t.udpSessions.add(subprocess, conn.(*net.UDPConn))
+
+	var sent, received *atomic.Uint64
+	if counters := t.metrics.destination("udp", dst); counters != nil {
+		counters.connections.Add(1)
+		sent, received = &counters.sent, &counters.received
+	}
+	go func() {
+		defer s.close()
+		s.toWorld(sent)
+	}()
+	go func() {
+		defer s.close()
+		s.toSandbox(received)
+	}()
+}
+
+func (s *udpSession) toWorld(counted *atomic.Uint64) {
+	bufp := udpBufferPool.Get().(*[]byte)
+	defer udpBufferPool.Put(bufp)
+	buf := *bufp
+	for {
+		n, err := s.subprocess.Read(buf)
+		if err != nil {
+			return
+		}
+		s.touch()
+		if _, err := s.world.Write(buf[:n]); err != nil {
+			verbosef("error writing udp packet to %v: %v", s.flow.destination, err)
+			return
+		}
+		if counted != nil {
+			counted.Add(uint64(n))
+		}
+	}
+}
+
+// toSandbox reads the datagrams from the world udpBatchSize at a time, with
+// recvmmsg. The batch is only taken from the pool once there is something to
+// read, idle flows don't hold any buffer.
+func (s *udpSession) toSandbox(counted *atomic.Uint64) {
+	raw, err := s.world.SyscallConn()
+	if err != nil {
+		return
+	}
+	for {
+		var batch *udpBatch
+		var n int
+		var rerr error
+		err := raw.Read(func(fd uintptr) bool {
+			if batch == nil {
+				batch = udpBatchPool.Get().(*udpBatch)
+			}
+			n, rerr = recvmmsg(fd, batch.msgs[:])
+			if rerr == syscall.EAGAIN {
+				udpBatchPool.Put(batch)
+				batch = nil
+				return false
+			}
+			return true
+		})
+		if err == nil {
+			err = rerr
+		}
+		if err != nil {
+			// e.g. ECONNREFUSED, from an ICMP error of the destination
+			verbosef("error reading udp packets from %v: %v", s.flow.destination, err)
+			if batch != nil {
+				udpBatchPool.Put(batch)
+			}
+			return
+		}
+		s.touch()
+		for i := 0; i < n; i++ {
+			size := int(batch.msgs[i].len)
+			if _, err := s.subprocess.Write(batch.bufs[i][:size]); err != nil {
+				udpBatchPool.Put(batch)
+				return
+			}
+			if counted != nil {
+				counted.Add(uint64(size))
+			}
+		}
+		udpBatchPool.Put(batch)
+	}
+}
+
+func recvmmsg(fd uintptr, msgs []mmsghdr) (int, error) {
+	n, _, errno := syscall.Syscall6(syscall.SYS_RECVMMSG, fd, uintptr(unsafe.Pointer(&msgs[0])),
+		uintptr(len(msgs)), syscall.MSG_DONTWAIT, 0, 0)
+	if errno != 0 {
+		return 0, errno
+	}
+	return int(n), nil
+}
@@ -0,0 +1,92 @@
+package main
+
+import (
+	"net"
+	"testing"
+	"time"
+)
+
+// udpPipe is the subprocess end of a UDP flow from 10.1.1.100 to local
+type udpPipe struct {
+	net.Conn
+	local *net.UDPAddr
+}
+
+func (p *udpPipe) LocalAddr() net.Addr { return p.local }
+func (p *udpPipe) RemoteAddr() net.Addr {
+	return &net.UDPAddr{IP: net.IPv4(10, 1, 1, 100), Port: 4000}
+}
+
+// startUDPEchoServer plays the world, it sends back every datagram
+func startUDPEchoServer(t *testing.T) *net.UDPConn {
+	conn, err := net.ListenUDP("udp", &net.UDPAddr{IP: net.IPv4(127, 0, 0, 1)})
+	if err != nil {
+		t.Fatal(err)
+	}
+	t.Cleanup(func() { conn.Close() })
+	go func() {
+		buf := make([]byte, 2048)
+		for {
+			n, addr, err := conn.ReadFromUDP(buf)
+			if err != nil {
+				return
+			}
+			conn.WriteToUDP(buf[:n], addr)
+		}
+	}()
+	return conn
+}
+
+func TestProxyUDP(t *testing.T) {
+	saved := config
+	config.ConnectTimeout, config.UDPTimeout = time.Second, time.Minute
+	t.Cleanup(func() { config = saved })
+
+	echo := startUDPEchoServer(t)
+	client, server := net.Pipe()
+	defer client.Close()
+	defaultTenant.proxyUDP(&udpPipe{Conn: server, local: echo.LocalAddr().(*net.UDPAddr)})
+	if n := defaultTenant.udpSessions.Len(); n != 1 {
+		t.Fatalf("%d sessions", n)
+	}
+
+	client.SetDeadline(time.Now().Add(5 * time.Second))
+	buf := make([]byte, 2048)
+	for _, datagram := range []string{"first", "second", "third"} {
+		if _, err := client.Write([]byte(datagram)); err != nil {
+			t.Fatal(err)
+		}
+		n, err := client.Read(buf)
+		if err != nil || string(buf[:n]) != datagram {
+			t.Fatalf("read %q, %v", buf[:n], err)
+		}
+	}
+
+	// active since, not expired
+	defaultTenant.udpSessions.expire(time.Now().Add(-time.Second))
+	if n := defaultTenant.udpSessions.Len(); n != 1 {
+		t.Fatalf("%d sessions after expiring the idle ones", n)
+	}
+	defaultTenant.udpSessions.expire(time.Now().Add(time.Second))
+	if n := defaultTenant.udpSessions.Len(); n != 0 {
+		t.Fatalf("%d sessions after expiring them all", n)
+	}
+	if _, err := client.Write([]byte("late")); err == nil {
+		t.Error("wrote to an expired flow")
+	}
+}
+
+func TestUDPSessionReplaced(t *testing.T) {
+	local := &net.UDPAddr{IP: net.IPv4(192, 0, 2, 1), Port: 53}
+	_, first := net.Pipe()
+	_, second := net.Pipe()
+	old := defaultTenant.udpSessions.add(&udpPipe{Conn: first, local: local}, nil)
+	s := defaultTenant.udpSessions.add(&udpPipe{Conn: second, local: local}, nil)
+	defer s.close()
+	if !old.closed.Load() || s.closed.Load() {
+		t.Errorf("closed: old %v, new %v", old.closed.Load(), s.closed.Load())
+	}
+	if n := defaultTenant.udpSessions.Len(); n != 1 {
+		t.Errorf("%d sessions", n)
+	}
+}